@@ -0,0 +1,203 @@
+#!/usr/bin/python3
+# -*- coding:utf-8 -*-
+import argparse
+import json
+import re
+import statistics
+import sys
+import time
+import traceback
+from test import Qemu, Yaf, parse_arguments
+
+# directories and files per directory, below the 1024 dentrys limit
+DIRS = 8
+FILES = 1000
+
+# files of the throughput workloads, each as large as yaf allows
+IO_FILES = 256
+IO_SIZE = 32 * 1024
+# blocks read or written at random offsets of those files
+RANDOM_OPS = 2048
+BLOCK_SIZE = 4096
+# writes each followed by fsync()
+FSYNCS = 256
+
+# the timed workloads in their order, each run against the caches
+# dropped, with the number of operations or bytes it handles
+WORKLOADS = {
+    "create": ("perl -e 'for $d (0..%d) { mkdir \"test/d$d\"; for $f (0..%d) "
+               "{ open(F, \">test/d$d/f$f\") or die; close(F); } }' && sync"
+               % (DIRS - 1, FILES - 1), "ops", DIRS * FILES),
+    "stat": ("perl -e 'for $d (0..%d) { for $f (0..%d) "
+             "{ stat(\"test/d$d/f$f\") or die; } }'"
+             % (DIRS - 1, FILES - 1), "ops", DIRS * FILES),
+    "readdir": ("perl -e 'for $d (0..%d) { opendir(D, \"test/d$d\") or die; "
+                "@e = readdir(D); closedir(D); }'"
+                % (DIRS - 1), "ops", DIRS * (FILES + 2)),
+    "seq-write": ("perl -e '$b = \"y\" x %d; for $f (0..%d) "
+                  "{ open(F, \">test/s$f\") or die; "
+                  "syswrite(F, $b) == %d or die; close(F); }' && sync"
+                  % (IO_SIZE, IO_FILES - 1, IO_SIZE),
+                  "bytes", IO_FILES * IO_SIZE),
+    "seq-read": ("perl -e 'for $f (0..%d) { open(F, \"<test/s$f\") or die; "
+                 "sysread(F, $b, %d) == %d or die; close(F); }'"
+                 % (IO_FILES - 1, IO_SIZE, IO_SIZE),
+                 "bytes", IO_FILES * IO_SIZE),
+    "random-write": ("perl -e 'srand(1); $b = \"z\" x %d; for (1..%d) "
+                     "{ open(F, \"+<test/s\" . int(rand(%d))) or die; "
+                     "sysseek(F, %d * int(rand(%d)), 0); "
+                     "syswrite(F, $b) == %d or die; close(F); }' && sync"
+                     % (BLOCK_SIZE, RANDOM_OPS, IO_FILES, BLOCK_SIZE,
+                        IO_SIZE // BLOCK_SIZE, BLOCK_SIZE),
+                     "bytes", RANDOM_OPS * BLOCK_SIZE),
+    "random-read": ("perl -e 'srand(2); for (1..%d) "
+                    "{ open(F, \"<test/s\" . int(rand(%d))) or die; "
+                    "sysseek(F, %d * int(rand(%d)), 0); "
+                    "sysread(F, $b, %d) == %d or die; close(F); }'"
+                    % (RANDOM_OPS, IO_FILES, BLOCK_SIZE,
+                       IO_SIZE // BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE),
+                    "bytes", RANDOM_OPS * BLOCK_SIZE),
+    "fsync": ("perl -e 'use IO::Handle; open(my $f, \">test/fsync\") or die; "
+              "$b = \"f\" x %d; for (1..%d) { sysseek($f, 0, 0); "
+              "syswrite($f, $b) == %d or die; $f->sync or die; }'"
+              % (BLOCK_SIZE, FSYNCS, BLOCK_SIZE), "ops", FSYNCS),
+    "unlink": ("perl -e 'for $d (0..%d) { for $f (0..%d) "
+               "{ unlink(\"test/d$d/f$f\") or die; } }' && sync"
+               % (DIRS - 1, FILES - 1), "ops", DIRS * FILES),
+}
+
+# the workloads whose checksum overhead is checked by --max-overhead,
+# the others being dominated by the data blocks or too noisy
+GATED = ["create", "stat", "readdir"]
+
+# mkfs options of the compared formats
+FORMATS = {
+    "checksums": "",
+    "no-checksums": "--no-checksums",
+}
+
+def value(qemu:Qemu, key:str, timeout:int) -> int:
+    '''wait for the guest to print "key=<value>us" and return the value'''
+    pattern = re.compile(r"%s=(\d+)us" % key)
+    cur = time.time()
+    while(True):
+        match = pattern.search(qemu.output)
+        if (match):
+            print(qemu.output[:match.end()], end="", flush=True)
+            qemu.output = qemu.output[match.end():]
+            return int(match.group(1))
+        if (time.time() - cur > timeout):
+            raise TimeoutError
+        qemu._read()
+
+def measure(qemu:Qemu, name:str, command:str, timeout:int) -> int:
+    '''run the timed @command in the guest and return its microseconds'''
+    qemu.execute("sync; echo 3 > /proc/sys/vm/drop_caches")
+    qemu.execute("s=$(date +%%s%%N); %s; echo %s=$(( ($(date +%%s%%N) - s) / 1000 ))us"
+                 % (command, name))
+    return value(qemu, name, timeout)
+
+def summarize(times:list, unit:str, amount:int) -> dict:
+    '''the median of @times with the rate of the @amount of @unit'''
+    us = statistics.median(times)
+    result = {"median_us": us, "min_us": min(times), "max_us": max(times),
+              "runs": times}
+    if (unit == "ops"):
+        result["ops"] = amount
+        result["ops_per_s"] = amount * 1e6 / us if us else None
+        result["latency_us"] = us / amount
+    elif (unit == "bytes"):
+        result["bytes"] = amount
+        result["mib_per_s"] = amount * 1e6 / us / (1 << 20) if us else None
+    return result
+
+if __name__ == "__main__":
+    ret = 0
+    qemu:Qemu = None
+
+    parser = argparse.ArgumentParser(description="yaf benchmark")
+    parser.add_argument("--command", action="store",
+                        type=str, required=True,
+                        help="command to boot up qemu")
+    parser.add_argument("--history", action="store",
+                        type=str, required=True,
+                        help="path to store executed commands")
+    parser.add_argument("--timeout", action="store",
+                        type=int, default=60,
+                        help="max timeout for receiving from guest")
+    parser.add_argument("--rounds", action="store",
+                        type=int, default=5,
+                        help="number of runs per workload and format")
+    parser.add_argument("--max-overhead", action="store",
+                        type=float, default=5,
+                        help="max checksum overhead in percent of the "
+                             "create, stat and readdir workloads")
+    parser.add_argument("--json", action="store",
+                        type=str, default=None,
+                        help="path to write the results as JSON to, "
+                             "- for the standard output")
+    args = parse_arguments(parser)
+
+    try:
+        # boot up the Qemu
+        qemu = Qemu(command=args.command, history=args.history)
+        yaf = Yaf(qemu, args)
+        yaf.setup(timeout=args.timeout)
+        if (args.fuse):
+            qemu.execute("truncate -s 1G %s" % (args.image))
+        qemu.execute("mkdir -p test")
+
+        # alternate the formats, so a drift of the host hits both alike
+        names = ["mount"] + list(WORKLOADS)
+        results = {fmt: {name: [] for name in names} for fmt in FORMATS}
+        for _ in range(args.rounds):
+            for fmt, options in FORMATS.items():
+                # time the mount of the freshly made image
+                qemu.execute(yaf.mkfs(options) + " > /dev/null")
+                results[fmt]["mount"].append(
+                    measure(qemu, "mount", yaf.mount_command(), args.timeout))
+                for name, (command, _, _) in WORKLOADS.items():
+                    results[fmt][name].append(
+                        measure(qemu, name, command, args.timeout))
+                yaf.umount()
+
+        yaf.teardown(timeout=args.timeout)
+
+        report = {
+            "driver": "yaf-fuse" if args.fuse else "yaf",
+            "rounds": args.rounds,
+            "formats": {},
+            "overhead_percent": {},
+        }
+        for fmt in FORMATS:
+            report["formats"][fmt] = {
+                "mount": summarize(results[fmt]["mount"], None, 0)}
+            for name, (_, unit, amount) in WORKLOADS.items():
+                report["formats"][fmt][name] = summarize(results[fmt][name],
+                                                         unit, amount)
+
+        # compare the medians
+        print("\n%-12s %14s %14s %9s" % ("", "checksums", "no-checksums", "overhead"))
+        for name in names:
+            on = report["formats"]["checksums"][name]["median_us"]
+            off = report["formats"]["no-checksums"][name]["median_us"]
+            overhead = (on - off) * 100 / off if off else 0
+            report["overhead_percent"][name] = overhead
+            print("%-12s %12dus %12dus %8.2f%%" % (name, on, off, overhead))
+            if (name in GATED and overhead > args.max_overhead):
+                ret = -1
+
+        if (args.json == "-"):
+            print(json.dumps(report, indent=4))
+        elif (args.json):
+            with open(args.json, "w") as f:
+                json.dump(report, f, indent=4)
+
+    except:
+        traceback.print_exc()
+        ret = -1
+    finally:
+        if (qemu != None):
+            qemu.kill()
+
+    sys.exit(ret)
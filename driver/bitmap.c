@@ -1,7 +1,12 @@
 #include <linux/bitmap.h>
 #include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/minmax.h>
+#include <linux/sort.h>
 #include "../include/bitmap.h"
+#include "../include/csum.h"
 #include "../include/inode.h"
+#include "../include/journal.h"
 #include "asm-generic/bitops/instrumented-atomic.h"
 
 /*
@@ -24,80 +29,290 @@ static inline void yaf_put_bit(void *addr, uint32_t nr) {
     assert(test_and_clear_bit(nr, addr));
 }
 
+/* order bitmap idxs ascending, so those sharing a block are adjacent */
+static int yaf_cmp_idx(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* sort the @nr bitmap idxs in @idxs ascending */
+void yaf_sort_idxs(uint32_t *idxs, unsigned int nr) {
+    sort(idxs, nr, sizeof(*idxs), yaf_cmp_idx, NULL);
+}
+
 /*
- * Return an unused inode number and mark it used.
+ * Return an unused bitmap idx below @nr_idx in the bitmap section
+ * starting at @bid_min and mark it used.
  *
- * Return *RESERVED_INO* if no free inode was found.
+ * Return *-ENOENT* if no free idx was found.
  */
-uint32_t yaf_get_free_inode(struct super_block *sb) {
-    for(uint32_t bid = BID_IBP_MIN(sb); bid <= BID_IBP_MAX(sb); ++bid) {
-        uint32_t res;
-        struct buffer_head *bh = sb_bread(sb, bid);
+static int64_t yaf_get_free_idx(struct super_block *sb,
+                                unsigned long bid_min, uint32_t nr_idx) {
+    for (uint32_t base = 0; base < nr_idx; base += BITS_PER_BLOCK) {
+        int32_t res;
+        struct buffer_head *bh = yaf_bread(sb,
+                                    bid_min + base / BITS_PER_BLOCK);
         if (!bh) {
-            log(LOG_ERR, "sb_bread() failed");
-            return RESERVED_INO;
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
         }
 
-        res = yaf_get_free_bit(bh->b_data, BITS_PER_BLOCK);
+        res = yaf_get_free_bit(bh->b_data,
+                               min_t(uint32_t, BITS_PER_BLOCK,
+                                     nr_idx - base));
 
         if (res >= 0) {
-            mark_buffer_dirty(bh);
+            yaf_journal_dirty(sb, bh);
             brelse(bh);
-            return res + (bid - BID_IBP_MIN(sb)) * BITS_PER_BLOCK;
+            return base + res;
         }
 
         brelse(bh);
     }
 
-    return RESERVED_INO;
+    return -ENOENT;
 }
 
-/* mark the given inode as unused */
-void yaf_put_inode(struct super_block *sb, uint32_t ino) {
-    struct buffer_head *bh = sb_bread(sb, IDXI2BID(sb, ino));
-    assert(bh);
+/*
+ * Return an unused inode number and mark it used.
+ *
+ * Return *RESERVED_INO* if no free inode was found.
+ */
+uint32_t yaf_get_free_inode(struct super_block *sb) {
+    int64_t ino = yaf_get_free_idx(sb, BID_IBP_MIN(sb), NR_INODES(sb));
 
-    yaf_put_bit(bh->b_data, ino % BITS_PER_BLOCK);
+    if (ino < 0) {
+        return RESERVED_INO;
+    }
+
+    percpu_counter_dec(&YAF_FS(sb)->nr_free_i);
+    return ino;
+}
+
+/*
+ * Return the number of inodes in use among the @nr inodes from @ino,
+ * which all share one inode bitmap block.
+ */
+int yaf_count_used_inodes(struct super_block *sb, uint32_t ino,
+                          uint32_t nr) {
+    uint32_t base = ino - ino % BITS_PER_BLOCK;
+    struct buffer_head *bh = yaf_bread(sb, IDXI2BID(sb, ino));
+    int used = 0;
+
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        return -EIO;
+    }
+    assert(ino - base + nr <= BITS_PER_BLOCK);
+
+    for (uint32_t i = ino - base; i < ino - base + nr; ++i) {
+        used += test_bit(i, (unsigned long *)bh->b_data);
+    }
 
-    mark_buffer_dirty(bh);
     brelse(bh);
+    return used;
+}
+
+/*
+ * Clear the @nr marked idxs in @idxs of the bitmap section starting
+ * at @bid_min, reading and dirtying each bitmap block only once.
+ *
+ * @idxs is sorted in place.
+ */
+static void yaf_put_idxs(struct super_block *sb, unsigned long bid_min,
+                         uint32_t *idxs, unsigned int nr) {
+    yaf_sort_idxs(idxs, nr);
+
+    for (unsigned int i = 0; i < nr;) {
+        uint32_t base = idxs[i] - idxs[i] % BITS_PER_BLOCK;
+        struct buffer_head *bh = yaf_bread(sb,
+                                    bid_min + base / BITS_PER_BLOCK);
+
+        /* the idxs of a bitmap block failing its checksum are leaked */
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            while (i < nr && idxs[i] - base < BITS_PER_BLOCK) {
+                ++i;
+            }
+            continue;
+        }
+
+        for (; i < nr && idxs[i] - base < BITS_PER_BLOCK; ++i) {
+            yaf_put_bit(bh->b_data, idxs[i] - base);
+        }
+
+        yaf_journal_dirty(sb, bh);
+        brelse(bh);
+    }
+}
+
+/* mark the given @nr inodes as unused */
+void yaf_put_inodes(struct super_block *sb, uint32_t *inos,
+                    unsigned int nr) {
+    yaf_put_idxs(sb, BID_IBP_MIN(sb), inos, nr);
+    percpu_counter_add(&YAF_FS(sb)->nr_free_i, nr);
+}
+
+/* mark the given inode as unused */
+void yaf_put_inode(struct super_block *sb, uint32_t ino) {
+    yaf_put_inodes(sb, &ino, 1);
 }
 
 /*
  * Return an unused data block and mark it used.
  *
- * Return *RESERVED_DNO* if no free inode was found.
+ * Return *RESERVED_DNO* if no free data block was found, or only
+ * reserved ones for an unprivileged user.
  */
 uint32_t yaf_get_free_dblock(struct super_block *sb) {
-    for(uint32_t bid = BID_DBP_MIN(sb); bid <= BID_DBP_MAX(sb); ++bid) {
-        uint32_t res;
-        struct buffer_head *bh = sb_bread(sb, bid);
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    int64_t dno;
+
+    /* the reserved data blocks are left to the privileged users */
+    if (yfi->nr_r && percpu_counter_compare(&yfi->nr_free_d,
+                                            (s64)yfi->nr_r + 1) < 0 &&
+        !capable(CAP_SYS_RESOURCE)) {
+        return RESERVED_DNO;
+    }
+
+    dno = yaf_get_free_idx(sb, BID_DBP_MIN(sb), YAF_SB(sb)->nr_d);
+
+    if (dno < 0) {
+        return RESERVED_DNO;
+    }
+
+    percpu_counter_dec(&YAF_FS(sb)->nr_free_d);
+    return dno;
+}
+
+/*
+ * Return the first of @nr consecutive unused bitmap idxs below
+ * @nr_idx in the bitmap section starting at @bid_min and mark them
+ * used. A run does not span two bitmap blocks.
+ *
+ * The bits are claimed one by one like in yaf_get_free_bit(), so a
+ * run losing a bit to a concurrent allocation is given back and the
+ * search goes on behind that bit.
+ *
+ * Return *-ENOENT* if no such run was found.
+ */
+static int64_t yaf_get_free_run(struct super_block *sb,
+                                unsigned long bid_min, uint32_t nr_idx,
+                                unsigned int nr) {
+    for (uint32_t base = 0; base < nr_idx; base += BITS_PER_BLOCK) {
+        uint32_t bits = min_t(uint32_t, BITS_PER_BLOCK, nr_idx - base);
+        unsigned long start = 0;
+        struct buffer_head *bh = yaf_bread(sb,
+                                    bid_min + base / BITS_PER_BLOCK);
         if (!bh) {
-            log(LOG_ERR, "sb_bread() failed");
-            return RESERVED_INO;
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
         }
 
-        res = yaf_get_free_bit(bh->b_data, BITS_PER_BLOCK);
+        for (;;) {
+            unsigned long *map = (unsigned long *)bh->b_data;
+            unsigned long idx = bitmap_find_next_zero_area(map, bits, start,
+                                                           nr, 0);
+            unsigned int got = 0;
 
-        if (res >= 0) {
-            brelse(bh);
-            mark_buffer_dirty(bh);
-            return res + (bid - BID_DBP_MIN(sb)) * BITS_PER_BLOCK;
+            if (idx >= bits) {
+                break;
+            }
+
+            while (got < nr && !test_and_set_bit(idx + got, map)) {
+                ++got;
+            }
+            if (got == nr) {
+                yaf_journal_dirty(sb, bh);
+                brelse(bh);
+                return base + idx;
+            }
+
+            start = idx + got + 1;
+            while (got) {
+                clear_bit(idx + --got, map);
+            }
         }
 
         brelse(bh);
     }
 
-    return RESERVED_DNO;
+    return -ENOENT;
+}
+
+/*
+ * Store @nr unused data blocks in @dnos and mark them used, as one
+ * run of consecutive data blocks if there is one left, otherwise
+ * wherever yaf_get_free_dblock() finds them.
+ *
+ * Return *-ENOSPC* if not all of them were found, which leaves no
+ * data block marked.
+ */
+int yaf_get_free_dblocks(struct super_block *sb, uint32_t *dnos,
+                         unsigned int nr) {
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    int64_t dno;
+
+    /* the reserved data blocks are left to the privileged users */
+    if (yfi->nr_r && percpu_counter_compare(&yfi->nr_free_d,
+                                            (s64)yfi->nr_r + nr) < 0 &&
+        !capable(CAP_SYS_RESOURCE)) {
+        return -ENOSPC;
+    }
+
+    dno = yaf_get_free_run(sb, BID_DBP_MIN(sb), YAF_SB(sb)->nr_d, nr);
+    if (dno >= 0) {
+        for (unsigned int i = 0; i < nr; ++i) {
+            dnos[i] = dno + i;
+        }
+        percpu_counter_sub(&yfi->nr_free_d, nr);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < nr; ++i) {
+        dnos[i] = yaf_get_free_dblock(sb);
+        if (dnos[i] == RESERVED_DNO) {
+            yaf_put_dblocks(sb, dnos, i);
+            return -ENOSPC;
+        }
+    }
+    return 0;
+}
+
+/* mark the given @nr data blocks as unused */
+void yaf_put_dblocks(struct super_block *sb, uint32_t *dnos,
+                     unsigned int nr) {
+    yaf_put_idxs(sb, BID_DBP_MIN(sb), dnos, nr);
+    percpu_counter_add(&YAF_FS(sb)->nr_free_d, nr);
 }
 
 /* mark the given data block as unused */
 void yaf_put_dblock(struct super_block *sb, uint32_t dno) {
-    struct buffer_head *bh = sb_bread(sb, IDXD2BID(sb, dno));
-    assert(bh);
+    yaf_put_dblocks(sb, &dno, 1);
+}
 
-    yaf_put_bit(bh->b_data, dno % BITS_PER_BLOCK);
+/*
+ * Return the number of unused bits among the first @nr_idx bits of
+ * the bitmap section starting at @bid_min.
+ */
+int64_t yaf_count_free(struct super_block *sb, unsigned long bid_min,
+                       uint32_t nr_idx) {
+    int64_t nr_free = 0;
 
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    for (uint32_t base = 0; base < nr_idx; base += BITS_PER_BLOCK) {
+        uint32_t bits = min_t(uint32_t, BITS_PER_BLOCK, nr_idx - base);
+        struct buffer_head *bh = yaf_bread(sb,
+                                    bid_min + base / BITS_PER_BLOCK);
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
+        }
+
+        nr_free += bits - bitmap_weight((unsigned long *)bh->b_data, bits);
+
+        brelse(bh);
+    }
+
+    return nr_free;
 }
@@ -0,0 +1,335 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/mpage.h>
+#include "../include/compact.h"
+#include "../include/csum.h"
+#include "../include/inode.h"
+#include "../include/yaf.h"
+
+/* number of data blocks of the directory or regular file @inode */
+static inline uint64_t yaf_compact_blocks(struct inode *inode)
+{
+    return DIV_ROUND_UP(i_size_read(inode), YAF_BLOCK_SIZE);
+}
+
+/* block id of the @iblock-th data block of @inode */
+static inline sector_t yaf_compact_bid(struct inode *inode, uint64_t iblock)
+{
+    return DNO2BID(inode->i_sb, YAF_INODE(inode)->i_block[0] + iblock);
+}
+
+/*
+ * Associate the @bh_result with the @iblock-th block of the file
+ * denoted by @inode.
+ *
+ * The data blocks of a file are consecutive, so the blocks behind
+ * @iblock are mapped as well, up to the size of @bh_result, which
+ * lets mpage_readahead() read a whole file in few requests.
+ */
+static int yaf_compact_get_block(struct inode *inode, sector_t iblock,
+                                 struct buffer_head *bh_result, int create)
+{
+    uint64_t nr = yaf_compact_blocks(inode);
+    uint64_t max = bh_result->b_size >> inode->i_blkbits;
+
+    /* a compact image is never written */
+    if (create) {
+        return -EROFS;
+    }
+    if (iblock >= nr) {
+        return 0;
+    }
+
+    map_bh(bh_result, inode->i_sb, yaf_compact_bid(inode, iblock));
+    bh_result->b_size = min_t(uint64_t, max, nr - iblock) <<
+                        inode->i_blkbits;
+
+    return 0;
+}
+
+/* read the folio from the disk and map it into memory */
+static int yaf_compact_read_folio(struct file *file, struct folio *folio)
+{
+    return mpage_read_folio(folio, yaf_compact_get_block);
+}
+
+/* read the pages from the disk and map them into memory */
+static void yaf_compact_readahead(struct readahead_control *rac)
+{
+    mpage_readahead(rac, yaf_compact_get_block);
+}
+
+/* map the @block-th block of the file to its block of the device */
+static sector_t yaf_compact_bmap(struct address_space *mapping,
+                                 sector_t block)
+{
+    return generic_block_bmap(mapping, block, yaf_compact_get_block);
+}
+
+/*
+ * describes how the page cache reads the regular files of a compact
+ * image, see yaf_as_ops
+ */
+static const struct address_space_operations yaf_compact_as_ops = {
+    .read_folio = yaf_compact_read_folio,   /* called by the page cache
+                                        to read a folio from the disk */
+    .readahead = yaf_compact_readahead,     /* called by the page cache to
+                read pages associated with the address_space object */
+    .bmap = yaf_compact_bmap,               /* called by the FIBMAP ioctl
+                        to map a file block to its block of the device */
+};
+
+/*
+ * describes how the VFS can read an open regular file of a compact
+ * image, see yaf_file_ops
+ */
+static const struct file_operations yaf_compact_file_ops = {
+    .owner = THIS_MODULE,
+    .read_iter = generic_file_read_iter,    /* called when the VFS needs to
+                                               read the file content */
+    .llseek = generic_file_llseek,          /* called when the VFS needs to
+                                            move the file position index */
+    .mmap = generic_file_readonly_mmap,     /* called by the mmap(2)
+                                               system call */
+    .splice_read = filemap_splice_read,     /* called by the splice(2)
+                                               and sendfile(2) system
+                                               calls */
+};
+
+/*
+ * called when the VFS needs to read the directory contents.
+ *
+ * The dentrys are packed, so each one from @ctx->pos on is emitted, and
+ * the dentry blocks are consecutive, so all of them are read ahead at
+ * once.
+ */
+static int yaf_compact_iterate_shared(struct file *dir,
+                                      struct dir_context *ctx)
+{
+    struct inode *dinode = file_inode(dir);
+    struct super_block *sb = dinode->i_sb;
+    uint64_t nr = yaf_compact_blocks(dinode);
+    struct blk_plug plug;
+    uint64_t doff;
+
+    /* commit possible *.* and *..* to @ctx */
+    if (!dir_emit_dots(dir, ctx)) {
+        return 0;
+    }
+
+    /* validate the @ctx->pos */
+    doff = ctx->pos - 2;
+    if (doff % YAF_DENTRY_SIZE) {
+        log(LOG_ERR, "@ctx->pos = %lld is not valid", ctx->pos);
+        return -ENOENT;
+    }
+
+    /* start reading the remaining dentry blocks in the background */
+    blk_start_plug(&plug);
+    for (uint64_t iblock = doff / YAF_BLOCK_SIZE + 1; iblock < nr;
+         ++iblock) {
+        sb_breadahead(sb, yaf_compact_bid(dinode, iblock));
+    }
+    blk_finish_plug(&plug);
+
+    while (doff < dinode->i_size) {
+        struct buffer_head *bh;
+        Yaf_Dentry *yd;
+
+        bh = yaf_bread(sb, yaf_compact_bid(dinode, doff / YAF_BLOCK_SIZE));
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
+        }
+
+        yd = (Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE);
+        do {
+            ctx->pos = doff + 2;
+            if (!dir_emit(ctx, yd->d_name,
+                          min_t(uint32_t, le32_to_cpu(yd->d_name_len),
+                                YAF_DENTRY_NAME_LEN),
+                          le32_to_cpu(yd->d_ino), DT_UNKNOWN)) {
+                /* @ctx is full, resume from this dentry next time */
+                brelse(bh);
+                return 0;
+            }
+            ++yd;
+            doff += YAF_DENTRY_SIZE;
+        } while (doff < dinode->i_size && doff % YAF_BLOCK_SIZE);
+
+        brelse(bh);
+    }
+
+    /* update the @ctx->pos */
+    ctx->pos = doff + 2;
+
+    return 0;
+}
+
+/*
+ * describes how the VFS can read an open directory of a compact
+ * image, see yaf_dir_ops
+ */
+static const struct file_operations yaf_compact_dir_ops = {
+    .iterate_shared = yaf_compact_iterate_shared, /* called when the VFS
+                                needs to read the directory contents */
+    .llseek = generic_file_llseek,  /* called when the VFS needs to
+                                       move the file position index */
+};
+
+/* compare the name of @yd with @name in the order of mkfs --compact */
+static int yaf_compact_cmp(const Yaf_Dentry *yd, const struct qstr *name)
+{
+    uint32_t len = min_t(uint32_t, le32_to_cpu(yd->d_name_len),
+                         YAF_DENTRY_NAME_LEN);
+    int ret = memcmp(yd->d_name, name->name, min(len, name->len));
+
+    if (ret) {
+        return ret;
+    }
+    return len < name->len ? -1 : len > name->len;
+}
+
+/*
+ * Find the inode of @name in the directory @dir into @ino, or leave it
+ * *RESERVED_INO* if there is none.
+ *
+ * The dentry block holding @name is the last one starting with a name
+ * not after it, and is found by a binary search over the first dentry
+ * of each block, @name then by a binary search within it.
+ */
+static int yaf_compact_find(struct inode *dir, const struct qstr *name,
+                            uint32_t *ino)
+{
+    uint64_t nr = dir->i_size / YAF_DENTRY_SIZE;
+    uint64_t lo = 0, hi = yaf_compact_blocks(dir);
+    struct buffer_head *bh;
+    Yaf_Dentry *yd;
+    int cmp;
+
+    *ino = RESERVED_INO;
+    if (!nr) {
+        return 0;
+    }
+
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        bh = yaf_bread(dir->i_sb, yaf_compact_bid(dir, mid));
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
+        }
+        cmp = yaf_compact_cmp((Yaf_Dentry *)bh->b_data, name);
+        brelse(bh);
+
+        if (cmp > 0) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    bh = yaf_bread(dir->i_sb, yaf_compact_bid(dir, lo));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        return -EIO;
+    }
+    yd = (Yaf_Dentry *)bh->b_data;
+    nr = min_t(uint64_t, nr - lo * DENTRYS_PER_BLOCK, DENTRYS_PER_BLOCK);
+    for (lo = 0, hi = nr; lo < hi; ) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        cmp = yaf_compact_cmp(&yd[mid], name);
+        if (!cmp) {
+            *ino = le32_to_cpu(yd[mid].d_ino);
+            break;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * The name to look for is found in the dentry, see yaf_lookup().
+ */
+static struct dentry *yaf_compact_lookup(struct inode *dir,
+                                         struct dentry *dentry,
+                                         unsigned int flags)
+{
+    struct inode *inode = NULL;
+    uint32_t ino;
+    int ret;
+
+    /* check the dentry name length */
+    if (dentry->d_name.len > YAF_DENTRY_NAME_LEN) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+
+    ret = yaf_compact_find(dir, &dentry->d_name, &ino);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    if (ino != RESERVED_INO) {
+        inode = yaf_iget(dir->i_sb, ino);
+        if (IS_ERR(inode)) {
+            log(LOG_ERR, "yaf_iget() failed with error code %ld",
+                PTR_ERR(inode));
+            return ERR_CAST(inode);
+        }
+    }
+
+    /* fill the dentry with the inode */
+    d_add(dentry, inode);
+
+    return NULL;
+}
+
+/*
+ * describes how the VFS can look up the inodes of a directory of a
+ * compact image, see yaf_inode_ops
+ */
+static const struct inode_operations yaf_compact_dir_inode_ops = {
+    .lookup = yaf_compact_lookup,   /* called when the VFS needs to
+                    look up an inode in a parent directory */
+};
+
+/*
+ * Set the operations of the directory or regular file @inode of a
+ * compact image, after checking that its data blocks are within the
+ * data blocks section, which the operations above rely on.
+ */
+int yaf_compact_set_ops(struct inode *inode)
+{
+    uint64_t nr = yaf_compact_blocks(inode);
+    uint32_t dno = YAF_INODE(inode)->i_block[0];
+
+    if (nr && (dno == RESERVED_DNO ||
+               dno + nr > YAF_SB(inode->i_sb)->nr_d)) {
+        log(LOG_ERR, "data blocks of inode %lu exceed the data blocks "
+            "section", inode->i_ino);
+        return -EIO;
+    }
+    if (S_ISDIR(inode->i_mode) && inode->i_size % YAF_DENTRY_SIZE) {
+        log(LOG_ERR, "directory inode %lu has a partial dentry",
+            inode->i_ino);
+        return -EIO;
+    }
+
+    if (S_ISDIR(inode->i_mode)) {
+        inode->i_op = &yaf_compact_dir_inode_ops;
+        inode->i_fop = &yaf_compact_dir_ops;
+    } else {
+        inode->i_fop = &yaf_compact_file_ops;
+        inode->i_mapping->a_ops = &yaf_compact_as_ops;
+    }
+
+    return 0;
+}
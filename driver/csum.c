@@ -0,0 +1,188 @@
+#include <linux/buffer_head.h>
+#include <linux/byteorder/generic.h>
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/yaf.h"
+
+/* the metadata buffer matched its checksum, behind BH_PrivateStart */
+#define BH_Verified (BH_PrivateStart + 1)
+BUFFER_FNS(Verified, verified)
+
+/* whether the block @bid has an entry in the checksum section */
+static inline bool yaf_csum_covers(struct super_block *sb, sector_t bid)
+{
+    return bid >= BID_IBP_MIN(sb) && bid <= BID_D_MAX(sb);
+}
+
+/*
+ * Read the checksum block holding the entry of the block @bid and
+ * return the index of that entry in @idx.
+ */
+static struct buffer_head *yaf_csum_bread(struct super_block *sb,
+                                          sector_t bid, uint32_t *idx)
+{
+    uint32_t nr = bid - BID_IBP_MIN(sb);
+
+    *idx = nr % YAF_CSUMS_PER_BLOCK;
+    return sb_bread(sb, BID_C_MIN(sb) + nr / YAF_CSUMS_PER_BLOCK);
+}
+
+/*
+ * Check the metadata block @bh against its checksum.
+ *
+ * The result is cached in the buffer, so a block is only hashed
+ * after being read from the disk, not on every lookup.
+ *
+ * Return *-EBADMSG* on a mismatch.
+ */
+int yaf_csum_verify(struct super_block *sb, struct buffer_head *bh)
+{
+    uint32_t want, got;
+
+    if (!yaf_has_csum(sb) || buffer_verified(bh)) {
+        return 0;
+    }
+
+    if (bh->b_blocknr == BID_SB_MIN(sb)) {
+        Yaf_Superblock *ysb = (Yaf_Superblock *)bh->b_data;
+
+        want = le32_to_cpu(ysb->csum);
+        got = yaf_csum_super(ysb);
+    } else if (yaf_csum_covers(sb, bh->b_blocknr)) {
+        struct buffer_head *cbh;
+        uint32_t idx;
+
+        cbh = yaf_csum_bread(sb, bh->b_blocknr, &idx);
+        if (!cbh) {
+            log(LOG_ERR, "sb_bread() failed");
+            return -EIO;
+        }
+        want = le32_to_cpu(((uint32_t *)cbh->b_data)[idx]);
+        brelse(cbh);
+
+        /* blocks not written since mkfs have no checksum yet */
+        got = want ? yaf_csum_block(bh->b_data) : 0;
+    } else {
+        return 0;
+    }
+
+    /* a concurrent reader may have verified and modified it meanwhile */
+    if (want != got && !buffer_verified(bh)) {
+        log(LOG_ERR, "block %llu does not match its checksum "
+            "%#x but %#x", (unsigned long long)bh->b_blocknr, want, got);
+        return -EBADMSG;
+    }
+
+    set_buffer_verified(bh);
+    return 0;
+}
+
+/*
+ * Read the metadata block @bid, like sb_bread(), and check it against
+ * its checksum.
+ *
+ * Return NULL if it cannot be read or does not match.
+ */
+struct buffer_head *yaf_bread(struct super_block *sb, sector_t bid)
+{
+    struct buffer_head *bh = sb_bread(sb, bid);
+
+    if (bh && yaf_csum_verify(sb, bh)) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*
+ * Tell in @written whether the block @bid was written since mkfs, i.e.
+ * whether its checksum entry is set. Without checksums it cannot be
+ * told and is reported as not written.
+ */
+int yaf_csum_written(struct super_block *sb, sector_t bid, bool *written)
+{
+    struct buffer_head *cbh;
+    uint32_t idx;
+
+    *written = false;
+    if (!yaf_has_csum(sb) || !yaf_csum_covers(sb, bid)) {
+        return 0;
+    }
+
+    cbh = yaf_csum_bread(sb, bid, &idx);
+    if (!cbh) {
+        log(LOG_ERR, "sb_bread() failed");
+        return -EIO;
+    }
+    *written = ((uint32_t *)cbh->b_data)[idx] != 0;
+    brelse(cbh);
+
+    return 0;
+}
+
+/*
+ * Called when the metadata block @bh is logged in the running
+ * transaction, whose content is trusted from now on.
+ *
+ * Return the referenced checksum block to log along with it, or
+ * NULL if @bh has no entry in the checksum section.
+ */
+struct buffer_head *yaf_csum_dirty(struct super_block *sb,
+                                   struct buffer_head *bh)
+{
+    struct buffer_head *cbh;
+    uint32_t idx;
+
+    if (!yaf_has_csum(sb)) {
+        return NULL;
+    }
+    set_buffer_verified(bh);
+
+    if (!yaf_csum_covers(sb, bh->b_blocknr)) {
+        return NULL;
+    }
+    cbh = yaf_csum_bread(sb, bh->b_blocknr, &idx);
+    if (!cbh) {
+        log(LOG_ERR, "sb_bread() failed");
+    }
+    return cbh;
+}
+
+/*
+ * Store the checksum of @bh, which is being committed, in its
+ * checksum block or, for the superblock, in itself.
+ *
+ * Called by the commit while no handle can modify @bh, or right
+ * before @bh is marked dirty once the journal is gone on unmount,
+ * when the checksum block is marked dirty as well.
+ */
+void yaf_csum_update(struct super_block *sb, struct buffer_head *bh)
+{
+    struct buffer_head *cbh;
+    uint32_t idx;
+
+    if (!yaf_has_csum(sb)) {
+        return;
+    }
+
+    if (bh->b_blocknr == BID_SB_MIN(sb)) {
+        Yaf_Superblock *ysb = (Yaf_Superblock *)bh->b_data;
+
+        ysb->csum = cpu_to_le32(yaf_csum_super(ysb));
+        return;
+    }
+    if (!yaf_csum_covers(sb, bh->b_blocknr)) {
+        return;
+    }
+
+    cbh = yaf_csum_bread(sb, bh->b_blocknr, &idx);
+    if (!cbh) {
+        log(LOG_ERR, "sb_bread() failed");
+        return;
+    }
+    ((uint32_t *)cbh->b_data)[idx] = cpu_to_le32(yaf_csum_block(bh->b_data));
+    if (!YAF_FS(sb)->journal) {
+        mark_buffer_dirty(cbh);
+    }
+    brelse(cbh);
+}
@@ -0,0 +1,180 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uio.h>
+#include <linux/writeback.h>
+#include "../include/defrag.h"
+#include "../include/inode.h"
+#include "../include/journal.h"
+#include "../include/yaf.h"
+
+/* return the number of data blocks of the regular file @inode */
+static uint32_t yaf_nr_dblocks(struct inode *inode)
+{
+    Yaf_Inode_Info *yii = YAF_INODE(inode);
+    uint32_t nr = 0;
+
+    while (nr < YAF_IBLOCKS && yii->i_block[nr] != RESERVED_DNO) {
+        ++nr;
+    }
+    return nr;
+}
+
+/*
+ * Copy the @size bytes of @file into the data blocks of @donor and
+ * write them to the disk.
+ *
+ * The inode lock of @donor is held by the caller, so the content is
+ * written by generic_perform_write() instead of a write(2).
+ */
+static int yaf_copy_to_donor(struct file *file, struct file *donor,
+                             loff_t size)
+{
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    struct kvec kvec;
+    loff_t pos = 0;
+    ssize_t n;
+    void *buf;
+    int ret = 0;
+
+    buf = kvmalloc(size, GFP_KERNEL);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    n = kernel_read(file, buf, size, &pos);
+    if (n != size) {
+        ret = n < 0 ? n : -EIO;
+        log(LOG_ERR, "kernel_read() failed with error code %d", ret);
+        goto free_buf;
+    }
+
+    kvec.iov_base = buf;
+    kvec.iov_len = size;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, size);
+    init_sync_kiocb(&kiocb, donor);
+    kiocb.ki_pos = 0;
+    n = generic_perform_write(&kiocb, &iter);
+    if (n != size) {
+        ret = n < 0 ? n : -ENOSPC;
+        log(LOG_ERR, "generic_perform_write() failed with error code %d",
+            ret);
+        goto free_buf;
+    }
+
+    ret = filemap_write_and_wait(donor->f_mapping);
+    if (ret) {
+        log(LOG_ERR, "filemap_write_and_wait() failed with error code %d",
+            ret);
+    }
+
+free_buf:
+    kvfree(buf);
+    return ret;
+}
+
+/* swap the first @nr data blocks of @inode and @dinode and log them */
+static int yaf_swap_iblocks(struct inode *inode, struct inode *dinode,
+                            uint32_t nr)
+{
+    const struct super_operations *sop = inode->i_sb->s_op;
+    struct writeback_control wbc = {
+        .sync_mode = WB_SYNC_ALL,
+    };
+    Yaf_Inode_Info *yii = YAF_INODE(inode), *dyii = YAF_INODE(dinode);
+
+    for (uint32_t i = 0; i < nr; ++i) {
+        swap(yii->i_block[i], dyii->i_block[i]);
+    }
+    return sop->write_inode(inode, &wbc) ?: sop->write_inode(dinode, &wbc);
+}
+
+/*
+ * Move the content of the regular file @file into the data blocks of
+ * the regular file @donor, which has as many data blocks, and hand
+ * the previous data blocks of @file to @donor, see defrag.h.
+ *
+ * @file must be open for reading and writing and @donor for writing.
+ */
+int yaf_swap_blocks(struct file *file, struct file *donor)
+{
+    struct inode *inode = file_inode(file), *dinode = file_inode(donor);
+    struct super_block *sb = inode->i_sb;
+    Yaf_Handle handle;
+    loff_t size;
+    uint32_t nr;
+    int ret = 0;
+
+    if (dinode->i_sb != sb) {
+        return -EXDEV;
+    }
+    if (inode == dinode || !S_ISREG(inode->i_mode) ||
+        !S_ISREG(dinode->i_mode)) {
+        return -EINVAL;
+    }
+    if (!(file->f_mode & FMODE_READ) || !(file->f_mode & FMODE_WRITE) ||
+        !(donor->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+    }
+
+    sb_start_write(sb);
+    lock_two_nondirectories(inode, dinode);
+    if (IS_IMMUTABLE(inode) || IS_APPEND(inode) ||
+        IS_IMMUTABLE(dinode) || IS_APPEND(dinode)) {
+        ret = -EPERM;
+        goto unlock;
+    }
+    /* a store through a shared mapping does not take the inode lock */
+    if (mapping_writably_mapped(inode->i_mapping) ||
+        mapping_writably_mapped(dinode->i_mapping)) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+
+    /* the data blocks are a prefix of *i_block* without holes */
+    size = i_size_read(inode);
+    nr = yaf_nr_dblocks(inode);
+    if (nr != DIV_ROUND_UP(size, YAF_BLOCK_SIZE) ||
+        yaf_nr_dblocks(dinode) != nr) {
+        ret = -EINVAL;
+        goto unlock;
+    }
+    if (!nr) {
+        goto unlock;
+    }
+
+    ret = yaf_copy_to_donor(file, donor, size);
+    if (ret) {
+        goto unlock;
+    }
+
+    filemap_invalidate_lock_two(inode->i_mapping, dinode->i_mapping);
+    ret = yaf_journal_start(sb, &handle, 2);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        goto unlock_mapping;
+    }
+    ret = yaf_swap_iblocks(inode, dinode, nr);
+    if (ret) {
+        log(LOG_ERR, "failed to write the swapped inodes with error code "
+            "%d", ret);
+        yaf_swap_iblocks(inode, dinode, nr);
+    }
+    yaf_journal_stop(&handle);
+
+    /* the cached folios still map the previous data blocks */
+    if (!ret) {
+        truncate_inode_pages(inode->i_mapping, 0);
+        truncate_inode_pages(dinode->i_mapping, 0);
+    }
+unlock_mapping:
+    filemap_invalidate_unlock_two(inode->i_mapping, dinode->i_mapping);
+    if (!ret) {
+        ret = yaf_journal_commit(sb);
+    }
+unlock:
+    unlock_two_nondirectories(inode, dinode);
+    sb_end_write(sb);
+    return ret;
+}
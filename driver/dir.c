@@ -1,11 +1,33 @@
 #include <asm-generic/errno-base.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/byteorder/generic.h>
 #include <linux/fs_types.h>
 #include <linux/stat.h>
+#include "../include/csum.h"
+#include "../include/file.h"
 #include "../include/inode.h"
+#include "../include/ioctl.h"
 #include "../include/yaf.h"
 
+/*
+ * Issue readahead for the dentry blocks of @dinode behind the
+ * @iblock-th one, so they are already in flight when
+ * yaf_iterate_shared() reaches them.
+ */
+static void yaf_readahead_dir(struct inode *dinode, uint64_t iblock)
+{
+    struct super_block *sb = dinode->i_sb;
+    Yaf_Inode_Info *dyii = YAF_INODE(dinode);
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    for (++iblock; iblock * YAF_BLOCK_SIZE < dinode->i_size; ++iblock) {
+        sb_breadahead(sb, DNO2BID(sb, dyii->i_block[iblock]));
+    }
+    blk_finish_plug(&plug);
+}
+
 /*
  * called when the VFS needs to read the directory contents.
  *
@@ -42,28 +64,55 @@ static int yaf_iterate_shared(struct file *dir, struct dir_context *ctx) {
         }
     }
 
+    /* start reading the remaining dentry blocks in the background */
+    if (doff < dinode->i_size) {
+        yaf_readahead_dir(dinode, doff / YAF_BLOCK_SIZE);
+    }
+
     /* iterate files in the directory from doff */
     while(doff < dinode->i_size) {
         Yaf_Dentry *yd;
         uint64_t iboff = doff % YAF_BLOCK_SIZE;
-        struct buffer_head *bh = sb_bread(sb,
+        unsigned long last_bid = 0;
+        struct blk_plug plug;
+        struct buffer_head *bh = yaf_bread(sb,
                     DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
         if (!bh) {
-            log(LOG_ERR, "sb_bread() failed");
+            log(LOG_ERR, "yaf_bread() failed");
             return -EIO;
         }
 
+        /*
+         * the caller usually stat()s every emitted name, so prefetch
+         * the inode blocks holding them while they are being emitted
+         */
+        blk_start_plug(&plug);
         yd = (Yaf_Dentry *)(bh->b_data);
         for(int i = iboff / YAF_DENTRY_SIZE;
             i < DENTRYS_PER_BLOCK && doff < dinode->i_size;
             ++i, ++yd, doff += YAF_DENTRY_SIZE) {
-            if (le32_to_cpu(yd->d_ino) != RESERVED_INO) {
-                if (!dir_emit(ctx, yd->d_name, le32_to_cpu(yd->d_name_len),
-                              le32_to_cpu(yd->d_ino), DT_UNKNOWN)) {
-                    log(LOG_ERR, "dir_emit() for %s failed", yd->d_name);
-                }
+            uint32_t ino = le32_to_cpu(yd->d_ino);
+
+            if (ino == RESERVED_INO) {
+                continue;
+            }
+
+            ctx->pos = doff + 2;
+            if (!dir_emit(ctx, yd->d_name, le32_to_cpu(yd->d_name_len),
+                          ino, DT_UNKNOWN)) {
+                /* @ctx is full, resume from this dentry next time */
+                blk_finish_plug(&plug);
+                brelse(bh);
+                return 0;
+            }
+
+            if (ino < NR_INODES(sb) &&
+                INO2BID(sb, ino) != last_bid) {
+                last_bid = INO2BID(sb, ino);
+                sb_breadahead(sb, last_bid);
             }
         }
+        blk_finish_plug(&plug);
 
         brelse(bh);
     }
@@ -81,4 +130,9 @@ static int yaf_iterate_shared(struct file *dir, struct dir_context *ctx) {
 const struct file_operations yaf_dir_ops = {
     .iterate_shared = yaf_iterate_shared, /* called when the VFS needs to
                                 read the directory contents */
+    .fsync = yaf_fsync,             /* called by the fsync(2) system call */
+    .unlocked_ioctl = yaf_ioctl,    /* called by the ioctl(2) system call */
+    .compat_ioctl = compat_ptr_ioctl, /* called by the ioctl(2) system call
+                                when 32-bit system calls are used on
+                                64-bit kernels */
 };
@@ -0,0 +1,209 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/delay.h>
+#include <linux/minmax.h>
+#include <linux/sched/signal.h>
+#include "../include/bitmap.h"
+#include "../include/csum.h"
+#include "../include/discard.h"
+#include "../include/inode.h"
+#include "../include/journal.h"
+#include "../include/yaf.h"
+
+/* number of sectors per block */
+#define SECTORS_PER_BLOCK   (YAF_BLOCK_SIZE >> SECTOR_SHIFT)
+
+/* convert dblock number to its first sector */
+static inline sector_t yaf_dno_sector(struct super_block *sb, uint32_t dno)
+{
+    return (sector_t)DNO2BID(sb, dno) * SECTORS_PER_BLOCK;
+}
+
+/*
+ * Discard the @nr data blocks in @dnos, merging adjacent blocks into
+ * one range and chaining all the ranges into one bio submission.
+ *
+ * @dnos is sorted in place.
+ */
+int yaf_discard_dblocks(struct super_block *sb, uint32_t *dnos,
+                        unsigned int nr)
+{
+    struct bio *bio = NULL;
+    int ret = 0, err;
+
+    yaf_sort_idxs(dnos, nr);
+
+    for (unsigned int i = 0, j; i < nr; i = j) {
+        j = i + 1;
+        while (j < nr && dnos[j] == dnos[j - 1] + 1) {
+            ++j;
+        }
+
+        ret = __blkdev_issue_discard(sb->s_bdev, yaf_dno_sector(sb, dnos[i]),
+                                     (sector_t)(j - i) * SECTORS_PER_BLOCK,
+                                     GFP_NOFS, &bio);
+        if (ret) {
+            log(LOG_ERR, "__blkdev_issue_discard() failed "
+                "with error code %d", ret);
+            break;
+        }
+    }
+
+    /* wait for the ranges chained so far even after a failure */
+    if (bio) {
+        err = submit_bio_wait(bio);
+        bio_put(bio);
+        if (err) {
+            log(LOG_ERR, "submit_bio_wait() failed with error code %d",
+                err);
+            ret = ret ? ret : err;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Discard up to @nr free data blocks from the bit @bit of the data
+ * bitmap block @bh covering the data blocks from @base.
+ *
+ * The blocks are marked used while being discarded, so they are not
+ * allocated meanwhile. The journal handle keeps those marks out of a
+ * commit and the buffer lock keeps them out of a writeback.
+ *
+ * Return the number of blocks discarded, which stops short of @nr at
+ * the first block allocated since the bitmap was scanned.
+ */
+static int64_t yaf_trim_range(struct super_block *sb,
+                              struct buffer_head *bh, uint32_t base,
+                              uint32_t bit, uint32_t nr)
+{
+    unsigned long *addr = (unsigned long *)bh->b_data;
+    Yaf_Handle handle;
+    uint32_t claimed = 0;
+    int ret;
+
+    ret = yaf_journal_start(sb, &handle, 0);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+    lock_buffer(bh);
+
+    while (claimed < nr && !test_and_set_bit(bit + claimed, addr)) {
+        ++claimed;
+    }
+    if (claimed) {
+        ret = blkdev_issue_discard(sb->s_bdev,
+                                   yaf_dno_sector(sb, base + bit),
+                                   (sector_t)claimed * SECTORS_PER_BLOCK,
+                                   GFP_NOFS);
+        for (uint32_t i = 0; i < claimed; ++i) {
+            clear_bit(bit + i, addr);
+        }
+    }
+
+    unlock_buffer(bh);
+    yaf_journal_stop(&handle);
+
+    if (ret) {
+        log(LOG_ERR, "blkdev_issue_discard() failed with error code %d",
+            ret);
+        return ret;
+    }
+    return claimed;
+}
+
+/*
+ * Discard the free runs of at least @range->minlen bytes among the data
+ * blocks within [@range->start, @range->start + @range->len), which
+ * are byte offsets from the start of the filesystem, and return the
+ * number of bytes discarded in @range->len.
+ *
+ * The discards are issued *YAF_TRIM_CHUNK* blocks at a time with a
+ * pause of *YAF_TRIM_PAUSE_MS* in between, so a trim of the whole
+ * filesystem does not starve the foreground I/O.
+ */
+int yaf_trim(struct super_block *sb, struct fstrim_range *range)
+{
+    uint64_t first = range->start / YAF_BLOCK_SIZE;
+    uint64_t last = first + range->len / YAF_BLOCK_SIZE;
+    uint64_t minlen = max_t(uint64_t, 1,
+                            DIV_ROUND_UP(range->minlen, YAF_BLOCK_SIZE));
+    uint32_t from, to;
+    uint64_t trimmed = 0;
+    int ret = 0;
+
+    /* the device cannot discard less than its granularity */
+    minlen = max_t(uint64_t, minlen,
+                   DIV_ROUND_UP(bdev_discard_granularity(sb->s_bdev),
+                                YAF_BLOCK_SIZE));
+    if (minlen > YAF_SB(sb)->nr_d) {
+        return -EINVAL;
+    }
+
+    if (last < first || last > BID_D_MAX(sb) + 1) {
+        last = BID_D_MAX(sb) + 1;
+    }
+    first = max_t(uint64_t, first, BID_D_MIN(sb));
+    if (first >= last) {
+        range->len = 0;
+        return 0;
+    }
+    from = first - BID_D_MIN(sb);
+    to = last - BID_D_MIN(sb);
+
+    for (uint32_t base = from - from % BITS_PER_BLOCK; base < to;
+         base += BITS_PER_BLOCK) {
+        uint32_t lo = max(from, base) - base;
+        uint32_t hi = min_t(uint32_t, to - base, BITS_PER_BLOCK);
+        unsigned long *addr;
+        struct buffer_head *bh;
+
+        bh = yaf_bread(sb, IDXD2BID(sb, base));
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            ret = -EIO;
+            break;
+        }
+        addr = (unsigned long *)bh->b_data;
+
+        for (uint32_t bit = lo; bit < hi && !ret;) {
+            uint32_t zero = find_next_zero_bit(addr, hi, bit);
+            uint32_t end = find_next_bit(addr, hi, zero);
+
+            bit = end;
+            if (zero >= hi || end - zero < minlen) {
+                continue;
+            }
+
+            while (zero < end) {
+                uint32_t nr = min_t(uint32_t, end - zero, YAF_TRIM_CHUNK);
+                int64_t res = yaf_trim_range(sb, bh, base, zero, nr);
+
+                if (res < 0) {
+                    ret = res;
+                    break;
+                }
+                trimmed += res;
+                /* skip the block allocated under the scan */
+                zero += res < nr ? res + 1 : res;
+
+                if (fatal_signal_pending(current)) {
+                    ret = -ERESTARTSYS;
+                    break;
+                }
+                msleep_interruptible(YAF_TRIM_PAUSE_MS);
+            }
+        }
+
+        brelse(bh);
+        if (ret) {
+            break;
+        }
+    }
+
+    range->len = trimmed * YAF_BLOCK_SIZE;
+    return ret;
+}
@@ -1,13 +1,16 @@
 #include <asm-generic/errno-base.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/export.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <linux/mpage.h>
-#include <linux/time64.h>
 #include <linux/writeback.h>
 #include "../include/bitmap.h"
 #include "../include/file.h"
 #include "../include/inode.h"
+#include "../include/ioctl.h"
+#include "../include/journal.h"
 #include "../include/yaf.h"
 
 /*
@@ -33,15 +36,27 @@ static int yaf_get_block(struct inode *inode, sector_t iblock,
     }
 
     if (iblock >= dbnr) {
+        Yaf_Handle handle;
+        int ret;
+
         if (!create) {
             return 0;
         }
 
+        /* the bitmap blocks of the data blocks and the inode block */
+        ret = yaf_journal_start(sb, &handle, iblock - dbnr + 2);
+        if (ret) {
+            log(LOG_ERR, "yaf_journal_start() failed with error code %d",
+                ret);
+            return ret;
+        }
+
         /* allocate the need data block */
         while(dbnr <= iblock) {
             uint32_t dno = yaf_get_free_dblock(sb);
             if (dno == RESERVED_DNO) {
                 mark_inode_dirty(inode);
+                yaf_journal_stop(&handle);
                 log(LOG_ERR, "yaf_gre_free_dblock() failed");
                 return -ENOSPC;
             }
@@ -50,6 +65,7 @@ static int yaf_get_block(struct inode *inode, sector_t iblock,
             ++dbnr;
         }
         mark_inode_dirty(inode);
+        yaf_journal_stop(&handle);
     }
 
     /* map the physical block to the given 'buffer_head' */
@@ -98,16 +114,16 @@ static int yaf_write_begin(struct file *file,
  * Called by the VFS after writing data from a write() syscall to the
  * page cache.
  *
- * yaf_write_end() updates inode metadata and truncates the file
- * if necessary.
+ * yaf_write_end() updates the inode size if necessary. The mtime and
+ * ctime have already been updated by generic_file_write_iter(),
+ * which only marks the inode dirty for timestamps when the lazytime
+ * mount flag allows it.
  */
 static int yaf_write_end(struct file *file,
                          struct address_space *mapping, loff_t pos,
                          unsigned int len, unsigned int copied,
                          struct page *page, void *fsdata)
 {
-    struct inode *inode = file->f_inode;
-    struct timespec64 cur;
     int ret;
 
     ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
@@ -117,12 +133,6 @@ static int yaf_write_end(struct file *file,
         return ret;
     }
 
-    /* update the inode */
-    cur = current_time(inode);
-    inode_set_ctime_to_ts(inode, cur);
-    inode_set_mtime_to_ts(inode, cur);
-    mark_inode_dirty(inode);
-
     return ret;
 }
 
@@ -132,6 +142,112 @@ static int yaf_writepage(struct page *page, struct writeback_control *wbc)
     return block_write_full_page(page, yaf_get_block, wbc);
 }
 
+/* map the @block-th block of the file for the FIBMAP ioctl */
+static sector_t yaf_bmap(struct address_space *mapping, sector_t block)
+{
+    return generic_block_bmap(mapping, block, yaf_get_block);
+}
+
+/*
+ * Called by the fallocate(2) system call.
+ *
+ * The data blocks missing up to @offset + @len are allocated in one
+ * run of consecutive data blocks if possible, e.g. for the donor file
+ * of yaf-defrag, and zeroed, since yaf has no unwritten blocks.
+ * Only *FALLOC_FL_KEEP_SIZE* is supported.
+ */
+static long yaf_fallocate(struct file *file, int mode, loff_t offset,
+                          loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    Yaf_Inode_Info *yii = YAF_INODE(inode);
+    uint32_t dnos[YAF_IBLOCKS];
+    loff_t end = offset + len;
+    uint32_t dbnr = 0, nr;
+    Yaf_Handle handle;
+    int ret;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    if (end > MAX_FILESIZE) {
+        return -EFBIG;
+    }
+
+    inode_lock(inode);
+    ret = file_modified(file);
+    if (ret) {
+        goto unlock;
+    }
+
+    while (dbnr < YAF_IBLOCKS && yii->i_block[dbnr] != RESERVED_DNO) {
+        ++dbnr;
+    }
+    nr = DIV_ROUND_UP(end, YAF_BLOCK_SIZE);
+    nr = nr > dbnr ? nr - dbnr : 0;
+
+    ret = yaf_journal_start(sb, &handle, nr + 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        goto unlock;
+    }
+
+    if (nr) {
+        ret = yaf_get_free_dblocks(sb, dnos, nr);
+        if (ret) {
+            goto stop;
+        }
+
+        /* zero each run of consecutive data blocks at once */
+        for (uint32_t i = 0, j = 1; i < nr; i = j++) {
+            while (j < nr && dnos[j] == dnos[j - 1] + 1) {
+                ++j;
+            }
+            ret = sb_issue_zeroout(sb, DNO2BID(sb, dnos[i]), j - i,
+                                   GFP_NOFS);
+            if (ret) {
+                log(LOG_ERR, "sb_issue_zeroout() failed with error code "
+                    "%d", ret);
+                yaf_put_dblocks(sb, dnos, nr);
+                goto stop;
+            }
+        }
+
+        memcpy(&yii->i_block[dbnr], dnos, nr * sizeof(dnos[0]));
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        i_size_write(inode, end);
+    }
+    mark_inode_dirty(inode);
+
+stop:
+    yaf_journal_stop(&handle);
+unlock:
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+ * Called by the fsync(2) system call.
+ *
+ * generic_file_fsync() only commits the journal when the inode itself
+ * is dirty, so the dentry and bitmap blocks logged for @file are
+ * committed here as well.
+ */
+int yaf_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    int ret;
+
+    ret = generic_file_fsync(file, start, end, datasync);
+    if (ret) {
+        return ret;
+    }
+
+    return yaf_journal_commit(file_inode(file)->i_sb);
+}
+
 /*
  * describes how the VFS can manipulate mapping of a file
  * to page cache in your filesystem accroding to
@@ -146,6 +262,8 @@ const struct address_space_operations yaf_as_ops = {
              write code to ask the filesystem to prepare to write file */
     .write_end = yaf_write_end,     /* after a successful write_begin,
                             and data copy, write_end must be called */
+    .bmap = yaf_bmap,               /* called by the FIBMAP ioctl to
+                         map a file block to its block of the device */
 };
 
 /*
@@ -160,4 +278,14 @@ const struct file_operations yaf_file_ops = {
                                                write the file */
     .llseek = generic_file_llseek,          /* called when the VFS needs to
                                             move the file position index */
+    .fsync = yaf_fsync,                     /* called by the fsync(2)
+                                               system call */
+    .fallocate = yaf_fallocate,             /* called by the
+                                               fallocate(2) system call */
+    .unlocked_ioctl = yaf_ioctl,            /* called by the ioctl(2)
+                                               system call */
+    .compat_ioctl = compat_ptr_ioctl,       /* called by the ioctl(2)
+                                               system call when 32-bit
+                                               system calls are used on
+                                               64-bit kernels */
 };
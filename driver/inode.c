@@ -1,14 +1,20 @@
 #include <asm-generic/errno.h>
 #include <linux/array_size.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/byteorder/generic.h>
 #include <linux/fs.h>
 #include <linux/mnt_idmapping.h>
 #include <linux/time64.h>
 #include "../include/bitmap.h"
+#include "../include/compact.h"
+#include "../include/csum.h"
 #include "../include/file.h"
 #include "../include/dir.h"
 #include "../include/inode.h"
+#include "../include/itable.h"
+#include "../include/journal.h"
+#include "../include/orphan.h"
 #include "../include/yaf.h"
 
 /*
@@ -22,6 +28,7 @@ static struct inode *yaf_new_inode(struct inode *dir, mode_t mode)
     uint32_t ino;
     struct timespec64 cur;
     Yaf_Inode_Info *yii;
+    int ret;
 
     /* allocate the on-disk inode */
     ino = yaf_get_free_inode(sb);
@@ -30,6 +37,14 @@ static struct inode *yaf_new_inode(struct inode *dir, mode_t mode)
         return ERR_PTR(-ENOSPC);
     }
 
+    /* its inode block may be left as it was on the disk by mkfs */
+    ret = yaf_itable_prepare(sb, ino);
+    if (ret) {
+        log(LOG_ERR, "yaf_itable_prepare() failed with error code %d", ret);
+        yaf_put_inode(sb, ino);
+        return ERR_PTR(ret);
+    }
+
     inode = yaf_iget(sb, ino);
     if (IS_ERR(inode)) {
         log(LOG_ERR, "yaf_iget() failed with error code %ld",
@@ -75,10 +90,10 @@ static int64_t yaf_get_free_dentry(struct inode *dir)
     /* iterate diretory to find unsed dentry */
     while(doff < dir->i_size) {
         Yaf_Dentry *yd;
-        bh = sb_bread(sb,
+        bh = yaf_bread(sb,
                 DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
         if (!bh) {
-            log(LOG_ERR, "sb_bread() failed");
+            log(LOG_ERR, "yaf_bread() failed");
             return -EIO;
         }
 
@@ -107,37 +122,144 @@ static int64_t yaf_get_free_dentry(struct inode *dir)
         }
         assert(dyii->i_block[doff / YAF_BLOCK_SIZE] == RESERVED_DNO);
         dyii->i_block[doff / YAF_BLOCK_SIZE] = dno;
+
+        /*
+         * The new dentry block is zeroed instead of read, its stale
+         * content would not match the checksum of its last owner.
+         */
+        bh = sb_getblk(sb, DNO2BID(sb, dno));
+        assert(bh);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, YAF_BLOCK_SIZE);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+    } else {
+        bh = yaf_bread(sb,
+                DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
+        assert(bh);
     }
 
     /* mark the found dentry as unuse */
-    bh = sb_bread(sb,
-            DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
-    assert(bh);
     ((Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE))->d_ino = RESERVED_INO;
-    mark_buffer_dirty(bh);
+    yaf_journal_dirty(sb, bh);
     brelse(bh);
 
     /* mark dir inode is dirty */
     dir->i_size = doff + YAF_DENTRY_SIZE;
     cur = current_time(dir);
-    inode_set_atime_to_ts(dir, cur);
     inode_set_mtime_to_ts(dir, cur);
     inode_set_ctime_to_ts(dir, cur);
     mark_inode_dirty(dir);
     return doff;
 }
 
-/* create @dentry(a file or directory) in @dir */
+/*
+ * Point the on-disk dentry at @doff of @dir to the inode @ino and,
+ * if @name is given, rename it to @name as well.
+ */
+static int yaf_set_dentry(struct inode *dir, int64_t doff, uint32_t ino,
+                          const struct qstr *name)
+{
+    struct super_block *sb = dir->i_sb;
+    Yaf_Inode_Info *dyii = YAF_INODE(dir);
+    struct buffer_head *bh;
+    Yaf_Dentry *yd;
+
+    bh = yaf_bread(sb, DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        return -EIO;
+    }
+    yd = (Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE);
+
+    yd->d_ino = cpu_to_le32(ino);
+    if (name) {
+        yd->d_name_len = cpu_to_le32(name->len);
+        strncpy(yd->d_name, name->name, YAF_DENTRY_NAME_LEN);
+    }
+
+    yaf_journal_dirty(sb, bh);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Drop a link of @inode.
+ *
+ * Its data blocks and on-disk inode are released by
+ * yaf_evict_inode() once the last link and the last open file
+ * are gone, so an unlinked file stays readable while it is open.
+ * Until then it is kept on the orphan list.
+ */
+static void yaf_drop_link(struct inode *inode)
+{
+    drop_nlink(inode);
+    mark_inode_dirty(inode);
+    if (!inode->i_nlink) {
+        yaf_orphan_add(inode);
+    }
+}
+
+/*
+ * describes how the VFS can follow a symlink whose target is kept
+ * inside *i_block*, see yaf_set_symlink()
+ */
+static const struct inode_operations yaf_fast_symlink_ops = {
+    .get_link = simple_get_link,    /* called when the VFS needs to
+                            follow the symlink to the inode it points to */
+};
+
+/*
+ * describes how the VFS can follow a symlink whose target is kept
+ * in a data block
+ */
+static const struct inode_operations yaf_symlink_ops = {
+    .get_link = page_get_link,      /* called when the VFS needs to
+                            follow the symlink to the inode it points to */
+};
+
+/*
+ * Store the target @symname of the symlink @inode.
+ *
+ * Short targets are kept inside *i_block*, so following them
+ * needs no data block read.
+ */
+static int yaf_set_symlink(struct inode *inode, const char *symname)
+{
+    Yaf_Inode_Info *yii = YAF_INODE(inode);
+    size_t len = strlen(symname);
+
+    if (len <= YAF_FAST_SYMLINK_LEN) {
+        memset(yii->i_block, 0, sizeof(yii->i_block));
+        memcpy(yii->i_block, symname, len);
+        inode->i_size = len;
+        inode->i_op = &yaf_fast_symlink_ops;
+        inode->i_link = (char *)yii->i_block;
+        mark_inode_dirty(inode);
+        return 0;
+    }
+
+    inode->i_op = &yaf_symlink_ops;
+    inode_nohighmem(inode);
+    inode->i_mapping->a_ops = &yaf_as_ops;
+    return page_symlink(inode, symname, len + 1);
+}
+
+/* create @dentry(a file, directory or symlink to @symname) in @dir */
 static int _yaf_create(struct mnt_idmap *id, struct inode *dir,
-                      struct dentry *dentry, umode_t mode, bool excl)
+                      struct dentry *dentry, umode_t mode, bool excl,
+                      const char *symname)
 {
     Yaf_Inode_Info *dyii = YAF_INODE(dir);
     struct super_block *sb = dir->i_sb;
     uint64_t doff;
     struct buffer_head *bh;
     Yaf_Dentry *yd;
-    struct inode *inode;
+    struct inode *inode = NULL;
     struct timespec64 cur;
+    Yaf_Handle handle;
+    int ret;
 
     /* check @dentry name length */
     if (dentry->d_name.len > YAF_DENTRY_NAME_LEN) {
@@ -146,22 +268,30 @@ static int _yaf_create(struct mnt_idmap *id, struct inode *dir,
         return -ENAMETOOLONG;
     }
 
+    ret = yaf_journal_start(sb, &handle, YAF_JOURNAL_CREDITS);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
     /* get on-disk free dentry */
     doff = yaf_get_free_dentry(dir);
     if (doff < 0) {
         log(LOG_ERR, "yaf_get_free_dentry() failed "
             "with error code %lld", doff);
-        return -EIO;
+        ret = -EIO;
+        goto stop;
     }
-    bh = sb_bread(sb,
+    bh = yaf_bread(sb,
             DNO2BID(sb, dyii->i_block[doff / YAF_BLOCK_SIZE]));
     if (!bh) {
         /*
          * here we do not need to put the free dentry,
          * then can be used next time
          */
-        log(LOG_ERR, "sb_bread() failed");
-        return -EIO;
+        log(LOG_ERR, "yaf_bread() failed");
+        ret = -EIO;
+        goto stop;
     }
     yd = (Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE);
 
@@ -171,19 +301,31 @@ static int _yaf_create(struct mnt_idmap *id, struct inode *dir,
         log(LOG_ERR, "yaf_new_inode() failed with error code %ld",
             PTR_ERR(inode));
         brelse(bh);
-        return PTR_ERR(inode);
+        ret = PTR_ERR(inode);
+        goto stop;
+    }
+
+    /* store the symlink target */
+    if (symname) {
+        ret = yaf_set_symlink(inode, symname);
+        if (ret) {
+            log(LOG_ERR, "yaf_set_symlink() failed with error code %d",
+                ret);
+            brelse(bh);
+            yaf_drop_link(inode);
+            goto stop;
+        }
     }
 
     yd->d_ino = cpu_to_le32(inode->i_ino);
     yd->d_name_len = cpu_to_le32(dentry->d_name.len);
     strncpy(yd->d_name, dentry->d_name.name, YAF_DENTRY_NAME_LEN);
 
-    mark_buffer_dirty(bh);
+    yaf_journal_dirty(sb, bh);
     brelse(bh);
 
     /* update @dir */
     cur = current_time(dir);
-    inode_set_atime_to_ts(dir, cur);
     inode_set_mtime_to_ts(dir, cur);
     inode_set_ctime_to_ts(dir, cur);
     inc_nlink(dir);
@@ -191,21 +333,92 @@ static int _yaf_create(struct mnt_idmap *id, struct inode *dir,
 
     d_instantiate(dentry, inode);
 
-    return 0;
+stop:
+    yaf_journal_stop(&handle);
+
+    /* the failed inode is evicted outside of the handle */
+    if (ret && !IS_ERR_OR_NULL(inode)) {
+        iput(inode);
+    }
+
+    return ret;
 }
 
 /* create subdirectory */
 static int yaf_mkdir(struct mnt_idmap *id, struct inode *dir,
                      struct dentry *dentry, umode_t mode)
 {
-    return _yaf_create(id, dir, dentry, mode | S_IFDIR, 0);
+    return _yaf_create(id, dir, dentry, mode | S_IFDIR, 0, NULL);
 }
 
 /* create regular file */
 static int yaf_create(struct mnt_idmap *id, struct inode *dir,
                      struct dentry *dentry, umode_t mode, bool excl)
 {
-    return _yaf_create(id, dir, dentry, mode | S_IFREG, excl);
+    return _yaf_create(id, dir, dentry, mode | S_IFREG, excl, NULL);
+}
+
+/* create symlink @dentry to @symname in @dir */
+static int yaf_symlink(struct mnt_idmap *id, struct inode *dir,
+                       struct dentry *dentry, const char *symname)
+{
+    return _yaf_create(id, dir, dentry, S_IFLNK | S_IRWXUGO, 0, symname);
+}
+
+/* create hard link @dentry in @dir to the inode of @old_dentry */
+static int yaf_link(struct dentry *old_dentry, struct inode *dir,
+                    struct dentry *dentry)
+{
+    struct inode *inode = d_inode(old_dentry);
+    struct timespec64 cur;
+    Yaf_Handle handle;
+    int64_t doff;
+    int ret;
+
+    /* check @dentry name length */
+    if (dentry->d_name.len > YAF_DENTRY_NAME_LEN) {
+        log(LOG_ERR, "dentry->d_name.len = %d is too long for [1, %ld]",
+            dentry->d_name.len, YAF_DENTRY_NAME_LEN);
+        return -ENAMETOOLONG;
+    }
+
+    ret = yaf_journal_start(dir->i_sb, &handle, YAF_JOURNAL_CREDITS);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
+    /* get on-disk free dentry and point it to @inode */
+    doff = yaf_get_free_dentry(dir);
+    if (doff < 0) {
+        log(LOG_ERR, "yaf_get_free_dentry() failed "
+            "with error code %lld", doff);
+        ret = doff;
+        goto stop;
+    }
+    ret = yaf_set_dentry(dir, doff, inode->i_ino, &dentry->d_name);
+    if (ret) {
+        log(LOG_ERR, "yaf_set_dentry() failed with error code %d", ret);
+        goto stop;
+    }
+
+    /* update @dir and @inode */
+    cur = current_time(dir);
+    inode_set_mtime_to_ts(dir, cur);
+    inode_set_ctime_to_ts(dir, cur);
+    inc_nlink(dir);
+    mark_inode_dirty(dir);
+
+    inode_set_ctime_to_ts(inode, cur);
+    inc_nlink(inode);
+    mark_inode_dirty(inode);
+
+    ihold(inode);
+    d_instantiate(dentry, inode);
+
+stop:
+    yaf_journal_stop(&handle);
+    return ret;
 }
 
 /* return the on-disk dentry offset in the directory */
@@ -225,10 +438,10 @@ static int64_t _yaf_lookup(struct inode *dir, struct dentry *dentry)
     /* search for the dentry in directory */
     while(doff < dir->i_size) {
         Yaf_Dentry *yd;
-        struct buffer_head *bh = sb_bread(sb,
+        struct buffer_head *bh = yaf_bread(sb,
                     DNO2BID(sb, yii->i_block[doff / YAF_BLOCK_SIZE]));
         if (!bh) {
-            log(LOG_ERR, "sb_bread() failed");
+            log(LOG_ERR, "yaf_bread() failed");
             return -EIO;
         }
 
@@ -280,9 +493,9 @@ static struct dentry* yaf_lookup(struct inode *dir,
         return ERR_PTR(doff);
     }
 
-    bh = sb_bread(sb, DNO2BID(sb, yii->i_block[doff / YAF_BLOCK_SIZE]));
+    bh = yaf_bread(sb, DNO2BID(sb, yii->i_block[doff / YAF_BLOCK_SIZE]));
     if (!bh) {
-        log(LOG_ERR, "sb_bread() failed");
+        log(LOG_ERR, "yaf_bread() failed");
         return ERR_PTR(-EIO);
     }
     yd = (Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE);
@@ -299,9 +512,10 @@ static struct dentry* yaf_lookup(struct inode *dir,
 
 out:
 
-    /* update the directory access time */
-    inode_set_atime_to_ts(dir, current_time(dir));
-    mark_inode_dirty(dir);
+    /*
+     * the directory access time is left alone here, it is updated
+     * by the VFS on readdir according to the atime mount flags
+     */
 
     /* fill the dentry with the inode */
     d_add(dentry, inode);
@@ -312,59 +526,40 @@ out:
 /* delete @dentry(a file or directory) in @dir */
 static int yaf_delete(struct inode *dir, struct dentry *dentry)
 {
-    struct super_block *sb = dir->i_sb;
-    Yaf_Inode_Info *yii = YAF_INODE(dir);
     struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh;
-    Yaf_Dentry *yd;
     int64_t doff;
     struct timespec64 cur;
+    Yaf_Handle handle;
+    int ret;
 
     doff = _yaf_lookup(dir, dentry);
     assert(doff >= 0);
 
-    /* get the *Yaf_Dentry* in @dir  */
-    bh = sb_bread(sb, DNO2BID(sb, yii->i_block[doff / YAF_BLOCK_SIZE]));
-    if (!bh) {
-        log(LOG_ERR, "sb_bread() failed");
-        return -EIO;
+    ret = yaf_journal_start(dir->i_sb, &handle, YAF_JOURNAL_CREDITS);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
     }
-    yd = (Yaf_Dentry *)(bh->b_data + doff % YAF_BLOCK_SIZE);
 
     /* remove @dentry from @dir */
-    yd->d_ino = cpu_to_le32(RESERVED_INO);
-
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    ret = yaf_set_dentry(dir, doff, RESERVED_INO, NULL);
+    if (ret) {
+        log(LOG_ERR, "yaf_set_dentry() failed with error code %d", ret);
+        goto stop;
+    }
 
     /* update the @dir */
     cur = current_time(dir);
-    inode_set_atime_to_ts(dir, cur);
     inode_set_mtime_to_ts(dir, cur);
     inode_set_ctime_to_ts(dir, cur);
     drop_nlink(dir);
     mark_inode_dirty(dir);
 
-    drop_nlink(inode);
-    if (inode->i_nlink > 1) {
-        /* there still other link for this inode */
-        mark_inode_dirty(inode);
-        return 0;
-    }
-
-    /* there is no other link, we can delete this inode */
+    yaf_drop_link(inode);
 
-    /* clear the *i_block* */
-    yii = YAF_INODE(inode);
-    for (doff = 0; doff < inode->i_size; doff += YAF_BLOCK_SIZE) {
-        yaf_put_dblock(sb, yii->i_block[doff / YAF_BLOCK_SIZE]);
-    }
-
-    /* put the inode */
-    yaf_put_inode(sb, inode->i_ino);
-    mark_inode_dirty(inode);
-
-    return 0;
+stop:
+    yaf_journal_stop(&handle);
+    return ret;
 }
 
 /* delete directory @dentry in @dir */
@@ -386,6 +581,157 @@ static int yaf_unlink(struct inode *dir, struct dentry *dentry)
     return yaf_delete(dir, dentry);
 }
 
+/* swap the inodes of @old_dentry in @old_dir and @new_dentry in @new_dir */
+static int yaf_exchange(struct inode *old_dir, struct dentry *old_dentry,
+                        struct inode *new_dir, struct dentry *new_dentry)
+{
+    struct inode *old_inode = d_inode(old_dentry);
+    struct inode *new_inode = d_inode(new_dentry);
+    int64_t old_doff, new_doff;
+    int ret;
+
+    old_doff = _yaf_lookup(old_dir, old_dentry);
+    if (old_doff < 0) {
+        return old_doff;
+    }
+    new_doff = _yaf_lookup(new_dir, new_dentry);
+    if (new_doff < 0) {
+        return new_doff;
+    }
+
+    ret = yaf_set_dentry(new_dir, new_doff, old_inode->i_ino, NULL);
+    if (ret) {
+        return ret;
+    }
+    return yaf_set_dentry(old_dir, old_doff, new_inode->i_ino, NULL);
+}
+
+/*
+ * Move @old_dentry in @old_dir to @new_dentry in @new_dir,
+ * replacing the inode of @new_dentry if there is one.
+ */
+static int yaf_move(struct inode *old_dir, struct dentry *old_dentry,
+                    struct inode *new_dir, struct dentry *new_dentry)
+{
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+    int64_t old_doff, new_doff;
+    int ret;
+
+    old_doff = _yaf_lookup(old_dir, old_dentry);
+    if (old_doff < 0) {
+        return old_doff;
+    }
+
+    /* a plain rename inside @old_dir only rewrites the dentry name */
+    if (old_dir == new_dir && !target) {
+        return yaf_set_dentry(old_dir, old_doff, inode->i_ino,
+                              &new_dentry->d_name);
+    }
+
+    if (target) {
+        /* check whether the replaced directory is empty */
+        if (S_ISDIR(target->i_mode) && target->i_nlink > 1) {
+            return -ENOTEMPTY;
+        }
+        new_doff = _yaf_lookup(new_dir, new_dentry);
+    } else {
+        new_doff = yaf_get_free_dentry(new_dir);
+    }
+    if (new_doff < 0) {
+        log(LOG_ERR, "failed to find the dentry in @new_dir "
+            "with error code %lld", new_doff);
+        return new_doff;
+    }
+
+    /*
+     * fill the new dentry before clearing the old one, so the
+     * inode is never left without a dentry on disk
+     */
+    ret = yaf_set_dentry(new_dir, new_doff, inode->i_ino,
+                         &new_dentry->d_name);
+    if (ret) {
+        return ret;
+    }
+    ret = yaf_set_dentry(old_dir, old_doff, RESERVED_INO, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    drop_nlink(old_dir);
+    if (target) {
+        yaf_drop_link(target);
+    } else {
+        inc_nlink(new_dir);
+    }
+
+    return 0;
+}
+
+/*
+ * Rename @old_dentry in @old_dir to @new_dentry in @new_dir.
+ *
+ * Only the affected on-disk dentrys and link counts are rewritten,
+ * the data of the renamed inode is never touched.
+ */
+static int yaf_rename(struct mnt_idmap *id, struct inode *old_dir,
+                      struct dentry *old_dentry, struct inode *new_dir,
+                      struct dentry *new_dentry, unsigned int flags)
+{
+    struct timespec64 cur;
+    Yaf_Handle handle;
+    int ret;
+
+    /* *RENAME_NOREPLACE* has already been checked by the VFS */
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+        return -EINVAL;
+    }
+
+    /* check @new_dentry name length */
+    if (new_dentry->d_name.len > YAF_DENTRY_NAME_LEN) {
+        log(LOG_ERR, "dentry->d_name.len = %d is too long for [1, %ld]",
+            new_dentry->d_name.len, YAF_DENTRY_NAME_LEN);
+        return -ENAMETOOLONG;
+    }
+
+    ret = yaf_journal_start(old_dir->i_sb, &handle, YAF_JOURNAL_CREDITS);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
+    if (flags & RENAME_EXCHANGE) {
+        ret = yaf_exchange(old_dir, old_dentry, new_dir, new_dentry);
+    } else {
+        ret = yaf_move(old_dir, old_dentry, new_dir, new_dentry);
+    }
+    if (ret) {
+        log(LOG_ERR, "failed to rename with error code %d", ret);
+        goto stop;
+    }
+
+    /* update the directories and the renamed inodes in the same handle */
+    cur = current_time(old_dir);
+    inode_set_mtime_to_ts(old_dir, cur);
+    inode_set_ctime_to_ts(old_dir, cur);
+    mark_inode_dirty(old_dir);
+    if (new_dir != old_dir) {
+        inode_set_mtime_to_ts(new_dir, cur);
+        inode_set_ctime_to_ts(new_dir, cur);
+        mark_inode_dirty(new_dir);
+    }
+    inode_set_ctime_to_ts(d_inode(old_dentry), cur);
+    mark_inode_dirty(d_inode(old_dentry));
+    if ((flags & RENAME_EXCHANGE) && d_inode(new_dentry)) {
+        inode_set_ctime_to_ts(d_inode(new_dentry), cur);
+        mark_inode_dirty(d_inode(new_dentry));
+    }
+
+stop:
+    yaf_journal_stop(&handle);
+    return ret;
+}
+
 /*
  * describes how the VFS can manipulate an inode according to
  * https://docs.kernel.org/next/filesystems/vfs.html#struct-inode-operations
@@ -401,8 +747,61 @@ static const struct inode_operations yaf_inode_ops = {
                                delete subdirectories */
     .unlink = yaf_unlink,   /* called when the VFS needs to
                                delete inodes */
+    .rename = yaf_rename,   /* called when the VFS needs to
+                               rename inodes */
+    .link = yaf_link,       /* called when the VFS needs to
+                               create hard links */
+    .symlink = yaf_symlink, /* called when the VFS needs to
+                               create symlinks */
 };
 
+/* number of inode blocks read ahead after an inode cache miss */
+#define YAF_INODE_READAHEAD_BLOCKS  4
+
+/*
+ * Read the inode block holding the on-disk inode @ino.
+ *
+ * If the block is not cached yet, the following inode blocks are
+ * read ahead with it, since inodes created together are usually
+ * looked up together.
+ */
+static struct buffer_head *yaf_bread_inode(struct super_block *sb,
+                                           unsigned long ino)
+{
+    unsigned long bid = INO2BID(sb, ino);
+    struct buffer_head *bh;
+    struct blk_plug plug;
+
+    bh = sb_getblk(sb, bid);
+    if (!bh) {
+        return NULL;
+    }
+
+    if (!buffer_uptodate(bh)) {
+        blk_start_plug(&plug);
+        bh_readahead(bh, 0);
+        for (unsigned long ra = bid + 1;
+             ra <= bid + YAF_INODE_READAHEAD_BLOCKS && ra <= BID_I_MAX(sb);
+             ++ra) {
+            sb_breadahead(sb, ra);
+        }
+        blk_finish_plug(&plug);
+    }
+
+    if (bh_read(bh, 0) < 0 || yaf_csum_verify(sb, bh)) {
+        brelse(bh);
+        return NULL;
+    }
+
+    return bh;
+}
+
+/* join the low and high 32 bits of an on-disk inode field */
+static inline int64_t yaf_join(uint32_t lo, uint32_t hi)
+{
+    return (int64_t)((uint64_t)le32_to_cpu(hi) << 32 | le32_to_cpu(lo));
+}
+
 /*
  * yaf_iget() is responsible for parsing the on-disk inode,
  * creating and initializing an in-memory inode based on
@@ -415,10 +814,10 @@ struct inode* yaf_iget(struct super_block *sb, unsigned long ino) {
     struct buffer_head *bh = NULL;
 
     /* check whether the ino is out-of-bounds */
-    if (ino >= YAF_SB(sb)->nr_i * INODES_PER_BLOCK) {
+    if (ino >= NR_INODES(sb)) {
         inode = ERR_PTR(-EINVAL);
-        log(LOG_ERR, "ino %ld is out-of-bounds for [0, %ld]",
-            ino, YAF_SB(sb)->nr_i * INODES_PER_BLOCK);
+        log(LOG_ERR, "ino %ld is out-of-bounds for [0, %u]",
+            ino, NR_INODES(sb));
         goto out;
     }
 
@@ -429,16 +828,26 @@ struct inode* yaf_iget(struct super_block *sb, unsigned long ino) {
         log(LOG_ERR, "iget_locked() failed");
         goto out;
     }
+
+    /*
+     * the inode is already cached, its in-memory fields are newer
+     * than the on-disk inode
+     */
+    if (!(inode->i_state & I_NEW)) {
+        goto out;
+    }
     yii = YAF_INODE(inode);
+    INIT_LIST_HEAD(&yii->i_orphan.node);
 
     /* read on-disk inode from block device */
-    bh = sb_bread(sb, INO2BID(sb, ino));
+    bh = yaf_bread_inode(sb, ino);
     if (!bh) {
+        iget_failed(inode);
         inode = ERR_PTR(-EIO);
-        log(LOG_ERR, "sb_bread() failed");
+        log(LOG_ERR, "yaf_bread_inode() failed");
         goto out;
     }
-    yi = (Yaf_Inode *)bh->b_data + (ino % INODES_PER_BLOCK);
+    yi = (Yaf_Inode *)(bh->b_data + INO2BOFF(sb, ino));
 
     /* initialize *struct inode* */
     inode->i_op = &yaf_inode_ops;
@@ -446,18 +855,51 @@ struct inode* yaf_iget(struct super_block *sb, unsigned long ino) {
     i_uid_write(inode, le32_to_cpu(yi->i_uid));
     i_gid_write(inode, le32_to_cpu(yi->i_gid));
     set_nlink(inode, le32_to_cpu(yi->i_nlink));
-    inode->i_size = le32_to_cpu(yi->i_size);
-    inode_set_atime(inode, le32_to_cpu(yi->i_atime), 0);
-    inode_set_mtime(inode, le32_to_cpu(yi->i_mtime), 0);
-    inode_set_ctime(inode, le32_to_cpu(yi->i_ctime), 0);
-    for (int i = 0; i < ARRAY_SIZE(yii->i_block); ++i) {
-        yii->i_block[i] = le32_to_cpu(yi->i_block[i]);
+    if (YAF_INODE_SIZE(sb) > sizeof(Yaf_Inode)) {
+        Yaf_Inode_Ext *yie = (Yaf_Inode_Ext *)(yi + 1);
+
+        inode->i_size = yaf_join(yi->i_size, yie->i_size_hi);
+        inode_set_atime(inode, yaf_join(yi->i_atime, yie->i_atime_hi),
+                        le32_to_cpu(yie->i_atime_nsec));
+        inode_set_mtime(inode, yaf_join(yi->i_mtime, yie->i_mtime_hi),
+                        le32_to_cpu(yie->i_mtime_nsec));
+        inode_set_ctime(inode, yaf_join(yi->i_ctime, yie->i_ctime_hi),
+                        le32_to_cpu(yie->i_ctime_nsec));
+    } else {
+        inode->i_size = le32_to_cpu(yi->i_size);
+        inode_set_atime(inode, le32_to_cpu(yi->i_atime), 0);
+        inode_set_mtime(inode, le32_to_cpu(yi->i_mtime), 0);
+        inode_set_ctime(inode, le32_to_cpu(yi->i_ctime), 0);
     }
-    if (S_ISDIR(inode->i_mode)) {
+    if (yaf_is_fast_symlink(inode)) {
+        memcpy(yii->i_block, yi->i_block, sizeof(yii->i_block));
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(yii->i_block); ++i) {
+            yii->i_block[i] = le32_to_cpu(yi->i_block[i]);
+        }
+    }
+    if (yaf_is_compact(sb) &&
+        (S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode))) {
+        int ret = yaf_compact_set_ops(inode);
+
+        if (ret) {
+            iget_failed(inode);
+            inode = ERR_PTR(ret);
+            brelse(bh);
+            goto out;
+        }
+    } else if (S_ISDIR(inode->i_mode)) {
         inode->i_fop = &yaf_dir_ops;
     } else if (S_ISREG(inode->i_mode)) {
         inode->i_fop = &yaf_file_ops;
         inode->i_mapping->a_ops = &yaf_as_ops;
+    } else if (yaf_is_fast_symlink(inode)) {
+        inode->i_op = &yaf_fast_symlink_ops;
+        inode->i_link = (char *)yii->i_block;
+    } else if (S_ISLNK(inode->i_mode)) {
+        inode->i_op = &yaf_symlink_ops;
+        inode_nohighmem(inode);
+        inode->i_mapping->a_ops = &yaf_as_ops;
     }
 
     /* unlock the inode to make it available */
@@ -468,3 +910,45 @@ struct inode* yaf_iget(struct super_block *sb, unsigned long ino) {
 out:
     return inode;
 }
+
+/*
+ * Fill the on-disk inode @dyi according to the in-memory @inode, the
+ * reverse of yaf_iget(). Its orphan list link is left to
+ * yaf_orphan_fill().
+ */
+void yaf_fill_inode(struct inode *inode, Yaf_Inode *dyi)
+{
+    struct super_block *sb = inode->i_sb;
+    Yaf_Inode_Info *yii = YAF_INODE(inode);
+
+    dyi->i_mode = cpu_to_le32(inode->i_mode);
+    dyi->i_uid = cpu_to_le32(i_uid_read(inode));
+    dyi->i_gid = cpu_to_le32(i_gid_read(inode));
+    dyi->i_nlink = cpu_to_le32(inode->i_nlink);
+    dyi->i_atime = cpu_to_le32(inode_get_atime_sec(inode));
+    dyi->i_mtime = cpu_to_le32(inode_get_mtime_sec(inode));
+    dyi->i_ctime = cpu_to_le32(inode_get_ctime_sec(inode));
+    dyi->i_size = cpu_to_le32(inode->i_size);
+    if (YAF_INODE_SIZE(sb) > sizeof(Yaf_Inode)) {
+        Yaf_Inode_Ext *dyie = (Yaf_Inode_Ext *)(dyi + 1);
+        struct timespec64 atime = inode_get_atime(inode);
+        struct timespec64 mtime = inode_get_mtime(inode);
+        struct timespec64 ctime = inode_get_ctime(inode);
+
+        memset(dyie, 0, sizeof(Yaf_Inode_Ext));
+        dyie->i_size_hi = cpu_to_le32(upper_32_bits(inode->i_size));
+        dyie->i_atime_hi = cpu_to_le32(upper_32_bits(atime.tv_sec));
+        dyie->i_mtime_hi = cpu_to_le32(upper_32_bits(mtime.tv_sec));
+        dyie->i_ctime_hi = cpu_to_le32(upper_32_bits(ctime.tv_sec));
+        dyie->i_atime_nsec = cpu_to_le32(atime.tv_nsec);
+        dyie->i_mtime_nsec = cpu_to_le32(mtime.tv_nsec);
+        dyie->i_ctime_nsec = cpu_to_le32(ctime.tv_nsec);
+    }
+    if (yaf_is_fast_symlink(inode)) {
+        memcpy(dyi->i_block, yii->i_block, sizeof(dyi->i_block));
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(yii->i_block); ++i) {
+            dyi->i_block[i] = cpu_to_le32(yii->i_block[i]);
+        }
+    }
+}
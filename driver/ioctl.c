@@ -0,0 +1,110 @@
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include "../include/defrag.h"
+#include "../include/discard.h"
+#include "../include/ioctl.h"
+#include "../include/resize.h"
+#include "../include/yaf.h"
+
+/* discard the free data blocks within the user's *struct fstrim_range* */
+static long yaf_ioctl_fitrim(struct super_block *sb,
+                             struct fstrim_range __user *arg)
+{
+    struct fstrim_range range;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (!bdev_max_discard_sectors(sb->s_bdev)) {
+        return -EOPNOTSUPP;
+    }
+    if (sb_rdonly(sb)) {
+        return -EROFS;
+    }
+    if (copy_from_user(&range, arg, sizeof(range))) {
+        return -EFAULT;
+    }
+
+    ret = yaf_trim(sb, &range);
+    if (ret) {
+        return ret;
+    }
+
+    if (copy_to_user(arg, &range, sizeof(range))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/* grow the data blocks up to the user's block count */
+static long yaf_ioctl_resize(struct super_block *sb, uint64_t __user *arg)
+{
+    uint64_t bnr;
+
+    if (!capable(CAP_SYS_RESOURCE)) {
+        return -EPERM;
+    }
+    if (sb_rdonly(sb)) {
+        return -EROFS;
+    }
+    if (copy_from_user(&bnr, arg, sizeof(bnr))) {
+        return -EFAULT;
+    }
+
+    return yaf_resize(sb, bnr);
+}
+
+/* move the content of @file into the user's donor file */
+static long yaf_ioctl_swap_blocks(struct file *file, uint32_t __user *arg)
+{
+    uint32_t donor_fd;
+    struct fd donor;
+    long ret;
+
+    if (copy_from_user(&donor_fd, arg, sizeof(donor_fd))) {
+        return -EFAULT;
+    }
+    donor = fdget(donor_fd);
+    if (!donor.file) {
+        return -EBADF;
+    }
+
+    ret = mnt_want_write_file(file);
+    if (!ret) {
+        ret = yaf_swap_blocks(file, donor.file);
+        mnt_drop_write_file(file);
+    }
+
+    fdput(donor);
+    return ret;
+}
+
+/*
+ * Called by the ioctl(2) system call.
+ *
+ * FITRIM is supported, e.g. for fstrim(8), YAF_IOC_RESIZE for
+ * yaf-resize and YAF_IOC_SWAP_BLOCKS for yaf-defrag.
+ */
+long yaf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct super_block *sb = file_inode(file)->i_sb;
+
+    switch (cmd) {
+        case FITRIM:
+            return yaf_ioctl_fitrim(sb, (struct fstrim_range __user *)arg);
+
+        case YAF_IOC_RESIZE:
+            return yaf_ioctl_resize(sb, (uint64_t __user *)arg);
+
+        case YAF_IOC_SWAP_BLOCKS:
+            return yaf_ioctl_swap_blocks(file, (uint32_t __user *)arg);
+
+        default:
+            return -ENOTTY;
+    }
+}
@@ -0,0 +1,295 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/byteorder/generic.h>
+#include <linux/minmax.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "../include/bitmap.h"
+#include "../include/csum.h"
+#include "../include/inode.h"
+#include "../include/itable.h"
+#include "../include/journal.h"
+#include "../include/yaf.h"
+
+/* number of sectors per block */
+#define SECTORS_PER_BLOCK   (YAF_BLOCK_SIZE >> SECTOR_SHIFT)
+
+/*
+ * Tell whether the inode block @blk of the inode blocks section must
+ * keep its content, because an inode of it is in use or it was written
+ * since mkfs.
+ *
+ * Return 1 if so, 0 if it may be zeroed, or a negative error code.
+ */
+static int yaf_itable_used(struct super_block *sb, uint32_t blk)
+{
+    uint32_t ipb = INODES_PER_BLOCK(sb);
+    bool written;
+    int ret;
+
+    ret = yaf_count_used_inodes(sb, blk * ipb, ipb);
+    if (ret) {
+        return ret < 0 ? ret : 1;
+    }
+
+    ret = yaf_csum_written(sb, BID_I_MIN(sb) + blk, &written);
+    return ret ? ret : written;
+}
+
+/*
+ * Zero the @nr inode blocks from the block @blk of the inode blocks
+ * section on the disk and in the buffer cache, so a copy read ahead
+ * does not bring the old content back.
+ */
+static int yaf_itable_zero(struct super_block *sb, uint32_t blk,
+                           uint32_t nr)
+{
+    sector_t bid = BID_I_MIN(sb) + blk;
+    int ret;
+
+    ret = blkdev_issue_zeroout(sb->s_bdev, bid * SECTORS_PER_BLOCK,
+                               (sector_t)nr * SECTORS_PER_BLOCK,
+                               GFP_NOFS, 0);
+    if (ret) {
+        log(LOG_ERR, "blkdev_issue_zeroout() failed with error code %d",
+            ret);
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < nr; ++i) {
+        struct buffer_head *bh = sb_find_get_block(sb, bid + i);
+
+        if (!bh) {
+            continue;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, YAF_BLOCK_SIZE);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/*
+ * Zero the inode blocks within [@from, @to) of the inode blocks
+ * section, skipping those marked in *itable_zeroed*.
+ *
+ * Called with *itable_lock* held, within a handle which keeps the
+ * cached blocks zeroed out of a commit.
+ */
+static int yaf_itable_zero_range(struct super_block *sb, uint32_t from,
+                                 uint32_t to)
+{
+    unsigned long *zeroed = YAF_FS(sb)->itable_zeroed;
+    int ret;
+
+    for (uint32_t blk = from, end; blk < to; blk = end + 1) {
+        blk = find_next_zero_bit(zeroed, to, blk);
+        end = find_next_bit(zeroed, to, blk);
+        if (end > blk) {
+            ret = yaf_itable_zero(sb, blk, end - blk);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* record the @nr_i_init zeroed inode blocks in the on-disk superblock */
+static int yaf_itable_save(struct super_block *sb, uint32_t nr_i_init)
+{
+    struct buffer_head *bh;
+    Yaf_Handle handle;
+    int ret;
+
+    ret = yaf_journal_start(sb, &handle, 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
+    bh = yaf_bread(sb, BID_SB_MIN(sb));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        yaf_journal_stop(&handle);
+        return -EIO;
+    }
+    ((Yaf_Superblock *)bh->b_data)->nr_i_init = cpu_to_le32(nr_i_init);
+
+    yaf_journal_dirty(sb, bh);
+    yaf_journal_stop(&handle);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Zero the next *YAF_ITABLE_CHUNK* inode blocks from *nr_i_init* on
+ * and requeue itself after *YAF_ITABLE_PAUSE_MS* until all inode
+ * blocks are zeroed.
+ *
+ * The blocks are zeroed before *nr_i_init* is advanced in memory and
+ * on the disk, so a crash only makes the next mount zero them again.
+ */
+void yaf_itable_worker(struct work_struct *work)
+{
+    Yaf_Fs_Info *yfi = container_of(to_delayed_work(work), Yaf_Fs_Info,
+                                    itable_work);
+    struct super_block *sb = yfi->sb;
+    uint32_t from = yfi->nr_i_init;
+    uint32_t to = min_t(uint32_t, from + YAF_ITABLE_CHUNK,
+                        YAF_SB(sb)->nr_i);
+    Yaf_Handle handle;
+    int ret;
+
+    ret = yaf_journal_start(sb, &handle, 0);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return;
+    }
+    mutex_lock(&yfi->itable_lock);
+
+    ret = yaf_itable_zero_range(sb, from, to);
+    if (!ret) {
+        WRITE_ONCE(yfi->nr_i_init, to);
+    }
+
+    mutex_unlock(&yfi->itable_lock);
+    yaf_journal_stop(&handle);
+
+    if (!ret) {
+        ret = yaf_itable_save(sb, to);
+    }
+    if (ret) {
+        log(LOG_ERR, "zeroing the inode blocks stopped at %u "
+            "with error code %d", from, ret);
+        return;
+    }
+
+    if (to < YAF_SB(sb)->nr_i) {
+        queue_delayed_work(system_long_wq, &yfi->itable_work,
+                           msecs_to_jiffies(YAF_ITABLE_PAUSE_MS));
+    } else {
+        log(LOG_INFO, "inode table is initialized");
+    }
+}
+
+/*
+ * Mark the inode blocks from *nr_i_init* on which must keep their
+ * content in *itable_zeroed*, before any inode is allocated.
+ *
+ * The inodes allocated later set their bits in the inode bitmap
+ * before yaf_itable_prepare() zeroes their block, so the bitmap only
+ * tells the blocks apart here.
+ */
+int yaf_itable_load(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    uint32_t nr_i = YAF_SB(sb)->nr_i;
+    int ret;
+
+    if (yfi->nr_i_init >= nr_i) {
+        return 0;
+    }
+
+    yfi->itable_zeroed = kvcalloc(BITS_TO_LONGS(nr_i), sizeof(unsigned long),
+                                  GFP_KERNEL);
+    if (!yfi->itable_zeroed) {
+        log(LOG_ERR, "kvcalloc() failed");
+        return -ENOMEM;
+    }
+
+    for (uint32_t blk = yfi->nr_i_init; blk < nr_i; ++blk) {
+        ret = yaf_itable_used(sb, blk);
+        if (ret < 0) {
+            yaf_itable_destroy(sb);
+            return ret;
+        }
+        if (ret) {
+            __set_bit(blk, yfi->itable_zeroed);
+        }
+    }
+
+    return 0;
+}
+
+/* free *itable_zeroed* */
+void yaf_itable_destroy(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+
+    kvfree(yfi->itable_zeroed);
+    yfi->itable_zeroed = NULL;
+}
+
+/* start zeroing the inode blocks from *nr_i_init* on, if any */
+void yaf_itable_start(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+
+    if (yfi->nr_i_init >= YAF_SB(sb)->nr_i || sb_rdonly(sb)) {
+        return;
+    }
+
+    log(LOG_INFO, "zeroing the inode blocks from %u on in the background",
+        yfi->nr_i_init);
+    queue_delayed_work(system_long_wq, &yfi->itable_work, 0);
+}
+
+/* stop zeroing the inode blocks, waiting for the running chunk */
+void yaf_itable_stop(struct super_block *sb)
+{
+    cancel_delayed_work_sync(&YAF_FS(sb)->itable_work);
+}
+
+/*
+ * Zero the inode block of the just allocated inode @ino in the buffer
+ * cache and log it, if the block lies beyond *nr_i_init* and is not
+ * marked in *itable_zeroed* yet, i.e. it may still hold anything.
+ *
+ * Called within the handle allocating @ino, before its on-disk inode
+ * is read.
+ */
+int yaf_itable_prepare(struct super_block *sb, uint32_t ino)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    uint32_t blk = ino / INODES_PER_BLOCK(sb);
+    struct buffer_head *bh;
+    int ret = 0;
+
+    if (blk < READ_ONCE(yfi->nr_i_init)) {
+        return 0;
+    }
+
+    mutex_lock(&yfi->itable_lock);
+    if (blk < yfi->nr_i_init) {
+        goto unlock;
+    }
+
+    if (test_bit(blk, yfi->itable_zeroed)) {
+        goto unlock;
+    }
+
+    bh = sb_getblk(sb, INO2BID(sb, ino));
+    if (!bh) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "sb_getblk() failed");
+        goto unlock;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, YAF_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    yaf_journal_dirty(sb, bh);
+    brelse(bh);
+    __set_bit(blk, yfi->itable_zeroed);
+
+unlock:
+    mutex_unlock(&yfi->itable_lock);
+    return ret;
+}
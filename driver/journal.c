@@ -0,0 +1,771 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/byteorder/generic.h>
+#include <linux/crc32.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/journal.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+
+/* the metadata buffer is in the running transaction */
+BUFFER_FNS(PrivateStart, journaled)
+TAS_BUFFER_FNS(PrivateStart, journaled)
+
+/*
+ * in-memory journal
+ *
+ * Handles hold *j_rwsem* shared, so the commit takes it exclusively
+ * only to copy the running transaction into the log while no
+ * handle is halfway through its metadata operation. The logged
+ * copies and the home buffers are pinned until the checkpoint, so
+ * the home buffers are never written back nor re-read from their
+ * stale home blocks before that.
+ */
+typedef struct YAF_JOURNAL {
+    struct super_block *sb;
+    uint32_t j_blocks;              /* number of journal blocks */
+    uint32_t j_max;                 /* max blocks of a transaction */
+
+    struct rw_semaphore j_rwsem;    /* held by handles and the commit */
+    struct mutex j_mutex;           /* serializes commits and checkpoints */
+    spinlock_t j_lock;              /* protects the running transaction */
+    struct list_head j_bufs;        /* buffers of the running transaction */
+    uint32_t j_nr;                  /* number of *j_bufs* */
+    uint32_t j_credits;             /* *j_nr* and the unused credits of
+                                       the running handles */
+    uint32_t j_seq;                 /* sequence of the running
+                                       transaction */
+    bool j_aborted;                 /* the journal failed to write */
+
+    uint32_t j_head;                /* next free log block */
+    struct buffer_head **j_log;     /* logged blocks by log position */
+    struct buffer_head **j_pin;     /* their pinned home buffers */
+
+    struct delayed_work j_commit_work;  /* background commit */
+} Yaf_Journal;
+
+/* stop committing after a write error, the log is left for replay */
+static void yaf_journal_abort(Yaf_Journal *j, int err)
+{
+    if (!j->j_aborted) {
+        log(LOG_ERR, "journal aborted with error code %d", err);
+    }
+    j->j_aborted = true;
+}
+
+/* return the zeroed buffer of the log block at @pos */
+static struct buffer_head *yaf_journal_block(Yaf_Journal *j, uint32_t pos)
+{
+    struct buffer_head *jbh = j->j_log[pos];
+
+    if (!jbh) {
+        jbh = sb_getblk(j->sb, BID_J_MIN(j->sb) + pos);
+        if (!jbh) {
+            return NULL;
+        }
+        j->j_log[pos] = jbh;
+    }
+    memset(jbh->b_data, 0, YAF_BLOCK_SIZE);
+
+    return jbh;
+}
+
+/* start writing the log block @jbh without marking it dirty */
+static void yaf_journal_submit(struct buffer_head *jbh)
+{
+    lock_buffer(jbh);
+    set_buffer_uptodate(jbh);
+    get_bh(jbh);
+    jbh->b_end_io = end_buffer_write_sync;
+    submit_bh(REQ_OP_WRITE | REQ_SYNC, jbh);
+}
+
+/*
+ * Write the journal superblock, making the log start with the
+ * transaction @seq.
+ */
+static int yaf_journal_write_sb(Yaf_Journal *j, uint32_t seq)
+{
+    struct buffer_head *bh;
+    Yaf_Journal_Sb *jsb;
+    int ret;
+
+    bh = sb_getblk(j->sb, BID_J_MIN(j->sb));
+    if (!bh) {
+        log(LOG_ERR, "sb_getblk() failed");
+        return -EIO;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, YAF_BLOCK_SIZE);
+    jsb = (Yaf_Journal_Sb *)bh->b_data;
+    jsb->j_magic = cpu_to_le32(YAF_JOURNAL_MAGIC);
+    jsb->j_seq = cpu_to_le32(seq);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    mark_buffer_dirty(bh);
+    ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_FUA);
+    brelse(bh);
+
+    return ret;
+}
+
+/* release the logged blocks and the home buffers they pinned */
+static void yaf_journal_release(Yaf_Journal *j)
+{
+    for (uint32_t pos = 1; pos < j->j_blocks; ++pos) {
+        brelse(j->j_log[pos]);
+        brelse(j->j_pin[pos]);
+        j->j_log[pos] = j->j_pin[pos] = NULL;
+    }
+    j->j_head = 1;
+}
+
+/*
+ * Write the logged copies of all committed transactions to their
+ * home blocks and empty the log.
+ *
+ * The transactions are written one after another, so a block logged
+ * by several of them ends up with its latest copy.
+ */
+static int yaf_journal_checkpoint(Yaf_Journal *j)
+{
+    struct block_device *bdev = j->sb->s_bdev;
+    int ret = 0;
+
+    if (j->j_head == 1) {
+        return 0;
+    }
+
+    for (uint32_t pos = 1; pos < j->j_head;) {
+        Yaf_Journal_Desc *desc = (Yaf_Journal_Desc *)j->j_log[pos]->b_data;
+        uint32_t nr = le32_to_cpu(desc->d_nr);
+        struct bio *bio = NULL;
+
+        for (uint32_t i = 0; i < nr; ++i) {
+            struct buffer_head *jbh = j->j_log[pos + 1 + i];
+
+            bio = blk_next_bio(bio, bdev, 1, REQ_OP_WRITE, GFP_NOFS);
+            bio->bi_iter.bi_sector = (sector_t)le32_to_cpu(desc->d_bid[i])
+                                     * (YAF_BLOCK_SIZE >> SECTOR_SHIFT);
+            __bio_add_page(bio, jbh->b_page, YAF_BLOCK_SIZE,
+                           bh_offset(jbh));
+        }
+        if (bio) {
+            ret = submit_bio_wait(bio);
+            bio_put(bio);
+            if (ret) {
+                log(LOG_ERR, "submit_bio_wait() failed "
+                    "with error code %d", ret);
+                goto abort;
+            }
+        }
+
+        pos += nr + 2;
+    }
+
+    ret = blkdev_issue_flush(bdev);
+    if (ret) {
+        log(LOG_ERR, "blkdev_issue_flush() failed with error code %d", ret);
+        goto abort;
+    }
+
+    /* the next commit starts the log again */
+    ret = yaf_journal_write_sb(j, j->j_seq);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_write_sb() failed with error code %d",
+            ret);
+        goto abort;
+    }
+
+    yaf_journal_release(j);
+    return 0;
+
+abort:
+    yaf_journal_abort(j, ret);
+    return ret;
+}
+
+/*
+ * Commit the running transaction with *j_mutex* held.
+ *
+ * The descriptor, the logged blocks and the commit block are
+ * written in one sequential pass followed by a single cache flush,
+ * since the crc32c in the commit block tells a torn transaction
+ * from a committed one.
+ */
+static int yaf_journal_do_commit(Yaf_Journal *j)
+{
+    struct super_block *sb = j->sb;
+    struct buffer_head *bh, *tmp, *dbh, *cbh;
+    Yaf_Journal_Desc *desc;
+    Yaf_Journal_Commit *commit;
+    struct blk_plug plug;
+    LIST_HEAD(bufs);
+    uint32_t pos = j->j_head, nr, seq, i = 0, crc;
+    int ret = 0;
+
+    if (j->j_aborted) {
+        return -EIO;
+    }
+
+    /* make room for the largest transaction */
+    if (j->j_head + j->j_max + 2 > j->j_blocks) {
+        ret = yaf_journal_checkpoint(j);
+        if (ret) {
+            return ret;
+        }
+        pos = j->j_head;
+    }
+
+    /* wait for the running handles and keep new ones out */
+    down_write(&j->j_rwsem);
+
+    spin_lock(&j->j_lock);
+    list_splice_init(&j->j_bufs, &bufs);
+    nr = j->j_nr;
+    seq = j->j_seq;
+    if (nr) {
+        j->j_credits -= nr;
+        j->j_nr = 0;
+        ++j->j_seq;
+    }
+    spin_unlock(&j->j_lock);
+
+    if (!nr) {
+        up_write(&j->j_rwsem);
+        return 0;
+    }
+
+    dbh = yaf_journal_block(j, pos);
+    cbh = yaf_journal_block(j, pos + 1 + min(nr, j->j_max));
+    if (nr > j->j_max || !dbh || !cbh) {
+        ret = nr > j->j_max ? -ENOSPC : -ENOMEM;
+        log(LOG_ERR, "transaction %u with %u blocks does not fit",
+            seq, nr);
+    }
+
+    /* the checksum blocks are in @bufs, so checksum all before copying */
+    list_for_each_entry(bh, &bufs, b_assoc_buffers) {
+        yaf_csum_update(sb, bh);
+    }
+
+    /* copy the modified blocks into the log */
+    desc = dbh ? (Yaf_Journal_Desc *)dbh->b_data : NULL;
+    list_for_each_entry_safe(bh, tmp, &bufs, b_assoc_buffers) {
+        struct buffer_head *jbh = NULL;
+
+        list_del_init(&bh->b_assoc_buffers);
+        clear_buffer_journaled(bh);
+        if (!ret) {
+            jbh = yaf_journal_block(j, pos + 1 + i);
+        }
+        if (!jbh) {
+            ret = ret ? : -ENOMEM;
+            brelse(bh);
+            continue;
+        }
+
+        memcpy(jbh->b_data, bh->b_data, YAF_BLOCK_SIZE);
+        desc->d_bid[i] = cpu_to_le32(bh->b_blocknr);
+        /* keep the reference until the checkpoint */
+        j->j_pin[pos + 1 + i] = bh;
+        ++i;
+    }
+
+    up_write(&j->j_rwsem);
+
+    if (ret) {
+        yaf_journal_abort(j, ret);
+        return ret;
+    }
+
+    desc->d_header.h_magic = cpu_to_le32(YAF_JOURNAL_MAGIC);
+    desc->d_header.h_type = cpu_to_le32(YAF_JOURNAL_TYPE_DESC);
+    desc->d_header.h_seq = cpu_to_le32(seq);
+    desc->d_nr = cpu_to_le32(nr);
+
+    crc = __crc32c_le(~0, dbh->b_data, YAF_BLOCK_SIZE);
+    for (i = 0; i < nr; ++i) {
+        crc = __crc32c_le(crc, j->j_log[pos + 1 + i]->b_data,
+                          YAF_BLOCK_SIZE);
+    }
+
+    commit = (Yaf_Journal_Commit *)cbh->b_data;
+    commit->c_header.h_magic = cpu_to_le32(YAF_JOURNAL_MAGIC);
+    commit->c_header.h_type = cpu_to_le32(YAF_JOURNAL_TYPE_COMMIT);
+    commit->c_header.h_seq = cpu_to_le32(seq);
+    commit->c_crc = cpu_to_le32(crc);
+
+    /* write the whole transaction in one sequential pass */
+    blk_start_plug(&plug);
+    for (i = pos; i < pos + nr + 2; ++i) {
+        yaf_journal_submit(j->j_log[i]);
+    }
+    blk_finish_plug(&plug);
+
+    for (i = pos; i < pos + nr + 2; ++i) {
+        wait_on_buffer(j->j_log[i]);
+        if (!buffer_uptodate(j->j_log[i])) {
+            ret = -EIO;
+        }
+    }
+    if (!ret) {
+        ret = blkdev_issue_flush(sb->s_bdev);
+    }
+    if (ret) {
+        log(LOG_ERR, "failed to write transaction %u "
+            "with error code %d", seq, ret);
+        yaf_journal_abort(j, ret);
+        return ret;
+    }
+
+    j->j_head = pos + nr + 2;
+
+    return 0;
+}
+
+/* commit the transaction @seq unless another commit already did */
+static int yaf_journal_commit_seq(Yaf_Journal *j, uint32_t seq)
+{
+    int ret = 0;
+
+    /*
+     * Callers waiting here are committed together by whichever of
+     * them gets the mutex first.
+     */
+    mutex_lock(&j->j_mutex);
+    if (j->j_seq == seq) {
+        ret = yaf_journal_do_commit(j);
+    }
+    mutex_unlock(&j->j_mutex);
+
+    return ret;
+}
+
+/* commit the running transaction and wait for it */
+int yaf_journal_commit(struct super_block *sb)
+{
+    Yaf_Journal *j = YAF_FS(sb)->journal;
+
+    /* a handle cannot wait for the commit which waits for it */
+    if (!j || current->journal_info) {
+        return 0;
+    }
+
+    return yaf_journal_commit_seq(j, READ_ONCE(j->j_seq));
+}
+
+/* commit the running transaction once per *YAF_JOURNAL_INTERVAL* */
+static void yaf_journal_commit_worker(struct work_struct *work)
+{
+    Yaf_Journal *j = container_of(to_delayed_work(work), Yaf_Journal,
+                                  j_commit_work);
+    int ret;
+
+    ret = yaf_journal_commit(j->sb);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_commit() failed with error code %d",
+            ret);
+    }
+}
+
+/*
+ * Begin a metadata operation which logs up to @credits blocks.
+ *
+ * The running transaction is committed first if it cannot take
+ * @credits more blocks. A handle begun inside another one is part
+ * of the outer one.
+ */
+int yaf_journal_start(struct super_block *sb, Yaf_Handle *handle,
+                      unsigned int credits)
+{
+    Yaf_Journal *j = YAF_FS(sb)->journal;
+    int ret;
+
+    handle->journal = j;
+    handle->credits = credits;
+    handle->used = 0;
+    handle->nested = current->journal_info != NULL;
+    if (!j || handle->nested) {
+        return 0;
+    }
+
+    /* each block may bring its checksum block into the transaction */
+    if (yaf_has_csum(sb)) {
+        credits *= 2;
+    }
+    handle->credits = credits = min(credits, j->j_max);
+    for (;;) {
+        uint32_t seq;
+
+        if (j->j_aborted) {
+            return -EIO;
+        }
+
+        spin_lock(&j->j_lock);
+        if (j->j_credits + credits <= j->j_max) {
+            j->j_credits += credits;
+            spin_unlock(&j->j_lock);
+            break;
+        }
+        seq = j->j_seq;
+        spin_unlock(&j->j_lock);
+
+        ret = yaf_journal_commit_seq(j, seq);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    down_read(&j->j_rwsem);
+    handle->nofs = memalloc_nofs_save();
+    current->journal_info = handle;
+
+    return 0;
+}
+
+/* end the metadata operation begun by yaf_journal_start() */
+void yaf_journal_stop(Yaf_Handle *handle)
+{
+    Yaf_Journal *j = handle->journal;
+
+    if (!j || handle->nested) {
+        return;
+    }
+
+    current->journal_info = NULL;
+    memalloc_nofs_restore(handle->nofs);
+
+    /* give back the credits left unused */
+    spin_lock(&j->j_lock);
+    if (handle->used < handle->credits) {
+        j->j_credits -= handle->credits - handle->used;
+    }
+    spin_unlock(&j->j_lock);
+
+    up_read(&j->j_rwsem);
+}
+
+/* add @bh to the running transaction unless it is already in */
+static void yaf_journal_add(Yaf_Journal *j, Yaf_Handle *handle,
+                            struct buffer_head *bh)
+{
+    bool first;
+
+    if (test_set_buffer_journaled(bh)) {
+        return;
+    }
+
+    get_bh(bh);
+    spin_lock(&j->j_lock);
+    list_add_tail(&bh->b_assoc_buffers, &j->j_bufs);
+    first = !j->j_nr++;
+    if (++handle->used > handle->credits) {
+        ++j->j_credits;
+    }
+    spin_unlock(&j->j_lock);
+
+    if (first) {
+        queue_delayed_work(system_long_wq, &j->j_commit_work,
+                           YAF_JOURNAL_INTERVAL);
+    }
+}
+
+/*
+ * Log the modified metadata block @bh in the running transaction
+ * instead of marking it dirty, so it reaches its home block only
+ * after being committed.
+ *
+ * The checksum block of @bh is logged along with it, its entry is
+ * filled in by the commit.
+ */
+void yaf_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+    Yaf_Journal *j = YAF_FS(sb)->journal;
+    Yaf_Handle *handle = current->journal_info;
+    struct buffer_head *cbh;
+
+    if (!j) {
+        /* e.g. the clean superblock written after yaf_journal_destroy() */
+        yaf_csum_update(sb, bh);
+        mark_buffer_dirty(bh);
+        return;
+    }
+    assert(handle);
+
+    yaf_journal_add(j, handle, bh);
+
+    cbh = yaf_csum_dirty(sb, bh);
+    if (cbh) {
+        yaf_journal_add(j, handle, cbh);
+        brelse(cbh);
+    }
+}
+
+/*
+ * Replay the committed transactions in the log onto their home
+ * blocks.
+ *
+ * Return the number of the replayed transactions or a negative
+ * error code.
+ */
+static int yaf_journal_replay(Yaf_Journal *j)
+{
+    struct super_block *sb = j->sb;
+    uint32_t pos = 1;
+    int nr_replay = 0, ret = 0;
+
+    while (pos + 2 <= j->j_blocks - 1) {
+        Yaf_Journal_Desc *desc;
+        Yaf_Journal_Commit *commit;
+        uint32_t nr, crc;
+        bool valid;
+
+        /* check the descriptor block */
+        j->j_log[pos] = sb_bread(sb, BID_J_MIN(sb) + pos);
+        if (!j->j_log[pos]) {
+            ret = -EIO;
+            break;
+        }
+        desc = (Yaf_Journal_Desc *)j->j_log[pos]->b_data;
+        nr = le32_to_cpu(desc->d_nr);
+        if (le32_to_cpu(desc->d_header.h_magic) != YAF_JOURNAL_MAGIC ||
+            le32_to_cpu(desc->d_header.h_type) != YAF_JOURNAL_TYPE_DESC ||
+            le32_to_cpu(desc->d_header.h_seq) != j->j_seq ||
+            nr > YAF_JOURNAL_DESC_ENTRIES ||
+            pos + nr + 2 > j->j_blocks) {
+            break;
+        }
+
+        /* check the commit block and the checksum */
+        crc = __crc32c_le(~0, j->j_log[pos]->b_data, YAF_BLOCK_SIZE);
+        for (uint32_t i = pos + 1; i <= pos + nr + 1; ++i) {
+            j->j_log[i] = sb_bread(sb, BID_J_MIN(sb) + i);
+            if (!j->j_log[i]) {
+                ret = -EIO;
+                break;
+            }
+            if (i <= pos + nr) {
+                crc = __crc32c_le(crc, j->j_log[i]->b_data, YAF_BLOCK_SIZE);
+            }
+        }
+        if (ret) {
+            break;
+        }
+        commit = (Yaf_Journal_Commit *)j->j_log[pos + nr + 1]->b_data;
+        valid = le32_to_cpu(commit->c_header.h_magic) == YAF_JOURNAL_MAGIC &&
+                le32_to_cpu(commit->c_header.h_type) == YAF_JOURNAL_TYPE_COMMIT &&
+                le32_to_cpu(commit->c_header.h_seq) == j->j_seq &&
+                le32_to_cpu(commit->c_crc) == crc;
+        for (uint32_t i = 0; valid && i < nr; ++i) {
+            uint32_t bid = le32_to_cpu(desc->d_bid[i]);
+
+            valid = bid == BID_SB_MIN(sb) ||
+                    (bid >= BID_C_MIN(sb) && bid <= BID_D_MAX(sb));
+        }
+        if (!valid) {
+            break;
+        }
+
+        /* write the logged blocks to their home blocks */
+        for (uint32_t i = 0; i < nr; ++i) {
+            struct buffer_head *bh = sb_getblk(sb,
+                                        le32_to_cpu(desc->d_bid[i]));
+            if (!bh) {
+                ret = -EIO;
+                break;
+            }
+
+            lock_buffer(bh);
+            memcpy(bh->b_data, j->j_log[pos + 1 + i]->b_data,
+                   YAF_BLOCK_SIZE);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            mark_buffer_dirty(bh);
+            brelse(bh);
+        }
+        if (ret) {
+            break;
+        }
+
+        yaf_journal_release(j);
+        pos += nr + 2;
+        ++j->j_seq;
+        ++nr_replay;
+    }
+    yaf_journal_release(j);
+
+    if (ret) {
+        log(LOG_ERR, "failed to replay the journal with error code %d", ret);
+        return ret;
+    }
+    if (!nr_replay) {
+        return 0;
+    }
+
+    /* the log is empty once the replayed blocks are durable */
+    ret = sync_blockdev(sb->s_bdev);
+    if (!ret) {
+        ret = blkdev_issue_flush(sb->s_bdev);
+    }
+    if (!ret) {
+        ret = yaf_journal_write_sb(j, j->j_seq);
+    }
+    if (ret) {
+        log(LOG_ERR, "failed to finish the replay with error code %d", ret);
+        return ret;
+    }
+
+    return nr_replay;
+}
+
+/* free the in-memory journal */
+static void yaf_journal_free(Yaf_Journal *j)
+{
+    struct buffer_head *bh, *tmp;
+
+    /* only an aborted journal has buffers left */
+    list_for_each_entry_safe(bh, tmp, &j->j_bufs, b_assoc_buffers) {
+        list_del_init(&bh->b_assoc_buffers);
+        clear_buffer_journaled(bh);
+        brelse(bh);
+    }
+    yaf_journal_release(j);
+
+    kvfree(j->j_pin);
+    kvfree(j->j_log);
+    kfree(j);
+}
+
+/*
+ * Load the journal of @sb and replay the committed transactions
+ * left by an unclean shutdown.
+ */
+int yaf_journal_load(struct super_block *sb)
+{
+    uint32_t nr_j = YAF_FS(sb)->nr_j;
+    struct buffer_head *bh;
+    Yaf_Journal_Sb *jsb;
+    Yaf_Journal *j;
+    int ret;
+
+    if (!nr_j) {
+        return 0;
+    }
+
+    j = kzalloc(sizeof(Yaf_Journal), GFP_KERNEL);
+    if (!j) {
+        log(LOG_ERR, "kzalloc() failed");
+        return -ENOMEM;
+    }
+    j->sb = sb;
+    j->j_blocks = nr_j;
+    j->j_max = min_t(uint32_t, YAF_JOURNAL_DESC_ENTRIES, nr_j - 3);
+    init_rwsem(&j->j_rwsem);
+    mutex_init(&j->j_mutex);
+    spin_lock_init(&j->j_lock);
+    INIT_LIST_HEAD(&j->j_bufs);
+    INIT_DELAYED_WORK(&j->j_commit_work, yaf_journal_commit_worker);
+    j->j_head = 1;
+    j->j_log = kvcalloc(nr_j, sizeof(*j->j_log), GFP_KERNEL);
+    j->j_pin = kvcalloc(nr_j, sizeof(*j->j_pin), GFP_KERNEL);
+    if (!j->j_log || !j->j_pin) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "kvcalloc() failed");
+        goto free_journal;
+    }
+
+    /* read the journal superblock */
+    bh = sb_bread(sb, BID_J_MIN(sb));
+    if (!bh) {
+        ret = -EIO;
+        log(LOG_ERR, "sb_bread() failed");
+        goto free_journal;
+    }
+    jsb = (Yaf_Journal_Sb *)bh->b_data;
+    if (le32_to_cpu(jsb->j_magic) != YAF_JOURNAL_MAGIC) {
+        ret = -EINVAL;
+        log(LOG_ERR, "journal magic check failed");
+        brelse(bh);
+        goto free_journal;
+    }
+    j->j_seq = le32_to_cpu(jsb->j_seq);
+    brelse(bh);
+
+    if (bdev_read_only(sb->s_bdev)) {
+        log(LOG_INFO, "read-only device, the journal is not replayed");
+    } else {
+        ret = yaf_journal_replay(j);
+        if (ret < 0) {
+            goto free_journal;
+        }
+        if (ret) {
+            log(LOG_INFO, "replayed %d journal transaction(s)", ret);
+        }
+    }
+
+    YAF_FS(sb)->journal = j;
+    return 0;
+
+free_journal:
+    yaf_journal_free(j);
+    return ret;
+}
+
+/*
+ * Commit the running transaction and checkpoint the log, so no
+ * logged copy is left to overwrite a home block later.
+ */
+int yaf_journal_flush(struct super_block *sb)
+{
+    Yaf_Journal *j = YAF_FS(sb)->journal;
+    int ret;
+
+    if (!j || current->journal_info) {
+        return 0;
+    }
+
+    mutex_lock(&j->j_mutex);
+    ret = yaf_journal_do_commit(j);
+    if (!ret) {
+        ret = yaf_journal_checkpoint(j);
+    }
+    mutex_unlock(&j->j_mutex);
+
+    return ret;
+}
+
+/* commit, checkpoint and free the journal of @sb */
+void yaf_journal_destroy(struct super_block *sb)
+{
+    Yaf_Journal *j = YAF_FS(sb)->journal;
+    int ret;
+
+    if (!j) {
+        return;
+    }
+
+    cancel_delayed_work_sync(&j->j_commit_work);
+
+    ret = yaf_journal_flush(sb);
+    if (ret) {
+        log(LOG_ERR, "failed to empty the journal with error code %d", ret);
+    }
+
+    YAF_FS(sb)->journal = NULL;
+    yaf_journal_free(j);
+}
@@ -0,0 +1,260 @@
+#include <linux/buffer_head.h>
+#include <linux/byteorder/generic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/inode.h"
+#include "../include/journal.h"
+#include "../include/orphan.h"
+#include "../include/yaf.h"
+
+/* legacy images have no room for the orphan list */
+static inline bool yaf_has_orphans(struct super_block *sb)
+{
+    return YAF_SB(sb)->version != YAF_VERSION_LEGACY;
+}
+
+/* return the orphan behind @yo, or *RESERVED_INO* at the end */
+static uint32_t yaf_orphan_next(struct super_block *sb, Yaf_Orphan *yo)
+{
+    if (list_is_last(&yo->node, &YAF_FS(sb)->orphans)) {
+        return RESERVED_INO;
+    }
+    return list_next_entry(yo, node)->ino;
+}
+
+/*
+ * Point the on-disk orphan @ino, or the superblock if @ino is
+ * *RESERVED_INO*, to the next orphan @next.
+ *
+ * If @inode is given, the whole on-disk inode @ino is filled from it
+ * first, so the orphan is valid on the disk even if the inode was
+ * never written back before, see yaf_orphan_recover().
+ */
+static int yaf_orphan_link(struct super_block *sb, uint32_t ino,
+                           uint32_t next, struct inode *inode)
+{
+    struct buffer_head *bh;
+
+    if (ino == RESERVED_INO) {
+        bh = yaf_bread(sb, BID_SB_MIN(sb));
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
+        }
+        ((Yaf_Superblock *)bh->b_data)->orphan = cpu_to_le32(next);
+    } else {
+        Yaf_Inode *dyi;
+
+        bh = yaf_bread(sb, INO2BID(sb, ino));
+        if (!bh) {
+            log(LOG_ERR, "yaf_bread() failed");
+            return -EIO;
+        }
+        dyi = (Yaf_Inode *)(bh->b_data + INO2BOFF(sb, ino));
+        if (inode) {
+            yaf_fill_inode(inode, dyi);
+        }
+
+        /* yaf_orphan_recover() only trusts orphans without links */
+        dyi->i_nlink = 0;
+        dyi->i_atime = cpu_to_le32(next);
+    }
+
+    yaf_journal_dirty(sb, bh);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Put @inode, which just lost its last link, at the head of the
+ * orphan list.
+ *
+ * Called inside the journal handle dropping the link.
+ */
+void yaf_orphan_add(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    Yaf_Orphan *yo = &YAF_INODE(inode)->i_orphan;
+    uint32_t first = RESERVED_INO;
+
+    if (!yaf_has_orphans(sb)) {
+        return;
+    }
+
+    mutex_lock(&yfi->orphan_lock);
+    assert(list_empty(&yo->node));
+    if (!list_empty(&yfi->orphans)) {
+        first = list_first_entry(&yfi->orphans, Yaf_Orphan, node)->ino;
+    }
+    yo->ino = inode->i_ino;
+    list_add(&yo->node, &yfi->orphans);
+
+    if (yaf_orphan_link(sb, yo->ino, first, inode) ||
+        yaf_orphan_link(sb, RESERVED_INO, yo->ino, NULL)) {
+        log(LOG_ERR, "failed to put inode %u on the orphan list", yo->ino);
+    }
+    mutex_unlock(&yfi->orphan_lock);
+}
+
+/*
+ * Hand the orphan entry of the evicted @inode over to @yo, which
+ * stays on the orphan list until yaf_orphan_del().
+ */
+void yaf_orphan_move(struct inode *inode, Yaf_Orphan *yo)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(inode->i_sb);
+    Yaf_Orphan *old = &YAF_INODE(inode)->i_orphan;
+
+    INIT_LIST_HEAD(&yo->node);
+    yo->ino = inode->i_ino;
+
+    mutex_lock(&yfi->orphan_lock);
+    if (!list_empty(&old->node)) {
+        list_replace_init(&old->node, &yo->node);
+    }
+    mutex_unlock(&yfi->orphan_lock);
+}
+
+/*
+ * Take the orphan entry @yo off the orphan list.
+ *
+ * Called inside the journal handle releasing the orphan.
+ */
+void yaf_orphan_del(struct super_block *sb, Yaf_Orphan *yo)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    uint32_t prev = RESERVED_INO, next;
+
+    mutex_lock(&yfi->orphan_lock);
+    if (list_empty(&yo->node)) {
+        goto unlock;
+    }
+
+    if (!list_is_first(&yo->node, &yfi->orphans)) {
+        prev = list_prev_entry(yo, node)->ino;
+    }
+    next = yaf_orphan_next(sb, yo);
+    list_del_init(&yo->node);
+
+    if (yaf_orphan_link(sb, prev, next, NULL)) {
+        log(LOG_ERR, "failed to take inode %u off the orphan list",
+            yo->ino);
+    }
+
+unlock:
+    mutex_unlock(&yfi->orphan_lock);
+}
+
+/*
+ * Fill the on-disk inode @dyi of @inode with its orphan list link,
+ * if it is an orphan.
+ */
+void yaf_orphan_fill(struct inode *inode, Yaf_Inode *dyi)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(inode->i_sb);
+    Yaf_Orphan *yo = &YAF_INODE(inode)->i_orphan;
+
+    mutex_lock(&yfi->orphan_lock);
+    if (!list_empty(&yo->node)) {
+        dyi->i_atime = cpu_to_le32(yaf_orphan_next(inode->i_sb, yo));
+    }
+    mutex_unlock(&yfi->orphan_lock);
+}
+
+/*
+ * Release the orphans left on the orphan list by an unclean shutdown.
+ *
+ * Each orphan is looked up and put again, so it is released through
+ * yaf_evict_inode() and taken off the list like any other. A list
+ * broken by a corrupted inode is cut off behind the last valid
+ * orphan, whose leaked blocks are then left to a full check.
+ */
+int yaf_orphan_recover(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    uint32_t ino, last = RESERVED_INO, nr = 0;
+    struct buffer_head *bh;
+    Yaf_Handle handle;
+    int ret;
+
+    if (!yaf_has_orphans(sb)) {
+        return 0;
+    }
+
+    bh = yaf_bread(sb, BID_SB_MIN(sb));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        return -EIO;
+    }
+    ino = le32_to_cpu(((Yaf_Superblock *)bh->b_data)->orphan);
+    brelse(bh);
+
+    if (ino == RESERVED_INO) {
+        return 0;
+    }
+    if (sb_rdonly(sb)) {
+        log(LOG_INFO, "read-only mount, the orphans are not released");
+        return 0;
+    }
+
+    while (ino != RESERVED_INO) {
+        Yaf_Inode_Info *yii;
+        struct inode *inode;
+        Yaf_Inode *dyi;
+        uint32_t next = RESERVED_INO;
+        bool valid = ino > ROOT_INO && ino < NR_INODES(sb) &&
+                     nr < NR_INODES(sb);
+
+        if (valid) {
+            bh = yaf_bread(sb, INO2BID(sb, ino));
+            if (!bh) {
+                log(LOG_ERR, "yaf_bread() failed");
+                return -EIO;
+            }
+            dyi = (Yaf_Inode *)(bh->b_data + INO2BOFF(sb, ino));
+            valid = !dyi->i_nlink && dyi->i_mode;
+            next = le32_to_cpu(dyi->i_atime);
+            brelse(bh);
+        }
+
+        if (!valid) {
+            log(LOG_ERR, "orphan list is broken at inode %u", ino);
+            ret = yaf_journal_start(sb, &handle, 1);
+            if (ret) {
+                return ret;
+            }
+            mutex_lock(&yfi->orphan_lock);
+            ret = yaf_orphan_link(sb, last, RESERVED_INO, NULL);
+            mutex_unlock(&yfi->orphan_lock);
+            yaf_journal_stop(&handle);
+            return ret;
+        }
+
+        inode = yaf_iget(sb, ino);
+        if (IS_ERR(inode)) {
+            log(LOG_ERR, "yaf_iget() failed with error code %ld",
+                PTR_ERR(inode));
+            return PTR_ERR(inode);
+        }
+        yii = YAF_INODE(inode);
+
+        /* the orphan is already linked on disk */
+        mutex_lock(&yfi->orphan_lock);
+        yii->i_orphan.ino = ino;
+        list_add_tail(&yii->i_orphan.node, &yfi->orphans);
+        mutex_unlock(&yfi->orphan_lock);
+
+        iput(inode);
+
+        last = ino;
+        ino = next;
+        ++nr;
+    }
+
+    log(LOG_INFO, "released %u orphan inode(s)", nr);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/journal.h"
+#include "../include/resize.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+
+/*
+ * Grow the data blocks of @sb up to the block @bnr of its device, 0
+ * for its end, within the data bitmap and checksum blocks it has.
+ *
+ * The superblock is committed before the new data blocks are handed
+ * out, so a crash leaves either size, the free counter being counted
+ * from the bitmap after an unclean unmount anyway.
+ */
+int yaf_resize(struct super_block *sb, uint64_t bnr)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    Yaf_Sb_Info *ysi = YAF_SB(sb);
+    uint64_t dev_bnr = bdev_nr_bytes(sb->s_bdev) / YAF_BLOCK_SIZE;
+    uint64_t nr_d, capacity;
+    struct buffer_head *bh;
+    Yaf_Superblock *ysb;
+    Yaf_Handle handle;
+    uint32_t nr_r;
+    int ret = 0;
+
+    /* a legacy superblock is never written */
+    if (ysi->version == YAF_VERSION_LEGACY) {
+        return -EOPNOTSUPP;
+    }
+    if (!bnr) {
+        bnr = dev_bnr;
+    }
+    if (bnr > dev_bnr) {
+        log(LOG_ERR, "%llu blocks exceed the %llu blocks of the device",
+            bnr, dev_bnr);
+        return -EINVAL;
+    }
+
+    mutex_lock(&yfi->resize_lock);
+    if (bnr < BID_D_MAX(sb) + 1) {
+        ret = -EINVAL;
+        log(LOG_ERR, "shrinking to %llu blocks is not supported", bnr);
+        goto unlock;
+    }
+    nr_d = bnr - BID_D_MIN(sb);
+    if (nr_d == ysi->nr_d) {
+        goto unlock;
+    }
+    capacity = yaf_resize_capacity(ysi->nr_ibp, ysi->nr_dbp, ysi->nr_i,
+                                   yfi->nr_c);
+    if (nr_d > capacity) {
+        ret = -ENOSPC;
+        log(LOG_ERR, "%llu data blocks exceed the %llu covered by the "
+            "bitmap and checksum blocks, use yaf-resize offline",
+            nr_d, capacity);
+        goto unlock;
+    }
+    /* the reserved data blocks keep their share */
+    nr_r = (uint64_t)yfi->nr_r * nr_d / ysi->nr_d;
+
+    ret = yaf_journal_start(sb, &handle, 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        goto unlock;
+    }
+    bh = yaf_bread(sb, BID_SB_MIN(sb));
+    if (!bh) {
+        ret = -EIO;
+        log(LOG_ERR, "yaf_bread() failed");
+        yaf_journal_stop(&handle);
+        goto unlock;
+    }
+    ysb = (Yaf_Superblock *)bh->b_data;
+    ysb->yaf_sb_info.nr_d = cpu_to_le32(nr_d);
+    ysb->nr_r = cpu_to_le32(nr_r);
+    yaf_journal_dirty(sb, bh);
+    yaf_journal_stop(&handle);
+
+    if (yfi->journal) {
+        ret = yaf_journal_commit(sb);
+    } else {
+        ret = sync_dirty_buffer(bh);
+    }
+    brelse(bh);
+    if (ret) {
+        log(LOG_ERR, "failed to write the superblock with error code %d",
+            ret);
+        goto unlock;
+    }
+
+    /* the bits of the new data blocks are zero, see resize.h */
+    percpu_counter_add(&yfi->nr_free_d, nr_d - ysi->nr_d);
+    WRITE_ONCE(yfi->nr_r, nr_r);
+    WRITE_ONCE(ysi->nr_d, nr_d);
+    log(LOG_INFO, "grew to %llu data blocks", nr_d);
+
+unlock:
+    mutex_unlock(&yfi->resize_lock);
+    return ret;
+}
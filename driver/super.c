@@ -1,12 +1,26 @@
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/byteorder/generic.h>
 #include <linux/fs.h>
 #include <linux/gfp_types.h>
+#include <linux/list_sort.h>
+#include <linux/mm.h>
+#include <linux/parser.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/statfs.h>
 #include <linux/writeback.h>
 #include "../include/yaf.h"
 #include "../include/super.h"
+#include "../include/bitmap.h"
+#include "../include/compact.h"
+#include "../include/csum.h"
+#include "../include/discard.h"
 #include "../include/inode.h"
+#include "../include/itable.h"
+#include "../include/journal.h"
+#include "../include/orphan.h"
 #include "../include/fs.h"
 
 /* *Yaf_Inode_Info* strucutre cache  */
@@ -68,6 +82,7 @@ static struct inode* yaf_alloc_inode(struct super_block *sb)
         goto out;
     }
 
+    INIT_LIST_HEAD(&yii->i_wb);
     inode = &yii->vfs_inode;
 
 out:
@@ -84,37 +99,610 @@ static void yaf_destroy_inode(struct inode *inode)
     kmem_cache_free(yaf_inode_cachep, yii);
 }
 
-/* write in-memory inode back to on-disk inode */
+/* fill @inode with its orphan list link into its cached inode block @bh */
+static void yaf_fill_iblock(struct inode *inode, struct buffer_head *bh)
+{
+    Yaf_Inode *dyi = (Yaf_Inode *)(bh->b_data +
+                                   INO2BOFF(inode->i_sb, inode->i_ino));
+
+    yaf_fill_inode(inode, dyi);
+    yaf_orphan_fill(inode, dyi);
+}
+
+/*
+ * Fill @inode into its inode block right away, waiting for the block
+ * if @wait is set.
+ *
+ * With a journal the inode block is logged, and waiting for it means
+ * committing the running transaction.
+ */
+static int yaf_write_one(struct inode *inode, bool wait)
+{
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+    Yaf_Handle handle;
+    int ret = 0;
+
+    ret = yaf_journal_start(sb, &handle, 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
+    bh = yaf_bread(sb, INO2BID(sb, inode->i_ino));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        yaf_journal_stop(&handle);
+        return -EIO;
+    }
+    yaf_fill_iblock(inode, bh);
+
+    yaf_journal_dirty(sb, bh);
+    yaf_journal_stop(&handle);
+    if (wait) {
+        if (YAF_FS(sb)->journal) {
+            ret = yaf_journal_commit(sb);
+        } else {
+            ret = sync_dirty_buffer(bh);
+        }
+    }
+    brelse(bh);
+
+    return ret;
+}
+
+/* order the inodes on *wb_inodes* by their inode numbers */
+static int yaf_cmp_wb(void *priv, const struct list_head *a,
+                      const struct list_head *b)
+{
+    unsigned long ia = list_entry(a, Yaf_Inode_Info, i_wb)->vfs_inode.i_ino;
+    unsigned long ib = list_entry(b, Yaf_Inode_Info, i_wb)->vfs_inode.i_ino;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Fill the inodes at the head of the sorted *wb_inodes* into up to
+ * *YAF_WB_BATCH* inode blocks, each block read and filled once for
+ * all its inodes, and take them off the list.
+ *
+ * Without a journal the blocks are then submitted in one plug, so
+ * adjacent ones are merged into larger requests, and waited for if
+ * @wait is set. With a journal they are logged in one handle instead.
+ *
+ * Called with *wb_lock* held.
+ */
+static int yaf_write_iblocks(struct super_block *sb, bool wait)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    struct buffer_head *bhs[YAF_WB_BATCH];
+    Yaf_Inode_Info *yii, *tmp;
+    struct blk_plug plug;
+    unsigned int nr = 0;
+    Yaf_Handle handle;
+    int ret;
+
+    ret = yaf_journal_start(sb, &handle, YAF_WB_BATCH);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+
+    list_for_each_entry_safe(yii, tmp, &yfi->wb_inodes, i_wb) {
+        struct inode *inode = &yii->vfs_inode;
+        sector_t bid = INO2BID(sb, inode->i_ino);
+
+        /* the list is sorted, so the inodes of a block are adjacent */
+        if (!nr || bhs[nr - 1]->b_blocknr != bid) {
+            if (nr == YAF_WB_BATCH) {
+                break;
+            }
+            bhs[nr] = yaf_bread(sb, bid);
+            if (!bhs[nr]) {
+                log(LOG_ERR, "yaf_bread() failed");
+                ret = -EIO;
+                break;
+            }
+            ++nr;
+        }
+
+        list_del_init(&yii->i_wb);
+        yaf_fill_iblock(inode, bhs[nr - 1]);
+    }
+
+    for (unsigned int i = 0; i < nr; ++i) {
+        yaf_journal_dirty(sb, bhs[i]);
+    }
+    yaf_journal_stop(&handle);
+
+    if (!yfi->journal) {
+        blk_start_plug(&plug);
+        for (unsigned int i = 0; i < nr; ++i) {
+            write_dirty_buffer(bhs[i], wait ? REQ_SYNC : 0);
+        }
+        blk_finish_plug(&plug);
+    }
+
+    for (unsigned int i = 0; i < nr; ++i) {
+        if (wait && !yfi->journal) {
+            wait_on_buffer(bhs[i]);
+            if (!buffer_uptodate(bhs[i]) && !ret) {
+                ret = -EIO;
+            }
+        }
+        brelse(bhs[i]);
+    }
+
+    return ret;
+}
+
+/*
+ * Fill all inodes waiting on *wb_inodes* into their inode blocks,
+ * see yaf_write_iblocks().
+ *
+ * No memory reclaim may enter the filesystem meanwhile, since it
+ * would evict inodes, which takes *wb_lock*.
+ */
+static int yaf_write_inodes(struct super_block *sb, bool wait)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    unsigned int nofs;
+    int ret = 0;
+
+    mutex_lock(&yfi->wb_lock);
+    nofs = memalloc_nofs_save();
+
+    list_sort(NULL, &yfi->wb_inodes, yaf_cmp_wb);
+    while (!ret && !list_empty(&yfi->wb_inodes)) {
+        ret = yaf_write_iblocks(sb, wait);
+    }
+
+    memalloc_nofs_restore(nofs);
+    mutex_unlock(&yfi->wb_lock);
+
+    return ret;
+}
+
+/* fill the inodes queued by yaf_write_inode() in the background */
+static void yaf_write_inodes_worker(struct work_struct *work)
+{
+    Yaf_Fs_Info *yfi = container_of(to_delayed_work(work), Yaf_Fs_Info,
+                                    wb_work);
+    int ret;
+
+    ret = yaf_write_inodes(yfi->sb, false);
+    if (ret) {
+        log(LOG_ERR, "yaf_write_inodes() failed with error code %d", ret);
+    }
+}
+
+/*
+ * Write in-memory inode back to on-disk inode.
+ *
+ * The inode is only queued on *wb_inodes* here, which is drained by
+ * *wb_work* shortly after the writeback queued the first one, or by
+ * yaf_sync_fs() for sync(). So the inodes written back together are
+ * grouped by their inode blocks, and each block is filled once and
+ * written once, see yaf_write_iblocks().
+ *
+ * Only a data-integrity write of this very inode, e.g. fsync(), fills
+ * and waits for its block right away.
+ */
 static int yaf_write_inode(struct inode *inode,
                            struct writeback_control *wbc)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(inode->i_sb);
+    Yaf_Inode_Info *yii = YAF_INODE(inode);
+    bool first;
+
+    if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync) {
+        return yaf_write_one(inode, true);
+    }
+
+    mutex_lock(&yfi->wb_lock);
+    first = list_empty(&yfi->wb_inodes);
+    if (list_empty(&yii->i_wb)) {
+        list_add_tail(&yii->i_wb, &yfi->wb_inodes);
+    }
+    mutex_unlock(&yfi->wb_lock);
+
+    if (first) {
+        queue_delayed_work(system_long_wq, &yfi->wb_work, YAF_WB_DELAY);
+    }
+
+    return 0;
+}
+
+/*
+ * Called when the VFS marks @inode dirty.
+ *
+ * Inside a journal handle the inode block is filled and logged right
+ * away, so the inode lands in the same transaction as the dentry and
+ * bitmap blocks of the operation dirtying it, e.g. a new inode with
+ * its dentry or a link count with the dentrys counted. Outside one
+ * the inode is left to yaf_write_inode().
+ */
+static void yaf_dirty_inode(struct inode *inode, int flags)
+{
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+
+    if (!YAF_FS(sb)->journal || !current->journal_info ||
+        !(flags & I_DIRTY_INODE)) {
+        return;
+    }
+
+    bh = yaf_bread(sb, INO2BID(sb, inode->i_ino));
+    if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        return;
+    }
+    yaf_fill_iblock(inode, bh);
+
+    yaf_journal_dirty(sb, bh);
+    brelse(bh);
+}
+
+/* a released inode waiting for yaf_free_worker() to free it */
+typedef struct YAF_FREE {
+    struct llist_node node;
+    uint32_t ino;                   /* the released inode */
+    bool dir;                       /* whether it is a directory */
+    Yaf_Orphan orphan;              /* its orphan list entry */
+    uint32_t nr_dno;                /* number of its data blocks */
+    uint32_t dno[YAF_IBLOCKS];      /* its data blocks */
+} Yaf_Free;
+static_assert(YAF_FREE_DNOS == YAF_FREE_BATCH * YAF_IBLOCKS);
+
+/*
+ * Free the @nr released inodes in @yfs, whose inode numbers are
+ * gathered in @inos and data blocks in @dnos, and take them off the
+ * orphan list within one journal handle.
+ *
+ * On failure nothing is freed and the inodes stay on the orphan
+ * list, so the next mount releases them.
+ *
+ * The dentry blocks of a released directory may still be in the
+ * journal, so the journal is flushed first for a directory, otherwise
+ * a later checkpoint or replay could overwrite the next owner of
+ * such a block with the stale dentrys.
+ *
+ * With the *discard* mount option the data blocks are discarded
+ * before their bits are cleared, once the transactions releasing
+ * the inodes are committed.
+ */
+static int yaf_free(struct super_block *sb, Yaf_Free **yfs,
+                    unsigned int nr, uint32_t *inos, uint32_t *dnos,
+                    unsigned int nr_dno)
+{
+    bool discard = YAF_FS(sb)->discard && nr_dno;
+    Yaf_Handle handle;
+    bool dir = false;
+    int ret;
+
+    for (unsigned int i = 0; i < nr; ++i) {
+        dir |= yfs[i]->dir;
+    }
+    if (dir && nr_dno) {
+        ret = yaf_journal_flush(sb);
+        if (ret) {
+            log(LOG_ERR, "yaf_journal_flush() failed with error code %d",
+                ret);
+            return ret;
+        }
+    } else if (discard) {
+        ret = yaf_journal_commit(sb);
+        if (ret) {
+            log(LOG_ERR, "yaf_journal_commit() failed with error code %d",
+                ret);
+            return ret;
+        }
+    }
+
+    /* a failed discard only leaves the blocks to the next FITRIM */
+    if (discard) {
+        yaf_discard_dblocks(sb, dnos, nr_dno);
+    }
+
+    /* each orphan rewrites its predecessor, so count two blocks more */
+    ret = yaf_journal_start(sb, &handle, 3 * nr + nr_dno);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
+    yaf_put_dblocks(sb, dnos, nr_dno);
+    yaf_put_inodes(sb, inos, nr);
+    for (unsigned int i = 0; i < nr; ++i) {
+        yaf_orphan_del(sb, &yfs[i]->orphan);
+    }
+    yaf_journal_stop(&handle);
+
+    return 0;
+}
+
+/*
+ * Free the inodes released by yaf_evict_inode().
+ *
+ * Up to *YAF_FREE_BATCH* inodes are freed together, so every
+ * bitmap block shared by them is read and dirtied only once. The
+ * inodes failed to be freed are kept on *free_kept* instead, since
+ * their orphan entries are still on the orphan list, and retried
+ * along with the inodes released next.
+ */
+static void yaf_free_worker(struct work_struct *work)
+{
+    Yaf_Fs_Info *yfi = container_of(work, Yaf_Fs_Info, free_work);
+    struct llist_node *kept = llist_del_all(&yfi->free_kept);
+    Yaf_Free *yfs[YAF_FREE_BATCH], *yf, *tmp;
+    unsigned int nr = 0, nr_dno = 0;
+    struct llist_node *list, *last;
+
+    if (kept) {
+        last = kept;
+        while (last->next) {
+            last = last->next;
+        }
+        llist_add_batch(kept, last, &yfi->free_list);
+    }
+    list = llist_del_all(&yfi->free_list);
+
+    llist_for_each_entry_safe(yf, tmp, list, node) {
+        yfs[nr] = yf;
+        yfi->free_ino[nr++] = yf->ino;
+        memcpy(&yfi->free_dno[nr_dno], yf->dno,
+               yf->nr_dno * sizeof(yf->dno[0]));
+        nr_dno += yf->nr_dno;
+
+        if (nr == YAF_FREE_BATCH || !yf->node.next) {
+            int ret = yaf_free(yfi->sb, yfs, nr, yfi->free_ino,
+                               yfi->free_dno, nr_dno);
+
+            while (nr) {
+                if (ret) {
+                    llist_add(&yfs[--nr]->node, &yfi->free_kept);
+                } else {
+                    kfree(yfs[--nr]);
+                }
+            }
+            nr_dno = 0;
+        }
+    }
+}
+
+/*
+ * Free the inodes still waiting on *free_wq* and destroy it.
+ *
+ * The inodes kept by yaf_free_worker() are left on the on-disk
+ * orphan list for the next mount to release, only their in-memory
+ * entries are taken off the orphan list and released here.
+ */
+static void yaf_free_destroy(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    struct llist_node *list;
+    Yaf_Free *yf, *tmp;
+
+    destroy_workqueue(yfi->free_wq);
+
+    list = llist_del_all(&yfi->free_kept);
+    llist_for_each_entry_safe(yf, tmp, list, node) {
+        log(LOG_ERR, "inode %u is left on the orphan list", yf->ino);
+        mutex_lock(&yfi->orphan_lock);
+        list_del_init(&yf->orphan.node);
+        mutex_unlock(&yfi->orphan_lock);
+        kfree(yf);
+    }
+}
+
+/*
+ * Called when the VFS wants to evict an inode.
+ *
+ * An inode without links is released here, once the last open
+ * file is gone as well. Its data blocks and on-disk inode are
+ * handed to the per-superblock *free_wq*, so neither unlink() nor
+ * the final close() waits for the bitmap blocks. It stays on the
+ * orphan list until then.
+ *
+ * An inode still queued by yaf_write_inode() is taken off
+ * *wb_inodes* and, if it keeps its links, filled right away.
+ */
+static void yaf_evict_inode(struct inode *inode)
 {
     struct super_block *sb = inode->i_sb;
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
     Yaf_Inode_Info *yii = YAF_INODE(inode);
-    Yaf_Inode *dyi;
+    Yaf_Free *yf;
+    uint32_t nr_dno = 0;
+    bool queued;
+
+    mutex_lock(&yfi->wb_lock);
+    queued = !list_empty(&yii->i_wb);
+    list_del_init(&yii->i_wb);
+    mutex_unlock(&yfi->wb_lock);
+    if (queued && inode->i_nlink && !is_bad_inode(inode)) {
+        yaf_write_one(inode, false);
+    }
+
+    truncate_inode_pages_final(&inode->i_data);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+
+    if (inode->i_nlink || is_bad_inode(inode)) {
+        return;
+    }
+
+    /* the *i_block* of a fast symlink holds its target instead */
+    while (!yaf_is_fast_symlink(inode) && nr_dno < YAF_IBLOCKS &&
+           yii->i_block[nr_dno] != RESERVED_DNO) {
+        ++nr_dno;
+    }
+
+    /* eviction cannot fail, and the entry is small */
+    yf = kmalloc(sizeof(Yaf_Free), GFP_NOFS | __GFP_NOFAIL);
+    yf->ino = inode->i_ino;
+    yf->dir = S_ISDIR(inode->i_mode);
+    yf->nr_dno = nr_dno;
+    memcpy(yf->dno, yii->i_block, nr_dno * sizeof(yf->dno[0]));
+    yaf_orphan_move(inode, &yf->orphan);
+
+    /* the worker is only queued by whoever refills an empty list */
+    if (llist_add(&yf->node, &yfi->free_list)) {
+        queue_work(yfi->free_wq, &yfi->free_work);
+    }
+}
+
+/*
+ * Write the free counters and @state back to the on-disk superblock,
+ * waiting for the write to complete if @wait is set.
+ *
+ * Legacy images are left untouched, since their superblock has no
+ * room for them.
+ */
+static int yaf_write_super(struct super_block *sb, uint32_t state,
+                           int wait)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
     struct buffer_head *bh;
+    Yaf_Superblock *ysb;
+    Yaf_Handle handle;
+    int ret = 0;
+
+    if (YAF_SB(sb)->version == YAF_VERSION_LEGACY || sb_rdonly(sb)) {
+        return 0;
+    }
+
+    /* the superblock holds the orphan list head, so it is logged too */
+    ret = yaf_journal_start(sb, &handle, 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_start() failed with error code %d", ret);
+        return ret;
+    }
 
-    bh = sb_bread(sb, INO2BID(sb, inode->i_ino));
+    bh = yaf_bread(sb, BID_SB_MIN(sb));
     if (!bh) {
+        log(LOG_ERR, "yaf_bread() failed");
+        yaf_journal_stop(&handle);
         return -EIO;
-        log(LOG_ERR, "sb_bread() failed");
     }
-    dyi = (Yaf_Inode *)(bh->b_data + INO2BOFF(sb, inode->i_ino));
+    ysb = (Yaf_Superblock *)bh->b_data;
 
-    dyi->i_mode = cpu_to_le32(inode->i_mode);
-    dyi->i_uid = cpu_to_le32(i_uid_read(inode));
-    dyi->i_gid = cpu_to_le32(i_gid_read(inode));
-    dyi->i_nlink = cpu_to_le32(inode->i_nlink);
-    dyi->i_atime = cpu_to_le32(inode_get_atime_sec(inode));
-    dyi->i_mtime = cpu_to_le32(inode_get_mtime_sec(inode));
-    dyi->i_ctime = cpu_to_le32(inode_get_ctime_sec(inode));
-    dyi->i_size = cpu_to_le32(inode->i_size);
-    for (int i = 0; i < ARRAY_SIZE(yii->i_block); ++i) {
-        dyi->i_block[i] = cpu_to_le32(yii->i_block[i]);
-    }
+    ysb->state = cpu_to_le32(state);
+    ysb->nr_free_i = cpu_to_le32(
+                        percpu_counter_sum_positive(&yfi->nr_free_i));
+    ysb->nr_free_d = cpu_to_le32(
+                        percpu_counter_sum_positive(&yfi->nr_free_d));
 
-    mark_buffer_dirty(bh);
+    yaf_journal_dirty(sb, bh);
+    yaf_journal_stop(&handle);
+    if (wait) {
+        if (yfi->journal) {
+            ret = yaf_journal_commit(sb);
+        } else {
+            ret = sync_dirty_buffer(bh);
+        }
+    }
     brelse(bh);
 
+    return ret;
+}
+
+/*
+ * Fill the inodes queued by yaf_write_inode() into their inode blocks
+ * in batches, then write back the dirty superblock, bitmap and inode
+ * blocks through the block device mapping, which writes them in block
+ * order. With a journal those blocks are committed to the log first.
+ *
+ * yaf_sync_fs() only starts the writeback when @wait is 0, and waits
+ * for it to complete otherwise.
+ */
+static int yaf_sync_fs(struct super_block *sb, int wait)
+{
+    struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
+    loff_t start = (loff_t)BID_SB_MIN(sb) * YAF_BLOCK_SIZE;
+    loff_t end = (loff_t)(BID_I_MAX(sb) + 1) * YAF_BLOCK_SIZE - 1;
+    int ret;
+
+    /* the inodes released so far must reach the bitmaps first */
+    if (wait) {
+        flush_workqueue(YAF_FS(sb)->free_wq);
+    }
+
+    /* fill the inodes written back by sync() into their inode blocks */
+    ret = yaf_write_inodes(sb, wait);
+    if (ret) {
+        return ret;
+    }
+
+    ret = yaf_write_super(sb, YAF_STATE_MOUNTED, 0);
+    if (!ret && wait) {
+        ret = yaf_journal_commit(sb);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    if (!wait) {
+        return filemap_fdatawrite_range(mapping, start, end);
+    }
+    return filemap_write_and_wait_range(mapping, start, end);
+}
+
+/*
+ * yaf_put_super() releases the in-memory superblock after all the
+ * metadata reached the disk, marking the on-disk superblock clean
+ * so that the next mount can trust its free counters.
+ */
+static void yaf_put_super(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+
+    /* every inode was filled by sync_filesystem() and evict_inodes() */
+    cancel_delayed_work_sync(&yfi->wb_work);
+
+    yaf_itable_stop(sb);
+    yaf_itable_destroy(sb);
+
+    /* free the inodes released by the final evict_inodes() */
+    yaf_free_destroy(sb);
+
+    /* write every logged block to its home block */
+    yaf_journal_destroy(sb);
+
+    if (!sync_blockdev(sb->s_bdev)) {
+        yaf_write_super(sb, YAF_STATE_CLEAN, 1);
+    }
+
+    percpu_counter_destroy(&yfi->nr_free_i);
+    percpu_counter_destroy(&yfi->nr_free_d);
+    kfree(yfi);
+    sb->s_fs_info = NULL;
+}
+
+/* report the filesystem statistics from the in-memory free counters */
+static int yaf_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+
+    buf->f_type = YAF_MAGIC_NUMBER;
+    buf->f_bsize = YAF_BLOCK_SIZE;
+    buf->f_blocks = YAF_SB(sb)->nr_d;
+    buf->f_bfree = percpu_counter_sum_positive(&yfi->nr_free_d);
+    buf->f_bavail = buf->f_bfree > yfi->nr_r ? buf->f_bfree - yfi->nr_r : 0;
+    buf->f_files = NR_INODES(sb);
+    buf->f_ffree = percpu_counter_sum_positive(&yfi->nr_free_i);
+    buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+    buf->f_namelen = YAF_DENTRY_NAME_LEN;
+
+    return 0;
+}
+
+/* show the mount options of @root in /proc/mounts */
+static int yaf_show_options(struct seq_file *seq, struct dentry *root)
+{
+    if (YAF_FS(root->d_sb)->discard) {
+        seq_puts(seq, ",discard");
+    }
     return 0;
 }
 
@@ -130,10 +718,172 @@ static struct super_operations yaf_super_ops = {
     .destroy_inode = yaf_destroy_inode, /* this method is called to release
                                          * resources allocated for
                                          * *struct inode* */
+    .dirty_inode = yaf_dirty_inode,     /* this method is called by the VFS
+                                         * when an inode is marked dirty */
     .write_inode = yaf_write_inode,     /* this method is called when the VFS
                                          * needs to write an inode to disk */
+    .sync_fs = yaf_sync_fs,             /* this method is called when the VFS
+                                         * is writing out all dirty data
+                                         * associated with a superblock */
+    .evict_inode = yaf_evict_inode,     /* this method is called when the VFS
+                                         * wants to evict an inode */
+    .put_super = yaf_put_super,         /* this method is called when the VFS
+                                         * wishes to free the superblock */
+    .statfs = yaf_statfs,               /* this method is called when the VFS
+                                         * needs to get filesystem
+                                         * statistics */
+    .show_options = yaf_show_options,   /* this method is called by the VFS
+                                         * to show mount options for
+                                         * /proc/<pid>/mounts */
+};
+
+/*
+ * yaf_compact_put_super() releases the in-memory superblock of a
+ * compact image, which has nothing to write back.
+ */
+static void yaf_compact_put_super(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+
+    percpu_counter_destroy(&yfi->nr_free_i);
+    percpu_counter_destroy(&yfi->nr_free_d);
+    kfree(yfi);
+    sb->s_fs_info = NULL;
+}
+
+/* a compact image is never remounted read-write, see compact.h */
+static int yaf_compact_remount_fs(struct super_block *sb, int *flags,
+                                  char *data)
+{
+    if (!(*flags & SB_RDONLY)) {
+        log(LOG_ERR, "compact image is read-only");
+        return -EROFS;
+    }
+    return 0;
+}
+
+/*
+ * describes how the VFS can manipulate the superblock of a compact
+ * image, which neither writes nor frees anything, see yaf_super_ops
+ */
+static struct super_operations yaf_compact_super_ops = {
+    .alloc_inode = yaf_alloc_inode,     /* this method is called to allocate
+                                         * memory for *struct inode* and
+                                         * initialize it */
+    .destroy_inode = yaf_destroy_inode, /* this method is called to release
+                                         * resources allocated for
+                                         * *struct inode* */
+    .put_super = yaf_compact_put_super, /* this method is called when the VFS
+                                         * wishes to free the superblock */
+    .statfs = yaf_statfs,               /* this method is called when the VFS
+                                         * needs to get filesystem
+                                         * statistics */
+    .remount_fs = yaf_compact_remount_fs, /* this method is called when the
+                                         * filesystem is remounted */
+};
+
+/* mount options */
+enum {
+    Opt_discard,
+    Opt_nodiscard,
+    Opt_err,
+};
+
+static const match_table_t yaf_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_err, NULL},
 };
 
+/* parse the comma-separated mount options @data into @yfi */
+static int yaf_parse_options(Yaf_Fs_Info *yfi, char *data)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    while (data && (p = strsep(&data, ",")) != NULL) {
+        if (!*p) {
+            continue;
+        }
+
+        switch (match_token(p, yaf_tokens, args)) {
+            case Opt_discard:
+                yfi->discard = true;
+                break;
+
+            case Opt_nodiscard:
+                yfi->discard = false;
+                break;
+
+            default:
+                log(LOG_ERR, "unknown mount option \"%s\"", p);
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Finish yaf_fill_super() for a compact image, which is mounted
+ * read-only without a journal, orphans, or free inodes and data
+ * blocks to count, see compact.h.
+ */
+static int yaf_fill_compact_super(struct super_block *sb)
+{
+    Yaf_Fs_Info *yfi = YAF_FS(sb);
+    Yaf_Sb_Info *ysi = YAF_SB(sb);
+    struct inode *root;
+    int ret;
+
+    if (ysi->nr_ibp || ysi->nr_dbp || yfi->nr_j || yfi->nr_c ||
+        yfi->nr_r || !ysi->nr_i || yfi->nr_i_init != ysi->nr_i) {
+        log(LOG_ERR, "sections of the compact image are invalid");
+        return -EINVAL;
+    }
+    sb->s_op = &yaf_compact_super_ops;
+    sb->s_flags |= SB_RDONLY;
+    sb->s_maxbytes = MAX_LFS_FILESIZE;
+
+    ret = percpu_counter_init(&yfi->nr_free_i, 0, GFP_KERNEL);
+    if (ret) {
+        log(LOG_ERR, "percpu_counter_init() failed");
+        return ret;
+    }
+    ret = percpu_counter_init(&yfi->nr_free_d, 0, GFP_KERNEL);
+    if (ret) {
+        log(LOG_ERR, "percpu_counter_init() failed");
+        goto destroy_free_i;
+    }
+
+    /* get inode for root dentry from block device */
+    root = yaf_iget(sb, ROOT_INO);
+    if (IS_ERR(root)) {
+        ret = PTR_ERR(root);
+        log(LOG_ERR, "yaf_iget() failed with error code %d", ret);
+        goto destroy_free_d;
+    }
+
+    /* create root dentry for this mount instance */
+    sb->s_root = d_make_root(root);
+    if (!sb->s_root) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "d_make_root() failed");
+        goto destroy_free_d;
+    }
+
+    log(LOG_INFO, "compact image with inode blocks [%ld, %ld] "
+        "and data blocks [%ld, %ld]", BID_I_MIN(sb), BID_I_MAX(sb),
+        BID_D_MIN(sb), BID_D_MAX(sb));
+    return 0;
+
+destroy_free_d:
+    percpu_counter_destroy(&yfi->nr_free_d);
+destroy_free_i:
+    percpu_counter_destroy(&yfi->nr_free_i);
+    return ret;
+}
+
 /*
  * yaf_fill_super() is responsible for parsing the provided
  * block device containing the yaf filesystem image, creating
@@ -145,12 +895,15 @@ int yaf_fill_super(struct super_block *sb, void *data, int silent)
     long ret = 0;
     struct buffer_head *bh = NULL;
     Yaf_Superblock *ysb = NULL;
+    Yaf_Fs_Info *yfi = NULL;
     Yaf_Sb_Info *ysi = NULL;
     struct inode *root = NULL;
+    int64_t nr_free_i, nr_free_d;
 
     /* initialize *struct super_block* */
     sb_set_blocksize(sb, YAF_BLOCK_SIZE);
     sb->s_op = &yaf_super_ops;
+    sb->s_magic = YAF_MAGIC_NUMBER;
 
     /* read on-disk superblock from block device */
     bh = sb_bread(sb, BID_SB_MIN(sb));
@@ -171,22 +924,200 @@ int yaf_fill_super(struct super_block *sb, void *data, int silent)
         }
     }
 
-    /* alloc *Yaf_Sb_Info* */
-    ysi = kzalloc(sizeof(Yaf_Sb_Info), GFP_KERNEL);
-    if (!ysi) {
+    /* check on-disk format version */
+    if (le32_to_cpu(ysb->yaf_sb_info.version) != YAF_VERSION_LEGACY &&
+        le32_to_cpu(ysb->yaf_sb_info.version) > YAF_VERSION &&
+        le32_to_cpu(ysb->yaf_sb_info.version) != YAF_VERSION_COMPACT) {
+        ret = -EINVAL;
+        log(LOG_ERR, "on-disk format version %u is not supported",
+            le32_to_cpu(ysb->yaf_sb_info.version));
+        goto release_bh;
+    }
+
+    /* alloc *Yaf_Fs_Info* */
+    yfi = kzalloc(sizeof(Yaf_Fs_Info), GFP_KERNEL);
+    if (!yfi) {
         ret = -ENOMEM;
         log(LOG_ERR, "kzalloc() failed");
         goto release_bh;
     }
 
     /* initialize *Yaf_Sb_Info* */
+    ysi = &yfi->yaf_sb_info;
     ysi->nr_ibp = le32_to_cpu(ysb->yaf_sb_info.nr_ibp);
     ysi->nr_dbp = le32_to_cpu(ysb->yaf_sb_info.nr_dbp);
     ysi->nr_i = le32_to_cpu(ysb->yaf_sb_info.nr_i);
     ysi->nr_d = le32_to_cpu(ysb->yaf_sb_info.nr_d);
+    ysi->version = le32_to_cpu(ysb->yaf_sb_info.version);
+    yfi->inode_size = yaf_inode_size(ysi->version);
+    if (ysi->version != YAF_VERSION_LEGACY &&
+        ysi->version >= YAF_VERSION_JOURNAL) {
+        yfi->nr_j = le32_to_cpu(ysb->nr_j);
+    }
+    if (ysi->version != YAF_VERSION_LEGACY &&
+        ysi->version >= YAF_VERSION_CSUM) {
+        yfi->nr_c = le32_to_cpu(ysb->nr_c);
+    }
+    if (ysi->version != YAF_VERSION_LEGACY) {
+        yfi->nr_r = le32_to_cpu(ysb->nr_r);
+    }
+    yfi->nr_i_init = ysi->nr_i;
+    if (ysi->version != YAF_VERSION_LEGACY &&
+        ysi->version >= YAF_VERSION_ITABLE_INIT) {
+        yfi->nr_i_init = le32_to_cpu(ysb->nr_i_init);
+    }
 
     /* attach yaf private data to *struct super_block* */
-    sb->s_fs_info = ysi;
+    sb->s_fs_info = yfi;
+    yfi->sb = sb;
+
+    ret = yaf_parse_options(yfi, data);
+    if (ret) {
+        goto free_yfi;
+    }
+    if (yfi->discard && !bdev_max_discard_sectors(sb->s_bdev)) {
+        log(LOG_INFO, "device does not support discard, "
+            "disabling the discard option");
+        yfi->discard = false;
+    }
+
+    /* inodes without *Yaf_Inode_Ext* only keep 32-bit seconds */
+    if (YAF_INODE_SIZE(sb) > sizeof(Yaf_Inode)) {
+        sb->s_time_gran = 1;
+    } else {
+        sb->s_time_gran = NSEC_PER_SEC;
+        sb->s_time_min = 0;
+        sb->s_time_max = U32_MAX;
+    }
+    init_llist_head(&yfi->free_list);
+    init_llist_head(&yfi->free_kept);
+    mutex_init(&yfi->wb_lock);
+    INIT_LIST_HEAD(&yfi->wb_inodes);
+    INIT_DELAYED_WORK(&yfi->wb_work, yaf_write_inodes_worker);
+    INIT_WORK(&yfi->free_work, yaf_free_worker);
+    mutex_init(&yfi->orphan_lock);
+    INIT_LIST_HEAD(&yfi->orphans);
+    mutex_init(&yfi->itable_lock);
+    mutex_init(&yfi->resize_lock);
+    INIT_DELAYED_WORK(&yfi->itable_work, yaf_itable_worker);
+
+    /* a compact image has no bitmaps, journal or orphans */
+    if (ysi->version == YAF_VERSION_COMPACT) {
+        ret = yaf_fill_compact_super(sb);
+        if (ret) {
+            goto free_yfi;
+        }
+        goto release_bh;
+    }
+
+    /* check whether the bitmaps cover all inodes and data blocks */
+    if ((uint64_t)ysi->nr_ibp * BITS_PER_BLOCK < NR_INODES(sb) ||
+        (uint64_t)ysi->nr_dbp * BITS_PER_BLOCK < ysi->nr_d) {
+        ret = -EINVAL;
+        log(LOG_ERR, "bitmaps are too small for the sections");
+        goto free_yfi;
+    }
+    if (yfi->nr_j && yfi->nr_j < YAF_JOURNAL_MIN_BLOCKS) {
+        ret = -EINVAL;
+        log(LOG_ERR, "journal of %u blocks is too small", yfi->nr_j);
+        goto free_yfi;
+    }
+    if (yfi->nr_r > ysi->nr_d) {
+        ret = -EINVAL;
+        log(LOG_ERR, "%u reserved data blocks exceed the %u data blocks",
+            yfi->nr_r, ysi->nr_d);
+        goto free_yfi;
+    }
+    /* the first inode block holds the root inode, so mkfs zeroes it */
+    if (!yfi->nr_i_init || yfi->nr_i_init > ysi->nr_i) {
+        ret = -EINVAL;
+        log(LOG_ERR, "%u zeroed inode blocks are invalid", yfi->nr_i_init);
+        goto free_yfi;
+    }
+
+    /* the checksums are only kept up to date by the journal */
+    if (yfi->nr_c && (!yfi->nr_j ||
+        (uint64_t)yfi->nr_c * YAF_CSUMS_PER_BLOCK <
+        (uint64_t)ysi->nr_ibp + ysi->nr_dbp + ysi->nr_i + ysi->nr_d)) {
+        ret = -EINVAL;
+        log(LOG_ERR, "checksum section of %u blocks is invalid",
+            yfi->nr_c);
+        goto free_yfi;
+    }
+    ret = yaf_csum_verify(sb, bh);
+    if (ret) {
+        log(LOG_ERR, "yaf_csum_verify() failed with error code %ld", ret);
+        goto free_yfi;
+    }
+
+    /* replay the journal before trusting any metadata block */
+    ret = yaf_journal_load(sb);
+    if (ret) {
+        log(LOG_ERR, "yaf_journal_load() failed with error code %ld", ret);
+        goto free_yfi;
+    }
+
+    /*
+     * The on-disk free counters are only trusted after a clean
+     * unmount, otherwise they are counted from the bitmaps.
+     */
+    if (ysi->version == YAF_VERSION_LEGACY ||
+        le32_to_cpu(ysb->state) != YAF_STATE_CLEAN) {
+        log(LOG_INFO, "counting free inodes and data blocks");
+        nr_free_i = yaf_count_free(sb, BID_IBP_MIN(sb), NR_INODES(sb));
+        nr_free_d = yaf_count_free(sb, BID_DBP_MIN(sb), ysi->nr_d);
+        if (nr_free_i < 0 || nr_free_d < 0) {
+            ret = -EIO;
+            log(LOG_ERR, "yaf_count_free() failed");
+            goto destroy_journal;
+        }
+    } else {
+        nr_free_i = le32_to_cpu(ysb->nr_free_i);
+        nr_free_d = le32_to_cpu(ysb->nr_free_d);
+    }
+
+    /* find the inode blocks left by mkfs which are in use already */
+    ret = yaf_itable_load(sb);
+    if (ret) {
+        log(LOG_ERR, "yaf_itable_load() failed with error code %ld", ret);
+        goto destroy_journal;
+    }
+
+    ret = percpu_counter_init(&yfi->nr_free_i, nr_free_i, GFP_KERNEL);
+    if (ret) {
+        log(LOG_ERR, "percpu_counter_init() failed");
+        goto destroy_itable;
+    }
+    ret = percpu_counter_init(&yfi->nr_free_d, nr_free_d, GFP_KERNEL);
+    if (ret) {
+        log(LOG_ERR, "percpu_counter_init() failed");
+        goto destroy_free_i;
+    }
+
+    /* released inodes are freed in the background by *free_wq* */
+    yfi->free_wq = alloc_workqueue("yaf-free/%s",
+                                   WQ_MEM_RECLAIM | WQ_FREEZABLE, 1,
+                                   sb->s_id);
+    if (!yfi->free_wq) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "alloc_workqueue() failed");
+        goto destroy_free_d;
+    }
+
+    /* the on-disk free counters are stale until a clean unmount */
+    ret = yaf_write_super(sb, YAF_STATE_MOUNTED, 1);
+    if (ret) {
+        log(LOG_ERR, "yaf_write_super() failed with error code %ld", ret);
+        goto destroy_free_wq;
+    }
+
+    /* release the inodes deleted or still open at an unclean shutdown */
+    ret = yaf_orphan_recover(sb);
+    if (ret) {
+        log(LOG_ERR, "yaf_orphan_recover() failed with error code %ld",
+            ret);
+        goto destroy_free_wq;
+    }
 
     /* get inode for root dentry from block device */
     root = yaf_iget(sb, ROOT_INO);
@@ -194,7 +1125,7 @@ int yaf_fill_super(struct super_block *sb, void *data, int silent)
         ret = PTR_ERR(root);
         log(LOG_ERR,
             "yaf_iget() failed with error code %ld", ret);
-        goto free_ysi;
+        goto destroy_free_wq;
     }
 
     /* create root dentry for this mount instance */
@@ -202,11 +1133,19 @@ int yaf_fill_super(struct super_block *sb, void *data, int silent)
     if (!sb->s_root) {
         ret = -ENOMEM;
         log(LOG_ERR, "d_make_root() failed");
-        goto iput_root;
+        goto destroy_free_wq;
     }
 
     log(LOG_INFO, "superblock is at blocks [%ld, %ld]",
         BID_SB_MIN(sb), BID_SB_MAX(sb));
+    if (yfi->nr_j) {
+        log(LOG_INFO, "journal section is at blocks [%ld, %ld]",
+            BID_J_MIN(sb), BID_J_MAX(sb));
+    }
+    if (yfi->nr_c) {
+        log(LOG_INFO, "checksum section is at blocks [%ld, %ld]",
+            BID_C_MIN(sb), BID_C_MAX(sb));
+    }
     log(LOG_INFO, "inode bitmap section is at blocks [%ld, %ld]",
         BID_IBP_MIN(sb), BID_IBP_MAX(sb));
     log(LOG_INFO, "data bitmap section is at blocks [%ld, %ld]",
@@ -215,13 +1154,29 @@ int yaf_fill_super(struct super_block *sb, void *data, int silent)
         BID_I_MIN(sb), BID_I_MAX(sb));
     log(LOG_INFO, "data blocks section is at blocks [%ld, %ld]",
         BID_D_MIN(sb), BID_D_MAX(sb));
+    if (yfi->nr_r) {
+        log(LOG_INFO, "%u data blocks are reserved for the privileged users",
+            yfi->nr_r);
+    }
+
+    /* zero the inode blocks left by mkfs in the background */
+    yaf_itable_start(sb);
 
     goto release_bh;
 
-iput_root:
-    iput(root);
-free_ysi:
-    kfree(ysi);
+destroy_free_wq:
+    yaf_free_destroy(sb);
+destroy_free_d:
+    percpu_counter_destroy(&yfi->nr_free_d);
+destroy_free_i:
+    percpu_counter_destroy(&yfi->nr_free_i);
+destroy_itable:
+    yaf_itable_destroy(sb);
+destroy_journal:
+    yaf_journal_destroy(sb);
+free_yfi:
+    sb->s_fs_info = NULL;
+    kfree(yfi);
 release_bh:
     brelse(bh);
 out:
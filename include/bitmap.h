@@ -59,18 +59,41 @@
 
     #ifdef __KERNEL__
 
+        /* sort the given bitmap idxs ascending */
+        void yaf_sort_idxs(uint32_t *idxs, unsigned int nr);
+
         /* find an unused inode and mark it */
         uint32_t yaf_get_free_inode(struct super_block *sb);
 
+        /* count the inodes in use among @nr inodes from @ino */
+        int yaf_count_used_inodes(struct super_block *sb, uint32_t ino,
+                                  uint32_t nr);
+
         /* mark the given inode as unused */
         void yaf_put_inode(struct super_block *sb, uint32_t ino);
 
+        /* mark the given inodes as unused, sorting @inos */
+        void yaf_put_inodes(struct super_block *sb, uint32_t *inos,
+                            unsigned int nr);
+
         /* find an unused data block and mark it */
         uint32_t yaf_get_free_dblock(struct super_block *sb);
 
+        /* find @nr unused data blocks, in a row if possible, and mark them */
+        int yaf_get_free_dblocks(struct super_block *sb, uint32_t *dnos,
+                                 unsigned int nr);
+
         /* mark the given data block as unused */
         void yaf_put_dblock(struct super_block *sb, uint32_t dno);
 
+        /* mark the given data blocks as unused, sorting @dnos */
+        void yaf_put_dblocks(struct super_block *sb, uint32_t *dnos,
+                             unsigned int nr);
+
+        /* count the unused bits among the first bits of a bitmap section */
+        int64_t yaf_count_free(struct super_block *sb,
+                               unsigned long bid_min, uint32_t nr_idx);
+
     #else // __KERNEL__
         /* set the bit at the given *byte offset* in the given *byte* */
         static inline uint8_t yaf_set_bit(uint8_t byte, uint8_t byte_off) {
@@ -0,0 +1,47 @@
+#ifndef __COMPACT_H_
+
+    #define __COMPACT_H_
+
+    /*
+     * compact read-only images
+     *
+     *                 compact image
+     *     ┌──────────┬──────────────┬───────────────────────────┐
+     *     │superblock│inode blocks  │data blocks                │
+     *     └──────────┴──────────────┴───────────────────────────┘
+     *     ▲          ▲              ▲                           ▲
+     * BID_SB_MIN BID_I_MIN      BID_D_MIN                   BID_D_MAX
+     *
+     * mkfs --compact copies a tree into an image of the format
+     * *YAF_VERSION_COMPACT*, which is only ever mounted read-only. It
+     * has no journal, checksum or bitmap sections, and exactly as many
+     * inode and data blocks as the tree needs, none of them free.
+     *
+     * The inodes are numbered from *ROOT_INO* on in breadth-first order,
+     * so the children of a directory are neighbours in the inode blocks.
+     * The data of a directory or regular file is *i_block[0]* and the
+     * data blocks behind it, the others being *RESERVED_DNO*, so no size
+     * limit but the 64-bit *i_size* applies. The dentrys of a directory
+     * are packed without holes and sorted by name, bytewise and shorter
+     * first, so its *i_size* is their number times *YAF_DENTRY_SIZE* and
+     * a lookup is a binary search over its dentry blocks. The symlinks
+     * are kept as in the other formats.
+     *
+     * The dentry blocks of each directory are followed by the data of
+     * its files in name order, so reading a directory and then its
+     * files walks the device forward.
+     */
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+        #include "super.h"
+
+        /* whether @sb is a compact read-only image */
+        static inline bool yaf_is_compact(struct super_block *sb) {
+            return YAF_SB(sb)->version == YAF_VERSION_COMPACT;
+        }
+
+        /* set the operations of the directory or regular file @inode */
+        int yaf_compact_set_ops(struct inode *inode);
+    #endif // __KERNEL__
+
+#endif // __COMPACT_H_
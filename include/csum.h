@@ -0,0 +1,136 @@
+#ifndef __CSUM_H_
+
+    #define __CSUM_H_
+
+    /*
+     * metadata checksums
+     *
+     *           checksum section
+     *     ┌────────┬────────┬─────┬────────┐
+     *     │csum[0] │csum[1] │ ... │csum[n] │
+     *     └───┬────┴───┬────┴─────┴───┬────┘
+     *         ▼        ▼              ▼
+     *  BID_IBP_MIN BID_IBP_MIN + 1  BID_D_MAX
+     *
+     * Since *YAF_VERSION_CSUM*, an image with a journal may carry the
+     * crc32c of its metadata blocks. The checksum section holds one
+     * little-endian crc32c for every block from *BID_IBP_MIN* on, i.e.
+     * the bitmaps, the inode blocks and the data blocks, of which only
+     * the dentry blocks use theirs. The superblock keeps its own in
+     * *csum*, computed with that field zeroed.
+     *
+     * A zero entry marks a block not written since mkfs, which is
+     * trusted as is, so a computed crc32c of zero is stored as one.
+     *
+     * The checksums are computed when a transaction is committed and
+     * logged within it, so they always match their blocks on disk,
+     * which is why an image without a journal carries none.
+     */
+    #include "super.h"
+
+    /* number of checksums per checksum block */
+    #define YAF_CSUMS_PER_BLOCK (YAF_BLOCK_SIZE / sizeof(uint32_t))
+
+    #ifdef __KERNEL__
+        #include <linux/buffer_head.h>
+        #include <linux/crc32.h>
+        #include <linux/fs.h>
+        #include <linux/stddef.h>
+        #define yaf_crc32c(crc, data, len)  __crc32c_le(crc, data, len)
+    #else // __KERNEL__
+        #include <stddef.h>
+        #include <stdint.h>
+        #include <string.h>
+
+        #ifdef __x86_64__
+            /* crc32c with the SSE4.2 instruction, 8 bytes at a time */
+            __attribute__((target("sse4.2")))
+            static inline uint32_t yaf_crc32c_sse42(uint32_t crc,
+                                                    const uint8_t *p,
+                                                    size_t len) {
+                uint64_t crc64 = crc;
+
+                for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+                    uint64_t word;
+
+                    memcpy(&word, p, sizeof(word));
+                    crc64 = __builtin_ia32_crc32di(crc64, word);
+                    p += sizeof(word);
+                }
+                crc = crc64;
+                while (len--) {
+                    crc = __builtin_ia32_crc32qi(crc, *p++);
+                }
+                return crc;
+            }
+        #endif // __x86_64__
+
+        /*
+         * crc32c with the SSE4.2 instruction where available, since fsck
+         * checksums every metadata block, and bitwise otherwise
+         */
+        static inline uint32_t yaf_crc32c(uint32_t crc, const void *data,
+                                          size_t len) {
+            const uint8_t *p = data;
+
+            #ifdef __x86_64__
+                if (__builtin_cpu_supports("sse4.2")) {
+                    return yaf_crc32c_sse42(crc, p, len);
+                }
+            #endif // __x86_64__
+            while (len--) {
+                crc ^= *p++;
+                for (int k = 0; k < 8; ++k) {
+                    crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+                }
+            }
+            return crc;
+        }
+    #endif // __KERNEL__
+
+    /* return the checksum of the metadata block @data */
+    static inline uint32_t yaf_csum_block(const void *data) {
+        uint32_t crc = yaf_crc32c(~0U, data, YAF_BLOCK_SIZE);
+
+        return crc ? crc : 1;
+    }
+
+    /* return the checksum of the superblock @ysb */
+    static inline uint32_t yaf_csum_super(const Yaf_Superblock *ysb) {
+        const char *p = (const char *)ysb;
+        size_t off = offsetof(Yaf_Superblock, csum);
+        uint32_t zero = 0, crc;
+
+        crc = yaf_crc32c(~0U, p, off);
+        crc = yaf_crc32c(crc, &zero, sizeof(zero));
+        crc = yaf_crc32c(crc, p + off + sizeof(zero),
+                         YAF_BLOCK_SIZE - off - sizeof(zero));
+        return crc ? crc : 1;
+    }
+
+    #ifdef __KERNEL__
+        /* whether the metadata blocks of @sb carry checksums */
+        static inline bool yaf_has_csum(struct super_block *sb) {
+            return YAF_FS(sb)->nr_c;
+        }
+
+        /* check the metadata block @bh against its checksum once */
+        int yaf_csum_verify(struct super_block *sb, struct buffer_head *bh);
+
+        /* read the metadata block @bid and check it against its checksum */
+        struct buffer_head *yaf_bread(struct super_block *sb,
+                                      sector_t bid);
+
+        /* tell whether the block @bid was written since mkfs */
+        int yaf_csum_written(struct super_block *sb, sector_t bid,
+                             bool *written);
+
+        /* return the checksum block to log along with @bh, if any */
+        struct buffer_head *yaf_csum_dirty(struct super_block *sb,
+                                           struct buffer_head *bh);
+
+        /* store the checksum of the committed block @bh */
+        void yaf_csum_update(struct super_block *sb, struct buffer_head *bh);
+    #endif // __KERNEL__
+
+#endif // __CSUM_H_
@@ -0,0 +1,38 @@
+#ifndef __DEFRAG_H_
+
+    #define __DEFRAG_H_
+
+    /*
+     * defrag
+     *
+     * A file written piecewise among other files gets its data blocks
+     * wherever the first free bits were found at that time, so reading
+     * it sequentially seeks between them. yaf-defrag moves such a file
+     * into one run of consecutive data blocks while it stays mounted
+     * and in use.
+     *
+     * The run is allocated to a donor file by fallocate(2), and
+     * YAF_IOC_SWAP_BLOCKS on the fragmented file then
+     *
+     *  1. copies its content into the data blocks of the donor through
+     *     the page cache, holding both inode locks against writers,
+     *  2. swaps the *i_block* of the two inodes in one transaction, so
+     *     after a crash either both or none of them are swapped,
+     *  3. drops the cached folios of both files, which still map the
+     *     previous data blocks, holding their *invalidate_lock* so no
+     *     reader fills a folio from the previous data blocks meanwhile.
+     *
+     * A reader holding a cached folio keeps reading the same content
+     * from it. The donor ends up with the previous data blocks, which
+     * are released with it, so yaf-defrag unlinks the donor right after
+     * creating it and a crash leaves it on the orphan list.
+     */
+
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+
+        /* move the data blocks of @file into those of @donor */
+        int yaf_swap_blocks(struct file *file, struct file *donor);
+    #endif // __KERNEL__
+
+#endif // __DEFRAG_H_
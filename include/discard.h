@@ -0,0 +1,35 @@
+#ifndef __DISCARD_H_
+
+    #define __DISCARD_H_
+
+    /*
+     * discard
+     *
+     * With the *discard* mount option, the data blocks of the released
+     * inodes are discarded by yaf_free_worker() in one chain of bios,
+     * adjacent blocks merged into a single range. They are discarded
+     * after the transactions unlinking their inodes are committed and
+     * before their bitmap bits are cleared, so neither a replay can
+     * bring back a discarded block nor a new owner can lose its data.
+     *
+     * FITRIM discards the free data blocks on demand instead, a chunk
+     * of *YAF_TRIM_CHUNK* blocks at a time with a pause in between,
+     * so the foreground I/O keeps most of the device.
+     */
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+
+        /* max number of data blocks discarded at once by FITRIM */
+        #define YAF_TRIM_CHUNK      1024
+        /* pause between the FITRIM chunks in milliseconds */
+        #define YAF_TRIM_PAUSE_MS   10
+
+        /* discard the given data blocks, sorting @dnos */
+        int yaf_discard_dblocks(struct super_block *sb, uint32_t *dnos,
+                                unsigned int nr);
+
+        /* discard the free data blocks within @range */
+        int yaf_trim(struct super_block *sb, struct fstrim_range *range);
+    #endif // __KERNEL__
+
+#endif // __DISCARD_H_
@@ -8,6 +8,10 @@
         extern const struct address_space_operations yaf_as_ops;
         extern const struct file_operations yaf_file_ops;
 
+        /* sync @file and commit the journal */
+        int yaf_fsync(struct file *file, loff_t start, loff_t end,
+                      int datasync);
+
     #endif // __KERNEL__
 
 #endif // __FILE_H_
@@ -5,13 +5,21 @@
     /*
      * partition layout
      *
-     *     ┌──────────┬─────────────┬────────────┬────────────┬───────────┐
-     *     │superblock│inode bitmap │data bitmap │inode blocks│data blocks│
-     *     ├──────────┼─────────────┼────────────┼────────────┼───────────┤
-     *     │          │             │            │            │           │
-     *     ▼          ▼             ▼            ▼            ▼           ▼
-     *  BID_MIN   BID_SB_MAX   BID_IBP_MAX  BID_DBP_MAX   BID_I_MAX   BID_D_MAX
-     * BID_SB_MIN BID_IBP_MIN  BID_DBP_MIN   BID_I_MIN    BID_D_MIN    BID_MAX
+     *     ┌──────────┬─────────┬─────────┬─────────────┬────────────┬────────────┬───────────┐
+     *     │superblock│journal  │checksums│inode bitmap │data bitmap │inode blocks│data blocks│
+     *     ├──────────┼─────────┼─────────┼─────────────┼────────────┼────────────┼───────────┤
+     *     │          │         │         │             │            │            │           │
+     *     ▼          ▼         ▼         ▼             ▼            ▼            ▼           ▼
+     *  BID_MIN   BID_SB_MAX BID_J_MAX BID_C_MAX   BID_IBP_MAX  BID_DBP_MAX   BID_I_MAX   BID_D_MAX
+     * BID_SB_MIN BID_J_MIN  BID_C_MIN BID_IBP_MIN BID_DBP_MIN   BID_I_MIN    BID_D_MIN    BID_MAX
+     *
+     * The journal section is empty unless the image has a journal, and
+     * the checksum section unless it has checksums as well.
+     *
+     * Each section is sized by its own count in the superblock, so
+     * the inode blocks are independent of the data blocks. The inode
+     * bitmap only has to cover the *nr_i* * *INODES_PER_BLOCK* inodes
+     * and the data bitmap the *nr_d* data blocks.
      */
     #include "super.h"
 
@@ -32,9 +40,27 @@
             return BID_SB_MIN(sb) + 1 - 1;
         }
 
+        /* minimum block id for the journal section */
+        static inline unsigned long BID_J_MIN(struct super_block *sb) {
+            return BID_SB_MAX(sb) + 1;
+        }
+        /* maximum block id for the journal section */
+        static inline unsigned long BID_J_MAX(struct super_block *sb) {
+            return BID_J_MIN(sb) + YAF_FS(sb)->nr_j - 1;
+        }
+
+        /* minimum block id for the checksum section */
+        static inline unsigned long BID_C_MIN(struct super_block *sb) {
+            return BID_J_MAX(sb) + 1;
+        }
+        /* maximum block id for the checksum section */
+        static inline unsigned long BID_C_MAX(struct super_block *sb) {
+            return BID_C_MIN(sb) + YAF_FS(sb)->nr_c - 1;
+        }
+
         /* minimum block id for the inode bitmap section */
         static inline unsigned long BID_IBP_MIN(struct super_block *sb) {
-            return BID_SB_MAX(sb) + 1;
+            return BID_C_MAX(sb) + 1;
         }
         /* maximum block id for the inode bitmap section */
         static inline unsigned long BID_IBP_MAX(struct super_block *sb) {
@@ -84,9 +110,49 @@
             return BID_SB_MIN(ysb) + 1 - 1;
         }
 
+        /* number of journal blocks */
+        static inline uint32_t NR_J(Yaf_Superblock *ysb) {
+            uint32_t version = le32toh(ysb->yaf_sb_info.version);
+
+            if (version == YAF_VERSION_LEGACY ||
+                version < YAF_VERSION_JOURNAL) {
+                return 0;
+            }
+            return le32toh(ysb->nr_j);
+        }
+
+        /* minimum block id for the journal section */
+        static inline unsigned long BID_J_MIN(Yaf_Superblock *ysb) {
+            return BID_SB_MAX(ysb) + 1;
+        }
+        /* maximum block id for the journal section */
+        static inline unsigned long BID_J_MAX(Yaf_Superblock *ysb) {
+            return BID_J_MIN(ysb) + NR_J(ysb) - 1;
+        }
+
+        /* number of checksum blocks */
+        static inline uint32_t NR_C(Yaf_Superblock *ysb) {
+            uint32_t version = le32toh(ysb->yaf_sb_info.version);
+
+            if (version == YAF_VERSION_LEGACY ||
+                version < YAF_VERSION_CSUM) {
+                return 0;
+            }
+            return le32toh(ysb->nr_c);
+        }
+
+        /* minimum block id for the checksum section */
+        static inline unsigned long BID_C_MIN(Yaf_Superblock *ysb) {
+            return BID_J_MAX(ysb) + 1;
+        }
+        /* maximum block id for the checksum section */
+        static inline unsigned long BID_C_MAX(Yaf_Superblock *ysb) {
+            return BID_C_MIN(ysb) + NR_C(ysb) - 1;
+        }
+
         /* minimum block id for the inode bitmap section */
         static inline unsigned long BID_IBP_MIN(Yaf_Superblock *ysb) {
-            return BID_SB_MAX(ysb) + 1;
+            return BID_C_MAX(ysb) + 1;
         }
         /* maximum block id for the inode bitmap section */
         static inline unsigned long BID_IBP_MAX(Yaf_Superblock *ysb) {
@@ -75,6 +75,38 @@
      * │d_name    │dentry name              │                              ├───────────┼───────────────┤◄──4064 bytes
      * └──────────┴─────────────────────────┘◄──32   bytes                 │dentry[128]│directory entry│
      *                                                                     └───────────┴───────────────┘◄──4096 bytes
+     *
+     * Since *YAF_VERSION_INODE_EXT*, each on-disk inode is followed
+     * by the extra fields below, which widen *i_size* to 64 bits and
+     * the timestamps to 64-bit seconds with nanoseconds.
+     *
+     *                     on-disk inode extra fields
+     *         ┌────────────┬──────────────────────────────┐◄──64  bytes
+     *         │i_size_hi   │high 32 bits of i_size        │
+     *         ├────────────┼──────────────────────────────┤◄──68  bytes
+     *         │i_atime_hi  │high 32 bits of i_atime       │
+     *         ├────────────┼──────────────────────────────┤◄──72  bytes
+     *         │i_mtime_hi  │high 32 bits of i_mtime       │
+     *         ├────────────┼──────────────────────────────┤◄──76  bytes
+     *         │i_ctime_hi  │high 32 bits of i_ctime       │
+     *         ├────────────┼──────────────────────────────┤◄──80  bytes
+     *         │i_atime_nsec│nanoseconds of i_atime        │
+     *         ├────────────┼──────────────────────────────┤◄──84  bytes
+     *         │i_mtime_nsec│nanoseconds of i_mtime        │
+     *         ├────────────┼──────────────────────────────┤◄──88  bytes
+     *         │i_ctime_nsec│nanoseconds of i_ctime        │
+     *         ├────────────┼──────────────────────────────┤◄──92  bytes
+     *         │i_reserved  │zero                          │
+     *         └────────────┴──────────────────────────────┘◄──128 bytes
+     *
+     * A symlink inode whose target is at most *YAF_FAST_SYMLINK_LEN*
+     * bytes long keeps the NUL-terminated target inside *i_block*
+     * instead of block ids, longer targets are kept in a data block
+     * like the file content.
+     *
+     * An inode without links whose blocks are not released yet is on
+     * the orphan list, and its *i_atime* holds the next orphan inode
+     * instead, see orphan.h.
      */
 
     /* the array size of *i_block* */
@@ -83,8 +115,18 @@
         #include <linux/types.h>
         #include <linux/fs.h>
 
+        #include <linux/list.h>
+
+        /* an entry of the in-memory orphan list, see orphan.h */
+        typedef struct YAF_ORPHAN {
+            struct list_head node;  /* empty unless on the list */
+            uint32_t ino;           /* the orphan inode */
+        } Yaf_Orphan;
+
         typedef struct YAF_INODE_INFO {
             uint32_t i_block[8];
+            Yaf_Orphan i_orphan;
+            struct list_head i_wb;  /* on *wb_inodes* of *Yaf_Fs_Info* */
             struct inode vfs_inode;
         } Yaf_Inode_Info;
     #else // __KERNEL__
@@ -104,6 +146,18 @@
         uint32_t i_block[YAF_IBLOCKS];  /* block ids for the data block */
     } Yaf_Inode;
 
+    /* extra fields of the on-disk inode since *YAF_VERSION_INODE_EXT* */
+    typedef struct YAF_INODE_EXT {
+        uint32_t i_size_hi;             /* high 32 bits of *i_size* */
+        uint32_t i_atime_hi;            /* high 32 bits of *i_atime* */
+        uint32_t i_mtime_hi;            /* high 32 bits of *i_mtime* */
+        uint32_t i_ctime_hi;            /* high 32 bits of *i_ctime* */
+        uint32_t i_atime_nsec;          /* nanoseconds of *i_atime* */
+        uint32_t i_mtime_nsec;          /* nanoseconds of *i_mtime* */
+        uint32_t i_ctime_nsec;          /* nanoseconds of *i_ctime* */
+        uint32_t i_reserved[9];         /* zero */
+    } Yaf_Inode_Ext;
+
     #define YAF_DENTRY_SIZE     32
     #define YAF_DENTRY_NAME_LEN (YAF_DENTRY_SIZE - \
         sizeof(uint32_t) - sizeof(uint32_t))
@@ -119,6 +173,8 @@
     #endif // __KERNEL__
     #include "super.h"
     static_assert(YAF_BLOCK_SIZE % sizeof(Yaf_Inode) == 0);
+    static_assert(YAF_BLOCK_SIZE %
+                  (sizeof(Yaf_Inode) + sizeof(Yaf_Inode_Ext)) == 0);
     static_assert(sizeof(Yaf_Dentry) == YAF_DENTRY_SIZE);
 
     /* this is reserved as invalid inode number */
@@ -128,17 +184,39 @@
     /* this is reserved as invalid data block number */
     #define RESERVED_DNO    -1
 
+    /* size of the on-disk inode in the on-disk format @version */
+    static inline uint32_t yaf_inode_size(uint32_t version) {
+        if (version == YAF_VERSION_LEGACY ||
+            version < YAF_VERSION_INODE_EXT) {
+            return sizeof(Yaf_Inode);
+        }
+        return sizeof(Yaf_Inode) + sizeof(Yaf_Inode_Ext);
+    }
+
+    #ifdef __KERNEL__
+        /* size of the on-disk inode */
+        static inline uint32_t YAF_INODE_SIZE(struct super_block *sb) {
+            return YAF_FS(sb)->inode_size;
+        }
+    #else // __KERNEL__
+        #include <endian.h>
+        /* size of the on-disk inode */
+        static inline uint32_t YAF_INODE_SIZE(Yaf_Superblock *ysb) {
+            return yaf_inode_size(le32toh(ysb->yaf_sb_info.version));
+        }
+    #endif // __KERNEL__
+
     /* number of inodes per block */
-    #define INODES_PER_BLOCK    (YAF_BLOCK_SIZE / sizeof(Yaf_Inode))
+    #define INODES_PER_BLOCK(sb)    (YAF_BLOCK_SIZE / YAF_INODE_SIZE(sb))
 
     #include "fs.h"
     /* convert inode number to the corresponding block id */
     #define INO2BID(sb, ino)    (BID_I_MIN((sb)) + \
-                                 ((ino)) / INODES_PER_BLOCK)
+                                 ((ino)) / INODES_PER_BLOCK(sb))
 
     /* convert inode number to the offset within its corresponding block */
-    #define INO2BOFF(sb, ino)   ((ino) % INODES_PER_BLOCK \
-                                 * sizeof(Yaf_Inode))
+    #define INO2BOFF(sb, ino)   ((ino) % INODES_PER_BLOCK(sb) \
+                                 * YAF_INODE_SIZE(sb))
 
     /* convert dblock number to the corresponding block id */
     #define DNO2BID(sb, dno)    (BID_D_MIN((sb)) + (dno))
@@ -153,11 +231,29 @@
     #define YAF_INODE(inode) \
         ((Yaf_Inode_Info *)container_of(inode, Yaf_Inode_Info, vfs_inode))
 
+    /* the longest symlink target kept inside *i_block* */
+    #define YAF_FAST_SYMLINK_LEN \
+        (sizeof(uint32_t) * YAF_IBLOCKS - 1)
+
     #ifdef __KERNEL__
         #include <linux/fs.h>
         #include <linux/types.h>
+        /* number of on-disk inodes */
+        static inline uint32_t NR_INODES(struct super_block *sb) {
+            return YAF_SB(sb)->nr_i * INODES_PER_BLOCK(sb);
+        }
+
         /* fill the in-memory inode according to on-disk inode */
         struct inode *yaf_iget(struct super_block *sb, unsigned long ino);
+
+        /* fill the on-disk inode according to in-memory inode */
+        void yaf_fill_inode(struct inode *inode, Yaf_Inode *dyi);
+
+        /* whether the symlink target of @inode is kept in *i_block* */
+        static inline bool yaf_is_fast_symlink(struct inode *inode) {
+            return S_ISLNK(inode->i_mode) &&
+                   inode->i_size <= YAF_FAST_SYMLINK_LEN;
+        }
     #endif // __KERNEL__
 
 #endif // __INODE_H_
@@ -0,0 +1,32 @@
+#ifndef __IOCTL_H_
+
+    #define __IOCTL_H_
+
+    #ifdef __KERNEL__
+        #include <linux/types.h>
+    #else // __KERNEL__
+        #include <stdint.h>
+    #endif // __KERNEL__
+    #include <linux/ioctl.h>
+
+    /*
+     * grow the data blocks of a mounted image up to the block count
+     * passed as a uint64_t, 0 for the end of the device, see resize.h
+     */
+    #define YAF_IOC_RESIZE  _IOW('y', 1, uint64_t)
+
+    /*
+     * move the content of a regular file into the data blocks of the
+     * donor file whose descriptor is passed as a uint32_t, see defrag.h
+     */
+    #define YAF_IOC_SWAP_BLOCKS _IOW('y', 2, uint32_t)
+
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+
+        /* handle the ioctl(2) system call on a yaf file */
+        long yaf_ioctl(struct file *file, unsigned int cmd,
+                       unsigned long arg);
+    #endif // __KERNEL__
+
+#endif // __IOCTL_H_
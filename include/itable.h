@@ -0,0 +1,55 @@
+#ifndef __ITABLE_H_
+
+    #define __ITABLE_H_
+
+    /*
+     * lazy inode table initialization
+     *
+     *                    inode blocks section
+     *     ┌─────────────────────┬──────────────────────────────┐
+     *     │       zeroed        │ left as they were on the disk│
+     *     └─────────────────────┴──────────────────────────────┘
+     *     ▲                     ▲                              ▲
+     * BID_I_MIN       BID_I_MIN + nr_i_init                BID_I_MAX
+     *
+     * Since *YAF_VERSION_ITABLE_INIT*, mkfs may only zero the first
+     * *nr_i_init* inode blocks and leave the rest to the driver, which
+     * zeroes them in the background after the mount, a chunk of
+     * *YAF_ITABLE_CHUNK* blocks at a time with a pause in between, and
+     * advances *nr_i_init* in the superblock after each chunk.
+     *
+     * An inode allocated beyond *nr_i_init* meanwhile zeroes its inode
+     * block in the buffer cache first, unless the block is marked in
+     * *itable_zeroed*, and marks it. The mount marks the blocks with
+     * inodes in use, as well as those written since mkfs according to
+     * their checksums, whose stale content is free inodes only. The
+     * background zeroing skips the marked blocks.
+     */
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+
+        /* max number of inode blocks zeroed at once */
+        #define YAF_ITABLE_CHUNK        256
+        /* pause between the chunks in milliseconds */
+        #define YAF_ITABLE_PAUSE_MS     10
+
+        /* zero the next chunk of inode blocks, *itable_work* */
+        void yaf_itable_worker(struct work_struct *work);
+
+        /* mark the inode blocks which must keep their content */
+        int yaf_itable_load(struct super_block *sb);
+
+        /* free the marks of yaf_itable_load() */
+        void yaf_itable_destroy(struct super_block *sb);
+
+        /* start zeroing the inode blocks from *nr_i_init* on */
+        void yaf_itable_start(struct super_block *sb);
+
+        /* stop zeroing the inode blocks */
+        void yaf_itable_stop(struct super_block *sb);
+
+        /* zero the inode block of the just allocated inode @ino if needed */
+        int yaf_itable_prepare(struct super_block *sb, uint32_t ino);
+    #endif // __KERNEL__
+
+#endif // __ITABLE_H_
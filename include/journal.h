@@ -0,0 +1,124 @@
+#ifndef __JOURNAL_H_
+
+    #define __JOURNAL_H_
+
+    /*
+     * journal layout
+     *
+     * ┌──────────┬──────────┬───────┬─────┬───────┬──────┬──────────┬─────┐
+     * │journal sb│descriptor│block 0│ ... │block n│commit│descriptor│ ... │
+     * └──────────┴──────────┴───────┴─────┴───────┴──────┴──────────┴─────┘
+     *            ◄────────── transaction j_seq ──────────►◄─ j_seq + 1 ─►
+     *
+     * Each transaction logs full copies of the modified metadata blocks,
+     * i.e. the bitmap, inode and dentry blocks, behind a descriptor
+     * recording their home block ids. It is committed by its commit
+     * block, which carries the crc32c of the descriptor and the logged
+     * blocks, so the whole transaction is written in one sequential
+     * pass and a torn one is simply not replayed.
+     *
+     * The logged copies are written to their home blocks only when
+     * the log is checkpointed, after which *j_seq* in the journal
+     * superblock skips the checkpointed transactions. A mount replays
+     * the transactions found from the block behind the journal
+     * superblock with consecutive sequences starting at *j_seq*.
+     */
+    #ifdef __KERNEL__
+        #include <linux/types.h>
+    #else // __KERNEL__
+        #include <stdint.h>
+    #endif // __KERNEL__
+    #include "super.h"
+
+    /* the magic string "yafj" read as a little-endian uint32_t */
+    #define YAF_JOURNAL_MAGIC   0x6a666179
+
+    /* types of the log blocks */
+    #define YAF_JOURNAL_TYPE_DESC   1
+    #define YAF_JOURNAL_TYPE_COMMIT 2
+
+    /* on-disk journal superblock structure */
+    typedef struct YAF_JOURNAL_SB {
+        uint32_t j_magic;   /* *YAF_JOURNAL_MAGIC* */
+        uint32_t j_seq;     /* sequence of the first logged transaction */
+    } Yaf_Journal_Sb;
+
+    /* header of the descriptor and commit blocks */
+    typedef struct YAF_JOURNAL_HEADER {
+        uint32_t h_magic;   /* *YAF_JOURNAL_MAGIC* */
+        uint32_t h_type;    /* type of the log block */
+        uint32_t h_seq;     /* sequence of the transaction */
+    } Yaf_Journal_Header;
+
+    /* max number of blocks logged by a transaction */
+    #define YAF_JOURNAL_DESC_ENTRIES \
+        ((YAF_BLOCK_SIZE - sizeof(Yaf_Journal_Header) - sizeof(uint32_t)) \
+         / sizeof(uint32_t))
+
+    /* on-disk descriptor block structure */
+    typedef struct YAF_JOURNAL_DESC {
+        Yaf_Journal_Header d_header;
+        uint32_t d_nr;                              /* number of logged
+                                                       blocks */
+        uint32_t d_bid[YAF_JOURNAL_DESC_ENTRIES];   /* their home block
+                                                       ids */
+    } Yaf_Journal_Desc;
+
+    /* on-disk commit block structure */
+    typedef struct YAF_JOURNAL_COMMIT {
+        Yaf_Journal_Header c_header;
+        uint32_t c_crc;     /* crc32c of the descriptor and logged blocks */
+    } Yaf_Journal_Commit;
+
+    #ifndef __KERNEL__
+        #include <assert.h>
+    #endif // __KERNEL__
+    static_assert(sizeof(Yaf_Journal_Desc) == YAF_BLOCK_SIZE);
+
+    /* the smallest journal, which holds the largest transaction */
+    #define YAF_JOURNAL_MIN_BLOCKS  1024
+
+    #ifdef __KERNEL__
+        #include <linux/buffer_head.h>
+        #include <linux/fs.h>
+
+        /* journal credits of a regular metadata operation */
+        #define YAF_JOURNAL_CREDITS     16
+
+        /* interval between the background commits */
+        #define YAF_JOURNAL_INTERVAL    (5 * HZ)
+
+        /* a metadata operation, see yaf_journal_start() */
+        typedef struct YAF_HANDLE {
+            struct YAF_JOURNAL *journal;    /* NULL without a journal */
+            unsigned int credits;           /* blocks reserved */
+            unsigned int used;              /* blocks added */
+            unsigned int nofs;              /* saved allocation scope */
+            bool nested;                    /* inside another handle */
+        } Yaf_Handle;
+
+        /* load the journal of @sb and replay the committed transactions */
+        int yaf_journal_load(struct super_block *sb);
+
+        /* commit, checkpoint and free the journal of @sb */
+        void yaf_journal_destroy(struct super_block *sb);
+
+        /* begin a metadata operation logging up to @credits blocks */
+        int yaf_journal_start(struct super_block *sb, Yaf_Handle *handle,
+                              unsigned int credits);
+
+        /* end the metadata operation begun by yaf_journal_start() */
+        void yaf_journal_stop(Yaf_Handle *handle);
+
+        /* log the modified metadata block @bh in the running transaction */
+        void yaf_journal_dirty(struct super_block *sb,
+                               struct buffer_head *bh);
+
+        /* commit the running transaction and wait for it */
+        int yaf_journal_commit(struct super_block *sb);
+
+        /* commit the running transaction and checkpoint the log */
+        int yaf_journal_flush(struct super_block *sb);
+    #endif // __KERNEL__
+
+#endif // __JOURNAL_H_
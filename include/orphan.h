@@ -0,0 +1,46 @@
+#ifndef __ORPHAN_H_
+
+    #define __ORPHAN_H_
+
+    /*
+     * orphan list
+     *
+     *   on-disk superblock      orphan inode          orphan inode
+     *     ┌──────────┐        ┌──────────────┐      ┌──────────────┐
+     *     │orphan    ├───────►│i_nlink = 0   │  ┌──►│i_nlink = 0   │
+     *     └──────────┘        │i_atime       ├──┘   │i_atime = 0   │
+     *                         └──────────────┘      └──────────────┘
+     *
+     * An inode is put on the orphan list when its last link is dropped,
+     * in the same journal transaction, and taken off it in the one
+     * releasing its data blocks and on-disk inode. So a mount only has
+     * to release the inodes on the list to get back everything an
+     * unclean shutdown leaked, e.g. the blocks of a file deleted while
+     * still open. The whole inode is written along with its link, so
+     * even a file unlinked before its first writeback is a valid orphan.
+     *
+     * The list is mirrored by *orphans* of *Yaf_Fs_Info*. Its entries
+     * are embedded in *Yaf_Inode_Info* and handed over to the
+     * released inodes waiting to be freed on eviction.
+     */
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+        #include "inode.h"
+
+        /* put @inode, which just lost its last link, on the orphan list */
+        void yaf_orphan_add(struct inode *inode);
+
+        /* hand the orphan entry of the evicted @inode over to @yo */
+        void yaf_orphan_move(struct inode *inode, Yaf_Orphan *yo);
+
+        /* take the orphan entry @yo off the orphan list */
+        void yaf_orphan_del(struct super_block *sb, Yaf_Orphan *yo);
+
+        /* fill the on-disk inode @dyi of an orphan @inode */
+        void yaf_orphan_fill(struct inode *inode, Yaf_Inode *dyi);
+
+        /* release the orphans left by an unclean shutdown */
+        int yaf_orphan_recover(struct super_block *sb);
+    #endif // __KERNEL__
+
+#endif // __ORPHAN_H_
@@ -0,0 +1,58 @@
+#ifndef __RESIZE_H_
+
+    #define __RESIZE_H_
+
+    /*
+     * resize
+     *
+     * The data blocks come last, so a grown device only adds data
+     * blocks, but those need their bits in the data bitmap and, with
+     * checksums, their entries in the checksum section, both of which
+     * lie before the inode blocks.
+     *
+     * As long as the data bitmap and checksum blocks have room for
+     * them, the data blocks grow in place by raising *nr_d*, which
+     * YAF_IOC_RESIZE does on a mounted image. Their bits are zero,
+     * as mkfs and yaf-resize zero the whole bitmap blocks.
+     *
+     * Otherwise yaf-resize grows the sections offline. The checksum
+     * and data bitmap sections grow by the blocks they need and shift
+     * the following sections up, i.e. the inode bitmap and the inode
+     * blocks are moved, and the data blocks then starting within the
+     * inode blocks are moved to the new end of the device. Every other
+     * data block stays where it is, only renumbered in the *i_block*
+     * of its inode. The sections may be sized for a larger device
+     * still, so later growth up to it happens online.
+     */
+    #include "bitmap.h"
+    #include "csum.h"
+    #include "super.h"
+
+    /*
+     * Return the number of data blocks @nr_dbp data bitmap blocks and
+     * @nr_c checksum blocks cover, next to the other sections.
+     */
+    static inline uint64_t yaf_resize_capacity(uint32_t nr_ibp,
+                                               uint32_t nr_dbp,
+                                               uint32_t nr_i,
+                                               uint32_t nr_c) {
+        uint64_t nr_d = (uint64_t)nr_dbp * BITS_PER_BLOCK;
+        uint64_t others = (uint64_t)nr_ibp + nr_dbp + nr_i;
+
+        if (nr_c) {
+            uint64_t covered = (uint64_t)nr_c * YAF_CSUMS_PER_BLOCK;
+
+            covered = covered > others ? covered - others : 0;
+            nr_d = covered < nr_d ? covered : nr_d;
+        }
+        return nr_d < ~(uint32_t)0 ? nr_d : ~(uint32_t)0;
+    }
+
+    #ifdef __KERNEL__
+        #include <linux/fs.h>
+
+        /* grow the data blocks of @sb up to the block @bnr in place */
+        int yaf_resize(struct super_block *sb, uint64_t bnr);
+    #endif // __KERNEL__
+
+#endif // __RESIZE_H_
@@ -8,22 +8,82 @@
     /*
      * superblock layout
      *
-     * yaf_sb_info               on-disk superblock
-     * ┌──────┐       ┌──────┬────────────────────────────────┐◄──0  bytes
-     * │nr_ibp◄───────►nr_ibp│number of inode bitmap blocks   │
-     * ├──────┐       ┌──────┼────────────────────────────────┤◄──4  bytes
-     * │nr_dbp◄───────►nr_dbp│number of data bitmap blocks    │
-     * ├──────┐       ┌──────┼────────────────────────────────┤◄──8  bytes
-     * │nr_i  ◄───────►nr_i  │number of inode blocks          │
-     * ├──────┐       ┌──────┼────────────────────────────────┤◄──12 bytes
-     * │nr_d  ◄───────►nr_d  │number of data blocks           │
-     * └──────┘       ┌──────┼────────────────────────────────┤◄──16 bytes
-     *                │      │                                │
-     *                │magic │fill with the magic string "yaf"│
-     *                │      │                                │
-     *                └──────┴────────────────────────────────┘
+     * yaf_sb_info                   on-disk superblock
+     * ┌───────┐       ┌─────────┬────────────────────────────────┐◄──0    bytes
+     * │nr_ibp ◄───────►nr_ibp   │number of inode bitmap blocks   │
+     * ├───────┐       ┌─────────┼────────────────────────────────┤◄──4    bytes
+     * │nr_dbp ◄───────►nr_dbp   │number of data bitmap blocks    │
+     * ├───────┐       ┌─────────┼────────────────────────────────┤◄──8    bytes
+     * │nr_i   ◄───────►nr_i     │number of inode blocks          │
+     * ├───────┐       ┌─────────┼────────────────────────────────┤◄──12   bytes
+     * │nr_d   ◄───────►nr_d     │number of data blocks           │
+     * ├───────┐       ┌─────────┼────────────────────────────────┤◄──16   bytes
+     * │version◄───────►version  │on-disk format version          │
+     * └───────┘       ┌─────────┼────────────────────────────────┤◄──20   bytes
+     *                 │state    │whether it was unmounted cleanly│
+     *                 ├─────────┼────────────────────────────────┤◄──24   bytes
+     *                 │nr_free_i│number of free inodes           │
+     *                 ├─────────┼────────────────────────────────┤◄──28   bytes
+     *                 │nr_free_d│number of free data blocks      │
+     *                 ├─────────┼────────────────────────────────┤◄──32   bytes
+     *                 │nr_j     │number of journal blocks        │
+     *                 ├─────────┼────────────────────────────────┤◄──36   bytes
+     *                 │orphan   │first inode of the orphan list  │
+     *                 ├─────────┼────────────────────────────────┤◄──40   bytes
+     *                 │csum     │crc32c of the superblock        │
+     *                 ├─────────┼────────────────────────────────┤◄──44   bytes
+     *                 │nr_c     │number of checksum blocks       │
+     *                 ├─────────┼────────────────────────────────┤◄──48   bytes
+     *                 │nr_i_init│number of zeroed inode blocks   │
+     *                 ├─────────┼────────────────────────────────┤◄──52   bytes
+     *                 │nr_r     │number of reserved data blocks  │
+     *                 ├─────────┼────────────────────────────────┤◄──56   bytes
+     *                 │         │zero                            │
+     *                 ├─────────┼────────────────────────────────┤◄──4032 bytes
+     *                 │magic    │fill with the magic string "yaf"│
+     *                 └─────────┴────────────────────────────────┘◄──4096 bytes
+     *
+     * Images formatted before the *version* was introduced are filled
+     * with the magic string from byte 16 on, so their *version* reads
+     * as *YAF_VERSION_LEGACY*. Their *state* and free counters are
+     * meaningless and are never written. Likewise *nr_j* is only
+     * meaningful since *YAF_VERSION_JOURNAL*. *orphan* is zero in every
+     * image formatted before it was introduced, i.e. an empty list, so
+     * all but legacy images keep it. *csum* and *nr_c* are only
+     * meaningful since *YAF_VERSION_CSUM*, see csum.h. *nr_i_init* is
+     * only meaningful since *YAF_VERSION_ITABLE_INIT*, see itable.h,
+     * all inode blocks of older images count as zeroed. *nr_r* is
+     * zero, i.e. nothing reserved, in all images formatted before it
+     * was introduced, so all but legacy images keep it like *orphan*.
+     * *YAF_VERSION_COMPACT* follows *YAF_VERSION*, the newest writable
+     * format, and leaves all sections but the inode and data blocks
+     * empty, see compact.h.
+     *
+     * The sizes of all sections are recorded above, so mkfs may pick
+     * any number of inode blocks, see fs.h.
      */
     #define MAGIC "yaf"
+    #define YAF_MAGIC_SIZE      64
+    /* the magic string read as a little-endian uint32_t */
+    #define YAF_MAGIC_NUMBER    0x00666179
+
+    /* on-disk format versions */
+    #define YAF_VERSION_LEGACY      YAF_MAGIC_NUMBER
+    #define YAF_VERSION_COUNTERS    1   /* superblock keeps free counters */
+    #define YAF_VERSION_INODE_EXT   2   /* inodes carry *Yaf_Inode_Ext* */
+    #define YAF_VERSION_JOURNAL     3   /* a journal may follow the
+                                           superblock */
+    #define YAF_VERSION_CSUM        4   /* metadata blocks may carry
+                                           checksums */
+    #define YAF_VERSION_ITABLE_INIT 5   /* the inode blocks may be zeroed
+                                           after mkfs */
+    #define YAF_VERSION             YAF_VERSION_ITABLE_INIT
+    /* a read-only image, never written after mkfs, see compact.h */
+    #define YAF_VERSION_COMPACT     6
+
+    /* on-disk superblock states */
+    #define YAF_STATE_CLEAN     1   /* unmounted cleanly */
+    #define YAF_STATE_MOUNTED   2   /* mounted, or not unmounted cleanly */
 
     #ifdef __KERNEL__
         #include <linux/types.h>
@@ -31,19 +91,106 @@
         #include <stdint.h>
     #endif // __KERNEL__
     typedef struct YAF_SB_INFO {
-        uint32_t nr_ibp; /*number of inode bitmap blocks*/
-        uint32_t nr_dbp; /*number of data bitmap blocks*/
-        uint32_t nr_i;   /*number of inode blocks*/
-        uint32_t nr_d;   /*number of data blocks*/
+        uint32_t nr_ibp;    /*number of inode bitmap blocks*/
+        uint32_t nr_dbp;    /*number of data bitmap blocks*/
+        uint32_t nr_i;      /*number of inode blocks*/
+        uint32_t nr_d;      /*number of data blocks*/
+        uint32_t version;   /*on-disk format version*/
     } Yaf_Sb_Info;
 
     /* on-disk superblock structure */
     typedef struct YAF_SUPERBLOCK {
-        Yaf_Sb_Info yaf_sb_info;
-        char magic[YAF_BLOCK_SIZE - sizeof(Yaf_Sb_Info)];
+        union {
+            struct {
+                Yaf_Sb_Info yaf_sb_info;
+                uint32_t state;     /*whether it was unmounted cleanly*/
+                uint32_t nr_free_i; /*number of free inodes*/
+                uint32_t nr_free_d; /*number of free data blocks*/
+                uint32_t nr_j;      /*number of journal blocks*/
+                uint32_t orphan;    /*first inode of the orphan list*/
+                uint32_t csum;      /*crc32c of the superblock*/
+                uint32_t nr_c;      /*number of checksum blocks*/
+                uint32_t nr_i_init; /*number of zeroed inode blocks*/
+                uint32_t nr_r;      /*number of reserved data blocks*/
+            };
+            char header[YAF_BLOCK_SIZE - YAF_MAGIC_SIZE];
+        };
+        char magic[YAF_MAGIC_SIZE];
     } Yaf_Superblock;
 
-    #define YAF_SB(sb)  ((Yaf_Sb_Info *)(sb->s_fs_info))
+    #ifdef __KERNEL__
+        #include <linux/list.h>
+        #include <linux/llist.h>
+        #include <linux/mutex.h>
+        #include <linux/percpu_counter.h>
+        #include <linux/workqueue.h>
+
+        /* max number of released inodes freed in one bitmap pass */
+        #define YAF_FREE_BATCH  64
+        /* max number of their data blocks, *YAF_IBLOCKS* per inode */
+        #define YAF_FREE_DNOS   (YAF_FREE_BATCH * 8)
+
+        /* max number of inode blocks filled and submitted at once */
+        #define YAF_WB_BATCH    32
+        /* delay of *wb_work* behind the first inode written back */
+        #define YAF_WB_DELAY    (HZ / 10)
+
+        /* in-memory superblock information */
+        typedef struct YAF_FS_INFO {
+            Yaf_Sb_Info yaf_sb_info;            /* host-endian layout */
+            struct percpu_counter nr_free_i;    /* number of free inodes */
+            struct percpu_counter nr_free_d;    /* number of free data
+                                                   blocks */
+
+            uint32_t inode_size;                /* size of the on-disk
+                                                   inode */
+            uint32_t nr_j;                      /* number of journal
+                                                   blocks */
+            uint32_t nr_c;                      /* number of checksum
+                                                   blocks */
+            struct YAF_JOURNAL *journal;        /* NULL without a journal */
+            uint32_t nr_r;                      /* number of data blocks
+                                                   reserved for the
+                                                   privileged users */
+            bool discard;                       /* discard the freed data
+                                                   blocks */
+
+            struct mutex itable_lock;           /* protects the inode
+                                                   blocks from *nr_i_init*
+                                                   on */
+            uint32_t nr_i_init;                 /* number of zeroed inode
+                                                   blocks */
+            unsigned long *itable_zeroed;       /* inode blocks from
+                                                   *nr_i_init* on which
+                                                   keep their content */
+            struct delayed_work itable_work;    /* zeroes the inode blocks
+                                                   from *nr_i_init* on */
+
+            struct mutex resize_lock;           /* serializes the resizes */
+
+            struct mutex orphan_lock;           /* protects *orphans* */
+            struct list_head orphans;           /* the orphan list in
+                                                   on-disk order */
+
+            struct super_block *sb;             /* the owner superblock */
+            struct mutex wb_lock;               /* protects *wb_inodes* */
+            struct list_head wb_inodes;         /* inodes written back but
+                                                   not filled into their
+                                                   inode blocks yet */
+            struct delayed_work wb_work;        /* drains *wb_inodes* */
+            struct workqueue_struct *free_wq;   /* frees released inodes */
+            struct work_struct free_work;       /* drains *free_list* */
+            struct llist_head free_list;        /* released inodes waiting
+                                                   to be freed */
+            struct llist_head free_kept;        /* released inodes failed
+                                                   to be freed */
+            uint32_t free_ino[YAF_FREE_BATCH];  /* *free_work* buffers */
+            uint32_t free_dno[YAF_FREE_DNOS];
+        } Yaf_Fs_Info;
+
+        #define YAF_FS(sb)  ((Yaf_Fs_Info *)(sb->s_fs_info))
+        #define YAF_SB(sb)  (&YAF_FS(sb)->yaf_sb_info)
+    #endif // __KERNEL__
 
     #ifdef __KERNEL__
         #include "yaf.h"
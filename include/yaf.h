@@ -17,9 +17,12 @@
         } while(0)
     #else // __KERNEL__
         #include <stdio.h>
+        /* name of the running tool from glibc, e.g. mkfs */
+        extern char *program_invocation_short_name;
         #define log(level, args...) do { \
             printf(level); \
-            printf("[mkfs(%s:%d)]: ", __FILE__, __LINE__); \
+            printf("[%s(%s:%d)]: ", program_invocation_short_name, \
+                   __FILE__, __LINE__); \
             printf(args); \
             printf(LOG_NONE "\n"); \
         } while(0)
@@ -20,6 +20,7 @@ class Qemu:
 
         self.proc = subprocess.Popen("exec " + command, shell=True,
                                      stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT,
                                      stdin=subprocess.PIPE)
         self.output = ""
         self.outbytes = bytearray()
@@ -77,6 +78,68 @@ class Qemu:
         self.proc.kill()
         self.proc.wait()
 
+class Yaf:
+    '''how to drive the yaf module in the guest, or yaf-fuse on the host'''
+
+    def __init__(self, qemu:Qemu, args:argparse.Namespace):
+        self.qemu = qemu
+        self.fuse = args.fuse
+        self.tools = args.tools
+        self.device = args.image if args.fuse else "/dev/vda"
+
+    def setup(self, timeout:int) -> None:
+        '''log into the guest and insmod the yaf module'''
+        if (self.fuse):
+            return
+        self.qemu.runtil("login:", timeout=timeout)
+        self.qemu.write("root\n")
+        self.qemu.execute("insmod /mnt/shares/yaf.ko")
+
+    def teardown(self, timeout:int) -> None:
+        '''rmmod the yaf module'''
+        if (self.fuse):
+            return
+        self.qemu.execute("rmmod yaf")
+        self.qemu.runtil("cleanup filesystem", timeout=timeout)
+
+    def mkfs(self, options:str = "") -> str:
+        return "%s/mkfs %s %s" % (self.tools, options, self.device)
+
+    def fsck(self, options:str = "") -> str:
+        return "%s/fsck.yaf %s %s" % (self.tools, options, self.device)
+
+    def mount_command(self, options:str = "") -> str:
+        '''the command mounting the device on test, see mount()'''
+        if (self.fuse):
+            return ("%s/yaf-fuse -f %s test & "
+                    "until mountpoint -q test; do sleep 0.1; done"
+                    % (self.tools, self.device))
+        return "mount -t yaf %s /dev/vda test" % options
+
+    def mount(self, options:str = "") -> None:
+        '''mount the device on test, the yaf-fuse one in the background'''
+        self.qemu.execute(self.mount_command(options))
+
+    def umount(self) -> None:
+        '''umount test, waiting for yaf-fuse to write the image'''
+        if (self.fuse):
+            self.qemu.execute("fusermount3 -u test; wait")
+        else:
+            self.qemu.execute("umount test")
+
+def parse_arguments(parser:argparse.ArgumentParser) -> argparse.Namespace:
+    '''add the options choosing between the guest and the host'''
+    parser.add_argument("--fuse", action="store_true",
+                        help="run on the host against yaf-fuse, "
+                             "--command starting the shell instead of qemu")
+    parser.add_argument("--image", action="store",
+                        type=str, default="fuse.img",
+                        help="image file formatted on the host with --fuse")
+    parser.add_argument("--tools", action="store",
+                        type=str, default="/mnt/shares",
+                        help="directory of mkfs, fsck.yaf and yaf-fuse")
+    return parser.parse_args()
+
 if __name__ == "__main__":
     ret = 0
     qemu:Qemu = None
@@ -91,34 +154,48 @@ if __name__ == "__main__":
     parser.add_argument("--timeout", action="store",
                         type=int, default=10,
                         help="max timeout for receiving from guest")
-    args = parser.parse_args()
+    args = parse_arguments(parser)
 
     try:
         # boot up the Qemu
         qemu = Qemu(command=args.command, history=args.history)
+        yaf = Yaf(qemu, args)
         dirs = []
         files = []
-
-        qemu.runtil("login:", timeout=args.timeout)
-        qemu.write("root\n")
+        links = []
 
         # insmod the yaf module
-        qemu.execute("insmod /mnt/shares/yaf.ko")
+        yaf.setup(timeout=args.timeout)
 
-        # format the disk device
-        qemu.execute("/mnt/shares/mkfs /dev/vda")
+        # format the disk device, leaving the inode blocks to the driver
+        if (args.fuse):
+            qemu.execute("truncate -s 1G %s" % (args.image))
+        qemu.execute(yaf.mkfs("--lazy-itable-init -m 5"))
 
         qemu.execute("mkdir -p test")
 
-        # mount the device
-        qemu.execute("mount -t yaf /dev/vda test")
+        # mount the device, which has a journal by default
+        yaf.mount()
+        if (not args.fuse):
+            qemu.execute("echo journal=$(dmesg | grep -c 'journal section')")
+            qemu.runtil("journal=1", timeout=args.timeout)
+            qemu.execute("echo checksum=$(dmesg | grep -c 'checksum section')")
+            qemu.runtil("checksum=1", timeout=args.timeout)
+
+        # only the reserved and root inode are in use
+        qemu.execute("echo used=$(( $(stat -f -c '%c - %d' test) ))")
+        qemu.runtil("used=2", timeout=args.timeout)
+
+        # the reserved data blocks are free but not available
+        qemu.execute("echo reserved=$(( $(stat -f -c '%f - %a' test) > 0 ))")
+        qemu.runtil("reserved=1", timeout=args.timeout)
 
         def check_directory():
             qemu.execute("ls -al test")
 
             # check entrys number
             qemu.execute("ls -al test | wc -l")
-            qemu.runtil(str(len(dirs) + len(files) + 3), timeout=args.timeout)
+            qemu.runtil(str(len(dirs) + len(files) + len(links) + 3), timeout=args.timeout)
 
             # check '.'
             qemu.execute('''ls -al test | grep " \.$" | wc -l''')
@@ -129,8 +206,8 @@ if __name__ == "__main__":
             qemu.runtil("1", timeout=args.timeout)
 
             # check each entrys
-            for name in dirs + files:
-                qemu.execute('''ls -al test | grep " %s$" | wc -l'''%(name))
+            for name in dirs + files + links:
+                qemu.execute('''ls -al test | grep -E " %s( -> .*)?$" | wc -l'''%(name))
                 qemu.runtil("1", timeout=args.timeout)
 
         # add random subdirectorys
@@ -139,6 +216,8 @@ if __name__ == "__main__":
             dirs.append(name)
             qemu.execute("mkdir -p test/%s"%(name))
         check_directory()
+        qemu.execute("echo used=$(( $(stat -f -c '%c - %d' test) ))")
+        qemu.runtil("used=%d"%(len(dirs) + 2), timeout=args.timeout)
 
         # add random files
         for i in range(64 + random.randint(1, 32)):
@@ -192,6 +271,64 @@ if __name__ == "__main__":
             qemu.execute("tail --bytes=+%d test/%s | sha512sum -"%(offset, name))
             qemu.runtil(hashlib.sha512(content[offset-1:].encode("ascii")).hexdigest(), timeout=args.timeout)
 
+        # rename random files, replacing an existing file every other time
+        for i in range(16 + random.randint(1, 16)):
+            src = files.pop(random.randint(0, len(files) - 1))
+            if (i % 2 == 0):
+                dst = files.pop(random.randint(0, len(files) - 1))
+                contents.pop(dst, None)
+            else:
+                dst = "renamed%d"%(i)
+            if src in contents:
+                contents[dst] = contents.pop(src)
+            files.append(dst)
+            qemu.execute("mv test/%s test/%s"%(src, dst))
+
+        # rename random subdirectorys
+        for i in range(8 + random.randint(1, 8)):
+            src = dirs.pop(random.randint(0, len(dirs) - 1))
+            dst = "moved%d"%(i)
+            dirs.append(dst)
+            qemu.execute("mv test/%s test/%s"%(src, dst))
+
+        # move a file into a subdirectory and back
+        qemu.execute("mv test/%s test/%s/"%(files[0], dirs[0]))
+        qemu.execute("mv test/%s/%s test/"%(dirs[0], files[0]))
+        check_directory()
+        check_files()
+
+        # hard link and symlink a file
+        linked = ''.join(random.choice(string.digits) for _ in range(step))
+        slowtarget = "./" * 16 + "linked"
+        qemu.execute('''echo -n "%s" > test/linked'''%(linked))
+        qemu.execute("ln test/linked test/hardlink")
+        qemu.execute("ln -s linked test/fastlink")
+        qemu.execute("ln -s %s test/slowlink"%(slowtarget))
+        links += ["linked", "hardlink", "fastlink", "slowlink"]
+
+        def check_links():
+            qemu.execute("stat -c links=%h test/linked")
+            qemu.runtil("links=2", timeout=args.timeout)
+            qemu.execute("readlink test/fastlink | sed 's/^/target=/'")
+            qemu.runtil("target=linked", timeout=args.timeout)
+            qemu.execute("readlink test/slowlink | sed 's/^/target=/'")
+            qemu.runtil("target=" + slowtarget, timeout=args.timeout)
+            for name in links:
+                qemu.execute("md5sum test/%s"%(name))
+                qemu.runtil(hashlib.md5(linked.encode("ascii")).hexdigest(), timeout=args.timeout)
+        check_links()
+        check_directory()
+
+        # an unlinked file stays readable while it is open
+        opened = ''.join(random.choice(string.digits) for _ in range(step))
+        qemu.execute('''echo -n "%s" > test/opened'''%(opened))
+        qemu.execute("exec 3< test/opened")
+        qemu.execute("rm test/opened")
+        qemu.execute("cat <&3 | sed 's/^/opened=/'")
+        qemu.runtil("opened=" + opened, timeout=args.timeout)
+        qemu.execute("exec 3<&-")
+        check_directory()
+
         # delete test
         qemu.execute("rmdir test")
         qemu.runtil("rmdir: failed to remove 'test': Device or resource busy", timeout=args.timeout)
@@ -208,21 +345,76 @@ if __name__ == "__main__":
                     contents.pop(name)
                 qemu.execute("rm test/%s"%(files.pop(name)))
 
+        # nanosecond timestamps survive the remount
+        qemu.execute("touch -m -d @1577836800.123456789 test/linked")
+
+        # the inode blocks are zeroed in the background meanwhile
+        if (not args.fuse):
+            qemu.execute("until dmesg | grep -q 'inode table is initialized'; do sleep 1; done; "
+                         "echo itable=$(dmesg | grep -c 'inode table is initialized')")
+            qemu.runtil("itable=1", timeout=args.timeout)
+
         # umount the device
-        qemu.execute("umount test")
+        qemu.execute("stat -f -c '%d %f' test > /tmp/statfs")
+        yaf.umount()
 
-        # mount the device again
-        qemu.execute("mount -t yaf /dev/vda test")
+        # mount the device again, the free counters must survive it
+        yaf.mount("-o discard")
+        qemu.execute("stat -f -c '%d %f' test | cmp -s - /tmp/statfs; echo status=$?")
+        qemu.runtil("status=0", timeout=args.timeout)
+        if (not args.fuse):
+            qemu.execute("echo discard=$(grep -c 'yaf .*discard' /proc/mounts)")
+            qemu.runtil("discard=1", timeout=args.timeout)
 
         check_directory()
         check_files()
+        check_links()
+        qemu.execute("stat -c mtime=%.9Y test/linked")
+        qemu.runtil("mtime=1577836800.123456789", timeout=args.timeout)
+
+        # drop the hard link
+        qemu.execute("rm test/hardlink")
+        links.remove("hardlink")
+        qemu.execute("stat -c links=%h test/linked")
+        qemu.runtil("links=1", timeout=args.timeout)
+        qemu.execute("md5sum test/linked")
+        qemu.runtil(hashlib.md5(linked.encode("ascii")).hexdigest(), timeout=args.timeout)
+
+        # trim the free data blocks, the files must survive it
+        if (not args.fuse):
+            qemu.execute("fstrim test; echo fstrim=$?")
+            qemu.runtil("fstrim=0", timeout=args.timeout)
+        check_files()
 
         # umount the device
-        qemu.execute("umount test")
+        yaf.umount()
+
+        # the device must be left consistent
+        qemu.execute(yaf.fsck() + " > /dev/null; echo fsck=$?")
+        qemu.runtil("fsck=0", timeout=args.timeout)
+
+        # copy a tree into a compact image, which only mounts read-only
+        if (not args.fuse):
+            qemu.execute("mkdir -p compact/dir/sub compact/empty")
+            qemu.execute("for i in $(seq 300); do echo $i > compact/dir/f$i; done")
+            qemu.execute("head -c 100000 /dev/urandom > compact/dir/sub/large")
+            qemu.execute("ln compact/dir/f1 compact/hardlink")
+            qemu.execute("ln -s dir/f2 compact/symlink")
+            qemu.execute(yaf.mkfs("--compact -d compact") + " > /dev/null; echo mkfs=$?")
+            qemu.runtil("mkfs=0", timeout=args.timeout)
+            yaf.mount()
+            qemu.execute("diff -r compact test; echo diff=$?")
+            qemu.runtil("diff=0", timeout=args.timeout)
+            qemu.execute("stat -c links=%h test/hardlink")
+            qemu.runtil("links=2", timeout=args.timeout)
+            qemu.execute("touch test/new 2> /dev/null; echo touch=$(( $? != 0 ))")
+            qemu.runtil("touch=1", timeout=args.timeout)
+            qemu.execute("mount -o remount,rw test 2> /dev/null; echo remount=$(( $? != 0 ))")
+            qemu.runtil("remount=1", timeout=args.timeout)
+            yaf.umount()
 
         # remove the yaf module
-        qemu.execute("rmmod yaf")
-        qemu.runtil("cleanup filesystem", timeout=args.timeout)
+        yaf.teardown(timeout=args.timeout)
 
     except:
         traceback.print_exc()
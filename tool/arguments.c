@@ -1,9 +1,85 @@
 #include <argp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/inode.h"
+#include "../include/journal.h"
 #include "../include/yaf.h"
 #include "arguments.h"
 
+/* bounds of the bytes per inode */
+#define BYTES_PER_INODE_MIN     1024
+#define BYTES_PER_INODE_MAX     (64 * 1024 * 1024)
+#define BYTES_PER_INODE_DEFAULT (16 * 1024)
+
+/* max percentage of the data blocks reserved for the privileged users */
+#define RESERVED_PERCENTAGE_MAX 50
+
+/* max number of checking threads */
+#define JOBS_MAX                256
+
+/* number of the most fragmented files listed by default */
+#define WORST_DEFAULT           10
+
+/*
+ * Parse the size @arg in bytes, with an optional K, M, G or T suffix
+ * for KiB, MiB, GiB or TiB, into @size.
+ *
+ * Return 0, or -1 if @arg is not a size.
+ */
+static int parse_size(const char *arg, uint64_t *size) {
+    const char *units = "KMGT";
+    char *end;
+
+    *size = strtoull(arg, &end, 0);
+    if (end == arg) {
+        return -1;
+    }
+    if (*end) {
+        const char *unit = strchr(units, *end);
+
+        if (!unit || end[1]) {
+            return -1;
+        }
+        *size <<= 10 * (unit - units + 1);
+    }
+    return 0;
+}
+
 /* available arguments */
 static struct argp_option options[] = {
+    {"inode-size", 'I', "SIZE", 0,
+     "size of the on-disk inode, 64 for the old format "
+     "with 32-bit sizes and second timestamps, "
+     "or 128 (the default) for 64-bit sizes and nanosecond timestamps"},
+    {"journal-blocks", 'J', "BLOCKS", 0,
+     "number of journal blocks, 0 for no journal or at least 1024, "
+     "by default 1024 on devices of at least 32 MiB"},
+    {"no-checksums", 'C', 0, 0,
+     "format without metadata checksums, "
+     "which are only kept on images with a journal"},
+    {"bytes-per-inode", 'i', "BYTES", 0,
+     "one inode per BYTES bytes of the device, "
+     "between 1024 and 67108864, 16384 by default"},
+    {"inodes", 'N', "NUMBER", 0,
+     "number of inodes, overriding --bytes-per-inode"},
+    {"reserved-percentage", 'm', "PERCENT", 0,
+     "percentage of the data blocks reserved for the privileged users, "
+     "at most 50, 0 by default"},
+    {"lazy-itable-init", 'L', 0, 0,
+     "zero only the first inode block, "
+     "the driver zeroes the others in the background after the mount"},
+    {"root-directory", 'd', "DIR", 0,
+     "copy the files, directories and symlinks below DIR into the image, "
+     "each file contiguous and each directory packed"},
+    {"max-size", 'M', "SIZE", 0,
+     "size the data bitmap and checksum sections for a device of SIZE "
+     "bytes, K, M, G or T suffixed, so the image grows up to it online"},
+    {"compact", 'R', 0, 0,
+     "copy the --root-directory into a read-only image of just the inode "
+     "and data blocks it needs, without bitmaps or journal, "
+     "an image file is truncated to that size"},
     {},
 };
 
@@ -14,6 +90,95 @@ static error_t parse_opt(int key, char *arg,
     long ret = 0;
 
     switch (key) {
+        case 'I':
+            arguments->inode_size = strtoul(arg, NULL, 0);
+            if (arguments->inode_size != yaf_inode_size(YAF_VERSION_COUNTERS)
+                && arguments->inode_size != yaf_inode_size(YAF_VERSION)) {
+                log(LOG_ERR, "inode size %s is neither %d nor %d", arg,
+                    yaf_inode_size(YAF_VERSION_COUNTERS),
+                    yaf_inode_size(YAF_VERSION));
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets inode size to %d",
+                arguments->inode_size);
+            break;
+
+        case 'J':
+            arguments->journal_blocks = strtoul(arg, NULL, 0);
+            if (arguments->journal_blocks &&
+                arguments->journal_blocks < YAF_JOURNAL_MIN_BLOCKS) {
+                log(LOG_ERR, "journal of %s blocks is neither 0 "
+                    "nor at least %d", arg, YAF_JOURNAL_MIN_BLOCKS);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets journal blocks to %ld",
+                arguments->journal_blocks);
+            break;
+
+        case 'C':
+            arguments->checksums = 0;
+            log(LOG_INFO, "parse_opt() disables the checksums");
+            break;
+
+        case 'i':
+            arguments->bytes_per_inode = strtoul(arg, NULL, 0);
+            if (arguments->bytes_per_inode < BYTES_PER_INODE_MIN ||
+                arguments->bytes_per_inode > BYTES_PER_INODE_MAX) {
+                log(LOG_ERR, "%s bytes per inode are not between %d and %d",
+                    arg, BYTES_PER_INODE_MIN, BYTES_PER_INODE_MAX);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets bytes per inode to %d",
+                arguments->bytes_per_inode);
+            break;
+
+        case 'N':
+            arguments->inodes = strtoull(arg, NULL, 0);
+            if (arguments->inodes < 2 || arguments->inodes > UINT32_MAX) {
+                log(LOG_ERR, "%s inodes are not between 2 and %u",
+                    arg, UINT32_MAX);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets inodes to %ld",
+                (long)arguments->inodes);
+            break;
+
+        case 'm':
+            arguments->reserved_percentage = strtoul(arg, NULL, 0);
+            if (arguments->reserved_percentage > RESERVED_PERCENTAGE_MAX) {
+                log(LOG_ERR, "%s percent reserved is more than %d",
+                    arg, RESERVED_PERCENTAGE_MAX);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets reserved percentage to %d",
+                arguments->reserved_percentage);
+            break;
+
+        case 'L':
+            arguments->lazy_itable_init = 1;
+            log(LOG_INFO, "parse_opt() enables the lazy inode table "
+                "initialization");
+            break;
+
+        case 'd':
+            arguments->root_directory = arg;
+            log(LOG_INFO, "parse_opt() sets root directory to %s", arg);
+            break;
+
+        case 'M':
+            if (parse_size(arg, &arguments->max_size)) {
+                log(LOG_ERR, "%s is not a size", arg);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets max size to %lu",
+                (unsigned long)arguments->max_size);
+            break;
+
+        case 'R':
+            arguments->compact = 1;
+            log(LOG_INFO, "parse_opt() enables the compact image");
+            break;
+
         case ARGP_KEY_ARG:
             arguments->device = arg;
             log(LOG_INFO, "parse_opt() sets device to %s", arg);
@@ -24,6 +189,31 @@ static error_t parse_opt(int key, char *arg,
             argp_usage(state);
             break;
 
+        case ARGP_KEY_END:
+            /* a compact image is made of the copied tree only */
+            if (arguments->compact && !arguments->root_directory) {
+                log(LOG_ERR, "compact image needs a root directory");
+                argp_usage(state);
+            }
+            if (arguments->compact &&
+                arguments->inode_size == sizeof(Yaf_Inode)) {
+                log(LOG_ERR, "compact image has 128-byte inodes");
+                argp_usage(state);
+            }
+            /* the 64-byte inode format predates the journal */
+            if (arguments->inode_size == sizeof(Yaf_Inode) &&
+                arguments->journal_blocks > 0) {
+                log(LOG_ERR, "64-byte inode format has no journal");
+                argp_usage(state);
+            }
+            /* as well as the lazy inode table initialization */
+            if (arguments->inode_size == sizeof(Yaf_Inode) &&
+                arguments->lazy_itable_init) {
+                log(LOG_ERR, "64-byte inode format zeroes all inode blocks");
+                argp_usage(state);
+            }
+            break;
+
         default:
             ret = ARGP_ERR_UNKNOWN;
             break;
@@ -41,6 +231,338 @@ static struct argp argp = {
 
 /* parse arguments from *argv* into *arguments* */
 void mkfs_parse_arguments(Arguments *arguments, int argc, char **argv) {
+    arguments->inode_size = yaf_inode_size(YAF_VERSION);
+    arguments->journal_blocks = -1;
+    arguments->checksums = 1;
+    arguments->bytes_per_inode = BYTES_PER_INODE_DEFAULT;
     argp_parse(&argp, argc, argv, 0, 0, arguments);
     assert(arguments->device);
 }
+
+/* available fsck arguments */
+static struct argp_option fsck_options[] = {
+    {"repair", 'y', 0, 0,
+     "repair the problems found, "
+     "otherwise the device is only checked and left untouched"},
+    {"jobs", 'j', "JOBS", 0,
+     "number of checking threads, at most 256, "
+     "by default the number of online processors"},
+    {},
+};
+
+/* parse the fsck arguments */
+static error_t fsck_parse_opt(int key, char *arg,
+                              struct argp_state *state) {
+    Fsck_Arguments *arguments = state->input;
+    long ret = 0;
+
+    switch (key) {
+        case 'y':
+            arguments->repair = 1;
+            log(LOG_INFO, "parse_opt() enables the repair");
+            break;
+
+        case 'j':
+            arguments->jobs = strtoul(arg, NULL, 0);
+            if (!arguments->jobs || arguments->jobs > JOBS_MAX) {
+                log(LOG_ERR, "%s jobs are not between 1 and %d",
+                    arg, JOBS_MAX);
+                argp_usage(state);
+            }
+            log(LOG_INFO, "parse_opt() sets jobs to %u", arguments->jobs);
+            break;
+
+        case ARGP_KEY_ARG:
+            arguments->device = arg;
+            log(LOG_INFO, "parse_opt() sets device to %s", arg);
+            break;
+
+        case ARGP_KEY_NO_ARGS:
+            log(LOG_ERR, "no device specified");
+            argp_usage(state);
+            break;
+
+        default:
+            ret = ARGP_ERR_UNKNOWN;
+            break;
+    }
+
+    return ret;
+}
+
+static struct argp fsck_argp = {
+    .options = fsck_options,
+    .parser = fsck_parse_opt,
+    .doc = "check and repair a yaf linux filesystem",
+    .args_doc = "<device>",
+};
+
+/* parse arguments from *argv* into *arguments* */
+void fsck_parse_arguments(Fsck_Arguments *arguments, int argc, char **argv) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+
+    arguments->jobs = nproc < 1 ? 1 : nproc > JOBS_MAX ? JOBS_MAX : nproc;
+    argp_parse(&fsck_argp, argc, argv, 0, 0, arguments);
+    assert(arguments->device);
+}
+
+/* available yaf-debug arguments */
+static struct argp_option debug_options[] = {
+    {"inode", 'i', "INO", 0,
+     "dump the inode INO, its block mapping and its dentrys"},
+    {"path", 'p', "PATH", 0,
+     "dump the inode at PATH from the root, like --inode"},
+    {"all", 'a', 0, 0, "list every inode in use with its extents"},
+    {"map", 'm', 0, 0, "draw the occupancy maps of both bitmaps"},
+    {"worst", 'w', "NR", 0,
+     "list the NR most fragmented files, 10 by default"},
+    {},
+};
+
+/* parse the yaf-debug arguments */
+static error_t debug_parse_opt(int key, char *arg,
+                               struct argp_state *state) {
+    Debug_Arguments *arguments = state->input;
+    long ret = 0;
+
+    switch (key) {
+        case 'i':
+            arguments->ino = strtoul(arg, NULL, 0);
+            if (arguments->ino == RESERVED_INO) {
+                log(LOG_ERR, "%s is not an inode", arg);
+                argp_usage(state);
+            }
+            break;
+
+        case 'p':
+            arguments->path = arg;
+            break;
+
+        case 'a':
+            arguments->all = 1;
+            break;
+
+        case 'm':
+            arguments->map = 1;
+            break;
+
+        case 'w':
+            arguments->worst = strtoul(arg, NULL, 0);
+            break;
+
+        case ARGP_KEY_ARG:
+            arguments->device = arg;
+            break;
+
+        case ARGP_KEY_NO_ARGS:
+            log(LOG_ERR, "no device specified");
+            argp_usage(state);
+            break;
+
+        default:
+            ret = ARGP_ERR_UNKNOWN;
+            break;
+    }
+
+    return ret;
+}
+
+static struct argp debug_argp = {
+    .options = debug_options,
+    .parser = debug_parse_opt,
+    .doc = "inspect the layout of a yaf linux filesystem",
+    .args_doc = "<device>",
+};
+
+/* parse arguments from *argv* into *arguments* */
+void debug_parse_arguments(Debug_Arguments *arguments, int argc,
+                           char **argv) {
+    arguments->worst = WORST_DEFAULT;
+    argp_parse(&debug_argp, argc, argv, 0, 0, arguments);
+    assert(arguments->device);
+}
+
+/* available yaf-resize arguments */
+static struct argp_option resize_options[] = {
+    {"max-size", 'M', "SIZE", 0,
+     "size the data bitmap and checksum sections for a device of SIZE "
+     "bytes, so the image grows up to it online later"},
+    {},
+};
+
+/* parse the yaf-resize arguments */
+static error_t resize_parse_opt(int key, char *arg,
+                                struct argp_state *state) {
+    Resize_Arguments *arguments = state->input;
+    long ret = 0;
+
+    switch (key) {
+        case 'M':
+            if (parse_size(arg, &arguments->max_size)) {
+                log(LOG_ERR, "%s is not a size", arg);
+                argp_usage(state);
+            }
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                arguments->device = arg;
+            } else if (state->arg_num > 1 ||
+                       parse_size(arg, &arguments->size)) {
+                log(LOG_ERR, "%s is not a size", arg);
+                argp_usage(state);
+            }
+            break;
+
+        case ARGP_KEY_NO_ARGS:
+            log(LOG_ERR, "no device specified");
+            argp_usage(state);
+            break;
+
+        default:
+            ret = ARGP_ERR_UNKNOWN;
+            break;
+    }
+
+    return ret;
+}
+
+static struct argp resize_argp = {
+    .options = resize_options,
+    .parser = resize_parse_opt,
+    .doc = "grow a yaf linux filesystem, unmounted or mounted, to SIZE "
+           "bytes, K, M, G or T suffixed, or to the size of its device",
+    .args_doc = "<device|mountpoint> [SIZE]",
+};
+
+/* parse arguments from *argv* into *arguments* */
+void resize_parse_arguments(Resize_Arguments *arguments, int argc,
+                            char **argv) {
+    argp_parse(&resize_argp, argc, argv, 0, 0, arguments);
+    assert(arguments->device);
+}
+
+/* available yaf-defrag arguments */
+static struct argp_option defrag_options[] = {
+    {"worst", 'w', "NR", 0,
+     "defragment only the NR most fragmented files"},
+    {"dry-run", 'n', 0, 0,
+     "list the fragmented files without defragmenting them"},
+    {},
+};
+
+/* parse the yaf-defrag arguments */
+static error_t defrag_parse_opt(int key, char *arg,
+                                struct argp_state *state) {
+    Defrag_Arguments *arguments = state->input;
+    long ret = 0;
+
+    switch (key) {
+        case 'w':
+            arguments->worst = strtoul(arg, NULL, 0);
+            break;
+
+        case 'n':
+            arguments->dry_run = 1;
+            break;
+
+        case ARGP_KEY_ARG:
+            arguments->path = arg;
+            break;
+
+        case ARGP_KEY_NO_ARGS:
+            log(LOG_ERR, "no mountpoint specified");
+            argp_usage(state);
+            break;
+
+        default:
+            ret = ARGP_ERR_UNKNOWN;
+            break;
+    }
+
+    return ret;
+}
+
+static struct argp defrag_argp = {
+    .options = defrag_options,
+    .parser = defrag_parse_opt,
+    .doc = "move the fragmented files of a mounted yaf linux filesystem "
+           "into consecutive data blocks, most fragmented first",
+    .args_doc = "<mountpoint>",
+};
+
+/* parse arguments from *argv* into *arguments* */
+void defrag_parse_arguments(Defrag_Arguments *arguments, int argc,
+                            char **argv) {
+    argp_parse(&defrag_argp, argc, argv, 0, 0, arguments);
+    assert(arguments->path);
+}
+
+/* available yaf-image arguments */
+static struct argp_option image_options[] = {
+    {"stream", 's', 0, 0,
+     "write the used blocks as a compact stream instead of a sparse "
+     "image"},
+    {"restore", 'r', 0, 0,
+     "restore the stream SOURCE onto the image or device TARGET"},
+    {},
+};
+
+/* parse the yaf-image arguments */
+static error_t image_parse_opt(int key, char *arg,
+                               struct argp_state *state) {
+    Image_Arguments *arguments = state->input;
+    long ret = 0;
+
+    switch (key) {
+        case 's':
+            arguments->stream = 1;
+            break;
+
+        case 'r':
+            arguments->restore = 1;
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                arguments->source = arg;
+            } else if (state->arg_num == 1) {
+                arguments->target = arg;
+            } else {
+                argp_usage(state);
+            }
+            break;
+
+        case ARGP_KEY_END:
+            if (state->arg_num < 2) {
+                log(LOG_ERR, "no source and target specified");
+                argp_usage(state);
+            }
+            if (arguments->stream && arguments->restore) {
+                log(LOG_ERR, "--stream and --restore exclude each other");
+                argp_usage(state);
+            }
+            break;
+
+        default:
+            ret = ARGP_ERR_UNKNOWN;
+            break;
+    }
+
+    return ret;
+}
+
+static struct argp image_argp = {
+    .options = image_options,
+    .parser = image_parse_opt,
+    .doc = "copy only the used blocks of an unmounted yaf linux filesystem "
+           "into a sparse image or a stream, or restore such a stream",
+    .args_doc = "<SOURCE> <TARGET>",
+};
+
+/* parse arguments from *argv* into *arguments* */
+void image_parse_arguments(Image_Arguments *arguments, int argc,
+                           char **argv) {
+    argp_parse(&image_argp, argc, argv, 0, 0, arguments);
+    assert(arguments->source && arguments->target);
+}
@@ -2,12 +2,92 @@
 
     #define __ARGUMENTS_H_
 
+    #include <stdint.h>
+
     typedef struct ARGUMENTS {
         char *device; // path to the device to be used
+        uint32_t inode_size; // size of the on-disk inode
+        int64_t journal_blocks; // number of journal blocks, -1 to decide
+                                // by the device size
+        int checksums;          // whether to checksum the metadata blocks
+        int lazy_itable_init;   // whether to leave zeroing the inode
+                                // blocks to the driver
+        uint32_t bytes_per_inode; // bytes of the device per inode
+        uint64_t inodes;        // number of inodes, 0 to decide by
+                                // *bytes_per_inode*
+        uint32_t reserved_percentage; // percentage of the data blocks
+                                      // reserved for the privileged users
+        char *root_directory;   // directory copied into the new image,
+                                // NULL for an empty one
+        uint64_t max_size;      // bytes the image can grow to in place,
+                                // 0 for the device size
+        int compact;            // whether to copy *root_directory* into
+                                // a compact read-only image
     } Arguments;
 
     /* parse arguments from *argv* into *arguments* */
     void mkfs_parse_arguments(Arguments *arguments,
                               int argc, char *argv[]);
 
+    typedef struct FSCK_ARGUMENTS {
+        char *device;   // path to the device to be checked
+        int repair;     // whether to repair the problems found
+        uint32_t jobs;  // number of checking threads
+    } Fsck_Arguments;
+
+    /* parse arguments from *argv* into *arguments* */
+    void fsck_parse_arguments(Fsck_Arguments *arguments,
+                              int argc, char *argv[]);
+
+    typedef struct DEBUG_ARGUMENTS {
+        char *device;   // path to the device to be inspected
+        uint32_t ino;   // inode to be dumped, 0 for none
+        char *path;     // path of the inode to be dumped, NULL for none
+        int all;        // whether to list every inode in use
+        int map;        // whether to draw the bitmap occupancy maps
+        uint32_t worst; // number of the most fragmented files listed
+    } Debug_Arguments;
+
+    /* parse arguments from *argv* into *arguments* */
+    void debug_parse_arguments(Debug_Arguments *arguments,
+                               int argc, char *argv[]);
+
+    typedef struct RESIZE_ARGUMENTS {
+        char *device;       // path to the device, or the mountpoint of
+                            // a mounted one, to be grown
+        uint64_t size;      // bytes to grow to, 0 for the device size
+        uint64_t max_size;  // bytes the image can grow to in place
+                            // later, 0 for *size*
+    } Resize_Arguments;
+
+    /* parse arguments from *argv* into *arguments* */
+    void resize_parse_arguments(Resize_Arguments *arguments,
+                                int argc, char *argv[]);
+
+    typedef struct DEFRAG_ARGUMENTS {
+        char *path;     // mountpoint, or directory within it, whose
+                        // files are defragmented
+        uint32_t worst; // number of the most fragmented files
+                        // defragmented, 0 for all of them
+        int dry_run;    // whether to only list the fragmented files
+    } Defrag_Arguments;
+
+    /* parse arguments from *argv* into *arguments* */
+    void defrag_parse_arguments(Defrag_Arguments *arguments,
+                                int argc, char *argv[]);
+
+    typedef struct IMAGE_ARGUMENTS {
+        char *source;   // path to the device to be copied, or the
+                        // stream to be restored, - for the standard
+                        // input
+        char *target;   // path to the image or device written, or the
+                        // stream, - for the standard output
+        int stream;     // whether to write a stream instead of an image
+        int restore;    // whether to restore a stream onto *target*
+    } Image_Arguments;
+
+    /* parse arguments from *argv* into *arguments* */
+    void image_parse_arguments(Image_Arguments *arguments,
+                               int argc, char *argv[]);
+
 #endif // __ARGUMENTS_H_
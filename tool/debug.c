@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "../include/fs.h"
+#include "../include/inode.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "arguments.h"
+#include "libyaf.h"
+
+/*
+ * yaf-debug dumps the layout of an unmounted image from the
+ * memory-mapped device: the superblock and its sections, the occupancy
+ * of both bitmaps, single inodes with their block mapping and dentrys,
+ * and the fragmentation of the files and of the free space.
+ *
+ * Only the bitmap blocks, the inode blocks of the inodes in use and
+ * the dumped directories are touched, so the pages of the data blocks
+ * are never faulted in, whatever the size of the image. Like fsck.yaf
+ * the image is mapped privately, so the journal replay stays in memory.
+ */
+
+/* number of cells of an occupancy map row, and rows at most */
+#define MAP_COLUMNS     64
+#define MAP_ROWS        16
+
+/* number of buckets of the free run histogram, by powers of two */
+#define NR_RUN_BUCKETS  32
+
+/* a file listed by --worst */
+typedef struct DEBUG_FILE {
+    uint32_t ino;
+    uint32_t blocks;
+    uint32_t extents;
+} Debug_File;
+
+/* the fragmentation of the files and the free space */
+typedef struct DEBUG_STATS {
+    uint32_t nr_inodes;                     /* inodes in use */
+    uint32_t nr_empty;                      /* of those without blocks */
+    uint32_t extents[YAF_IBLOCKS + 1];      /* files per extent count */
+    uint64_t nr_blocks;                     /* blocks owned by files */
+    uint64_t nr_extents;                    /* extents of all files */
+    uint64_t runs[NR_RUN_BUCKETS];          /* free runs per log2 length */
+    uint64_t run_blocks[NR_RUN_BUCKETS];    /* their free blocks */
+    uint32_t nr_runs;                       /* free runs */
+    uint32_t longest_run;                   /* longest free run */
+    Debug_File *worst;                      /* the most fragmented files */
+    uint32_t nr_worst;
+} Debug_Stats;
+
+/* return a letter for the file type of @mode, like ls */
+static char type_letter(uint32_t mode) {
+    return S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISREG(mode) ? '-'
+                                                                      : '?';
+}
+
+static const char *state_name(uint32_t state) {
+    switch (state) {
+        case YAF_STATE_CLEAN:
+            return "clean";
+        case YAF_STATE_MOUNTED:
+            return "mounted or not unmounted cleanly";
+        default:
+            return "unknown";
+    }
+}
+
+/* dump the superblock and the block ranges of its sections */
+static void dump_super(Yaf_Image *img) {
+    Yaf_Superblock *ysb = img->ysb;
+
+    printf("superblock\n");
+    if (img->version == YAF_VERSION_LEGACY) {
+        printf("  version         legacy\n");
+    } else {
+        printf("  version         %u\n", img->version);
+        printf("  state           %s\n",
+               state_name(le32toh(ysb->state)));
+        printf("  free inodes     %u in the superblock, %u in the bitmap\n",
+               le32toh(ysb->nr_free_i), img->nr_free_i);
+        printf("  free blocks     %u in the superblock, %u in the bitmap\n",
+               le32toh(ysb->nr_free_d), img->nr_free_d);
+        printf("  reserved blocks %u\n", le32toh(ysb->nr_r));
+        printf("  orphan list     %u\n", le32toh(ysb->orphan));
+    }
+    printf("  inode size      %u bytes\n", img->inode_size);
+    printf("  inodes          %u, %u inode blocks zeroed\n",
+           img->nr_inodes, img->nr_i_init);
+    printf("  replayed        %d journal transactions\n", img->nr_replay);
+    printf("  blocks          %lu\n", (unsigned long)img->bnr);
+
+    printf("sections\n");
+    printf("  superblock      %8lu\n", BID_SB_MIN(ysb));
+    if (NR_J(ysb)) {
+        printf("  journal         %8lu - %8lu\n", BID_J_MIN(ysb),
+               BID_J_MAX(ysb));
+    }
+    if (NR_C(ysb)) {
+        printf("  checksums       %8lu - %8lu\n", BID_C_MIN(ysb),
+               BID_C_MAX(ysb));
+    }
+    printf("  inode bitmap    %8lu - %8lu\n", BID_IBP_MIN(ysb),
+           BID_IBP_MAX(ysb));
+    printf("  data bitmap     %8lu - %8lu\n", BID_DBP_MIN(ysb),
+           BID_DBP_MAX(ysb));
+    printf("  inode blocks    %8lu - %8lu\n", BID_I_MIN(ysb), BID_I_MAX(ysb));
+    printf("  data blocks     %8lu - %8lu\n", BID_D_MIN(ysb), BID_D_MAX(ysb));
+}
+
+/* count the bits set within [@from, @to) of the bitmap from @bid on */
+static uint32_t count_bits(Yaf_Image *img, unsigned long bid, uint32_t from,
+                           uint32_t to) {
+    uint32_t count = 0;
+    int64_t idx = from;
+
+    while ((idx = yaf_find_bit(img, bid, idx, to, true)) >= 0) {
+        int64_t end = yaf_find_bit(img, bid, idx, to, false);
+
+        end = end < 0 ? to : end;
+        count += end - idx;
+        idx = end;
+    }
+    return count;
+}
+
+/*
+ * Draw the occupancy of the @nr bits of the bitmap from @bid on, each
+ * cell covering the same number of bits: *.* for none in use, *#* for
+ * all, and 1 to 9 by the share in use otherwise.
+ */
+static void dump_map(Yaf_Image *img, const char *what, unsigned long bid,
+                     uint32_t nr) {
+    uint64_t cells = MAP_COLUMNS * MAP_ROWS;
+    uint32_t span = (nr + cells - 1) / cells;
+
+    printf("%s, %u per cell\n", what, span);
+    for (uint64_t from = 0; from < nr; from += (uint64_t)span * MAP_COLUMNS) {
+        printf("  %10lu ", (unsigned long)from);
+        for (uint64_t cell = from;
+             cell < nr && cell < from + (uint64_t)span * MAP_COLUMNS;
+             cell += span) {
+            uint32_t to = cell + span < nr ? cell + span : nr;
+            uint32_t used = count_bits(img, bid, cell, to);
+
+            putchar(!used ? '.' : used == to - cell
+                    ? '#' : '1' + used * 9 / (to - cell));
+        }
+        putchar('\n');
+    }
+}
+
+/* print the data blocks of @yi as runs of consecutive blocks */
+static void print_extents(Yaf_Image *img, Yaf_Inode *yi) {
+    uint32_t nr = yaf_inode_blocks(img, yi);
+
+    for (uint32_t i = 0, start = 0; i < nr; ++i) {
+        uint32_t dno = le32toh(yi->i_block[i]);
+
+        if (i + 1 < nr && le32toh(yi->i_block[i + 1]) == dno + 1) {
+            continue;
+        }
+        printf(" %u", le32toh(yi->i_block[start]));
+        if (start != i) {
+            printf("-%u", dno);
+        }
+        start = i + 1;
+    }
+}
+
+/* print a dentry, see dump_inode() */
+static int print_dentry(void *arg, const char *name, uint32_t len,
+                        uint32_t ino, uint64_t next) {
+    Yaf_Image *img = arg;
+    Yaf_Inode *yi = yaf_inode(img, ino);
+
+    printf("  %8lu %10u %c %.*s\n",
+           (unsigned long)(next - YAF_DENTRY_SIZE), ino,
+           type_letter(le32toh(yi->i_mode)), (int)len, name);
+    return 0;
+}
+
+/* print the timestamp @ts of an inode with its nanoseconds */
+static void print_time(const char *what, const struct timespec *ts) {
+    char buf[64];
+    struct tm tm;
+
+    strftime(buf, sizeof(buf), "%F %T", localtime_r(&ts->tv_sec, &tm));
+    printf("  %-15s %s.%09ld\n", what, buf, ts->tv_nsec);
+}
+
+/* dump the inode @ino, its block mapping and its dentrys or target */
+static long dump_inode(Yaf_Image *img, uint32_t ino) {
+    Yaf_Inode *yi;
+    struct stat st;
+    uint32_t nr;
+
+    if (ino >= img->nr_inodes) {
+        log(LOG_ERR, "inode %u is beyond the %u inodes", ino,
+            img->nr_inodes);
+        return -EINVAL;
+    }
+    yi = yaf_inode(img, ino);
+    yaf_stat(img, ino, &st);
+    nr = yaf_inode_blocks(img, yi);
+
+    printf("inode %u%s\n", ino,
+           yaf_test_bit(img, BID_IBP_MIN(img->ysb), ino) ? ""
+                                                         : ", not in use");
+    printf("  mode            %c%04o\n", type_letter(st.st_mode),
+           st.st_mode & 07777);
+    printf("  owner           %u:%u\n", st.st_uid, st.st_gid);
+    printf("  links           %lu\n", (unsigned long)st.st_nlink);
+    printf("  size            %lu\n", (unsigned long)st.st_size);
+    print_time("access", &st.st_atim);
+    print_time("modification", &st.st_mtim);
+    print_time("change", &st.st_ctim);
+    printf("  blocks          %u in %u extents\n", nr,
+           yaf_inode_extents(img, yi));
+    for (uint32_t i = 0; i < nr; ++i) {
+        uint32_t dno = le32toh(yi->i_block[i]);
+
+        printf("  i_block[%u]      %u, block %lu\n", i, dno,
+               img->bid_d + dno);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        printf("dentrys\n  %8s %10s\n", "offset", "inode");
+        return yaf_readdir(img, ino, 0, print_dentry, img);
+    }
+    if (S_ISLNK(st.st_mode)) {
+        char target[YAF_BLOCK_SIZE];
+
+        if (yaf_readlink(img, ino, target, sizeof(target)) >= 0) {
+            printf("  target          %s\n", target);
+        }
+    }
+    return 0;
+}
+
+/* find the inode at @path from the root */
+static long resolve(Yaf_Image *img, const char *path, uint32_t *ino) {
+    char *copy = strdup(path), *save, *name;
+    long ret = 0;
+
+    if (!copy) {
+        return -ENOMEM;
+    }
+    *ino = ROOT_INO;
+    for (name = strtok_r(copy, "/", &save); name;
+         name = strtok_r(NULL, "/", &save)) {
+        ret = yaf_lookup(img, *ino, name, ino);
+        if (ret) {
+            log(LOG_ERR, "%s of %s is not found", name, path);
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+/* keep @file among the @arguments->worst most fragmented files */
+static void rank_file(Debug_Stats *stats, Debug_Arguments *arguments,
+                      Debug_File file) {
+    uint32_t i = stats->nr_worst;
+
+    if (i == arguments->worst) {
+        if (!i || stats->worst[i - 1].extents >= file.extents) {
+            return;
+        }
+        --i;
+    } else {
+        ++stats->nr_worst;
+    }
+    for (; i && stats->worst[i - 1].extents < file.extents; --i) {
+        stats->worst[i] = stats->worst[i - 1];
+    }
+    stats->worst[i] = file;
+}
+
+/*
+ * Collect the extents of the inodes in use and the runs of free data
+ * blocks, both bitmaps scanned a word at a time.
+ */
+static void collect(Yaf_Image *img, Debug_Arguments *arguments,
+                    Debug_Stats *stats) {
+    unsigned long ibp = BID_IBP_MIN(img->ysb), dbp = BID_DBP_MIN(img->ysb);
+    int64_t idx = ROOT_INO;
+
+    if (arguments->all) {
+        printf("inodes\n  %10s %4s %10s %6s %7s  %s\n", "inode", "mode",
+               "size", "blocks", "extents", "data blocks");
+    }
+    while ((idx = yaf_find_bit(img, ibp, idx, img->nr_inodes, true)) >= 0) {
+        Yaf_Inode *yi = yaf_inode(img, idx);
+        Debug_File file = {idx, yaf_inode_blocks(img, yi),
+                           yaf_inode_extents(img, yi)};
+
+        ++stats->nr_inodes;
+        if (arguments->all) {
+            printf("  %10u %c%03o %10lu %6u %7u ", file.ino,
+                   type_letter(le32toh(yi->i_mode)),
+                   le32toh(yi->i_mode) & 0777,
+                   (unsigned long)yaf_inode_get_size(img, yi), file.blocks,
+                   file.extents);
+            print_extents(img, yi);
+            putchar('\n');
+        }
+        if (!file.blocks) {
+            ++stats->nr_empty;
+        } else if (file.extents <= YAF_IBLOCKS) {
+            ++stats->extents[file.extents];
+            stats->nr_blocks += file.blocks;
+            stats->nr_extents += file.extents;
+            rank_file(stats, arguments, file);
+        }
+        ++idx;
+    }
+
+    idx = 0;
+    while ((idx = yaf_find_bit(img, dbp, idx, img->nr_d, false)) >= 0) {
+        int64_t end = yaf_find_bit(img, dbp, idx, img->nr_d, true);
+        uint32_t len, bucket;
+
+        end = end < 0 ? img->nr_d : end;
+        len = end - idx;
+        bucket = 31 - __builtin_clz(len);
+        ++stats->runs[bucket];
+        stats->run_blocks[bucket] += len;
+        ++stats->nr_runs;
+        if (len > stats->longest_run) {
+            stats->longest_run = len;
+        }
+        idx = end;
+    }
+}
+
+/* report the fragmentation collected by collect() */
+static void dump_stats(Yaf_Image *img, Debug_Stats *stats) {
+    uint32_t nr_files = stats->nr_inodes - stats->nr_empty;
+
+    printf("files\n");
+    printf("  %u inodes in use, %u of them own %lu data blocks in %lu "
+           "extents\n", stats->nr_inodes, nr_files,
+           (unsigned long)stats->nr_blocks,
+           (unsigned long)stats->nr_extents);
+    if (nr_files) {
+        printf("  %.2f extents per file, %u%% of the files are "
+               "fragmented\n",
+               (double)stats->nr_extents / nr_files,
+               (nr_files - stats->extents[1]) * 100 / nr_files);
+    }
+    printf("  %8s %10s\n", "extents", "files");
+    for (int i = 1; i <= YAF_IBLOCKS; ++i) {
+        if (stats->extents[i]) {
+            printf("  %8d %10u\n", i, stats->extents[i]);
+        }
+    }
+
+    printf("free space\n");
+    printf("  %u free data blocks in %u runs, the longest %u blocks\n",
+           img->nr_free_d, stats->nr_runs, stats->longest_run);
+    printf("  %10s %10s %10s\n", "run", "runs", "blocks");
+    for (int i = 0; i < NR_RUN_BUCKETS; ++i) {
+        if (stats->runs[i]) {
+            printf("  %10lu %10lu %10lu\n", 1ul << i,
+                   (unsigned long)stats->runs[i],
+                   (unsigned long)stats->run_blocks[i]);
+        }
+    }
+
+    if (stats->nr_worst && stats->worst[0].extents > 1) {
+        printf("most fragmented\n  %10s %6s %7s  %s\n", "inode", "blocks",
+               "extents", "data blocks");
+        for (uint32_t i = 0; i < stats->nr_worst; ++i) {
+            Debug_File *file = &stats->worst[i];
+
+            if (file->extents <= 1) {
+                break;
+            }
+            printf("  %10u %6u %7u ", file->ino, file->blocks,
+                   file->extents);
+            print_extents(img, yaf_inode(img, file->ino));
+            putchar('\n');
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Debug_Arguments arguments = {};
+    Debug_Stats stats = {};
+    Yaf_Image img;
+    uint32_t ino;
+    int ret = EXIT_FAILURE;
+
+    debug_parse_arguments(&arguments, argc, argv);
+
+    /* a private mapping keeps the journal replay in memory */
+    if (yaf_image_open(&img, arguments.device, YAF_IMAGE_FORCE)) {
+        goto out;
+    }
+
+    /* a single inode only */
+    if (arguments.ino || arguments.path) {
+        ino = arguments.ino;
+        if (arguments.path && resolve(&img, arguments.path, &ino)) {
+            goto close;
+        }
+        if (!dump_inode(&img, ino)) {
+            ret = EXIT_SUCCESS;
+        }
+        goto close;
+    }
+
+    dump_super(&img);
+    if (arguments.map) {
+        dump_map(&img, "inode bitmap", BID_IBP_MIN(img.ysb), img.nr_inodes);
+        dump_map(&img, "data bitmap", BID_DBP_MIN(img.ysb), img.nr_d);
+    }
+
+    stats.worst = calloc(arguments.worst + 1, sizeof(*stats.worst));
+    if (!stats.worst) {
+        log(LOG_ERR, "calloc() failed");
+        goto close;
+    }
+    collect(&img, &arguments, &stats);
+    dump_stats(&img, &stats);
+    free(stats.worst);
+    ret = EXIT_SUCCESS;
+
+close:
+    yaf_image_close(&img);
+out:
+    return ret;
+}
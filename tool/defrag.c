@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../include/inode.h"
+#include "../include/ioctl.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "arguments.h"
+
+/*
+ * yaf-defrag moves the fragmented files of a mounted image into
+ * consecutive data blocks, see defrag.h.
+ *
+ * The block mapping of each file under the mountpoint is read by the
+ * FIBMAP ioctl, which needs CAP_SYS_RAWIO. The files with the most
+ * runs of consecutive data blocks go first, each through a donor file
+ * next to it, which gets one run from fallocate() and the content of
+ * the file from YAF_IOC_SWAP_BLOCKS. The files stay in use meanwhile,
+ * and the I/O is issued at the idle priority, so it only takes the
+ * disk time left by the other processes.
+ */
+
+/* prefix of the names of the donor files */
+#define DONOR_PREFIX    ".yaf-defrag."
+
+/* a fragmented file found by scan() */
+typedef struct DEFRAG_FILE {
+    char *path;
+    uint32_t blocks;    /* number of data blocks */
+    uint32_t extents;   /* number of runs of consecutive data blocks */
+} Defrag_File;
+
+/* the fragmented files, gathered by scan() as nftw() takes no argument */
+static Defrag_File *files;
+static size_t nr_files, max_files;
+
+static inline uint64_t div_ceil(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+/*
+ * Count the data blocks of the @size bytes of the file @fd into
+ * @blocks and their runs of consecutive blocks into @extents.
+ */
+static long count_extents(int fd, uint64_t size, uint32_t *blocks,
+                          uint32_t *extents) {
+    uint64_t nr = div_ceil(size, YAF_BLOCK_SIZE);
+    int prev = 0;
+
+    *blocks = *extents = 0;
+    for (uint32_t i = 0; i < nr && i < YAF_IBLOCKS; ++i) {
+        int bid = i;
+
+        if (ioctl(fd, FIBMAP, &bid)) {
+            log(LOG_ERR, "ioctl() failed with error %s", strerror(errno));
+            return -errno;
+        }
+        /* the data blocks are a prefix, so a hole ends them */
+        if (!bid) {
+            break;
+        }
+        if (!i || bid != prev + 1) {
+            ++*extents;
+        }
+        ++*blocks;
+        prev = bid;
+    }
+    return 0;
+}
+
+/* remember the regular file @path if it has more than one extent */
+static int scan(const char *path, const struct stat *st, int flag,
+                struct FTW *ftw) {
+    Defrag_File file;
+    long ret;
+    int fd;
+
+    if (flag != FTW_F || !S_ISREG(st->st_mode) ||
+        !strncmp(path + ftw->base, DONOR_PREFIX, strlen(DONOR_PREFIX))) {
+        return 0;
+    }
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        log(LOG_ERR, "open() %s failed with error %s", path,
+            strerror(errno));
+        return 0;
+    }
+    ret = count_extents(fd, st->st_size, &file.blocks, &file.extents);
+    close(fd);
+    /* without FIBMAP no file can be measured */
+    if (ret) {
+        return -ret;
+    }
+    if (file.extents <= 1) {
+        return 0;
+    }
+
+    if (nr_files == max_files) {
+        size_t max = max_files ? 2 * max_files : 64;
+        Defrag_File *more = realloc(files, max * sizeof(Defrag_File));
+
+        if (!more) {
+            log(LOG_ERR, "realloc() failed");
+            return ENOMEM;
+        }
+        files = more;
+        max_files = max;
+    }
+    file.path = strdup(path);
+    if (!file.path) {
+        log(LOG_ERR, "strdup() failed");
+        return ENOMEM;
+    }
+    files[nr_files++] = file;
+    return 0;
+}
+
+/* order the files by extents, then blocks, both descending */
+static int compare_files(const void *a, const void *b) {
+    const Defrag_File *x = a, *y = b;
+
+    if (x->extents != y->extents) {
+        return x->extents < y->extents ? 1 : -1;
+    }
+    return x->blocks < y->blocks ? 1 : x->blocks > y->blocks ? -1 : 0;
+}
+
+/*
+ * Move @file into one run of data blocks through a donor file in its
+ * directory, which is unlinked right away, so it never shows up and
+ * takes the previous data blocks with it when closed.
+ *
+ * A file for which no run better than its current blocks is left
+ * stays as it is.
+ */
+static long defrag_file(Defrag_File *file) {
+    const char *slash = strrchr(file->path, '/');
+    uint32_t blocks, extents, donor_fd;
+    char *donor_path;
+    struct stat st;
+    long ret = 0;
+    int fd, donor;
+
+    fd = open(file->path, O_RDWR | O_NOFOLLOW);
+    if (fd == -1) {
+        log(LOG_ERR, "open() %s failed with error %s", file->path,
+            strerror(errno));
+        return -errno;
+    }
+    if (fstat(fd, &st)) {
+        ret = -errno;
+        log(LOG_ERR, "fstat() failed with error %s", strerror(errno));
+        goto close_fd;
+    }
+
+    if (asprintf(&donor_path, "%.*s/" DONOR_PREFIX "%d",
+                 slash ? (int)(slash - file->path) : 1,
+                 slash ? file->path : ".", getpid()) == -1) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "asprintf() failed");
+        goto close_fd;
+    }
+    donor = open(donor_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (donor == -1) {
+        ret = -errno;
+        log(LOG_ERR, "open() %s failed with error %s", donor_path,
+            strerror(errno));
+        goto free_path;
+    }
+    if (unlink(donor_path)) {
+        ret = -errno;
+        log(LOG_ERR, "unlink() failed with error %s", strerror(errno));
+        goto close_donor;
+    }
+
+    if (fallocate(donor, 0, 0, st.st_size)) {
+        ret = -errno;
+        log(LOG_ERR, "fallocate() failed with error %s", strerror(errno));
+        goto close_donor;
+    }
+    ret = count_extents(donor, st.st_size, &blocks, &extents);
+    if (ret) {
+        goto close_donor;
+    }
+    if (extents >= file->extents) {
+        log(LOG_INFO, "%s: no free run of %u blocks is left", file->path,
+            blocks);
+        goto close_donor;
+    }
+
+    donor_fd = donor;
+    if (ioctl(fd, YAF_IOC_SWAP_BLOCKS, &donor_fd)) {
+        ret = -errno;
+        log(LOG_ERR, "ioctl() %s failed with error %s", file->path,
+            strerror(errno));
+        goto close_donor;
+    }
+    log(LOG_INFO, "%s: %u extents of %u blocks are now %u", file->path,
+        file->extents, file->blocks, extents);
+
+close_donor:
+    close(donor);
+free_path:
+    free(donor_path);
+close_fd:
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    Defrag_Arguments arguments = {};
+    uint32_t nr, nr_failed = 0;
+    struct statfs sfs;
+    int ret;
+
+    defrag_parse_arguments(&arguments, argc, argv);
+
+    if (statfs(arguments.path, &sfs)) {
+        log(LOG_ERR, "statfs() failed with error %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (sfs.f_type != YAF_MAGIC_NUMBER) {
+        log(LOG_ERR, "%s is not within a mounted yaf filesystem",
+            arguments.path);
+        return EXIT_FAILURE;
+    }
+
+    /* stay in the background of the other I/O */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0))) {
+        log(LOG_ERR, "ioprio_set() failed with error %s", strerror(errno));
+    }
+
+    ret = nftw(arguments.path, scan, 16, FTW_PHYS | FTW_MOUNT);
+    if (ret) {
+        log(LOG_ERR, "failed to scan %s with error %s", arguments.path,
+            strerror(ret == -1 ? errno : ret));
+        return EXIT_FAILURE;
+    }
+    qsort(files, nr_files, sizeof(Defrag_File), compare_files);
+
+    nr = nr_files;
+    if (arguments.worst && arguments.worst < nr) {
+        nr = arguments.worst;
+    }
+    for (uint32_t i = 0; i < nr; ++i) {
+        if (arguments.dry_run) {
+            printf("%u\t%u\t%s\n", files[i].extents, files[i].blocks,
+                   files[i].path);
+        } else if (defrag_file(&files[i])) {
+            ++nr_failed;
+        }
+    }
+
+    for (size_t i = 0; i < nr_files; ++i) {
+        free(files[i].path);
+    }
+    free(files);
+
+    if (nr_failed) {
+        log(LOG_ERR, "failed to defragment %u of %u files", nr_failed, nr);
+        return EXIT_FAILURE;
+    }
+    log(LOG_INFO, "%u of %zu fragmented files in %s have been %s", nr,
+        nr_files, arguments.path,
+        arguments.dry_run ? "listed" : "defragmented");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/csum.h"
+#include "../include/inode.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "../include/bitmap.h"
+#include "arguments.h"
+#include "libyaf.h"
+
+/*
+ * fsck.yaf checks the image in five passes over the memory-mapped
+ * device, the parallel ones split into chunks taken by the threads
+ * one after another:
+ *
+ *   1. the inode blocks, in parallel, classify each inode marked used
+ *      in the inode bitmap and check its mode, size and block ids
+ *   2. the directories, in parallel, check their dentrys and count the
+ *      references to each inode atomically, recording the parent of
+ *      each directory
+ *   3. the orphan list
+ *   4. the inodes, in parallel, compare the links with the references
+ *      and claim the blocks of the kept inodes in the rebuilt bitmaps
+ *   5. the rebuilt bitmaps are compared with the on-disk ones a word
+ *      at a time, followed by the free counters in the superblock
+ *
+ * The metadata blocks are checked against their checksums along the
+ * way. Without --repair the image is mapped privately, so even the
+ * journal replay does not reach the device.
+ */
+
+/* exit codes, as those of e2fsck */
+#define FSCK_OK             0   /* no problem found */
+#define FSCK_CORRECTED      1   /* all problems found are repaired */
+#define FSCK_UNCORRECTED    4   /* problems are left */
+#define FSCK_ERROR          8   /* the check itself failed */
+
+/* inode types in *types*, as found by the first pass */
+#define TYPE_FREE   0   /* marked unused in the inode bitmap */
+#define TYPE_REG    1
+#define TYPE_DIR    2
+#define TYPE_LNK    3
+#define TYPE_BAD    4   /* marked used but invalid */
+#define TYPE_MASK   0x7
+#define TYPE_ORPHAN 0x8 /* flag of the inodes on the orphan list */
+
+/* number of inode blocks per chunk of the first pass */
+#define CHUNK_BLOCKS    64
+/* number of inodes per chunk of the other passes */
+#define CHUNK_INODES    4096
+
+/* directories deeper than this are taken as detached from the root */
+#define MAX_DEPTH       65536
+
+#define BITS_PER_WORD   64
+
+typedef struct FSCK {
+    Fsck_Arguments *arguments;
+    Yaf_Image img;          /* the mapped device */
+
+    uint8_t *types;         /* per inode *TYPE_* */
+    uint32_t *refs;         /* per inode number of dentrys to it */
+    uint32_t *entries;      /* per directory number of its dentrys */
+    uint32_t *parents;      /* per directory the directory holding it */
+    uint64_t *ibitmap;      /* rebuilt inode bitmap */
+    uint64_t *dbitmap;      /* rebuilt data bitmap */
+
+    uint64_t nr_fixed;      /* number of problems repaired */
+    uint64_t nr_left;       /* number of problems left */
+} Fsck;
+
+/*
+ * report a problem, which is repaired by the caller if @fixable and
+ * *repair* is set, from any thread
+ */
+#define problem(fsck, fixable, args...) do { \
+    flockfile(stdout); \
+    log(LOG_ERR, args); \
+    funlockfile(stdout); \
+    __atomic_add_fetch((fixable) && (fsck)->arguments->repair \
+                       ? &(fsck)->nr_fixed : &(fsck)->nr_left, \
+                       1, __ATOMIC_RELAXED); \
+} while (0)
+
+/* set the bit @idx of the bitmap @map, returning whether it was set */
+static inline bool set_bit(uint64_t *map, uint64_t idx) {
+    uint64_t mask = (uint64_t)1 << (idx % BITS_PER_WORD);
+
+    return __atomic_fetch_or(&map[idx / BITS_PER_WORD], mask,
+                             __ATOMIC_RELAXED) & mask;
+}
+
+/* test the bit @idx of the little-endian bitmap @map */
+static inline bool test_bit(const uint8_t *map, uint64_t idx) {
+    return map[idx / BITS_PER_BYTE] & (1 << IDX2BEOFF(idx));
+}
+
+/* check the block @bid of @what against its checksum entry, if any */
+static void check_csum(Fsck *fsck, uint64_t bid, const char *what) {
+    Yaf_Superblock *ysb = fsck->img.ysb;
+    uint32_t want;
+
+    if (!NR_C(ysb)) {
+        return;
+    }
+    want = le32toh(((uint32_t *)yaf_block(&fsck->img, BID_C_MIN(ysb)))
+                   [bid - BID_IBP_MIN(ysb)]);
+
+    /* blocks not written since mkfs have no checksum yet */
+    if (!want || want == yaf_csum_block(yaf_block(&fsck->img, bid))) {
+        return;
+    }
+    problem(fsck, true, "%s block %lu does not match its checksum %#x",
+            what, (unsigned long)bid, want);
+    if (fsck->arguments->repair) {
+        yaf_dirty(&fsck->img, yaf_block(&fsck->img, bid));
+    }
+}
+
+/* pass 1: classify and check the used inode @ino */
+static void check_inode(Fsck *fsck, uint32_t ino) {
+    Yaf_Inode *yi = yaf_inode(&fsck->img, ino);
+    uint32_t mode = le32toh(yi->i_mode), nr;
+    uint64_t size = yaf_inode_get_size(&fsck->img, yi), max;
+    uint8_t type;
+
+    if (S_ISREG(mode)) {
+        type = TYPE_REG;
+    } else if (S_ISDIR(mode)) {
+        type = TYPE_DIR;
+    } else if (S_ISLNK(mode)) {
+        type = TYPE_LNK;
+    } else {
+        problem(fsck, true, "inode %u has the invalid mode %#o", ino, mode);
+        fsck->types[ino] = TYPE_BAD;
+        return;
+    }
+
+    nr = yaf_inode_blocks(&fsck->img, yi);
+    if (type == TYPE_LNK && size <= YAF_FAST_SYMLINK_LEN) {
+        fsck->types[ino] = type;
+        return;
+    }
+    for (uint32_t i = 0; i < nr; ++i) {
+        uint32_t dno = le32toh(yi->i_block[i]);
+
+        if (dno >= fsck->img.nr_d) {
+            problem(fsck, true, "inode %u refers to the data block %u "
+                    "out of range", ino, dno);
+            fsck->types[ino] = TYPE_BAD;
+            return;
+        }
+    }
+    /* a slow symlink keeps its target in one data block */
+    if (type == TYPE_LNK && (nr != 1 || size >= YAF_BLOCK_SIZE)) {
+        problem(fsck, true, "symlink %u of %lu bytes has %u blocks",
+                ino, (unsigned long)size, nr);
+        fsck->types[ino] = TYPE_BAD;
+        return;
+    }
+    fsck->types[ino] = type;
+
+    for (uint32_t i = nr; i < YAF_IBLOCKS; ++i) {
+        if (le32toh(yi->i_block[i]) == RESERVED_DNO) {
+            continue;
+        }
+        problem(fsck, true, "inode %u has the stray block id %u "
+                "behind its %u blocks", ino, le32toh(yi->i_block[i]), nr);
+        if (fsck->arguments->repair) {
+            yi->i_block[i] = htole32(RESERVED_DNO);
+            yaf_dirty(&fsck->img, yi);
+        }
+    }
+
+    /* the size is cut down to the blocks, and the dentrys */
+    max = (uint64_t)nr * YAF_BLOCK_SIZE;
+    if (type == TYPE_DIR) {
+        max = size < max ? size - size % YAF_DENTRY_SIZE : max;
+    }
+    if (size > max) {
+        problem(fsck, true, "inode %u of %lu bytes exceeds its %u blocks",
+                ino, (unsigned long)size, nr);
+        if (fsck->arguments->repair) {
+            yi->i_size = htole32(max);
+            if (fsck->img.inode_size > sizeof(Yaf_Inode)) {
+                ((Yaf_Inode_Ext *)(yi + 1))->i_size_hi = 0;
+            }
+            yaf_dirty(&fsck->img, yi);
+        }
+    }
+}
+
+/* pass 1: check the used inodes of the inode blocks within [@from, @to) */
+static void check_inode_blocks(Fsck *fsck, uint64_t from, uint64_t to) {
+    const uint8_t *map = yaf_block(&fsck->img, BID_IBP_MIN(fsck->img.ysb));
+    uint32_t ipb = YAF_BLOCK_SIZE / fsck->img.inode_size;
+
+    for (uint64_t blk = from; blk < to; ++blk) {
+        check_csum(fsck, fsck->img.bid_i + blk, "inode");
+        for (uint32_t ino = blk * ipb; ino < (blk + 1) * ipb; ++ino) {
+            if (ino != RESERVED_INO && test_bit(map, ino)) {
+                check_inode(fsck, ino);
+            }
+        }
+    }
+}
+
+/*
+ * pass 2: check the dentry @yd of the directory @dir
+ *
+ * Return why it is invalid, NULL if it is valid.
+ */
+static const char *check_dentry(Fsck *fsck, uint32_t dir, Yaf_Dentry *yd) {
+    uint32_t ino = le32toh(yd->d_ino);
+    uint32_t len = le32toh(yd->d_name_len), parent = RESERVED_INO;
+
+    if (!len || len > YAF_DENTRY_NAME_LEN ||
+        memchr(yd->d_name, '/', len) || memchr(yd->d_name, '\0', len)) {
+        return "has an invalid name";
+    }
+    if (ino >= fsck->img.nr_inodes) {
+        return "refers to an inode out of range";
+    }
+    switch (fsck->types[ino] & TYPE_MASK) {
+        case TYPE_FREE:
+            return "refers to an unused inode";
+        case TYPE_BAD:
+            return "refers to an invalid inode";
+        case TYPE_DIR:
+            if (ino == ROOT_INO || ino == dir) {
+                return "refers to the root or itself";
+            }
+            /* a directory has one parent, taken by the first dentry */
+            if (!__atomic_compare_exchange_n(&fsck->parents[ino], &parent,
+                                             dir, false, __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED)) {
+                return "is another link to a directory";
+            }
+            break;
+    }
+    return NULL;
+}
+
+/* pass 2: check the dentrys of the directory @dir */
+static void check_dir(Fsck *fsck, uint32_t dir) {
+    Yaf_Inode *yi = yaf_inode(&fsck->img, dir);
+    uint64_t size = yaf_inode_get_size(&fsck->img, yi);
+    uint64_t max = (uint64_t)yaf_inode_blocks(&fsck->img, yi) * YAF_BLOCK_SIZE;
+    uint32_t entries = 0;
+
+    size = size < max ? size - size % YAF_DENTRY_SIZE : max;
+    for (uint64_t off = 0; off < size; off += YAF_BLOCK_SIZE) {
+        uint64_t bid = fsck->img.bid_d +
+                       le32toh(yi->i_block[off / YAF_BLOCK_SIZE]);
+        Yaf_Dentry *yd = yaf_block(&fsck->img, bid);
+
+        check_csum(fsck, bid, "dentry");
+        for (uint32_t i = 0; i < DENTRYS_PER_BLOCK &&
+             off + i * YAF_DENTRY_SIZE < size; ++i, ++yd) {
+            uint32_t ino = le32toh(yd->d_ino);
+            const char *why;
+
+            if (ino == RESERVED_INO) {
+                continue;
+            }
+            why = check_dentry(fsck, dir, yd);
+            if (why) {
+                problem(fsck, true, "dentry %u of directory %u to inode %u "
+                        "%s", (uint32_t)(off / YAF_DENTRY_SIZE) + i, dir, ino,
+                        why);
+                if (fsck->arguments->repair) {
+                    yd->d_ino = htole32(RESERVED_INO);
+                    yaf_dirty(&fsck->img, yd);
+                }
+                continue;
+            }
+            __atomic_add_fetch(&fsck->refs[ino], 1, __ATOMIC_RELAXED);
+            ++entries;
+        }
+    }
+    fsck->entries[dir] = entries;
+}
+
+/* pass 2: check the directories among the inodes within [@from, @to) */
+static void check_dirs(Fsck *fsck, uint64_t from, uint64_t to) {
+    for (uint64_t ino = from; ino < to; ++ino) {
+        if ((fsck->types[ino] & TYPE_MASK) == TYPE_DIR) {
+            check_dir(fsck, ino);
+        }
+    }
+}
+
+/*
+ * pass 3: follow the orphan list, which must only hold used inodes
+ * without links, and cut it before the first one which is not
+ */
+static void check_orphans(Fsck *fsck) {
+    uint32_t *next = &fsck->img.ysb->orphan, ino;
+
+    if (fsck->img.version == YAF_VERSION_LEGACY) {
+        return;
+    }
+
+    while ((ino = le32toh(*next)) != RESERVED_INO) {
+        const char *why = NULL;
+        uint8_t type = ino < fsck->img.nr_inodes ? fsck->types[ino] : TYPE_BAD;
+
+        if ((type & TYPE_MASK) == TYPE_FREE ||
+            (type & TYPE_MASK) == TYPE_BAD) {
+            why = "is not a valid inode";
+        } else if (type & TYPE_ORPHAN) {
+            why = "is listed twice";
+        } else if (yaf_inode(&fsck->img, ino)->i_nlink || fsck->refs[ino]) {
+            why = "still has links";
+        }
+        if (why) {
+            problem(fsck, true, "orphan inode %u %s", ino, why);
+            if (fsck->arguments->repair) {
+                *next = htole32(RESERVED_INO);
+                yaf_dirty(&fsck->img, next);
+            }
+            return;
+        }
+
+        fsck->types[ino] |= TYPE_ORPHAN;
+        next = &yaf_inode(&fsck->img, ino)->i_atime;
+    }
+}
+
+/* pass 4: whether the parents of the directory @dir lead to the root */
+static bool connected(Fsck *fsck, uint32_t dir) {
+    for (uint32_t depth = 0; depth < MAX_DEPTH; ++depth) {
+        dir = fsck->parents[dir];
+        if (dir == ROOT_INO) {
+            return true;
+        }
+        if (dir == RESERVED_INO) {
+            return false;
+        }
+    }
+    return false;
+}
+
+/*
+ * pass 4: check the links of the inode @ino and claim its inode and
+ * data blocks in the rebuilt bitmaps, unless it is released
+ */
+static void check_links(Fsck *fsck, uint32_t ino) {
+    uint8_t type = fsck->types[ino] & TYPE_MASK;
+    bool orphan = fsck->types[ino] & TYPE_ORPHAN;
+    uint32_t refs = fsck->refs[ino], want, nr;
+    Yaf_Inode *yi;
+
+    /* invalid inodes are released, as reported by the first pass */
+    if (type == TYPE_FREE || type == TYPE_BAD) {
+        return;
+    }
+
+    if (ino != ROOT_INO && !refs && !orphan) {
+        /* the entries of a directory would be lost along with it */
+        if (type == TYPE_DIR && fsck->entries[ino]) {
+            problem(fsck, false, "directory %u with %u dentrys is not "
+                    "linked from any directory", ino, fsck->entries[ino]);
+        } else {
+            problem(fsck, true, "inode %u is not linked from any directory",
+                    ino);
+            return;
+        }
+    } else if (type == TYPE_DIR && ino != ROOT_INO && !orphan &&
+               !connected(fsck, ino)) {
+        problem(fsck, false, "directory %u is not connected to the root",
+                ino);
+    }
+
+    yi = yaf_inode(&fsck->img, ino);
+    want = orphan ? 0 : refs + (type == TYPE_DIR ? fsck->entries[ino] : 0) +
+                        (ino == ROOT_INO);
+    if (le32toh(yi->i_nlink) != want) {
+        problem(fsck, true, "inode %u has %u links but %u are found",
+                ino, le32toh(yi->i_nlink), want);
+        if (fsck->arguments->repair) {
+            yi->i_nlink = htole32(want);
+            yaf_dirty(&fsck->img, yi);
+        }
+    }
+
+    set_bit(fsck->ibitmap, ino);
+    nr = yaf_inode_blocks(&fsck->img, yi);
+    for (uint32_t i = 0; i < nr; ++i) {
+        uint32_t dno = le32toh(yi->i_block[i]);
+
+        if (set_bit(fsck->dbitmap, dno)) {
+            problem(fsck, false, "data block %u of inode %u is used by "
+                    "another inode as well", dno, ino);
+        }
+    }
+}
+
+/* pass 4: check the links of the inodes within [@from, @to) */
+static void check_inodes(Fsck *fsck, uint64_t from, uint64_t to) {
+    for (uint64_t ino = from; ino < to; ++ino) {
+        check_links(fsck, ino);
+    }
+}
+
+/* a parallel pass over @nr items, taken *chunk* items at a time */
+typedef struct FSCK_PASS {
+    Fsck *fsck;
+    void (*fn)(Fsck *fsck, uint64_t from, uint64_t to);
+    uint64_t nr;
+    uint64_t chunk;
+    uint64_t next;  /* first item of the next chunk */
+} Fsck_Pass;
+
+/* take the chunks of @arg until none is left */
+static void *pass_worker(void *arg) {
+    Fsck_Pass *pass = arg;
+
+    while (true) {
+        uint64_t from = __atomic_fetch_add(&pass->next, pass->chunk,
+                                           __ATOMIC_RELAXED);
+
+        if (from >= pass->nr) {
+            break;
+        }
+        pass->fn(pass->fsck, from,
+                 from + pass->chunk < pass->nr ? from + pass->chunk
+                                               : pass->nr);
+    }
+    return NULL;
+}
+
+/*
+ * run @fn over the @nr items in chunks of @chunk on *jobs* threads,
+ * the calling one included, so the chunks are all taken even if a
+ * thread cannot be created
+ */
+static void run_pass(Fsck *fsck,
+                     void (*fn)(Fsck *fsck, uint64_t from, uint64_t to),
+                     uint64_t nr, uint64_t chunk) {
+    Fsck_Pass pass = {.fsck = fsck, .fn = fn, .nr = nr, .chunk = chunk};
+    uint32_t jobs = fsck->arguments->jobs, nr_threads = 0;
+    pthread_t threads[jobs];
+
+    for (; nr_threads + 1 < jobs && (nr_threads + 1) * chunk < nr;
+         ++nr_threads) {
+        int ret = pthread_create(&threads[nr_threads], NULL, pass_worker,
+                                 &pass);
+
+        if (ret) {
+            log(LOG_ERR, "pthread_create() failed with error %s",
+                strerror(ret));
+            break;
+        }
+    }
+    pass_worker(&pass);
+    for (uint32_t i = 0; i < nr_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/*
+ * pass 5: compare the on-disk @name bitmap of @nr_blocks blocks from
+ * the block @bid with the rebuilt bitmap @want
+ */
+static void check_bitmap(Fsck *fsck, const char *name, unsigned long bid,
+                         uint32_t nr_blocks, const uint64_t *want) {
+    uint64_t *disk = yaf_block(&fsck->img, bid), leaked = 0, lost = 0;
+    uint64_t words = (uint64_t)nr_blocks * YAF_BLOCK_SIZE / sizeof(*disk);
+
+    for (uint32_t i = 0; i < nr_blocks; ++i) {
+        check_csum(fsck, bid + i, name);
+    }
+
+    /* the bitmaps are little-endian, just like the words on the host */
+    for (uint64_t w = 0; w < words; ++w) {
+        uint64_t diff = disk[w] ^ want[w];
+
+        leaked += __builtin_popcountll(diff & disk[w]);
+        lost += __builtin_popcountll(diff & want[w]);
+    }
+    if (leaked) {
+        problem(fsck, true, "%s bitmap marks %lu unused bits as used",
+                name, (unsigned long)leaked);
+    }
+    if (lost) {
+        problem(fsck, true, "%s bitmap marks %lu used bits as unused",
+                name, (unsigned long)lost);
+    }
+    if (!fsck->arguments->repair || !(leaked || lost)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < nr_blocks; ++i) {
+        void *dst = yaf_block(&fsck->img, bid + i);
+        const void *src = (const uint8_t *)want + (uint64_t)i * YAF_BLOCK_SIZE;
+
+        if (memcmp(dst, src, YAF_BLOCK_SIZE)) {
+            memcpy(dst, src, YAF_BLOCK_SIZE);
+            yaf_dirty(&fsck->img, dst);
+        }
+    }
+}
+
+/* count the bits set in the @nr_blocks blocks of the bitmap @map */
+static uint64_t count_bits(const uint64_t *map, uint32_t nr_blocks) {
+    uint64_t words = (uint64_t)nr_blocks * YAF_BLOCK_SIZE / sizeof(*map);
+    uint64_t nr = 0;
+
+    for (uint64_t w = 0; w < words; ++w) {
+        nr += __builtin_popcountll(map[w]);
+    }
+    return nr;
+}
+
+/*
+ * pass 5: compare the free counters with the rebuilt bitmaps, they are
+ * only trusted after a clean unmount
+ */
+static void check_counters(Fsck *fsck) {
+    Yaf_Superblock *ysb = fsck->img.ysb;
+    uint32_t free_i, free_d;
+
+    if (fsck->img.version == YAF_VERSION_LEGACY) {
+        return;
+    }
+    free_i = fsck->img.nr_inodes -
+             count_bits(fsck->ibitmap, le32toh(ysb->yaf_sb_info.nr_ibp));
+    free_d = fsck->img.nr_d -
+             count_bits(fsck->dbitmap, le32toh(ysb->yaf_sb_info.nr_dbp));
+    log(LOG_INFO, "%u inodes and %u data blocks are free", free_i, free_d);
+
+    if (le32toh(ysb->state) != YAF_STATE_CLEAN) {
+        log(LOG_INFO, "not unmounted cleanly, "
+            "the free counters are recounted by the mount");
+    } else if (le32toh(ysb->nr_free_i) != free_i ||
+               le32toh(ysb->nr_free_d) != free_d) {
+        problem(fsck, true, "superblock counts %u free inodes and %u free "
+                "data blocks", le32toh(ysb->nr_free_i),
+                le32toh(ysb->nr_free_d));
+    }
+    if (fsck->arguments->repair) {
+        fsck->img.nr_free_i = free_i;
+        fsck->img.nr_free_d = free_d;
+    }
+}
+
+/* run all passes over the mapped image */
+static long check(Fsck *fsck) {
+    Yaf_Superblock *ysb = fsck->img.ysb;
+    uint32_t nr_ibp = le32toh(ysb->yaf_sb_info.nr_ibp);
+    uint32_t nr_dbp = le32toh(ysb->yaf_sb_info.nr_dbp);
+
+    if (fsck->img.nr_replay) {
+        log(LOG_INFO, "replayed %d journal transactions",
+            fsck->img.nr_replay);
+    }
+    if (NR_C(ysb) && le32toh(ysb->csum) != yaf_csum_super(ysb)) {
+        problem(fsck, true, "superblock does not match its checksum %#x",
+                le32toh(ysb->csum));
+    }
+
+    fsck->types = calloc(fsck->img.nr_inodes, sizeof(*fsck->types));
+    fsck->refs = calloc(fsck->img.nr_inodes, sizeof(*fsck->refs));
+    fsck->entries = calloc(fsck->img.nr_inodes, sizeof(*fsck->entries));
+    fsck->parents = calloc(fsck->img.nr_inodes, sizeof(*fsck->parents));
+    fsck->ibitmap = calloc(nr_ibp, YAF_BLOCK_SIZE);
+    fsck->dbitmap = calloc(nr_dbp, YAF_BLOCK_SIZE);
+    if (!fsck->types || !fsck->refs || !fsck->entries || !fsck->parents ||
+        !fsck->ibitmap || !fsck->dbitmap) {
+        log(LOG_ERR, "calloc() failed");
+        return -ENOMEM;
+    }
+    set_bit(fsck->ibitmap, RESERVED_INO);
+
+    log(LOG_INFO, "pass 1: checking %u inodes with %u threads",
+        fsck->img.nr_inodes, fsck->arguments->jobs);
+    run_pass(fsck, check_inode_blocks, le32toh(ysb->yaf_sb_info.nr_i),
+             CHUNK_BLOCKS);
+    if ((fsck->types[ROOT_INO] & TYPE_MASK) != TYPE_DIR) {
+        log(LOG_ERR, "root inode is not a valid directory");
+        return -EINVAL;
+    }
+
+    log(LOG_INFO, "pass 2: checking directories");
+    run_pass(fsck, check_dirs, fsck->img.nr_inodes, CHUNK_INODES);
+
+    log(LOG_INFO, "pass 3: checking the orphan list");
+    check_orphans(fsck);
+
+    log(LOG_INFO, "pass 4: checking links and data blocks");
+    run_pass(fsck, check_inodes, fsck->img.nr_inodes, CHUNK_INODES);
+
+    log(LOG_INFO, "pass 5: checking bitmaps and counters");
+    check_bitmap(fsck, "inode", BID_IBP_MIN(ysb), nr_ibp, fsck->ibitmap);
+    check_bitmap(fsck, "data", BID_DBP_MIN(ysb), nr_dbp, fsck->dbitmap);
+    check_counters(fsck);
+
+    /* the mount need not recount what was just counted */
+    if (fsck->arguments->repair && fsck->img.version != YAF_VERSION_LEGACY &&
+        !fsck->nr_left) {
+        ysb->state = htole32(YAF_STATE_CLEAN);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Fsck_Arguments arguments = {};
+    Fsck fsck = {.arguments = &arguments};
+    int ret = FSCK_ERROR;
+
+    fsck_parse_arguments(&arguments, argc, argv);
+
+    /*
+     * Without --repair the image is mapped privately, so the journal
+     * replay and the checks only see their changes in memory.
+     */
+    if (yaf_image_open(&fsck.img, arguments.device,
+                       (arguments.repair ? YAF_IMAGE_RDWR : 0) |
+                       YAF_IMAGE_FORCE)) {
+        goto out;
+    }
+
+    log(LOG_INFO, "check the yaf filesystem on %s with %lu blocks",
+        arguments.device, (unsigned long)fsck.img.bnr);
+    if (check(&fsck)) {
+        goto close;
+    }
+
+    if (fsck.nr_left) {
+        log(LOG_ERR, "%lu problems are left, %lu are repaired",
+            (unsigned long)fsck.nr_left, (unsigned long)fsck.nr_fixed);
+        ret = FSCK_UNCORRECTED;
+    } else if (fsck.nr_fixed) {
+        log(LOG_INFO, "%lu problems are repaired",
+            (unsigned long)fsck.nr_fixed);
+        ret = FSCK_CORRECTED;
+    } else {
+        log(LOG_INFO, "%s is clean", arguments.device);
+        ret = FSCK_OK;
+    }
+
+close:
+    /* a repair is written along with the checksums of what it touched */
+    if (yaf_image_close(&fsck.img)) {
+        ret = FSCK_ERROR;
+    }
+    free(fsck.types);
+    free(fsck.refs);
+    free(fsck.entries);
+    free(fsck.parents);
+    free(fsck.ibitmap);
+    free(fsck.dbitmap);
+out:
+    return ret;
+}
@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+#include <endian.h>
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "../include/inode.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "libyaf.h"
+
+/*
+ * yaf-fuse mounts a yaf image through the low-level FUSE interface on
+ * top of libyaf, so the on-disk format and the semantics of the driver
+ * can be tested and profiled on a host without booting a kernel.
+ *
+ * The FUSE inode numbers are the yaf ones, *ROOT_INO* being the FUSE
+ * root as well. The requests are served by several threads, the reads
+ * sharing the image and the modifications taking it exclusively, while
+ * the kernel caches the written pages with the writeback cache.
+ *
+ * As in the driver, an inode without links stays on the orphan list
+ * until the kernel forgets its last lookup, so an unlinked file stays
+ * readable while it is open. The checksums, the free counters and the
+ * superblock are brought up to date on fsync(2) and on the unmount.
+ */
+
+/* seconds the kernel may cache the attributes and the dentrys */
+#define YAF_FUSE_TIMEOUT    1.0
+
+typedef struct YAF_FUSE {
+    Yaf_Image img;
+    pthread_rwlock_t lock;  /* shared by the reads, exclusive otherwise */
+    uint64_t *nlookup;      /* per inode the lookups known to the kernel */
+} Yaf_Fuse;
+
+/* return the *Yaf_Fuse* of the request @req */
+static inline Yaf_Fuse *yaf_fuse(fuse_req_t req) {
+    return fuse_req_userdata(req);
+}
+
+/* whether @ino is an inode number of the image */
+static inline bool valid_ino(Yaf_Fuse *yf, fuse_ino_t ino) {
+    return ino != RESERVED_INO && ino < yf->img.nr_inodes;
+}
+
+/* release the inode @ino once it has neither links nor lookups */
+static void try_evict(Yaf_Fuse *yf, uint32_t ino) {
+    if (!yf->nlookup[ino] && !le32toh(yaf_inode(&yf->img, ino)->i_nlink)) {
+        yaf_evict(&yf->img, ino);
+    }
+}
+
+/*
+ * Release the inodes left on the orphan list, by an unclean shutdown
+ * at the mount or by the forgotten lookups at the unmount. A list
+ * broken by a corrupted inode is cut off, leaving it to fsck.yaf.
+ */
+static void release_orphans(Yaf_Image *img) {
+    while (img->ysb->orphan != htole32(RESERVED_INO)) {
+        uint32_t ino = le32toh(img->ysb->orphan);
+
+        if (ino >= img->nr_inodes || le32toh(yaf_inode(img, ino)->i_nlink)) {
+            log(LOG_ERR, "the orphan list is broken at inode %u", ino);
+            img->ysb->orphan = htole32(RESERVED_INO);
+            break;
+        }
+        yaf_evict(img, ino);
+    }
+}
+
+/* reply the new lookup of @ino to @req, counting it */
+static void reply_entry(fuse_req_t req, uint32_t ino) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    struct fuse_entry_param e = {
+        .ino = ino,
+        .attr_timeout = YAF_FUSE_TIMEOUT,
+        .entry_timeout = YAF_FUSE_TIMEOUT,
+    };
+
+    yaf_stat(&yf->img, ino, &e.attr);
+    __atomic_fetch_add(&yf->nlookup[ino], 1, __ATOMIC_RELAXED);
+    fuse_reply_entry(req, &e);
+}
+
+/* ask for the writeback cache, so the kernel merges the small writes */
+static void yaf_fuse_init(void *userdata, struct fuse_conn_info *conn) {
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+}
+
+/* release the orphans after the unmount, like the driver on evict */
+static void yaf_fuse_destroy(void *userdata) {
+    Yaf_Fuse *yf = userdata;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    release_orphans(&yf->img);
+    if (yf->img.version != YAF_VERSION_LEGACY) {
+        yf->img.ysb->state = htole32(YAF_STATE_CLEAN);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+}
+
+static void yaf_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
+                            const char *name) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&yf->lock);
+    ret = yaf_lookup(&yf->img, parent, name, &ino);
+    if (!ret && !valid_ino(yf, ino)) {
+        ret = -EIO;
+    }
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        reply_entry(req, ino);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+}
+
+static void yaf_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+                            uint64_t nlookup) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+
+    pthread_rwlock_wrlock(&yf->lock);
+    yf->nlookup[ino] -= nlookup;
+    try_evict(yf, ino);
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_none(req);
+}
+
+static void yaf_fuse_forget_multi(fuse_req_t req, size_t count,
+                                  struct fuse_forget_data *forgets) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+
+    pthread_rwlock_wrlock(&yf->lock);
+    for (size_t i = 0; i < count; ++i) {
+        yf->nlookup[forgets[i].ino] -= forgets[i].nlookup;
+        try_evict(yf, forgets[i].ino);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_none(req);
+}
+
+static void yaf_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    struct stat st;
+
+    pthread_rwlock_rdlock(&yf->lock);
+    yaf_stat(&yf->img, ino, &st);
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_attr(req, &st, YAF_FUSE_TIMEOUT);
+}
+
+static void yaf_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
+                             struct stat *attr, int to_set,
+                             struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    Yaf_Inode *yi;
+    struct stat st;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    yi = yaf_inode(&yf->img, ino);
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        ret = yaf_truncate(&yf->img, ino, attr->st_size);
+        if (ret) {
+            goto unlock;
+        }
+    }
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        yi->i_mode = htole32((le32toh(yi->i_mode) & S_IFMT) |
+                             (attr->st_mode & ~S_IFMT));
+    }
+    if (to_set & FUSE_SET_ATTR_UID) {
+        yi->i_uid = htole32(attr->st_uid);
+    }
+    if (to_set & FUSE_SET_ATTR_GID) {
+        yi->i_gid = htole32(attr->st_gid);
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        yaf_inode_stamp(&yf->img, ino, YAF_ATIME);
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+        yaf_inode_set_time(&yf->img, ino, YAF_ATIME, &attr->st_atim);
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        yaf_inode_stamp(&yf->img, ino, YAF_MTIME);
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        yaf_inode_set_time(&yf->img, ino, YAF_MTIME, &attr->st_mtim);
+    }
+#ifdef FUSE_SET_ATTR_CTIME
+    if (to_set & FUSE_SET_ATTR_CTIME) {
+        yaf_inode_set_time(&yf->img, ino, YAF_CTIME, &attr->st_ctim);
+    } else
+#endif
+    {
+        yaf_inode_stamp(&yf->img, ino, YAF_CTIME);
+    }
+    yaf_stat(&yf->img, ino, &st);
+
+unlock:
+    pthread_rwlock_unlock(&yf->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &st, YAF_FUSE_TIMEOUT);
+    }
+}
+
+static void yaf_fuse_readlink(fuse_req_t req, fuse_ino_t ino) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    char target[YAF_BLOCK_SIZE];
+    ssize_t ret;
+
+    pthread_rwlock_rdlock(&yf->lock);
+    ret = yaf_readlink(&yf->img, ino, target, sizeof(target));
+    pthread_rwlock_unlock(&yf->lock);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_readlink(req, target);
+    }
+}
+
+/* create @name of @mode in @parent, or a symlink to @target */
+static void create_inode(fuse_req_t req, fuse_ino_t parent,
+                         const char *name, mode_t mode, const char *target,
+                         struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    if (target) {
+        ret = yaf_symlink(&yf->img, parent, name, target, ctx->uid,
+                          ctx->gid, &ino);
+    } else {
+        ret = yaf_create(&yf->img, parent, name, mode, ctx->uid, ctx->gid,
+                         &ino);
+    }
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else if (fi) {
+        struct fuse_entry_param e = {
+            .ino = ino,
+            .attr_timeout = YAF_FUSE_TIMEOUT,
+            .entry_timeout = YAF_FUSE_TIMEOUT,
+        };
+
+        yaf_stat(&yf->img, ino, &e.attr);
+        ++yf->nlookup[ino];
+        fi->keep_cache = 1;
+        fuse_reply_create(req, &e, fi);
+    } else {
+        reply_entry(req, ino);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+}
+
+/* the driver has regular files, directories and symlinks only */
+static void yaf_fuse_mknod(fuse_req_t req, fuse_ino_t parent,
+                           const char *name, mode_t mode, dev_t rdev) {
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    create_inode(req, parent, name, mode, NULL, NULL);
+}
+
+static void yaf_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
+                           const char *name, mode_t mode) {
+    create_inode(req, parent, name, S_IFDIR | (mode & ~S_IFMT), NULL, NULL);
+}
+
+static void yaf_fuse_symlink(fuse_req_t req, const char *link,
+                             fuse_ino_t parent, const char *name) {
+    create_inode(req, parent, name, S_IFLNK | 0777, link, NULL);
+}
+
+static void yaf_fuse_create(fuse_req_t req, fuse_ino_t parent,
+                            const char *name, mode_t mode,
+                            struct fuse_file_info *fi) {
+    create_inode(req, parent, name, S_IFREG | (mode & ~S_IFMT), NULL, fi);
+}
+
+static void yaf_fuse_link(fuse_req_t req, fuse_ino_t ino,
+                          fuse_ino_t newparent, const char *newname) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    int ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    ret = yaf_link(&yf->img, ino, newparent, newname);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        reply_entry(req, ino);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+}
+
+/* remove @name from @parent, a directory if @rmdir is set */
+static void remove_inode(fuse_req_t req, fuse_ino_t parent,
+                         const char *name, bool rmdir) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    if (rmdir) {
+        ret = yaf_rmdir(&yf->img, parent, name, &ino);
+    } else {
+        ret = yaf_unlink(&yf->img, parent, name, &ino);
+    }
+    if (!ret) {
+        try_evict(yf, ino);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static void yaf_fuse_unlink(fuse_req_t req, fuse_ino_t parent,
+                            const char *name) {
+    remove_inode(req, parent, name, false);
+}
+
+static void yaf_fuse_rmdir(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+    remove_inode(req, parent, name, true);
+}
+
+static void yaf_fuse_rename(fuse_req_t req, fuse_ino_t parent,
+                            const char *name, fuse_ino_t newparent,
+                            const char *newname, unsigned int flags) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    uint32_t gone;
+    int ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    ret = yaf_rename(&yf->img, parent, name, newparent, newname, flags,
+                     &gone);
+    if (!ret && gone != RESERVED_INO) {
+        try_evict(yf, gone);
+    }
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_err(req, -ret);
+}
+
+/* no one else modifies the image, so the cached pages stay valid */
+static void yaf_fuse_open(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void yaf_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    char *buf = malloc(size);
+    ssize_t ret;
+
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    pthread_rwlock_rdlock(&yf->lock);
+    ret = yaf_read(&yf->img, ino, buf, size, off);
+    pthread_rwlock_unlock(&yf->lock);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, buf, ret);
+    }
+    free(buf);
+}
+
+static void yaf_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                           size_t size, off_t off,
+                           struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    ssize_t ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    ret = yaf_write(&yf->img, ino, buf, size, off);
+    pthread_rwlock_unlock(&yf->lock);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+}
+
+/* write the whole image, as the driver commits the whole journal */
+static void yaf_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                           struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    int ret;
+
+    pthread_rwlock_wrlock(&yf->lock);
+    ret = yaf_image_sync(&yf->img);
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_err(req, -ret);
+}
+
+/* the state of a readdir() of yaf_fuse_readdir() */
+typedef struct YAF_FUSE_DIR {
+    fuse_req_t req;
+    Yaf_Image *img;
+    char *buf;
+    size_t size;            /* size of *buf* */
+    size_t pos;             /* bytes of *buf* filled */
+} Yaf_Fuse_Dir;
+
+/* add a dentry to the reply, the next one resuming at @next */
+static int add_dentry(void *arg, const char *name, uint32_t len,
+                      uint32_t ino, uint64_t next) {
+    Yaf_Fuse_Dir *dir = arg;
+    char dname[YAF_DENTRY_NAME_LEN + 1];
+    struct stat st = {.st_ino = ino};
+    size_t size;
+
+    memcpy(dname, name, len);
+    dname[len] = '\0';
+    if (ino < dir->img->nr_inodes) {
+        st.st_mode = le32toh(yaf_inode(dir->img, ino)->i_mode);
+    }
+
+    /* the offsets follow those of the driver, behind *.* and *..* */
+    size = fuse_add_direntry(dir->req, dir->buf + dir->pos,
+                             dir->size - dir->pos, dname, &st, next + 2);
+    if (size > dir->size - dir->pos) {
+        return 1;
+    }
+    dir->pos += size;
+    return 0;
+}
+
+static void yaf_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, struct fuse_file_info *fi) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    Yaf_Fuse_Dir dir = {
+        .req = req,
+        .img = &yf->img,
+        .buf = malloc(size),
+        .size = size,
+    };
+    struct stat st = {.st_ino = ino, .st_mode = S_IFDIR};
+    int ret = 0;
+
+    if (!dir.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* yaf keeps no *.* and *..* on the disk */
+    if (off < 1) {
+        dir.pos += fuse_add_direntry(req, dir.buf, size, ".", &st, 1);
+    }
+    if (off < 2) {
+        dir.pos += fuse_add_direntry(req, dir.buf + dir.pos,
+                                     size - dir.pos, "..", &st, 2);
+    }
+
+    pthread_rwlock_rdlock(&yf->lock);
+    ret = yaf_readdir(&yf->img, ino, off > 2 ? off - 2 : 0, add_dentry,
+                      &dir);
+    pthread_rwlock_unlock(&yf->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, dir.buf, dir.pos);
+    }
+    free(dir.buf);
+}
+
+static void yaf_fuse_statfs(fuse_req_t req, fuse_ino_t ino) {
+    Yaf_Fuse *yf = yaf_fuse(req);
+    Yaf_Image *img = &yf->img;
+    struct statvfs st = {
+        .f_bsize = YAF_BLOCK_SIZE,
+        .f_frsize = YAF_BLOCK_SIZE,
+        .f_namemax = YAF_DENTRY_NAME_LEN,
+    };
+    uint32_t nr_r;
+
+    pthread_rwlock_rdlock(&yf->lock);
+    nr_r = img->version == YAF_VERSION_LEGACY ? 0 : le32toh(img->ysb->nr_r);
+    st.f_blocks = img->nr_d;
+    st.f_bfree = img->nr_free_d;
+    st.f_bavail = img->nr_free_d > nr_r ? img->nr_free_d - nr_r : 0;
+    st.f_files = img->nr_inodes;
+    st.f_ffree = img->nr_free_i;
+    st.f_favail = img->nr_free_i;
+    pthread_rwlock_unlock(&yf->lock);
+    fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops yaf_fuse_ops = {
+    .init = yaf_fuse_init,
+    .destroy = yaf_fuse_destroy,
+    .lookup = yaf_fuse_lookup,
+    .forget = yaf_fuse_forget,
+    .forget_multi = yaf_fuse_forget_multi,
+    .getattr = yaf_fuse_getattr,
+    .setattr = yaf_fuse_setattr,
+    .readlink = yaf_fuse_readlink,
+    .mknod = yaf_fuse_mknod,
+    .mkdir = yaf_fuse_mkdir,
+    .symlink = yaf_fuse_symlink,
+    .create = yaf_fuse_create,
+    .link = yaf_fuse_link,
+    .unlink = yaf_fuse_unlink,
+    .rmdir = yaf_fuse_rmdir,
+    .rename = yaf_fuse_rename,
+    .open = yaf_fuse_open,
+    .read = yaf_fuse_read,
+    .write = yaf_fuse_write,
+    .fsync = yaf_fuse_fsync,
+    .fsyncdir = yaf_fuse_fsync,
+    .readdir = yaf_fuse_readdir,
+    .statfs = yaf_fuse_statfs,
+};
+
+/* take the first argument which is no option as the image */
+static int parse_image(void *data, const char *arg, int key,
+                       struct fuse_args *outargs) {
+    const char **image = data;
+
+    if (key == FUSE_OPT_KEY_NONOPT && !*image) {
+        *image = arg;
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts = {};
+    struct fuse_session *se = NULL;
+    const char *image = NULL;
+    Yaf_Fuse yf = {};
+    int ret = EXIT_FAILURE;
+
+    if (fuse_opt_parse(&args, &image, NULL, parse_image) ||
+        fuse_parse_cmdline(&args, &opts)) {
+        goto free;
+    }
+    if (opts.show_help || !image || !opts.mountpoint) {
+        printf("usage: %s [options] <image> <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = opts.show_help ? EXIT_SUCCESS : EXIT_FAILURE;
+        goto free;
+    }
+    if (opts.show_version) {
+        fuse_lowlevel_version();
+        ret = EXIT_SUCCESS;
+        goto free;
+    }
+
+    if (yaf_image_open(&yf.img, image, YAF_IMAGE_RDWR)) {
+        goto free;
+    }
+    yf.nlookup = calloc(yf.img.nr_inodes, sizeof(*yf.nlookup));
+    if (!yf.nlookup) {
+        log(LOG_ERR, "calloc() failed");
+        goto close;
+    }
+    pthread_rwlock_init(&yf.lock, NULL);
+
+    /* like the driver, recount on the next mount if this one crashes */
+    release_orphans(&yf.img);
+    if (yf.img.version != YAF_VERSION_LEGACY) {
+        yf.img.ysb->state = htole32(YAF_STATE_MOUNTED);
+    }
+    if (yaf_image_sync(&yf.img)) {
+        goto close;
+    }
+
+    se = fuse_session_new(&args, &yaf_fuse_ops, sizeof(yaf_fuse_ops), &yf);
+    if (!se) {
+        goto close;
+    }
+    if (fuse_set_signal_handlers(se)) {
+        goto destroy;
+    }
+    if (fuse_session_mount(se, opts.mountpoint)) {
+        goto remove;
+    }
+    fuse_daemonize(opts.foreground);
+
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        ret = fuse_session_loop_mt(se, opts.clone_fd);
+    }
+    ret = ret ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    fuse_session_unmount(se);
+remove:
+    fuse_remove_signal_handlers(se);
+destroy:
+    fuse_session_destroy(se);
+close:
+    if (yaf_image_close(&yf.img)) {
+        ret = EXIT_FAILURE;
+    }
+    free(yf.nlookup);
+free:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret;
+}
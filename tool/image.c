@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/bitmap.h"
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/inode.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "arguments.h"
+#include "libyaf.h"
+
+/*
+ * yaf-image copies an unmounted image without its unused blocks.
+ *
+ * The copied blocks are the superblock, the journal superblock with
+ * the first log block, the checksum and bitmap sections, the inode
+ * blocks either zeroed by mkfs or holding an inode in use, and the
+ * data blocks marked in the data bitmap. The journal is replayed in
+ * the private mapping first, so the copy needs no log, and the first
+ * log block, which no longer starts a transaction to replay, keeps a
+ * stale one on the target from being replayed.
+ *
+ * They are written either into a sparse image, leaving holes for the
+ * others, or into a stream of runs of consecutive blocks behind a
+ * header, which --restore writes back with one pwrite() per run. The
+ * gaps shorter than *GAP_MAX* blocks are copied along, so the runs
+ * stay long at the cost of a few unused blocks.
+ */
+
+/* the magic string of a stream */
+#define IMAGE_MAGIC     "yafimage"
+
+/* the format version of a stream */
+#define IMAGE_VERSION   1
+
+/* shortest gap between two runs of copied blocks */
+#define GAP_MAX         16
+
+/* number of blocks of a run at most */
+#define RUN_MAX         2048
+
+/* the header of a stream */
+typedef struct IMAGE_HEADER {
+    char magic[8];          /* *IMAGE_MAGIC* */
+    uint32_t version;       /* *IMAGE_VERSION* */
+    uint32_t block_size;    /* *YAF_BLOCK_SIZE* */
+    uint64_t bnr;           /* number of blocks of the image */
+} Image_Header;
+
+/* a run of blocks within a stream, followed by their content */
+typedef struct IMAGE_RUN {
+    uint64_t bid;           /* first block */
+    uint32_t nr;            /* number of blocks, 0 ends the stream */
+    uint32_t crc;           /* crc32c of their content */
+} Image_Run;
+
+/* whether the metadata block @bid of @img is copied */
+static bool meta_used(Yaf_Image *img, uint64_t bid) {
+    Yaf_Superblock *ysb = img->ysb;
+    uint32_t per_block = INODES_PER_BLOCK(ysb), ino;
+
+    if (bid == BID_SB_MIN(ysb) || (bid >= BID_C_MIN(ysb) &&
+                                   bid <= BID_DBP_MAX(ysb))) {
+        return true;
+    }
+    if (bid >= BID_J_MIN(ysb) && bid <= BID_J_MAX(ysb)) {
+        return bid - BID_J_MIN(ysb) <= 1;
+    }
+
+    /* an inode block beyond *nr_i_init* only counts with an inode in use */
+    if (bid - img->bid_i < img->nr_i_init) {
+        return true;
+    }
+    ino = (bid - img->bid_i) * per_block;
+    return ino < img->nr_inodes &&
+           yaf_find_bit(img, BID_IBP_MIN(ysb), ino,
+                        ino + per_block < img->nr_inodes ?
+                        ino + per_block : img->nr_inodes, true) >= 0;
+}
+
+/* return the first block from @bid on which is @used, or the end */
+static uint64_t next_block(Yaf_Image *img, uint64_t bid, bool used) {
+    int64_t dno;
+
+    while (bid < img->bid_d && meta_used(img, bid) != used) {
+        ++bid;
+    }
+    if (bid < img->bid_d || bid >= img->bid_d + img->nr_d) {
+        return bid < img->bid_d || !used ? bid : img->bnr;
+    }
+
+    dno = yaf_find_bit(img, BID_DBP_MIN(img->ysb), bid - img->bid_d,
+                       img->nr_d, used);
+    if (dno < 0) {
+        return used ? img->bnr : img->bid_d + img->nr_d;
+    }
+    return img->bid_d + dno;
+}
+
+/*
+ * Find the next run of copied blocks from *@bid on into @bid and @nr,
+ * bridging the gaps shorter than *GAP_MAX*.
+ *
+ * Return false once no block is left.
+ */
+static bool next_run(Yaf_Image *img, uint64_t *bid, uint32_t *nr) {
+    uint64_t start = next_block(img, *bid, true), end, next;
+
+    if (start >= img->bnr) {
+        return false;
+    }
+    end = next_block(img, start, false);
+    while (end - start < RUN_MAX) {
+        next = next_block(img, end, true);
+        if (next >= img->bnr || next - end >= GAP_MAX) {
+            break;
+        }
+        end = next_block(img, next, false);
+    }
+
+    *bid = start;
+    *nr = end - start < RUN_MAX ? end - start : RUN_MAX;
+    return true;
+}
+
+/* write the @size bytes of @buf to @fd at @off, or at its position if -1 */
+static long write_full(int fd, const void *buf, size_t size, off_t off) {
+    while (size) {
+        ssize_t n = off < 0 ? write(fd, buf, size) : pwrite(fd, buf, size,
+                                                            off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log(LOG_ERR, "write() failed with error %s", strerror(errno));
+            return -errno;
+        }
+        buf = (const uint8_t *)buf + n;
+        size -= n;
+        off = off < 0 ? off : off + n;
+    }
+    return 0;
+}
+
+/* read @size bytes from @fd into @buf */
+static long read_full(int fd, void *buf, size_t size) {
+    while (size) {
+        ssize_t n = read(fd, buf, size);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log(LOG_ERR, "read() failed with error %s", strerror(errno));
+            return -errno;
+        }
+        if (!n) {
+            log(LOG_ERR, "the stream ends early");
+            return -EIO;
+        }
+        buf = (uint8_t *)buf + n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Open the image or device @path to be written with @bnr blocks. An
+ * image file is emptied and sized, so the blocks not written are
+ * holes, while a device must have room for them.
+ */
+static int open_target(const char *path, uint64_t bnr) {
+    struct stat st;
+    uint64_t dev_bnr;
+    int fd, ret;
+
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        log(LOG_ERR, "open() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    if (fstat(fd, &st)) {
+        log(LOG_ERR, "fstat() failed with error %s", strerror(errno));
+        goto close_fd;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (ftruncate(fd, 0) || ftruncate(fd, bnr * YAF_BLOCK_SIZE)) {
+            log(LOG_ERR, "ftruncate() failed with error %s",
+                strerror(errno));
+            goto close_fd;
+        }
+        return fd;
+    }
+
+    if (yaf_device_blocks(fd, &dev_bnr)) {
+        goto close_fd;
+    }
+    if (dev_bnr < bnr) {
+        errno = ENOSPC;
+        log(LOG_ERR, "%s has %lu blocks, fewer than the %lu of the image",
+            path, dev_bnr, bnr);
+        goto close_fd;
+    }
+    return fd;
+
+close_fd:
+    ret = -errno;
+    close(fd);
+    return ret;
+}
+
+/* write the used blocks of @img into the sparse image or device @path */
+static long export_image(Yaf_Image *img, const char *path,
+                         uint64_t *copied) {
+    uint64_t bid = 0;
+    uint32_t nr;
+    long ret = 0;
+    int fd;
+
+    fd = open_target(path, img->bnr);
+    if (fd < 0) {
+        return fd;
+    }
+
+    for (; next_run(img, &bid, &nr); bid += nr) {
+        ret = write_full(fd, yaf_block(img, bid),
+                         (size_t)nr * YAF_BLOCK_SIZE, bid * YAF_BLOCK_SIZE);
+        if (ret) {
+            goto close_fd;
+        }
+        *copied += nr;
+    }
+
+    if (fsync(fd)) {
+        ret = -errno;
+        log(LOG_ERR, "fsync() failed with error %s", strerror(errno));
+    }
+
+close_fd:
+    close(fd);
+    return ret;
+}
+
+/* write the used blocks of @img as a stream to @fd */
+static long export_stream(Yaf_Image *img, int fd, uint64_t *copied) {
+    Image_Header header = {
+        .magic = IMAGE_MAGIC,
+        .version = htole32(IMAGE_VERSION),
+        .block_size = htole32(YAF_BLOCK_SIZE),
+        .bnr = htole64(img->bnr),
+    };
+    Image_Run run = {};
+    uint64_t bid = 0;
+    uint32_t nr;
+    long ret;
+
+    ret = write_full(fd, &header, sizeof(header), -1);
+    for (; !ret && next_run(img, &bid, &nr); bid += nr) {
+        size_t size = (size_t)nr * YAF_BLOCK_SIZE;
+
+        run.bid = htole64(bid);
+        run.nr = htole32(nr);
+        run.crc = htole32(yaf_crc32c(~0U, yaf_block(img, bid), size));
+        ret = write_full(fd, &run, sizeof(run), -1);
+        if (!ret) {
+            ret = write_full(fd, yaf_block(img, bid), size, -1);
+        }
+        *copied += nr;
+    }
+    if (ret) {
+        return ret;
+    }
+
+    /* the empty run ends the stream */
+    memset(&run, 0, sizeof(run));
+    return write_full(fd, &run, sizeof(run), -1);
+}
+
+/* restore the stream from @in onto the image or device @path */
+static long restore_stream(int in, const char *path, uint64_t *copied,
+                           uint64_t *bnr) {
+    Image_Header header;
+    Image_Run run;
+    uint8_t *buf;
+    long ret;
+    int fd;
+
+    ret = read_full(in, &header, sizeof(header));
+    if (ret) {
+        return ret;
+    }
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) ||
+        le32toh(header.version) != IMAGE_VERSION ||
+        le32toh(header.block_size) != YAF_BLOCK_SIZE) {
+        log(LOG_ERR, "the source is not a yaf-image stream of version %d",
+            IMAGE_VERSION);
+        return -EINVAL;
+    }
+    *bnr = le64toh(header.bnr);
+
+    buf = malloc((size_t)RUN_MAX * YAF_BLOCK_SIZE);
+    if (!buf) {
+        log(LOG_ERR, "malloc() failed");
+        return -ENOMEM;
+    }
+    fd = open_target(path, *bnr);
+    if (fd < 0) {
+        ret = fd;
+        goto free_buf;
+    }
+
+    for (;;) {
+        uint64_t bid;
+        uint32_t nr;
+        size_t size;
+
+        ret = read_full(in, &run, sizeof(run));
+        if (ret) {
+            goto close_fd;
+        }
+        bid = le64toh(run.bid);
+        nr = le32toh(run.nr);
+        if (!nr) {
+            break;
+        }
+        if (nr > RUN_MAX || bid > *bnr || nr > *bnr - bid) {
+            ret = -EINVAL;
+            log(LOG_ERR, "the run of %u blocks at %lu is out of bounds",
+                nr, bid);
+            goto close_fd;
+        }
+
+        size = (size_t)nr * YAF_BLOCK_SIZE;
+        ret = read_full(in, buf, size);
+        if (ret) {
+            goto close_fd;
+        }
+        if (yaf_crc32c(~0U, buf, size) != le32toh(run.crc)) {
+            ret = -EIO;
+            log(LOG_ERR, "the run of %u blocks at %lu fails its checksum",
+                nr, bid);
+            goto close_fd;
+        }
+        ret = write_full(fd, buf, size, bid * YAF_BLOCK_SIZE);
+        if (ret) {
+            goto close_fd;
+        }
+        *copied += nr;
+    }
+
+    if (fsync(fd)) {
+        ret = -errno;
+        log(LOG_ERR, "fsync() failed with error %s", strerror(errno));
+    }
+
+close_fd:
+    close(fd);
+free_buf:
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    Image_Arguments arguments = {};
+    uint64_t copied = 0, bnr;
+    Yaf_Image img;
+    long ret;
+    int fd;
+
+    image_parse_arguments(&arguments, argc, argv);
+
+    /* the logs go to the standard error next to a stream */
+    if ((arguments.stream && !strcmp(arguments.target, "-")) ||
+        (arguments.restore && !strcmp(arguments.source, "-"))) {
+        fd = dup(arguments.stream ? STDOUT_FILENO : STDIN_FILENO);
+        if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            log(LOG_ERR, "dup() failed with error %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else if (arguments.stream) {
+        fd = open(arguments.target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else if (arguments.restore) {
+        fd = open(arguments.source, O_RDONLY);
+    } else {
+        fd = -1;
+    }
+    if ((arguments.stream || arguments.restore) && fd == -1) {
+        log(LOG_ERR, "open() failed with error %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (arguments.restore) {
+        ret = restore_stream(fd, arguments.target, &copied, &bnr);
+        close(fd);
+        goto out;
+    }
+
+    ret = yaf_image_open(&img, arguments.source, 0);
+    if (ret) {
+        log(LOG_ERR, "failed to open %s with error %s", arguments.source,
+            strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    bnr = img.bnr;
+    /* the blocks are read in ascending order, mostly once */
+    madvise(img.map, img.bnr * YAF_BLOCK_SIZE, MADV_SEQUENTIAL);
+
+    if (arguments.stream) {
+        ret = export_stream(&img, fd, &copied);
+        if (close(fd) && !ret) {
+            ret = -errno;
+            log(LOG_ERR, "close() failed with error %s", strerror(errno));
+        }
+    } else {
+        ret = export_image(&img, arguments.target, &copied);
+    }
+    yaf_image_close(&img);
+
+out:
+    if (ret) {
+        log(LOG_ERR, "failed to copy %s to %s with error %s",
+            arguments.source, arguments.target, strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    log(LOG_INFO, "%lu of %lu blocks of %s have been copied to %s", copied,
+        bnr, arguments.source, arguments.target);
+    return EXIT_SUCCESS;
+}
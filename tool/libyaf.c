@@ -0,0 +1,1352 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/csum.h"
+#include "../include/inode.h"
+#include "../include/journal.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "../include/bitmap.h"
+#include "libyaf.h"
+
+#define BITS_PER_WORD   64
+
+static inline uint64_t div_ceil(uint64_t a, uint64_t b) {
+    return (a / b) + (a % b != 0);
+}
+
+/* get the number of blocks of the device or image file @fd */
+int yaf_device_blocks(int fd, uint64_t *bnr) {
+    struct stat bstat;
+    uint64_t size;
+
+    if (fstat(fd, &bstat)) {
+        log(LOG_ERR, "fstat() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    if (S_ISBLK(bstat.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size)) {
+            log(LOG_ERR, "ioctl() failed with error %s", strerror(errno));
+            return -errno;
+        }
+    } else {
+        size = bstat.st_size;
+    }
+
+    *bnr = size / YAF_BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Fill the new superblock @ysb with the sections for @layout, all
+ * free but the reserved and root inode.
+ *
+ * The inode bitmap only covers the inode blocks holding
+ * @layout->inodes, so the data blocks and their bitmap get the rest.
+ * The data bitmap and checksum sections cover @layout->max_bnr blocks,
+ * if larger, see resize.h.
+ */
+int yaf_layout(Yaf_Superblock *ysb, const Yaf_Layout *layout) {
+    uint64_t bnr = layout->bnr, nr_inodes = layout->inodes;
+    uint64_t max_bnr = layout->max_bnr > bnr ? layout->max_bnr : bnr;
+    uint32_t nr_j = layout->nr_j, nr_c = 0;
+    uint32_t ipb, nr_i, nr_ibp, nr_dbp, nr_d;
+
+    memset(ysb, 0, sizeof(*ysb));
+    ysb->yaf_sb_info.version = htole32(layout->version);
+    ipb = INODES_PER_BLOCK(ysb);
+
+    if (bnr < 1 + (uint64_t)nr_j) {
+        log(LOG_ERR, "%lu blocks leave no room for the journal",
+            (unsigned long)bnr);
+        return -EINVAL;
+    }
+    /* the checksums are only kept up to date through the journal */
+    if (nr_j && layout->checksums) {
+        nr_c = div_ceil(max_bnr - 1 - nr_j, YAF_CSUMS_PER_BLOCK);
+    }
+
+    /* the inode numbers are 32-bit, the reserved and root inode included */
+    if (nr_inodes < 2) {
+        nr_inodes = 2;
+    }
+    if (nr_inodes > UINT32_MAX - ipb) {
+        nr_inodes = UINT32_MAX - ipb;
+    }
+    nr_i = div_ceil(nr_inodes, ipb);
+    nr_ibp = div_ceil((uint64_t)nr_i * ipb, BITS_PER_BLOCK);
+
+    if ((uint64_t)1 + nr_j + nr_c + nr_ibp + nr_i + 2 > bnr) {
+        log(LOG_ERR, "%u inode blocks leave no data blocks", nr_i);
+        return -EINVAL;
+    }
+    nr_dbp = div_ceil(max_bnr - 1 - nr_j - nr_c - nr_ibp - nr_i,
+                      BITS_PER_BLOCK);
+    if ((uint64_t)1 + nr_j + nr_c + nr_ibp + nr_dbp + nr_i + 1 > bnr) {
+        log(LOG_ERR, "%u data bitmap blocks leave no data blocks", nr_dbp);
+        return -EINVAL;
+    }
+    nr_d = bnr - 1 - nr_j - nr_c - nr_i - nr_ibp - nr_dbp;
+
+    ysb->yaf_sb_info.nr_ibp = htole32(nr_ibp);
+    ysb->yaf_sb_info.nr_dbp = htole32(nr_dbp);
+    ysb->yaf_sb_info.nr_i = htole32(nr_i);
+    ysb->yaf_sb_info.nr_d = htole32(nr_d);
+    ysb->nr_j = htole32(nr_j);
+    ysb->nr_c = htole32(nr_c);
+    if (layout->version >= YAF_VERSION_ITABLE_INIT) {
+        ysb->nr_i_init = htole32(layout->lazy_itable_init ? 1 : nr_i);
+    }
+    ysb->nr_r = htole32((uint64_t)nr_d * layout->reserved_percentage / 100);
+
+    ysb->state = htole32(YAF_STATE_CLEAN);
+    ysb->nr_free_i = htole32(nr_i * ipb - 2);
+    ysb->nr_free_d = htole32(nr_d);
+
+    /* fill magic string */
+    for (int idx = 0; idx < sizeof(ysb->magic); idx += sizeof(MAGIC)) {
+        memcpy(&ysb->magic[idx], MAGIC, sizeof(MAGIC));
+    }
+
+    if (nr_c) {
+        ysb->csum = htole32(yaf_csum_super(ysb));
+    }
+    return 0;
+}
+
+/*
+ * Check whether the superblock of @img describes sections which fit
+ * in the image, like the driver does on mount.
+ */
+static int yaf_check_super(Yaf_Image *img) {
+    Yaf_Superblock *ysb = img->ysb;
+    uint64_t nr_inodes;
+
+    /* check on-disk superblock magic string */
+    for (int idx = 0; idx < sizeof(ysb->magic); idx += sizeof(MAGIC)) {
+        if (memcmp(&ysb->magic[idx], MAGIC, sizeof(MAGIC))) {
+            log(LOG_ERR, "magic string check failed");
+            return -EINVAL;
+        }
+    }
+
+    /* check on-disk format version */
+    img->version = le32toh(ysb->yaf_sb_info.version);
+    if (img->version == YAF_VERSION_COMPACT) {
+        log(LOG_ERR, "compact images are read-only and have no bitmaps, "
+            "mount them instead");
+        return -EROFS;
+    }
+    if (img->version != YAF_VERSION_LEGACY && img->version > YAF_VERSION) {
+        log(LOG_ERR, "on-disk format version %u is not supported",
+            img->version);
+        return -EINVAL;
+    }
+
+    img->inode_size = YAF_INODE_SIZE(ysb);
+    img->nr_d = le32toh(ysb->yaf_sb_info.nr_d);
+    nr_inodes = (uint64_t)le32toh(ysb->yaf_sb_info.nr_i) *
+                INODES_PER_BLOCK(ysb);
+    if (nr_inodes <= ROOT_INO || nr_inodes > UINT32_MAX) {
+        log(LOG_ERR, "%lu inodes are invalid", (unsigned long)nr_inodes);
+        return -EINVAL;
+    }
+    img->nr_inodes = nr_inodes;
+
+    /* check whether the sections fit in the image */
+    if (BID_D_MAX(ysb) >= img->bnr) {
+        log(LOG_ERR, "sections up to block %lu exceed the %lu blocks",
+            BID_D_MAX(ysb), (unsigned long)img->bnr);
+        return -EINVAL;
+    }
+    /* check whether the bitmaps cover all inodes and data blocks */
+    if ((uint64_t)le32toh(ysb->yaf_sb_info.nr_ibp) * BITS_PER_BLOCK <
+        img->nr_inodes ||
+        (uint64_t)le32toh(ysb->yaf_sb_info.nr_dbp) * BITS_PER_BLOCK <
+        img->nr_d) {
+        log(LOG_ERR, "bitmaps are too small for the sections");
+        return -EINVAL;
+    }
+    if (NR_J(ysb) && NR_J(ysb) < YAF_JOURNAL_MIN_BLOCKS) {
+        log(LOG_ERR, "journal of %u blocks is too small", NR_J(ysb));
+        return -EINVAL;
+    }
+    if (NR_C(ysb) && (!NR_J(ysb) ||
+        (uint64_t)NR_C(ysb) * YAF_CSUMS_PER_BLOCK <
+        BID_D_MAX(ysb) + 1 - BID_IBP_MIN(ysb))) {
+        log(LOG_ERR, "checksum section of %u blocks is invalid", NR_C(ysb));
+        return -EINVAL;
+    }
+
+    img->nr_i_init = le32toh(ysb->yaf_sb_info.nr_i);
+    if (img->version != YAF_VERSION_LEGACY &&
+        img->version >= YAF_VERSION_ITABLE_INIT) {
+        img->nr_i_init = le32toh(ysb->nr_i_init);
+    }
+    img->bid_i = BID_I_MIN(ysb);
+    img->bid_d = BID_D_MIN(ysb);
+
+    if (NR_C(ysb) && le32toh(ysb->csum) != yaf_csum_super(ysb) &&
+        !(img->flags & YAF_IMAGE_FORCE)) {
+        log(LOG_ERR, "superblock does not match its checksum");
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+/*
+ * Replay the committed transactions of the journal like a mount does
+ * and return their number.
+ *
+ * The replayed blocks reach the image before the journal superblock
+ * skips their transactions.
+ */
+static int yaf_replay_journal(Yaf_Image *img) {
+    Yaf_Superblock *ysb = img->ysb;
+    Yaf_Journal_Sb *jsb = yaf_block(img, BID_J_MIN(ysb));
+    uint32_t nr_j = NR_J(ysb), pos = 1, seq;
+    int nr_replay = 0;
+
+    if (!nr_j || le32toh(jsb->j_magic) != YAF_JOURNAL_MAGIC) {
+        return 0;
+    }
+    seq = le32toh(jsb->j_seq);
+
+    while (pos + 2 <= nr_j - 1) {
+        Yaf_Journal_Desc *desc = yaf_block(img, BID_J_MIN(ysb) + pos);
+        Yaf_Journal_Commit *commit;
+        uint32_t nr = le32toh(desc->d_nr), crc;
+        bool valid;
+
+        /* check the descriptor block */
+        if (le32toh(desc->d_header.h_magic) != YAF_JOURNAL_MAGIC ||
+            le32toh(desc->d_header.h_type) != YAF_JOURNAL_TYPE_DESC ||
+            le32toh(desc->d_header.h_seq) != seq ||
+            nr > YAF_JOURNAL_DESC_ENTRIES || pos + nr + 2 > nr_j) {
+            break;
+        }
+
+        /* check the commit block and the checksum */
+        crc = yaf_crc32c(~0U, desc, (uint64_t)(nr + 1) * YAF_BLOCK_SIZE);
+        commit = yaf_block(img, BID_J_MIN(ysb) + pos + nr + 1);
+        valid = le32toh(commit->c_header.h_magic) == YAF_JOURNAL_MAGIC &&
+                le32toh(commit->c_header.h_type) == YAF_JOURNAL_TYPE_COMMIT &&
+                le32toh(commit->c_header.h_seq) == seq &&
+                le32toh(commit->c_crc) == crc;
+        for (uint32_t i = 0; valid && i < nr; ++i) {
+            uint32_t bid = le32toh(desc->d_bid[i]);
+
+            valid = bid == BID_SB_MIN(ysb) ||
+                    (bid >= BID_C_MIN(ysb) && bid <= BID_D_MAX(ysb));
+        }
+        if (!valid) {
+            break;
+        }
+
+        /* write the logged blocks to their home blocks */
+        for (uint32_t i = 0; i < nr; ++i) {
+            memcpy(yaf_block(img, le32toh(desc->d_bid[i])),
+                   yaf_block(img, BID_J_MIN(ysb) + pos + 1 + i),
+                   YAF_BLOCK_SIZE);
+        }
+        pos += nr + 2;
+        ++seq;
+        ++nr_replay;
+    }
+    if (!nr_replay) {
+        return 0;
+    }
+
+    /* the log is empty once the replayed blocks are durable */
+    if ((img->flags & YAF_IMAGE_RDWR) &&
+        msync(img->map, img->bnr * YAF_BLOCK_SIZE, MS_SYNC)) {
+        log(LOG_ERR, "msync() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    jsb->j_seq = htole32(seq);
+    return nr_replay;
+}
+
+/* count the bits set among the first @nr bits of the bitmap @map */
+static uint32_t yaf_count_bits(const uint64_t *map, uint32_t nr) {
+    uint32_t count = 0, w;
+
+    for (w = 0; w < nr / BITS_PER_WORD; ++w) {
+        count += __builtin_popcountll(le64toh(map[w]));
+    }
+    if (nr % BITS_PER_WORD) {
+        count += __builtin_popcountll(le64toh(map[w]) &
+                                      (((uint64_t)1 << nr % BITS_PER_WORD)
+                                       - 1));
+    }
+    return count;
+}
+
+/*
+ * Open and map the image @path.
+ *
+ * Without *YAF_IMAGE_RDWR* the image is mapped privately, so the
+ * journal replay and any change stay in memory.
+ */
+int yaf_image_open(Yaf_Image *img, const char *path, int flags) {
+    bool rdwr = flags & YAF_IMAGE_RDWR;
+    struct stat bstat;
+    int ret;
+
+    memset(img, 0, sizeof(*img));
+    img->flags = flags;
+    img->map = MAP_FAILED;
+
+    /* a mounted device cannot be opened exclusively */
+    if (stat(path, &bstat)) {
+        log(LOG_ERR, "stat() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    img->fd = open(path, (rdwr ? O_RDWR : O_RDONLY) |
+                         (S_ISBLK(bstat.st_mode) ? O_EXCL : 0));
+    if (img->fd == -1) {
+        log(LOG_ERR, "open() failed with error %s", strerror(errno));
+        return -errno;
+    }
+
+    ret = yaf_device_blocks(img->fd, &img->bnr);
+    if (ret) {
+        goto close;
+    }
+    if (!img->bnr) {
+        ret = -EINVAL;
+        log(LOG_ERR, "%s is smaller than a block", path);
+        goto close;
+    }
+
+    /* a private mapping only copies the few modified pages */
+    img->map = mmap(NULL, img->bnr * YAF_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                    rdwr ? MAP_SHARED : MAP_PRIVATE | MAP_NORESERVE,
+                    img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        ret = -errno;
+        log(LOG_ERR, "mmap() failed with error %s", strerror(errno));
+        goto close;
+    }
+    img->ysb = yaf_block(img, 0);
+
+    ret = yaf_check_super(img);
+    if (ret) {
+        goto close;
+    }
+    img->dirty = calloc(img->bnr / BITS_PER_WORD + 1, sizeof(uint64_t));
+    if (!img->dirty) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "calloc() failed");
+        goto close;
+    }
+
+    /* replay the journal before trusting any metadata block */
+    ret = yaf_replay_journal(img);
+    if (ret < 0) {
+        goto close;
+    }
+    img->nr_replay = ret;
+
+    img->nr_free_i = img->nr_inodes -
+                     yaf_count_bits(yaf_block(img, BID_IBP_MIN(img->ysb)),
+                                    img->nr_inodes);
+    img->nr_free_d = img->nr_d -
+                     yaf_count_bits(yaf_block(img, BID_DBP_MIN(img->ysb)),
+                                    img->nr_d);
+    img->next_ino = ROOT_INO + 1;
+    return 0;
+
+close:
+    if (img->map != MAP_FAILED) {
+        munmap(img->map, img->bnr * YAF_BLOCK_SIZE);
+    }
+    free(img->dirty);
+    close(img->fd);
+    return ret;
+}
+
+/* the metadata block holding @p was modified, from any thread */
+void yaf_dirty(Yaf_Image *img, const void *p) {
+    uint64_t bid = ((const uint8_t *)p - img->map) / YAF_BLOCK_SIZE;
+
+    __atomic_fetch_or(&img->dirty[bid / BITS_PER_WORD],
+                      (uint64_t)1 << (bid % BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+/*
+ * Store the checksums of the modified blocks, the free counters and
+ * the checksum of the superblock, and write everything to the image.
+ */
+int yaf_image_sync(Yaf_Image *img) {
+    Yaf_Superblock *ysb = img->ysb;
+    uint32_t *table = yaf_block(img, BID_C_MIN(ysb));
+
+    if (img->version != YAF_VERSION_LEGACY) {
+        ysb->nr_free_i = htole32(img->nr_free_i);
+        ysb->nr_free_d = htole32(img->nr_free_d);
+    }
+
+    for (uint64_t w = 0; NR_C(ysb) && w <= BID_D_MAX(ysb) / BITS_PER_WORD;
+         ++w) {
+        for (uint64_t bits = img->dirty[w]; bits; bits &= bits - 1) {
+            uint64_t bid = w * BITS_PER_WORD + __builtin_ctzll(bits);
+
+            if (bid >= BID_IBP_MIN(ysb) && bid <= BID_D_MAX(ysb)) {
+                table[bid - BID_IBP_MIN(ysb)] =
+                    htole32(yaf_csum_block(yaf_block(img, bid)));
+            }
+        }
+    }
+    memset(img->dirty, 0, (img->bnr / BITS_PER_WORD + 1) * sizeof(uint64_t));
+    if (NR_C(ysb)) {
+        ysb->csum = htole32(yaf_csum_super(ysb));
+    }
+
+    if ((img->flags & YAF_IMAGE_RDWR) &&
+        msync(img->map, img->bnr * YAF_BLOCK_SIZE, MS_SYNC)) {
+        log(LOG_ERR, "msync() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+/* sync and unmap the image */
+int yaf_image_close(Yaf_Image *img) {
+    int ret = 0;
+
+    if (img->flags & YAF_IMAGE_RDWR) {
+        ret = yaf_image_sync(img);
+    }
+    munmap(img->map, img->bnr * YAF_BLOCK_SIZE);
+    free(img->dirty);
+    close(img->fd);
+    return ret;
+}
+
+/* return the on-disk inode @ino */
+Yaf_Inode *yaf_inode(Yaf_Image *img, uint32_t ino) {
+    uint32_t ipb = YAF_BLOCK_SIZE / img->inode_size;
+
+    return (Yaf_Inode *)((uint8_t *)yaf_block(img, img->bid_i + ino / ipb) +
+                         ino % ipb * img->inode_size);
+}
+
+/* return the extra fields of the on-disk inode @yi, if any */
+static inline Yaf_Inode_Ext *yaf_inode_ext(Yaf_Image *img, Yaf_Inode *yi) {
+    return img->inode_size > sizeof(Yaf_Inode) ? (Yaf_Inode_Ext *)(yi + 1)
+                                               : NULL;
+}
+
+/* return the 64-bit size of the on-disk inode @yi */
+uint64_t yaf_inode_get_size(Yaf_Image *img, Yaf_Inode *yi) {
+    Yaf_Inode_Ext *ext = yaf_inode_ext(img, yi);
+    uint64_t size = le32toh(yi->i_size);
+
+    if (ext) {
+        size |= (uint64_t)le32toh(ext->i_size_hi) << 32;
+    }
+    return size;
+}
+
+/* set the 64-bit size of the on-disk inode @yi */
+void yaf_inode_set_size(Yaf_Image *img, Yaf_Inode *yi, uint64_t size) {
+    Yaf_Inode_Ext *ext = yaf_inode_ext(img, yi);
+
+    yi->i_size = htole32(size);
+    if (ext) {
+        ext->i_size_hi = htole32(size >> 32);
+    }
+    yaf_dirty(img, yi);
+}
+
+/* return the number of data blocks owned by the on-disk inode @yi */
+uint32_t yaf_inode_blocks(Yaf_Image *img, Yaf_Inode *yi) {
+    uint32_t nr = 0;
+
+    /* a fast symlink keeps its target in *i_block* */
+    if (S_ISLNK(le32toh(yi->i_mode)) &&
+        yaf_inode_get_size(img, yi) <= YAF_FAST_SYMLINK_LEN) {
+        return 0;
+    }
+    while (nr < YAF_IBLOCKS && le32toh(yi->i_block[nr]) != RESERVED_DNO) {
+        ++nr;
+    }
+    return nr;
+}
+
+/*
+ * Return the number of extents, i.e. runs of consecutive data blocks,
+ * of the on-disk inode @yi.
+ */
+uint32_t yaf_inode_extents(Yaf_Image *img, Yaf_Inode *yi) {
+    uint32_t nr = yaf_inode_blocks(img, yi), extents = !!nr;
+
+    for (uint32_t i = 1; i < nr; ++i) {
+        extents += le32toh(yi->i_block[i]) != le32toh(yi->i_block[i - 1]) + 1;
+    }
+    return extents;
+}
+
+/* set the @which timestamps of the inode @ino to @ts */
+void yaf_inode_set_time(Yaf_Image *img, uint32_t ino, int which,
+                        const struct timespec *ts) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    Yaf_Inode_Ext *ext = yaf_inode_ext(img, yi);
+
+    if (which & YAF_ATIME) {
+        yi->i_atime = htole32(ts->tv_sec);
+        if (ext) {
+            ext->i_atime_hi = htole32((uint64_t)ts->tv_sec >> 32);
+            ext->i_atime_nsec = htole32(ts->tv_nsec);
+        }
+    }
+    if (which & YAF_MTIME) {
+        yi->i_mtime = htole32(ts->tv_sec);
+        if (ext) {
+            ext->i_mtime_hi = htole32((uint64_t)ts->tv_sec >> 32);
+            ext->i_mtime_nsec = htole32(ts->tv_nsec);
+        }
+    }
+    if (which & YAF_CTIME) {
+        yi->i_ctime = htole32(ts->tv_sec);
+        if (ext) {
+            ext->i_ctime_hi = htole32((uint64_t)ts->tv_sec >> 32);
+            ext->i_ctime_nsec = htole32(ts->tv_nsec);
+        }
+    }
+    yaf_dirty(img, yi);
+}
+
+/* set the @which timestamps of the inode @ino to now */
+void yaf_inode_stamp(Yaf_Image *img, uint32_t ino, int which) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    yaf_inode_set_time(img, ino, which, &now);
+}
+
+/* fill @st with the attributes of the inode @ino */
+void yaf_stat(Yaf_Image *img, uint32_t ino, struct stat *st) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    Yaf_Inode_Ext *ext = yaf_inode_ext(img, yi);
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = le32toh(yi->i_mode);
+    st->st_nlink = le32toh(yi->i_nlink);
+    st->st_uid = le32toh(yi->i_uid);
+    st->st_gid = le32toh(yi->i_gid);
+    st->st_size = yaf_inode_get_size(img, yi);
+    st->st_blksize = YAF_BLOCK_SIZE;
+    st->st_blocks = (uint64_t)yaf_inode_blocks(img, yi) *
+                    (YAF_BLOCK_SIZE / 512);
+    st->st_atim.tv_sec = le32toh(yi->i_atime);
+    st->st_mtim.tv_sec = le32toh(yi->i_mtime);
+    st->st_ctim.tv_sec = le32toh(yi->i_ctime);
+    if (ext) {
+        st->st_atim.tv_sec |= (uint64_t)le32toh(ext->i_atime_hi) << 32;
+        st->st_mtim.tv_sec |= (uint64_t)le32toh(ext->i_mtime_hi) << 32;
+        st->st_ctim.tv_sec |= (uint64_t)le32toh(ext->i_ctime_hi) << 32;
+        st->st_atim.tv_nsec = le32toh(ext->i_atime_nsec);
+        st->st_mtim.tv_nsec = le32toh(ext->i_mtime_nsec);
+        st->st_ctim.tv_nsec = le32toh(ext->i_ctime_nsec);
+    }
+}
+
+/*
+ * Find a bit among the bits within [@from, @to) of the bitmap @map
+ * that is set if @set, or clear otherwise, a word at a time, and
+ * return it, or -1 if there is none.
+ */
+static int64_t yaf_scan_bits(const uint64_t *map, uint32_t from,
+                             uint32_t to, bool set) {
+    uint64_t flip = set ? 0 : ~(uint64_t)0;
+
+    for (uint64_t idx = from; idx < to;) {
+        uint64_t word = (le64toh(map[idx / BITS_PER_WORD]) ^ flip) >>
+                        (idx % BITS_PER_WORD);
+
+        if (!word) {
+            idx = (idx / BITS_PER_WORD + 1) * BITS_PER_WORD;
+            continue;
+        }
+        idx += __builtin_ctzll(word);
+        return idx < to ? idx : -1;
+    }
+    return -1;
+}
+
+/* find a zero bit among the bits within [@from, @to) of the bitmap @map */
+static inline int64_t yaf_find_zero_bit(const uint64_t *map, uint32_t from,
+                                        uint32_t to) {
+    return yaf_scan_bits(map, from, to, false);
+}
+
+/*
+ * Find the first bit within [@from, @to) of the bitmap from the block
+ * @bid on that is set if @set, or clear otherwise, and return it, or
+ * -1 if there is none.
+ */
+int64_t yaf_find_bit(Yaf_Image *img, unsigned long bid, uint32_t from,
+                     uint32_t to, bool set) {
+    return yaf_scan_bits(yaf_block(img, bid), from, to, set);
+}
+
+/* test the bit @idx of the bitmap from the block @bid on */
+bool yaf_test_bit(Yaf_Image *img, unsigned long bid, uint32_t idx) {
+    const uint8_t *map = yaf_block(img, bid);
+
+    return map[idx / BITS_PER_BYTE] & BEOFF2MASK(IDX2BEOFF(idx));
+}
+
+/*
+ * Find a zero bit among the first @nr bits of the bitmap from the block
+ * @bid on, starting at *@next and wrapping around, and set it.
+ */
+static int64_t yaf_claim_bit(Yaf_Image *img, unsigned long bid,
+                             uint32_t nr, uint32_t *next) {
+    uint64_t *map = yaf_block(img, bid);
+    uint8_t *byte;
+    int64_t idx;
+
+    idx = yaf_find_zero_bit(map, *next < nr ? *next : 0, nr);
+    if (idx < 0) {
+        idx = yaf_find_zero_bit(map, 0, nr);
+    }
+    if (idx < 0) {
+        return -1;
+    }
+
+    byte = (uint8_t *)map + idx / BITS_PER_BYTE;
+    *byte = yaf_set_bit(*byte, IDX2BEOFF(idx));
+    yaf_dirty(img, byte);
+    *next = idx + 1;
+    return idx;
+}
+
+/* clear the bit @idx of the bitmap from the block @bid on */
+static void yaf_clear_bit(Yaf_Image *img, unsigned long bid, uint32_t idx) {
+    uint8_t *byte = (uint8_t *)yaf_block(img, bid) + idx / BITS_PER_BYTE;
+
+    assert(*byte & BEOFF2MASK(IDX2BEOFF(idx)));
+    *byte &= ~BEOFF2MASK(IDX2BEOFF(idx));
+    yaf_dirty(img, byte);
+}
+
+/*
+ * Find an unused inode, mark it and zero it.
+ *
+ * An inode block beyond *nr_i_init* may still hold anything until its
+ * first inode is used, so it is zeroed whole then, like the driver
+ * does, see itable.h.
+ */
+int yaf_alloc_inode(Yaf_Image *img, uint32_t *ino) {
+    uint32_t ipb = YAF_BLOCK_SIZE / img->inode_size;
+    const uint8_t *map = yaf_block(img, BID_IBP_MIN(img->ysb));
+    Yaf_Inode *yi;
+    int64_t idx;
+    uint32_t used = 0;
+
+    idx = yaf_claim_bit(img, BID_IBP_MIN(img->ysb), img->nr_inodes,
+                        &img->next_ino);
+    if (idx < 0) {
+        return -ENOSPC;
+    }
+    *ino = idx;
+    --img->nr_free_i;
+    yi = yaf_inode(img, *ino);
+
+    for (uint32_t i = *ino - *ino % ipb; i < *ino - *ino % ipb + ipb; ++i) {
+        used += !!(map[i / BITS_PER_BYTE] & BEOFF2MASK(IDX2BEOFF(i)));
+    }
+    if (*ino / ipb >= img->nr_i_init && used == 1) {
+        memset((uint8_t *)yi - *ino % ipb * img->inode_size, 0,
+               YAF_BLOCK_SIZE);
+    } else {
+        memset(yi, 0, img->inode_size);
+    }
+    yaf_dirty(img, yi);
+    return 0;
+}
+
+/* mark the inode @ino as unused */
+void yaf_free_inode(Yaf_Image *img, uint32_t ino) {
+    yaf_clear_bit(img, BID_IBP_MIN(img->ysb), ino);
+    ++img->nr_free_i;
+}
+
+/*
+ * Find an unused data block and mark it, the blocks reserved for the
+ * privileged users included, as the tools run as one.
+ */
+int yaf_alloc_dblock(Yaf_Image *img, uint32_t *dno) {
+    int64_t idx;
+
+    idx = yaf_claim_bit(img, BID_DBP_MIN(img->ysb), img->nr_d,
+                        &img->next_dno);
+    if (idx < 0) {
+        return -ENOSPC;
+    }
+    *dno = idx;
+    --img->nr_free_d;
+    return 0;
+}
+
+/* mark the data block @dno as unused */
+void yaf_free_dblock(Yaf_Image *img, uint32_t dno) {
+    yaf_clear_bit(img, BID_DBP_MIN(img->ysb), dno);
+    ++img->nr_free_d;
+}
+
+/* return the dentry at the offset @doff of the directory inode @yi */
+static inline Yaf_Dentry *yaf_dentry(Yaf_Image *img, Yaf_Inode *yi,
+                                     uint64_t doff) {
+    uint32_t dno = le32toh(yi->i_block[doff / YAF_BLOCK_SIZE]);
+
+    return (Yaf_Dentry *)((uint8_t *)yaf_block(img, img->bid_d + dno) +
+                          doff % YAF_BLOCK_SIZE);
+}
+
+/* find the dentry @name in the directory @dir */
+static int yaf_find_dentry(Yaf_Image *img, uint32_t dir, const char *name,
+                           Yaf_Dentry **yd) {
+    Yaf_Inode *yi = yaf_inode(img, dir);
+    uint64_t size = yaf_inode_get_size(img, yi);
+
+    if (!S_ISDIR(le32toh(yi->i_mode))) {
+        return -ENOTDIR;
+    }
+    if (strlen(name) > YAF_DENTRY_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    for (uint64_t doff = 0; doff < size; doff += YAF_DENTRY_SIZE) {
+        *yd = yaf_dentry(img, yi, doff);
+        if (le32toh((*yd)->d_ino) != RESERVED_INO &&
+            !strncmp((*yd)->d_name, name, YAF_DENTRY_NAME_LEN)) {
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+/* find the inode of the dentry @name in the directory @dir */
+int yaf_lookup(Yaf_Image *img, uint32_t dir, const char *name,
+               uint32_t *ino) {
+    Yaf_Dentry *yd;
+    int ret;
+
+    ret = yaf_find_dentry(img, dir, name, &yd);
+    if (!ret) {
+        *ino = le32toh(yd->d_ino);
+    }
+    return ret;
+}
+
+/* rename the dentry @yd to @name */
+static void yaf_set_name(Yaf_Image *img, Yaf_Dentry *yd, const char *name) {
+    size_t len = strlen(name);
+
+    yd->d_name_len = htole32(len);
+    memset(yd->d_name, 0, YAF_DENTRY_NAME_LEN);
+    memcpy(yd->d_name, name, len);
+    yaf_dirty(img, yd);
+}
+
+/*
+ * Add the dentry @name to the inode @ino in the directory @dir, in the
+ * first hole or behind the last dentry, and count it in the links of
+ * @dir like the driver does.
+ */
+int yaf_add_dentry(Yaf_Image *img, uint32_t dir, const char *name,
+                   uint32_t ino) {
+    Yaf_Inode *yi = yaf_inode(img, dir);
+    uint64_t size = yaf_inode_get_size(img, yi), doff;
+    size_t len = strlen(name);
+    Yaf_Dentry *yd = NULL;
+    int ret;
+
+    if (!len || len > YAF_DENTRY_NAME_LEN) {
+        return len ? -ENAMETOOLONG : -EINVAL;
+    }
+
+    for (doff = 0; doff < size; doff += YAF_DENTRY_SIZE) {
+        yd = yaf_dentry(img, yi, doff);
+        if (le32toh(yd->d_ino) == RESERVED_INO) {
+            break;
+        }
+    }
+    if (doff == size) {
+        /* check whether directory is full */
+        if (size / YAF_DENTRY_SIZE == MAX_DENTRYS) {
+            return -ENOSPC;
+        }
+        if (size % YAF_BLOCK_SIZE == 0) {
+            uint32_t dno;
+
+            ret = yaf_alloc_dblock(img, &dno);
+            if (ret) {
+                return ret;
+            }
+            memset(yaf_block(img, img->bid_d + dno), 0, YAF_BLOCK_SIZE);
+            yi->i_block[size / YAF_BLOCK_SIZE] = htole32(dno);
+        }
+        yaf_inode_set_size(img, yi, size + YAF_DENTRY_SIZE);
+        yd = yaf_dentry(img, yi, doff);
+    }
+
+    yd->d_ino = htole32(ino);
+    yaf_set_name(img, yd, name);
+
+    yi->i_nlink = htole32(le32toh(yi->i_nlink) + 1);
+    yaf_inode_stamp(img, dir, YAF_MTIME | YAF_CTIME);
+    return 0;
+}
+
+/*
+ * Call @actor on each dentry of @dir from the offset @doff on, with
+ * the offset behind it, until it returns nonzero.
+ */
+int yaf_readdir(Yaf_Image *img, uint32_t dir, uint64_t doff,
+                int (*actor)(void *arg, const char *name, uint32_t len,
+                             uint32_t ino, uint64_t next),
+                void *arg) {
+    Yaf_Inode *yi = yaf_inode(img, dir);
+    uint64_t size = yaf_inode_get_size(img, yi);
+
+    if (!S_ISDIR(le32toh(yi->i_mode))) {
+        return -ENOTDIR;
+    }
+
+    for (; doff < size; doff += YAF_DENTRY_SIZE) {
+        Yaf_Dentry *yd = yaf_dentry(img, yi, doff);
+        uint32_t len = le32toh(yd->d_name_len);
+
+        if (le32toh(yd->d_ino) == RESERVED_INO) {
+            continue;
+        }
+        len = len < YAF_DENTRY_NAME_LEN ? len : YAF_DENTRY_NAME_LEN;
+        if (actor(arg, yd->d_name, len, le32toh(yd->d_ino),
+                  doff + YAF_DENTRY_SIZE)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Create the inode @name of @mode in the directory @dir with one link,
+ * a directory included, as its dentrys count as its further links.
+ */
+int yaf_create(Yaf_Image *img, uint32_t dir, const char *name,
+               uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino) {
+    Yaf_Inode *yi;
+    uint32_t found;
+    int ret;
+
+    ret = yaf_lookup(img, dir, name, &found);
+    if (ret != -ENOENT) {
+        return ret ? ret : -EEXIST;
+    }
+
+    ret = yaf_alloc_inode(img, ino);
+    if (ret) {
+        return ret;
+    }
+    yi = yaf_inode(img, *ino);
+    yi->i_mode = htole32(mode);
+    yi->i_uid = htole32(uid);
+    yi->i_gid = htole32(gid);
+    yi->i_nlink = htole32(1);
+    for (int i = 0; i < YAF_IBLOCKS; ++i) {
+        yi->i_block[i] = htole32(RESERVED_DNO);
+    }
+    yaf_inode_stamp(img, *ino, YAF_ATIME | YAF_MTIME | YAF_CTIME);
+
+    ret = yaf_add_dentry(img, dir, name, *ino);
+    if (ret) {
+        yaf_free_inode(img, *ino);
+    }
+    return ret;
+}
+
+/* read up to @size bytes at @off of the file @ino into @buf */
+ssize_t yaf_read(Yaf_Image *img, uint32_t ino, void *buf, size_t size,
+                 uint64_t off) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint64_t fsize = yaf_inode_get_size(img, yi);
+    uint32_t nr = yaf_inode_blocks(img, yi);
+
+    if (S_ISDIR(le32toh(yi->i_mode))) {
+        return -EISDIR;
+    }
+    if (off >= fsize) {
+        return 0;
+    }
+    if (size > fsize - off) {
+        size = fsize - off;
+    }
+
+    for (size_t done = 0, len; done < size; done += len) {
+        uint64_t pos = off + done, blk = pos / YAF_BLOCK_SIZE;
+
+        len = YAF_BLOCK_SIZE - pos % YAF_BLOCK_SIZE;
+        len = len < size - done ? len : size - done;
+        if (blk < nr) {
+            memcpy((uint8_t *)buf + done,
+                   (uint8_t *)yaf_block(img, img->bid_d +
+                                        le32toh(yi->i_block[blk])) +
+                   pos % YAF_BLOCK_SIZE, len);
+        } else {
+            memset((uint8_t *)buf + done, 0, len);
+        }
+    }
+    return size;
+}
+
+/*
+ * Grow the blocks of the inode @yi to @nr, zeroing those not
+ * overwritten whole by the bytes within [@off, @end) afterwards.
+ *
+ * The blocks of a file are a prefix of *i_block*, so the blocks in
+ * between are allocated as well.
+ */
+static int yaf_grow(Yaf_Image *img, Yaf_Inode *yi, uint32_t nr,
+                    uint64_t off, uint64_t end) {
+    for (uint32_t i = yaf_inode_blocks(img, yi); i < nr; ++i) {
+        uint64_t from = (uint64_t)i * YAF_BLOCK_SIZE;
+        uint32_t dno;
+        int ret;
+
+        ret = yaf_alloc_dblock(img, &dno);
+        if (ret) {
+            return ret;
+        }
+        if (off > from || end < from + YAF_BLOCK_SIZE) {
+            memset(yaf_block(img, img->bid_d + dno), 0, YAF_BLOCK_SIZE);
+        }
+        yi->i_block[i] = htole32(dno);
+        yaf_dirty(img, yi);
+    }
+    return 0;
+}
+
+/*
+ * Zero the bytes of the file @yi behind @size within its last block,
+ * so growing it later reads zeros there.
+ */
+static void yaf_zero_tail(Yaf_Image *img, Yaf_Inode *yi, uint64_t size) {
+    uint32_t blk = size / YAF_BLOCK_SIZE;
+
+    if (size % YAF_BLOCK_SIZE && blk < yaf_inode_blocks(img, yi)) {
+        memset((uint8_t *)yaf_block(img, img->bid_d +
+                                    le32toh(yi->i_block[blk])) +
+               size % YAF_BLOCK_SIZE, 0,
+               YAF_BLOCK_SIZE - size % YAF_BLOCK_SIZE);
+    }
+}
+
+/* write the @size bytes of @buf at @off of the file @ino */
+ssize_t yaf_write(Yaf_Image *img, uint32_t ino, const void *buf,
+                  size_t size, uint64_t off) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint64_t end = off + size;
+    int ret;
+
+    if (S_ISDIR(le32toh(yi->i_mode))) {
+        return -EISDIR;
+    }
+    if (!size) {
+        return 0;
+    }
+    if (end < off || end > MAX_FILESIZE) {
+        return -EFBIG;
+    }
+
+    if (off > yaf_inode_get_size(img, yi)) {
+        yaf_zero_tail(img, yi, yaf_inode_get_size(img, yi));
+    }
+    ret = yaf_grow(img, yi, div_ceil(end, YAF_BLOCK_SIZE), off, end);
+    if (ret) {
+        return ret;
+    }
+
+    for (size_t done = 0, len; done < size; done += len) {
+        uint64_t pos = off + done;
+
+        len = YAF_BLOCK_SIZE - pos % YAF_BLOCK_SIZE;
+        len = len < size - done ? len : size - done;
+        memcpy((uint8_t *)yaf_block(img, img->bid_d +
+                                    le32toh(yi->i_block[pos /
+                                                        YAF_BLOCK_SIZE])) +
+               pos % YAF_BLOCK_SIZE, (const uint8_t *)buf + done, len);
+    }
+
+    if (end > yaf_inode_get_size(img, yi)) {
+        yaf_inode_set_size(img, yi, end);
+    }
+    yaf_inode_stamp(img, ino, YAF_MTIME | YAF_CTIME);
+    return size;
+}
+
+/* release the blocks of the inode @yi from the @nr-th one on */
+static void yaf_shrink(Yaf_Image *img, Yaf_Inode *yi, uint32_t nr) {
+    for (uint32_t i = yaf_inode_blocks(img, yi); i > nr; --i) {
+        yaf_free_dblock(img, le32toh(yi->i_block[i - 1]));
+        yi->i_block[i - 1] = htole32(RESERVED_DNO);
+    }
+    yaf_dirty(img, yi);
+}
+
+/* set the size of the file @ino to @size */
+int yaf_truncate(Yaf_Image *img, uint32_t ino, uint64_t size) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint64_t old = yaf_inode_get_size(img, yi);
+    int ret;
+
+    if (S_ISDIR(le32toh(yi->i_mode))) {
+        return -EISDIR;
+    }
+    if (!S_ISREG(le32toh(yi->i_mode))) {
+        return -EINVAL;
+    }
+    if (size > MAX_FILESIZE) {
+        return -EFBIG;
+    }
+
+    if (size < old) {
+        yaf_shrink(img, yi, div_ceil(size, YAF_BLOCK_SIZE));
+        yaf_zero_tail(img, yi, size);
+    } else if (size > old) {
+        yaf_zero_tail(img, yi, old);
+        ret = yaf_grow(img, yi, div_ceil(size, YAF_BLOCK_SIZE), 0, 0);
+        if (ret) {
+            return ret;
+        }
+    }
+    yaf_inode_set_size(img, yi, size);
+    yaf_inode_stamp(img, ino, YAF_MTIME | YAF_CTIME);
+    return 0;
+}
+
+/*
+ * Put the inode @ino, which just lost its last link, at the head of
+ * the orphan list, unless the image is too old to have one.
+ */
+static void yaf_orphan_add(Yaf_Image *img, uint32_t ino) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+
+    if (img->version == YAF_VERSION_LEGACY) {
+        return;
+    }
+    yi->i_atime = img->ysb->orphan;
+    yaf_dirty(img, yi);
+    img->ysb->orphan = htole32(ino);
+}
+
+/* take the inode @ino off the orphan list, if it is there */
+static void yaf_orphan_del(Yaf_Image *img, uint32_t ino) {
+    uint32_t *link = &img->ysb->orphan;
+
+    if (img->version == YAF_VERSION_LEGACY) {
+        return;
+    }
+    /* a broken list cannot loop more often than there are inodes */
+    for (uint32_t nr = 0; nr < img->nr_inodes; ++nr) {
+        uint32_t next = le32toh(*link);
+        Yaf_Inode *yi;
+
+        if (next == RESERVED_INO || next >= img->nr_inodes) {
+            return;
+        }
+        yi = yaf_inode(img, next);
+        if (next == ino) {
+            *link = yi->i_atime;
+            yaf_dirty(img, link);
+            return;
+        }
+        link = &yi->i_atime;
+    }
+}
+
+/*
+ * Drop a link of the inode @ino, putting it on the orphan list once
+ * the last one is gone, like the driver does until the inode is
+ * released by yaf_evict().
+ */
+static void yaf_drop_link(Yaf_Image *img, uint32_t ino) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint32_t nlink = le32toh(yi->i_nlink);
+
+    yi->i_nlink = htole32(nlink ? nlink - 1 : 0);
+    yaf_inode_stamp(img, ino, YAF_CTIME);
+    if (nlink <= 1) {
+        yaf_orphan_add(img, ino);
+    }
+}
+
+/* release the data blocks and the inode @ino, which has no links left */
+void yaf_evict(Yaf_Image *img, uint32_t ino) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+
+    yaf_orphan_del(img, ino);
+    if (yaf_inode_blocks(img, yi)) {
+        yaf_shrink(img, yi, 0);
+    }
+    yaf_free_inode(img, ino);
+}
+
+/* add the dentry @name to the inode @ino in the directory @dir */
+int yaf_link(Yaf_Image *img, uint32_t ino, uint32_t dir, const char *name) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint32_t found;
+    int ret;
+
+    if (S_ISDIR(le32toh(yi->i_mode))) {
+        return -EPERM;
+    }
+    ret = yaf_lookup(img, dir, name, &found);
+    if (ret != -ENOENT) {
+        return ret ? ret : -EEXIST;
+    }
+
+    ret = yaf_add_dentry(img, dir, name, ino);
+    if (ret) {
+        return ret;
+    }
+    yi->i_nlink = htole32(le32toh(yi->i_nlink) + 1);
+    yaf_inode_stamp(img, ino, YAF_CTIME);
+    return 0;
+}
+
+/*
+ * Remove the dentry @name from the directory @dir and drop a link of
+ * its inode @ino, which must be a directory without dentrys if @rmdir
+ * is set, or no directory otherwise.
+ */
+static int yaf_remove(Yaf_Image *img, uint32_t dir, const char *name,
+                      bool rmdir, uint32_t *ino) {
+    Yaf_Inode *yi;
+    Yaf_Dentry *yd;
+    int ret;
+
+    ret = yaf_find_dentry(img, dir, name, &yd);
+    if (ret) {
+        return ret;
+    }
+    *ino = le32toh(yd->d_ino);
+    yi = yaf_inode(img, *ino);
+
+    if (rmdir && !S_ISDIR(le32toh(yi->i_mode))) {
+        return -ENOTDIR;
+    }
+    if (!rmdir && S_ISDIR(le32toh(yi->i_mode))) {
+        return -EISDIR;
+    }
+    /* check whether the directory is empty */
+    if (rmdir && le32toh(yi->i_nlink) > 1) {
+        return -ENOTEMPTY;
+    }
+
+    yd->d_ino = htole32(RESERVED_INO);
+    yaf_dirty(img, yd);
+    yaf_drop_link(img, dir);
+    yaf_inode_stamp(img, dir, YAF_MTIME | YAF_CTIME);
+    yaf_drop_link(img, *ino);
+    return 0;
+}
+
+/* remove the file @name from the directory @dir */
+int yaf_unlink(Yaf_Image *img, uint32_t dir, const char *name,
+               uint32_t *ino) {
+    return yaf_remove(img, dir, name, false, ino);
+}
+
+/* remove the empty directory @name from the directory @dir */
+int yaf_rmdir(Yaf_Image *img, uint32_t dir, const char *name,
+              uint32_t *ino) {
+    return yaf_remove(img, dir, name, true, ino);
+}
+
+/*
+ * Rename @oname in @odir to @nname in @ndir, rewriting only the
+ * affected dentrys and links like the driver does.
+ *
+ * A replaced inode whose last link is gone is returned in @gone for
+ * yaf_evict(), *RESERVED_INO* otherwise.
+ */
+int yaf_rename(Yaf_Image *img, uint32_t odir, const char *oname,
+               uint32_t ndir, const char *nname, unsigned int flags,
+               uint32_t *gone) {
+    Yaf_Dentry *od, *nd = NULL;
+    uint32_t ino, target = RESERVED_INO;
+    int ret;
+
+    *gone = RESERVED_INO;
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+        return -EINVAL;
+    }
+    if (!*nname || strlen(nname) > YAF_DENTRY_NAME_LEN) {
+        return *nname ? -ENAMETOOLONG : -EINVAL;
+    }
+
+    ret = yaf_find_dentry(img, odir, oname, &od);
+    if (ret) {
+        return ret;
+    }
+    ino = le32toh(od->d_ino);
+    ret = yaf_find_dentry(img, ndir, nname, &nd);
+    if (ret && ret != -ENOENT) {
+        return ret;
+    }
+    if (!ret) {
+        target = le32toh(nd->d_ino);
+    }
+
+    if (flags & RENAME_EXCHANGE) {
+        if (target == RESERVED_INO) {
+            return -ENOENT;
+        }
+        od->d_ino = htole32(target);
+        nd->d_ino = htole32(ino);
+        yaf_dirty(img, od);
+        yaf_dirty(img, nd);
+        yaf_inode_stamp(img, target, YAF_CTIME);
+        goto stamp;
+    }
+    if (target != RESERVED_INO && (flags & RENAME_NOREPLACE)) {
+        return -EEXIST;
+    }
+    if (target == ino) {
+        return 0;
+    }
+
+    if (target != RESERVED_INO) {
+        Yaf_Inode *yi = yaf_inode(img, ino), *tyi = yaf_inode(img, target);
+
+        if (S_ISDIR(le32toh(yi->i_mode)) && !S_ISDIR(le32toh(tyi->i_mode))) {
+            return -ENOTDIR;
+        }
+        if (!S_ISDIR(le32toh(yi->i_mode)) && S_ISDIR(le32toh(tyi->i_mode))) {
+            return -EISDIR;
+        }
+        /* check whether the replaced directory is empty */
+        if (S_ISDIR(le32toh(tyi->i_mode)) && le32toh(tyi->i_nlink) > 1) {
+            return -ENOTEMPTY;
+        }
+
+        nd->d_ino = htole32(ino);
+        yaf_dirty(img, nd);
+        yaf_drop_link(img, target);
+        if (!le32toh(tyi->i_nlink)) {
+            *gone = target;
+        }
+    } else if (odir == ndir) {
+        /* a plain rename inside @odir only rewrites the dentry name */
+        yaf_set_name(img, od, nname);
+        goto stamp;
+    } else {
+        ret = yaf_add_dentry(img, ndir, nname, ino);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    /* the new dentry is filled before the old one is cleared */
+    od->d_ino = htole32(RESERVED_INO);
+    yaf_dirty(img, od);
+    yaf_drop_link(img, odir);
+
+stamp:
+    yaf_inode_stamp(img, odir, YAF_MTIME | YAF_CTIME);
+    yaf_inode_stamp(img, ndir, YAF_MTIME | YAF_CTIME);
+    yaf_inode_stamp(img, ino, YAF_CTIME);
+    return 0;
+}
+
+/*
+ * Store the target @target of the symlink @ino.
+ *
+ * Short targets are kept inside *i_block* like the driver does,
+ * longer ones in a data block without the terminating null.
+ */
+int yaf_set_symlink(Yaf_Image *img, uint32_t ino, const char *target) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    size_t len = strlen(target);
+    ssize_t ret;
+
+    if (len >= YAF_BLOCK_SIZE) {
+        return -ENAMETOOLONG;
+    }
+
+    if (len <= YAF_FAST_SYMLINK_LEN) {
+        memset(yi->i_block, 0, sizeof(yi->i_block));
+        memcpy(yi->i_block, target, len);
+        yaf_inode_set_size(img, yi, len);
+        return 0;
+    }
+    ret = yaf_write(img, ino, target, len, 0);
+    return ret < 0 ? ret : 0;
+}
+
+/* create the symlink @name to @target in the directory @dir */
+int yaf_symlink(Yaf_Image *img, uint32_t dir, const char *name,
+                const char *target, uint32_t uid, uint32_t gid,
+                uint32_t *ino) {
+    int ret;
+
+    if (strlen(target) >= YAF_BLOCK_SIZE) {
+        return -ENAMETOOLONG;
+    }
+    ret = yaf_create(img, dir, name, S_IFLNK | 0777, uid, gid, ino);
+    if (ret) {
+        return ret;
+    }
+
+    ret = yaf_set_symlink(img, *ino, target);
+    if (ret) {
+        yaf_unlink(img, dir, name, ino);
+        yaf_evict(img, *ino);
+    }
+    return ret;
+}
+
+/*
+ * Copy the target of the symlink @ino into @buf of @size bytes, null
+ * terminated, and return its length.
+ */
+ssize_t yaf_readlink(Yaf_Image *img, uint32_t ino, char *buf, size_t size) {
+    Yaf_Inode *yi = yaf_inode(img, ino);
+    uint64_t fsize = yaf_inode_get_size(img, yi), len;
+    ssize_t ret;
+
+    if (!S_ISLNK(le32toh(yi->i_mode))) {
+        return -EINVAL;
+    }
+    if (!size) {
+        return -ERANGE;
+    }
+    len = fsize < size - 1 ? fsize : size - 1;
+
+    if (fsize <= YAF_FAST_SYMLINK_LEN) {
+        memcpy(buf, yi->i_block, len);
+    } else {
+        ret = yaf_read(img, ino, buf, len, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        len = ret;
+    }
+    buf[len] = '\0';
+    return len;
+}
@@ -0,0 +1,221 @@
+#ifndef __LIBYAF_H_
+
+    #define __LIBYAF_H_
+
+    /*
+     * libyaf, the on-disk format of yaf in user space
+     *
+     * The tools share the layout of the sections, the access to the
+     * memory-mapped image and the allocation, directory and file
+     * algorithms of the driver from here, so they can be run and
+     * profiled against an image file without booting a kernel.
+     *
+     * The image must not be mounted meanwhile. The metadata is
+     * modified in place without the journal, whose committed
+     * transactions are replayed by yaf_image_open() first, and the
+     * checksums of the modified blocks, the free counters and the
+     * superblock are brought up to date by yaf_image_sync().
+     *
+     * The functions return 0 or a negative error code, like the driver.
+     */
+    #include <stdbool.h>
+    #include <stdint.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <time.h>
+    #include "../include/inode.h"
+    #include "../include/super.h"
+
+    /* the parameters the sections of a new image are picked from */
+    typedef struct YAF_LAYOUT {
+        uint64_t bnr;           /* number of blocks of the device */
+        uint32_t version;       /* on-disk format version */
+        uint32_t nr_j;          /* number of journal blocks */
+        int checksums;          /* whether to checksum the metadata */
+        uint64_t inodes;        /* number of inodes */
+        uint32_t reserved_percentage;   /* percentage of the data blocks
+                                           reserved */
+        int lazy_itable_init;   /* whether to zero only one inode block */
+        uint64_t max_bnr;       /* number of blocks the data bitmap and
+                                   checksum sections are sized for, so
+                                   the image grows up to it in place */
+    } Yaf_Layout;
+
+    /* flags of yaf_image_open() */
+    #define YAF_IMAGE_RDWR      0x1 /* write the changes to the image,
+                                       otherwise they stay in memory */
+    #define YAF_IMAGE_FORCE     0x2 /* open even if the superblock does
+                                       not match its checksum */
+
+    /* an image opened by yaf_image_open() */
+    typedef struct YAF_IMAGE {
+        int fd;
+        int flags;              /* *YAF_IMAGE_* */
+        uint8_t *map;           /* the mapped device */
+        uint64_t bnr;           /* number of blocks of the device */
+        Yaf_Superblock *ysb;    /* the superblock within *map* */
+        uint32_t version;       /* on-disk format version */
+        uint32_t inode_size;    /* size of the on-disk inode */
+        uint32_t nr_inodes;     /* number of on-disk inodes */
+        uint32_t nr_d;          /* number of data blocks */
+        uint32_t nr_i_init;     /* number of zeroed inode blocks */
+        unsigned long bid_i;    /* first inode block */
+        unsigned long bid_d;    /* first data block */
+        int nr_replay;          /* number of the replayed transactions */
+
+        uint32_t nr_free_i;     /* number of free inodes */
+        uint32_t nr_free_d;     /* number of free data blocks */
+        uint32_t next_ino;      /* where the next inode search starts */
+        uint32_t next_dno;      /* where the next data block search
+                                   starts */
+        uint64_t *dirty;        /* per block whether its checksum is
+                                   stale */
+    } Yaf_Image;
+
+    /* get the number of blocks of the device or image file @fd */
+    int yaf_device_blocks(int fd, uint64_t *bnr);
+
+    /* fill the new superblock @ysb with the sections for @layout */
+    int yaf_layout(Yaf_Superblock *ysb, const Yaf_Layout *layout);
+
+    /* open and map the image @path with the *YAF_IMAGE_* @flags */
+    int yaf_image_open(Yaf_Image *img, const char *path, int flags);
+
+    /* store the checksums, the counters and the superblock */
+    int yaf_image_sync(Yaf_Image *img);
+
+    /* sync and unmap the image */
+    int yaf_image_close(Yaf_Image *img);
+
+    /* return the block @bid within the mapped image */
+    static inline void *yaf_block(Yaf_Image *img, uint64_t bid) {
+        return img->map + bid * YAF_BLOCK_SIZE;
+    }
+
+    /* the metadata block holding @p was modified */
+    void yaf_dirty(Yaf_Image *img, const void *p);
+
+    /* return the on-disk inode @ino */
+    Yaf_Inode *yaf_inode(Yaf_Image *img, uint32_t ino);
+
+    /* return the 64-bit size of the on-disk inode @yi */
+    uint64_t yaf_inode_get_size(Yaf_Image *img, Yaf_Inode *yi);
+
+    /* set the 64-bit size of the on-disk inode @yi */
+    void yaf_inode_set_size(Yaf_Image *img, Yaf_Inode *yi, uint64_t size);
+
+    /* return the number of data blocks owned by the on-disk inode @yi */
+    uint32_t yaf_inode_blocks(Yaf_Image *img, Yaf_Inode *yi);
+
+    /* return the number of runs of consecutive data blocks of @yi */
+    uint32_t yaf_inode_extents(Yaf_Image *img, Yaf_Inode *yi);
+
+    /* timestamps of yaf_inode_stamp() */
+    #define YAF_ATIME   0x1
+    #define YAF_MTIME   0x2
+    #define YAF_CTIME   0x4
+
+    /* set the @which timestamps of the inode @ino to @ts */
+    void yaf_inode_set_time(Yaf_Image *img, uint32_t ino, int which,
+                            const struct timespec *ts);
+
+    /* set the @which timestamps of the inode @ino to now */
+    void yaf_inode_stamp(Yaf_Image *img, uint32_t ino, int which);
+
+    /* fill @st with the attributes of the inode @ino */
+    void yaf_stat(Yaf_Image *img, uint32_t ino, struct stat *st);
+
+    /*
+     * find the first bit within [@from, @to) of the bitmap from the
+     * block @bid on that is @set, or return -1
+     */
+    int64_t yaf_find_bit(Yaf_Image *img, unsigned long bid, uint32_t from,
+                         uint32_t to, bool set);
+
+    /* test the bit @idx of the bitmap from the block @bid on */
+    bool yaf_test_bit(Yaf_Image *img, unsigned long bid, uint32_t idx);
+
+    /* find an unused inode, mark it and zero it */
+    int yaf_alloc_inode(Yaf_Image *img, uint32_t *ino);
+
+    /* mark the inode @ino as unused */
+    void yaf_free_inode(Yaf_Image *img, uint32_t ino);
+
+    /* find an unused data block and mark it */
+    int yaf_alloc_dblock(Yaf_Image *img, uint32_t *dno);
+
+    /* mark the data block @dno as unused */
+    void yaf_free_dblock(Yaf_Image *img, uint32_t dno);
+
+    /* find the inode of the dentry @name in the directory @dir */
+    int yaf_lookup(Yaf_Image *img, uint32_t dir, const char *name,
+                   uint32_t *ino);
+
+    /* add the dentry @name to the inode @ino in the directory @dir */
+    int yaf_add_dentry(Yaf_Image *img, uint32_t dir, const char *name,
+                       uint32_t ino);
+
+    /*
+     * call @actor on each dentry of @dir from the offset @doff on, with
+     * the offset behind it, until it returns nonzero
+     */
+    int yaf_readdir(Yaf_Image *img, uint32_t dir, uint64_t doff,
+                    int (*actor)(void *arg, const char *name, uint32_t len,
+                                 uint32_t ino, uint64_t next),
+                    void *arg);
+
+    /* create the inode @name of @mode in the directory @dir */
+    int yaf_create(Yaf_Image *img, uint32_t dir, const char *name,
+                   uint32_t mode, uint32_t uid, uint32_t gid,
+                   uint32_t *ino);
+
+    /* read up to @size bytes at @off of the file @ino into @buf */
+    ssize_t yaf_read(Yaf_Image *img, uint32_t ino, void *buf, size_t size,
+                     uint64_t off);
+
+    /* write the @size bytes of @buf at @off of the file @ino */
+    ssize_t yaf_write(Yaf_Image *img, uint32_t ino, const void *buf,
+                      size_t size, uint64_t off);
+
+    /* set the size of the file @ino to @size */
+    int yaf_truncate(Yaf_Image *img, uint32_t ino, uint64_t size);
+
+    /* add the dentry @name to the inode @ino in the directory @dir */
+    int yaf_link(Yaf_Image *img, uint32_t ino, uint32_t dir,
+                 const char *name);
+
+    /*
+     * Remove the file, or the empty directory, @name from the directory
+     * @dir and drop a link of its inode @ino. An inode without links is
+     * kept on the orphan list until yaf_evict(), so the caller can
+     * release it once nothing uses it anymore.
+     */
+    int yaf_unlink(Yaf_Image *img, uint32_t dir, const char *name,
+                   uint32_t *ino);
+    int yaf_rmdir(Yaf_Image *img, uint32_t dir, const char *name,
+                  uint32_t *ino);
+
+    /*
+     * rename @oname in @odir to @nname in @ndir with the *RENAME_*
+     * @flags, returning a replaced inode without links in @gone
+     */
+    int yaf_rename(Yaf_Image *img, uint32_t odir, const char *oname,
+                   uint32_t ndir, const char *nname, unsigned int flags,
+                   uint32_t *gone);
+
+    /* release the data blocks and the inode @ino without links */
+    void yaf_evict(Yaf_Image *img, uint32_t ino);
+
+    /* store the target @target of the just created symlink @ino */
+    int yaf_set_symlink(Yaf_Image *img, uint32_t ino, const char *target);
+
+    /* create the symlink @name to @target in the directory @dir */
+    int yaf_symlink(Yaf_Image *img, uint32_t dir, const char *name,
+                    const char *target, uint32_t uid, uint32_t gid,
+                    uint32_t *ino);
+
+    /* copy the target of the symlink @ino into @buf, null terminated */
+    ssize_t yaf_readlink(Yaf_Image *img, uint32_t ino, char *buf,
+                         size_t size);
+
+#endif // __LIBYAF_H_
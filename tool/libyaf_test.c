@@ -0,0 +1,144 @@
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "../include/inode.h"
+#include "../include/yaf.h"
+#include "libyaf.h"
+
+/*
+ * libyaf_test exercises the allocation, directory and file algorithms
+ * of libyaf on a freshly formatted image, so they are checked without
+ * booting a kernel. *make unit* runs fsck.yaf on the image afterwards.
+ */
+
+/* fail the test at the current line unless @cond holds */
+#define expect(cond)                                        \
+    do {                                                    \
+        if (!(cond)) {                                      \
+            log(LOG_ERR, "expect(%s) failed", #cond);       \
+            goto out;                                       \
+        }                                                   \
+    } while (0)
+
+/* count the dentrys of a directory */
+static int count_dentry(void *arg, const char *name, uint32_t len,
+                        uint32_t ino, uint64_t next) {
+    ++*(uint32_t *)arg;
+    return 0;
+}
+
+/* write @len bytes of a pattern at @off of @ino and read them back */
+static int check_file(Yaf_Image *img, uint32_t ino, size_t len,
+                      uint64_t off) {
+    uint8_t *wbuf = malloc(len), *rbuf = malloc(len);
+    int ret = -1;
+
+    expect(wbuf && rbuf);
+    for (size_t i = 0; i < len; ++i) {
+        wbuf[i] = (i * 31 + off) & 0xff;
+    }
+    expect(yaf_write(img, ino, wbuf, len, off) == len);
+    expect(yaf_read(img, ino, rbuf, len, off) == len);
+    expect(!memcmp(wbuf, rbuf, len));
+    ret = 0;
+
+out:
+    free(wbuf);
+    free(rbuf);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t dir, ino, found, nr = 0, free_i, free_d;
+    char name[YAF_DENTRY_NAME_LEN + 2];
+    uint8_t zero[YAF_BLOCK_SIZE] = {};
+    uint8_t buf[YAF_BLOCK_SIZE];
+    Yaf_Image img;
+    int ret = EXIT_FAILURE;
+
+    if (argc != 2) {
+        log(LOG_ERR, "usage: %s <image>", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (yaf_image_open(&img, argv[1], YAF_IMAGE_RDWR)) {
+        return EXIT_FAILURE;
+    }
+    free_i = img.nr_free_i;
+    free_d = img.nr_free_d;
+
+    /* directories and lookups */
+    expect(!yaf_create(&img, ROOT_INO, "dir", S_IFDIR | 0755, 0, 0, &dir));
+    expect(yaf_create(&img, ROOT_INO, "dir", S_IFREG | 0644, 0, 0, &ino) ==
+           -EEXIST);
+    expect(!yaf_lookup(&img, ROOT_INO, "dir", &found) && found == dir);
+    expect(yaf_lookup(&img, ROOT_INO, "none", &found) == -ENOENT);
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    expect(yaf_create(&img, dir, name, S_IFREG | 0644, 0, 0, &ino) ==
+           -ENAMETOOLONG);
+    name[YAF_DENTRY_NAME_LEN] = '\0';
+    expect(!yaf_create(&img, dir, name, S_IFREG | 0644, 0, 0, &ino));
+    expect(!yaf_lookup(&img, dir, name, &found) && found == ino);
+
+    /* files within a block, across blocks, and beyond a hole */
+    expect(!yaf_create(&img, dir, "file", S_IFREG | 0644, 0, 0, &ino));
+    expect(!check_file(&img, ino, 100, 0));
+    expect(!check_file(&img, ino, YAF_BLOCK_SIZE + 200, 4000));
+    expect(!check_file(&img, ino, 10, MAX_FILESIZE - 10));
+    expect(yaf_read(&img, ino, buf, YAF_BLOCK_SIZE, 3 * YAF_BLOCK_SIZE) ==
+           YAF_BLOCK_SIZE && !memcmp(buf, zero, YAF_BLOCK_SIZE));
+    expect(yaf_write(&img, ino, buf, 1, MAX_FILESIZE) == -EFBIG);
+    expect(yaf_read(&img, dir, buf, 1, 0) == -EISDIR);
+
+    /* a full directory */
+    for (nr = 2; nr < MAX_DENTRYS; ++nr) {
+        snprintf(name, sizeof(name), "f%u", nr);
+        expect(!yaf_create(&img, dir, name, S_IFREG | 0644, 0, 0, &ino));
+    }
+    expect(yaf_create(&img, dir, "full", S_IFREG | 0644, 0, 0, &ino) ==
+           -ENOSPC);
+    nr = 0;
+    expect(!yaf_readdir(&img, dir, 0, count_dentry, &nr) && nr == MAX_DENTRYS);
+
+    expect(img.nr_free_i == free_i - MAX_DENTRYS - 1);
+    expect(img.nr_free_d == free_d - 1 - YAF_IBLOCKS - YAF_IBLOCKS);
+
+    /* truncate, rename and unlink release what they drop */
+    expect(!yaf_lookup(&img, dir, "file", &ino));
+    expect(!yaf_truncate(&img, ino, 100));
+    expect(img.nr_free_d == free_d - 1 - YAF_IBLOCKS - 1);
+    expect(!yaf_rename(&img, dir, "file", ROOT_INO, "moved", 0, &found) &&
+           found == RESERVED_INO);
+    expect(!yaf_rename(&img, dir, "f2", ROOT_INO, "moved", 0, &found) &&
+           found == ino);
+    yaf_evict(&img, found);
+    expect(!yaf_unlink(&img, dir, "f3", &ino));
+    expect(img.ysb->orphan == htole32(ino));
+    yaf_evict(&img, ino);
+    expect(img.ysb->orphan == htole32(RESERVED_INO));
+    expect(yaf_rmdir(&img, ROOT_INO, "dir", &ino) == -ENOTEMPTY);
+
+    /* fast and slow symlinks */
+    expect(!yaf_symlink(&img, ROOT_INO, "fast", "moved", 0, 0, &ino));
+    expect(yaf_readlink(&img, ino, name, sizeof(name)) == 5 &&
+           !strcmp(name, "moved"));
+    memset(buf, 'l', YAF_BLOCK_SIZE - 1);
+    buf[YAF_BLOCK_SIZE - 1] = '\0';
+    expect(!yaf_symlink(&img, ROOT_INO, "slow", (char *)buf, 0, 0, &ino));
+    expect(yaf_readlink(&img, ino, (char *)zero, sizeof(zero)) ==
+           YAF_BLOCK_SIZE - 1 && !strcmp((char *)zero, (char *)buf));
+    expect(img.nr_free_i == free_i - MAX_DENTRYS - 1);
+    log(LOG_INFO, "libyaf passes the checks on %s", argv[1]);
+    ret = EXIT_SUCCESS;
+
+out:
+    if (yaf_image_close(&img)) {
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
@@ -1,54 +1,138 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <search.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include "../include/csum.h"
 #include "../include/inode.h"
+#include "../include/journal.h"
 #include "../include/super.h"
 #include "../include/yaf.h"
 #include "../include/bitmap.h"
 #include "arguments.h"
+#include "libyaf.h"
 
-static inline uint32_t align_down(uint32_t x, uint32_t a) {
-    return x / a * a;
-}
+/* devices smaller than this get no journal by default */
+#define JOURNAL_DEFAULT_MIN_BNR (8 * YAF_JOURNAL_MIN_BLOCKS)
 
-static inline uint32_t idiv_ceil(uint32_t a, uint32_t b) {
-    return (a / b) + (a % b != 0);
-}
+/* zero buffer written by each vector of zero_blocks() */
+#define ZERO_SIZE   (64 KiB)
+/* number of vectors per pwritev() call, i.e. 4 MiB */
+#define ZERO_IOVS   64
 
-/* fill the on-disk superblock with relevant data */
-static long write_superblock(int bfd, Yaf_Superblock *ysb, long bnr) {
-    long ret;
-    uint32_t nr_i, nr_d, nr_ibp, nr_dbp;
+/*
+ * zero the @nr blocks from the block @bid for the @section
+ *
+ * The zeroing is offloaded to the device by BLKZEROOUT, or to the
+ * filesystem holding the image by FALLOC_FL_ZERO_RANGE, and only falls
+ * back to writing zeroes, *ZERO_IOVS* * *ZERO_SIZE* bytes per call.
+ */
+static long zero_blocks(int bfd, unsigned long bid, unsigned long nr,
+                        const char *section) {
+    static char zeroes[ZERO_SIZE];
+    struct iovec iov[ZERO_IOVS];
+    uint64_t off = (uint64_t)bid * YAF_BLOCK_SIZE;
+    uint64_t len = (uint64_t)nr * YAF_BLOCK_SIZE;
+    struct stat bstat;
 
-    /* initialize the *Yaf_Superblock* */
-    bnr = align_down(bnr, INODES_PER_BLOCK);
-    nr_ibp = idiv_ceil(bnr, YAF_BLOCK_SIZE * BITS_PER_BYTE);
-    ysb->yaf_sb_info.nr_ibp = htole32(nr_ibp);
-    log(LOG_INFO, "inode bitmap section has %d block(s)", nr_ibp);
+    if (!nr) {
+        return 0;
+    }
+    log(LOG_INFO, "Zeroing %ld byte(s) at disk offset %ld for the %s",
+        (long)len, (long)off, section);
 
-    nr_dbp = idiv_ceil(bnr, YAF_BLOCK_SIZE * BITS_PER_BYTE);
-    ysb->yaf_sb_info.nr_dbp = htole32(nr_dbp);
-    log(LOG_INFO, "data bitmap section has %d block(s)", nr_dbp);
+    if (!fstat(bfd, &bstat) && S_ISBLK(bstat.st_mode)) {
+        uint64_t range[2] = {off, len};
 
-    nr_i = idiv_ceil(bnr, INODES_PER_BLOCK);
-    ysb->yaf_sb_info.nr_i = htole32(nr_i);
-    log(LOG_INFO, "inode blocks section has %d block(s)", nr_i);
+        if (!ioctl(bfd, BLKZEROOUT, range)) {
+            return 0;
+        }
+    } else if (!fallocate(bfd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                          off, len)) {
+        return 0;
+    }
 
-    nr_d = bnr - 1 - nr_i - nr_ibp - nr_dbp;
-    ysb->yaf_sb_info.nr_d = htole32(nr_d);
-    log(LOG_INFO, "data blocks section has %d block(s)", nr_d);
+    for (int i = 0; i < ZERO_IOVS; ++i) {
+        iov[i].iov_base = zeroes;
+        iov[i].iov_len = ZERO_SIZE;
+    }
+    while (len) {
+        int cnt = len / ZERO_SIZE < ZERO_IOVS ? len / ZERO_SIZE : ZERO_IOVS;
+        ssize_t res;
 
+        /* the tail shorter than *ZERO_SIZE* takes a vector of its own */
+        if (cnt < ZERO_IOVS && len % ZERO_SIZE) {
+            iov[cnt++].iov_len = len % ZERO_SIZE;
+        }
+        res = pwritev(bfd, iov, cnt, off);
+        if (res <= 0) {
+            log(LOG_ERR, "pwritev() failed with error %s", strerror(errno));
+            return -EIO;
+        }
+        off += res;
+        len -= res;
+    }
 
-    /* fill magic string */
-    for (int idx = 0; idx < sizeof(ysb->magic); idx += sizeof(MAGIC)) {
-        memcpy(&ysb->magic[idx], MAGIC, sizeof(MAGIC));
+    return 0;
+}
+
+/*
+ * fill the on-disk superblock of the format @version with relevant data,
+ * sizing the sections as requested by @arguments, see yaf_layout()
+ *
+ * The inode blocks hold one inode per *bytes_per_inode* bytes of the
+ * device, unless the number of *inodes* is given.
+ */
+static long write_superblock(int bfd, Yaf_Superblock *ysb, uint64_t bnr,
+                             uint32_t version, const Arguments *arguments) {
+    Yaf_Layout layout = {
+        .bnr = bnr,
+        .version = version,
+        .nr_j = arguments->journal_blocks,
+        .checksums = arguments->checksums,
+        .inodes = arguments->inodes ? arguments->inodes
+                  : bnr * YAF_BLOCK_SIZE / arguments->bytes_per_inode,
+        .reserved_percentage = arguments->reserved_percentage,
+        .lazy_itable_init = arguments->lazy_itable_init,
+        .max_bnr = arguments->max_size / YAF_BLOCK_SIZE,
+    };
+    long ret;
+
+    ret = yaf_layout(ysb, &layout);
+    if (ret) {
+        errno = -ret;
+        goto out;
+    }
+    log(LOG_INFO, "on-disk format version %d with %d-byte inodes",
+        version, YAF_INODE_SIZE(ysb));
+    log(LOG_INFO, "journal section has %d block(s)", le32toh(ysb->nr_j));
+    log(LOG_INFO, "checksum section has %d block(s)", le32toh(ysb->nr_c));
+    log(LOG_INFO, "inode blocks section has %d block(s) for %d inodes",
+        le32toh(ysb->yaf_sb_info.nr_i),
+        le32toh(ysb->yaf_sb_info.nr_i) * INODES_PER_BLOCK(ysb));
+    log(LOG_INFO, "inode bitmap section has %d block(s)",
+        le32toh(ysb->yaf_sb_info.nr_ibp));
+    log(LOG_INFO, "data bitmap section has %d block(s)",
+        le32toh(ysb->yaf_sb_info.nr_dbp));
+    if (version >= YAF_VERSION_ITABLE_INIT) {
+        log(LOG_INFO, "inode blocks section has %d zeroed block(s)",
+            le32toh(ysb->nr_i_init));
     }
+    log(LOG_INFO, "data blocks section has %d block(s)",
+        le32toh(ysb->yaf_sb_info.nr_d));
+    log(LOG_INFO, "%d data block(s) are reserved for the privileged users",
+        le32toh(ysb->nr_r));
 
     /* write down the data */
     ret = lseek(bfd, BID_SB_MIN(ysb) * YAF_BLOCK_SIZE, SEEK_SET);
@@ -72,9 +156,25 @@ static long write_superblock(int bfd, Yaf_Superblock *ysb, long bnr) {
     ysb->yaf_sb_info.nr_dbp = le32toh(ysb->yaf_sb_info.nr_dbp);
     ysb->yaf_sb_info.nr_i = le32toh(ysb->yaf_sb_info.nr_i);
     ysb->yaf_sb_info.nr_d = le32toh(ysb->yaf_sb_info.nr_d);
+    ysb->yaf_sb_info.version = le32toh(ysb->yaf_sb_info.version);
+    ysb->state = le32toh(ysb->state);
+    ysb->nr_free_i = le32toh(ysb->nr_free_i);
+    ysb->nr_free_d = le32toh(ysb->nr_free_d);
+    ysb->nr_j = le32toh(ysb->nr_j);
+    ysb->nr_c = le32toh(ysb->nr_c);
+    ysb->nr_i_init = le32toh(ysb->nr_i_init);
+    ysb->nr_r = le32toh(ysb->nr_r);
 
     log(LOG_INFO, "superblock is at blocks [%ld, %ld]",
         BID_SB_MIN(ysb), BID_SB_MAX(ysb));
+    if (NR_J(ysb)) {
+        log(LOG_INFO, "journal section is at blocks [%ld, %ld]",
+            BID_J_MIN(ysb), BID_J_MAX(ysb));
+    }
+    if (NR_C(ysb)) {
+        log(LOG_INFO, "checksum section is at blocks [%ld, %ld]",
+            BID_C_MIN(ysb), BID_C_MAX(ysb));
+    }
     log(LOG_INFO, "inode bitmap section is at blocks [%ld, %ld]",
         BID_IBP_MIN(ysb), BID_IBP_MAX(ysb));
     log(LOG_INFO, "data bitmap section is at blocks [%ld, %ld]",
@@ -91,6 +191,48 @@ out:
 }
 
 
+/*
+ * fill the journal section with an empty log
+ *
+ * The block behind the journal superblock is zeroed, so a log left
+ * by an earlier format is never replayed. Its sequences are skipped
+ * as well, since the first sequence is taken from the clock.
+ */
+static long write_journal(int bfd, Yaf_Superblock *ysb) {
+    long ret = 0;
+    union {
+        Yaf_Journal_Sb jsb;
+        char bytes[YAF_BLOCK_SIZE];
+    } blocks[2] = {};
+
+    if (!NR_J(ysb)) {
+        goto out;
+    }
+
+    blocks[0].jsb.j_magic = htole32(YAF_JOURNAL_MAGIC);
+    blocks[0].jsb.j_seq = htole32(time(NULL));
+
+    ret = lseek(bfd, BID_J_MIN(ysb) * YAF_BLOCK_SIZE, SEEK_SET);
+    if (ret == -1) {
+        ret = errno;
+        log(LOG_ERR, "lseek() failed with error %s", strerror(errno));
+        goto out;
+    }
+    ret = write(bfd, blocks, sizeof(blocks));
+    if (ret != sizeof(blocks)) {
+        ret = -EIO;
+        log(LOG_INFO, "write() failed");
+        goto out;
+    }
+    log(LOG_INFO, "Writing %ld byte(s) at disk offset %ld "
+        "for the journal", sizeof(blocks), BID_J_MIN(ysb) * YAF_BLOCK_SIZE);
+
+    ret = 0;
+
+out:
+    return ret;
+}
+
 /* convert inode bitmap idx to the offset in disk */
 #define IDXI2DOFF(sb, idx)  (IDXI2BID(sb, idx) * YAF_BLOCK_SIZE \
                              + IDX2BKOFF(idx))
@@ -101,25 +243,10 @@ static long write_inode_bitmap(int bfd, Yaf_Superblock *ysb) {
     uint8_t byte = 0;
 
     /* zero the inode bitmap section */
-    for (int i = 0; i < le32toh(ysb->yaf_sb_info.nr_ibp); ++i) {
-        char bytes[YAF_BLOCK_SIZE] = {};
-
-        ret = lseek(bfd, (BID_IBP_MIN(ysb) + i) * YAF_BLOCK_SIZE,
-                    SEEK_SET);
-        if (ret == -1) {
-            ret = errno;
-            log(LOG_ERR, "lseek() failed with error %s", strerror(errno));
-            goto out;
-        }
-        ret = write(bfd, &bytes, sizeof(bytes));
-        if (ret != sizeof(bytes)) {
-            ret = -EIO;
-            log(LOG_INFO, "write() failed");
-            goto out;
-        }
-        log(LOG_INFO, "Writing %ld byte(s) at disk offset %ld "
-            "for the inode bitmap", sizeof(bytes),
-            (BID_IBP_MIN(ysb) + i) * YAF_BLOCK_SIZE);
+    ret = zero_blocks(bfd, BID_IBP_MIN(ysb),
+                      le32toh(ysb->yaf_sb_info.nr_ibp), "inode bitmap");
+    if (ret) {
+        goto out;
     }
 
     /* mark the reserved and root inode */
@@ -150,34 +277,9 @@ out:
 
 /* fill the disk data bitmap section with relevant data */
 static long write_data_bitmap(int bfd, Yaf_Superblock *ysb) {
-    long ret = 0;
-
     /* zero the data bitmap section */
-    for (int i = 0; i < le32toh(ysb->yaf_sb_info.nr_dbp); ++i) {
-        char bytes[YAF_BLOCK_SIZE] = {};
-
-        ret = lseek(bfd, (BID_DBP_MIN(ysb) + i) * YAF_BLOCK_SIZE,
-                    SEEK_SET);
-        if (ret == -1) {
-            ret = errno;
-            log(LOG_ERR, "lseek() failed with error %s", strerror(errno));
-            goto out;
-        }
-        ret = write(bfd, &bytes, sizeof(bytes));
-        if (ret != sizeof(bytes)) {
-            ret = -EIO;
-            log(LOG_INFO, "write() failed");
-            goto out;
-        }
-        log(LOG_INFO, "Writing %ld byte(s) at disk offset %ld "
-            "for the data bitmap", sizeof(bytes),
-            (BID_DBP_MIN(ysb) + i) * YAF_BLOCK_SIZE);
-    }
-
-    ret = 0;
-
-out:
-    return ret;
+    return zero_blocks(bfd, BID_DBP_MIN(ysb),
+                       le32toh(ysb->yaf_sb_info.nr_dbp), "data bitmap");
 }
 
 /* print debugging information of the given inode */
@@ -203,9 +305,19 @@ static void debug_inode(uint32_t ino, Yaf_Inode *node) {
 #define INO2DOFF(sb, ino)   (INO2BID(sb, ino) * YAF_BLOCK_SIZE \
                              + INO2BOFF(sb, ino))
 
-/* fill the disk inode blocks section with relevant data */
+/*
+ * fill the disk inode blocks section with relevant data
+ *
+ * Only the first *nr_i_init* inode blocks are zeroed, the driver zeroes
+ * the others after the mount.
+ */
 static long write_inode_blocks(int bfd, Yaf_Superblock *ysb) {
+    uint32_t nr_i_init = le32toh(ysb->yaf_sb_info.nr_i);
     long ret = 0;
+    struct {
+        Yaf_Inode root;
+        Yaf_Inode_Ext ext;      /* zero, timestamps are all 0 */
+    } inode = {};
     Yaf_Inode root;
 
     /* initialize the root on-disk inode */
@@ -219,6 +331,15 @@ static long write_inode_blocks(int bfd, Yaf_Superblock *ysb) {
         root.i_block[i] = RESERVED_DNO;
     }
 
+    /* zero the inode blocks section */
+    if (le32toh(ysb->yaf_sb_info.version) >= YAF_VERSION_ITABLE_INIT) {
+        nr_i_init = le32toh(ysb->nr_i_init);
+    }
+    ret = zero_blocks(bfd, BID_I_MIN(ysb), nr_i_init, "inode blocks");
+    if (ret) {
+        goto out;
+    }
+
     /* write down the root inode */
     ret = lseek(bfd, INO2DOFF(ysb, ROOT_INO), SEEK_SET);
     if (ret == -1) {
@@ -227,14 +348,16 @@ static long write_inode_blocks(int bfd, Yaf_Superblock *ysb) {
         goto out;
     }
 
-    if (write(bfd, &root, sizeof(root)) != sizeof(root)) {
+    inode.root = root;
+    if (write(bfd, &inode, YAF_INODE_SIZE(ysb)) != YAF_INODE_SIZE(ysb)) {
         ret = -EIO;
         log(LOG_INFO, "write() failed");
         goto out;
     }
 
     log(LOG_INFO, "Writing %ld byte(s) at disk offset %ld "
-        "for the root inode", sizeof(root), INO2DOFF(ysb, ROOT_INO));
+        "for the root inode", (long)YAF_INODE_SIZE(ysb),
+        INO2DOFF(ysb, ROOT_INO));
     debug_inode(ROOT_INO, &root);
     ret = 0;
 
@@ -251,13 +374,865 @@ static long write_data_blocks(int bfd, Yaf_Superblock *ysb) {
     return 0;
 }
 
+/*
+ * fill the checksum section with the checksums of the bitmap blocks
+ * and the root inode block
+ *
+ * The entries of all other blocks are zeroed, i.e. those blocks are
+ * trusted until the driver first writes them, so only the checksum
+ * blocks covering those few blocks are written over the zeroed section.
+ */
+static long write_checksums(int bfd, Yaf_Superblock *ysb) {
+    unsigned long root = INO2BID(ysb, ROOT_INO);
+    char block[YAF_BLOCK_SIZE];
+    long ret = 0;
+
+    ret = zero_blocks(bfd, BID_C_MIN(ysb), NR_C(ysb), "checksums");
+    if (ret) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < NR_C(ysb) &&
+         BID_IBP_MIN(ysb) + i * YAF_CSUMS_PER_BLOCK <= root; ++i) {
+        uint32_t csums[YAF_CSUMS_PER_BLOCK] = {};
+
+        for (uint32_t idx = 0; idx < YAF_CSUMS_PER_BLOCK; ++idx) {
+            unsigned long bid = BID_IBP_MIN(ysb)
+                                + i * YAF_CSUMS_PER_BLOCK + idx;
+
+            if (bid > BID_DBP_MAX(ysb) && bid != root) {
+                continue;
+            }
+            if (pread(bfd, block, sizeof(block), bid * YAF_BLOCK_SIZE)
+                != sizeof(block)) {
+                ret = -EIO;
+                log(LOG_INFO, "pread() failed");
+                goto out;
+            }
+            csums[idx] = htole32(yaf_csum_block(block));
+        }
+
+        if (pwrite(bfd, csums, sizeof(csums),
+                   (BID_C_MIN(ysb) + i) * YAF_BLOCK_SIZE) != sizeof(csums)) {
+            ret = -EIO;
+            log(LOG_INFO, "pwrite() failed");
+            goto out;
+        }
+        log(LOG_INFO, "Writing %ld byte(s) at disk offset %ld "
+            "for the checksums", sizeof(csums),
+            (BID_C_MIN(ysb) + i) * YAF_BLOCK_SIZE);
+    }
+
+out:
+    return ret;
+}
+
+/* a source inode with several links, see populate_link() */
+typedef struct POPULATE_LINK {
+    dev_t dev;
+    ino_t ino;
+    uint32_t yino;          /* its inode in the image */
+} Populate_Link;
+
+/* the state of populate() */
+typedef struct POPULATE {
+    Yaf_Image img;
+    void *links;            /* tsearch() tree of *Populate_Link* */
+    uint32_t nr_files;
+    uint32_t nr_dirs;
+} Populate;
+
+static int compare_links(const void *a, const void *b) {
+    const Populate_Link *la = a, *lb = b;
+
+    if (la->dev != lb->dev) {
+        return la->dev < lb->dev ? -1 : 1;
+    }
+    return la->ino < lb->ino ? -1 : la->ino > lb->ino;
+}
+
+/*
+ * Find the inode of the image copied from the source inode @st with
+ * several links in the tree @links, or record @yino as its copy if it
+ * is new.
+ *
+ * Return the found inode, or *RESERVED_INO* if there is none yet.
+ */
+static uint32_t populate_link(void **links, const struct stat *st,
+                              uint32_t yino) {
+    Populate_Link key = {st->st_dev, st->st_ino, yino}, *link, **found;
+
+    found = tfind(&key, links, compare_links);
+    if (found) {
+        return (*found)->yino;
+    }
+    if (yino != RESERVED_INO && (link = malloc(sizeof(*link)))) {
+        *link = key;
+        tsearch(link, links, compare_links);
+    }
+    return RESERVED_INO;
+}
+
+/* copy the owner, permissions and times of @st to the inode @ino */
+static void populate_attributes(Populate *p, uint32_t ino,
+                                const struct stat *st) {
+    Yaf_Inode *yi = yaf_inode(&p->img, ino);
+
+    yi->i_mode = htole32((le32toh(yi->i_mode) & S_IFMT) |
+                         (st->st_mode & ~S_IFMT));
+    yi->i_uid = htole32(st->st_uid);
+    yi->i_gid = htole32(st->st_gid);
+    yaf_inode_set_time(&p->img, ino, YAF_ATIME, &st->st_atim);
+    yaf_inode_set_time(&p->img, ino, YAF_MTIME, &st->st_mtim);
+}
+
+/* skip *.* and *..* */
+static int populate_filter(const struct dirent *de) {
+    return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+/*
+ * Copy the file @name of the source directory @dfd into the just
+ * created inode @ino at once, so its blocks are allocated in a row.
+ */
+static long populate_file(Populate *p, int dfd, const char *name,
+                          uint32_t ino) {
+    static char buf[MAX_FILESIZE + 1];
+    ssize_t size = 0, nr;
+    long ret = 0;
+    int fd;
+
+    fd = openat(dfd, name, O_RDONLY);
+    if (fd == -1) {
+        log(LOG_ERR, "open() %s failed with error %s", name,
+            strerror(errno));
+        return -errno;
+    }
+    do {
+        nr = read(fd, buf + size, sizeof(buf) - size);
+        size += nr > 0 ? nr : 0;
+    } while (nr > 0 && size < sizeof(buf));
+    if (nr < 0) {
+        ret = -errno;
+        log(LOG_ERR, "read() %s failed with error %s", name,
+            strerror(errno));
+        goto close;
+    }
+    if (size > MAX_FILESIZE) {
+        ret = -EFBIG;
+        log(LOG_ERR, "%s is larger than %ld bytes", name,
+            (long)MAX_FILESIZE);
+        goto close;
+    }
+
+    nr = yaf_write(&p->img, ino, buf, size, 0);
+    if (nr < 0) {
+        ret = nr;
+        log(LOG_ERR, "yaf_write() %s failed with error %s", name,
+            strerror(-ret));
+    }
+
+close:
+    close(fd);
+    return ret;
+}
+
+/*
+ * Copy the source directory @dfd into the directory @dir of the image.
+ *
+ * All dentrys of @dir are created first, packing them into its blocks
+ * in a row, then the data of its files and symlinks follows a file at
+ * a time, before the subdirectorys are copied the same way.
+ */
+static long populate_dir(Populate *p, int dfd, uint32_t dir) {
+    struct dirent **names;
+    struct stat *stats = NULL;
+    uint32_t *inos = NULL;
+    long ret = 0;
+    int nr;
+
+    /* sorted, so the same tree always yields the same image */
+    nr = scandirat(dfd, ".", &names, populate_filter, alphasort);
+    if (nr < 0) {
+        log(LOG_ERR, "scandirat() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    stats = calloc(nr, sizeof(*stats));
+    inos = calloc(nr, sizeof(*inos));
+    if (nr && (!stats || !inos)) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "calloc() failed");
+        goto free;
+    }
+
+    for (int i = 0; i < nr; ++i) {
+        const char *name = names[i]->d_name;
+        struct stat *st = &stats[i];
+        uint32_t link;
+
+        if (fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW)) {
+            ret = -errno;
+            log(LOG_ERR, "stat() %s failed with error %s", name,
+                strerror(errno));
+            goto free;
+        }
+        if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode) &&
+            !S_ISLNK(st->st_mode)) {
+            log(LOG_INFO, "skip %s, yaf has no special files", name);
+            continue;
+        }
+
+        /* a further link of an inode copied before */
+        link = !S_ISDIR(st->st_mode) && st->st_nlink > 1
+               ? populate_link(&p->links, st, RESERVED_INO) : RESERVED_INO;
+        if (link != RESERVED_INO) {
+            ret = yaf_link(&p->img, link, dir, name);
+        } else {
+            ret = yaf_create(&p->img, dir, name, st->st_mode & S_IFMT,
+                             st->st_uid, st->st_gid, &inos[i]);
+        }
+        if (ret) {
+            log(LOG_ERR, "failed to create %s with error %s", name,
+                strerror(-ret));
+            goto free;
+        }
+        if (link == RESERVED_INO && !S_ISDIR(st->st_mode) &&
+            st->st_nlink > 1) {
+            populate_link(&p->links, st, inos[i]);
+        }
+    }
+
+    for (int i = 0; i < nr; ++i) {
+        const char *name = names[i]->d_name;
+
+        if (inos[i] == RESERVED_INO) {
+            continue;
+        }
+        if (S_ISREG(stats[i].st_mode)) {
+            ret = populate_file(p, dfd, name, inos[i]);
+            ++p->nr_files;
+        } else if (S_ISLNK(stats[i].st_mode)) {
+            char target[YAF_BLOCK_SIZE];
+            ssize_t len = readlinkat(dfd, name, target, sizeof(target));
+
+            if (len < 0 || len == sizeof(target)) {
+                ret = len < 0 ? -errno : -ENAMETOOLONG;
+                log(LOG_ERR, "readlink() %s failed with error %s", name,
+                    strerror(-ret));
+                goto free;
+            }
+            target[len] = '\0';
+            ret = yaf_set_symlink(&p->img, inos[i], target);
+            ++p->nr_files;
+        }
+        if (ret) {
+            goto free;
+        }
+        if (!S_ISDIR(stats[i].st_mode)) {
+            populate_attributes(p, inos[i], &stats[i]);
+        }
+    }
+
+    for (int i = 0; i < nr; ++i) {
+        int sfd;
+
+        if (inos[i] == RESERVED_INO || !S_ISDIR(stats[i].st_mode)) {
+            continue;
+        }
+        sfd = openat(dfd, names[i]->d_name, O_RDONLY | O_DIRECTORY);
+        if (sfd == -1) {
+            ret = -errno;
+            log(LOG_ERR, "open() %s failed with error %s", names[i]->d_name,
+                strerror(errno));
+            goto free;
+        }
+        ret = populate_dir(p, sfd, inos[i]);
+        close(sfd);
+        if (ret) {
+            goto free;
+        }
+        /* after its dentrys, which stamp its times */
+        populate_attributes(p, inos[i], &stats[i]);
+        ++p->nr_dirs;
+    }
+
+free:
+    for (int i = 0; i < nr; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    free(stats);
+    free(inos);
+    return ret;
+}
+
+/*
+ * Copy the tree below @arguments->root_directory into the just
+ * formatted device through the memory-mapped image, the inodes and
+ * blocks being allocated one after another on the empty device.
+ */
+static long populate(Arguments *arguments) {
+    Populate p = {};
+    struct stat st;
+    long ret;
+    int dfd;
+
+    dfd = open(arguments->root_directory, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1 || fstat(dfd, &st)) {
+        log(LOG_ERR, "open() %s failed with error %s",
+            arguments->root_directory, strerror(errno));
+        ret = -errno;
+        goto out;
+    }
+
+    ret = yaf_image_open(&p.img, arguments->device, YAF_IMAGE_RDWR);
+    if (ret) {
+        goto close_dfd;
+    }
+    ret = populate_dir(&p, dfd, ROOT_INO);
+    if (!ret) {
+        populate_attributes(&p, ROOT_INO, &st);
+        log(LOG_INFO, "copied %u files and %u directories from %s, "
+            "%u data blocks are left", p.nr_files, p.nr_dirs,
+            arguments->root_directory, p.img.nr_free_d);
+    }
+
+    if (yaf_image_close(&p.img) && !ret) {
+        ret = -EIO;
+    }
+    tdestroy(p.links, free);
+close_dfd:
+    close(dfd);
+out:
+    return ret;
+}
+
+/* bytes copied at once into a compact image, a multiple of blocks */
+#define COMPACT_COPY_SIZE   (1024 KiB)
+
+/* an inode of a compact image, see compact() */
+typedef struct COMPACT_INODE {
+    char *path;             /* relative to the root directory */
+    struct stat st;
+    char *target;           /* the target of a symlink */
+    uint64_t size;          /* *i_size* */
+    uint32_t nlink;         /* number of links, counted like the driver */
+    uint32_t dno;           /* first data block, or *RESERVED_DNO* */
+    uint32_t dentry;        /* first dentry of a directory in *dentrys* */
+    uint32_t nr_dentrys;    /* number of dentrys of a directory */
+} Compact_Inode;
+
+/* a dentry of a compact image */
+typedef struct COMPACT_DENTRY {
+    char *name;
+    uint32_t ino;
+} Compact_Dentry;
+
+/* the state of compact() */
+typedef struct COMPACT {
+    int dfd;                    /* the root directory */
+    Compact_Inode *inodes;      /* indexed by the inode number */
+    uint32_t nr_inodes, max_inodes;
+    Compact_Dentry *dentrys;    /* those of each directory in a row */
+    uint32_t nr_dentrys, max_dentrys;
+    uint32_t *order;            /* the inodes in the order of their data */
+    uint32_t nr_order;
+    void *links;                /* tsearch() tree of *Populate_Link* */
+    uint64_t nr_d;              /* number of data blocks */
+} Compact;
+
+/* make room for one more of the @nr elements of @size in @array */
+static long compact_grow(void **array, uint32_t *max, uint32_t nr,
+                         size_t size) {
+    uint64_t more = *max ? 2 * (uint64_t)*max : 64;
+    void *p;
+
+    if (nr < *max) {
+        return 0;
+    }
+    if (more > UINT32_MAX) {
+        more = UINT32_MAX;
+    }
+    if (nr == more || !(p = realloc(*array, more * size))) {
+        log(LOG_ERR, "realloc() failed");
+        return -ENOMEM;
+    }
+    *array = p;
+    *max = more;
+    return 0;
+}
+
+/* sort the names bytewise like yaf_compact_cmp() in the driver */
+static int compact_sort(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Add the dentrys of the source directory of the inode @dir, sorted by
+ * name, and an inode behind the others for each new file, directory
+ * and symlink among them.
+ */
+static long compact_scan(Compact *c, uint32_t dir) {
+    struct dirent **names;
+    long ret = 0;
+    int nr;
+
+    nr = scandirat(c->dfd, c->inodes[dir].path, &names, populate_filter,
+                   compact_sort);
+    if (nr < 0) {
+        log(LOG_ERR, "scandirat() %s failed with error %s",
+            c->inodes[dir].path, strerror(errno));
+        return -errno;
+    }
+    c->inodes[dir].dentry = c->nr_dentrys;
+
+    for (int i = 0; i < nr; ++i) {
+        const char *name = names[i]->d_name;
+        Compact_Inode inode = {.dno = RESERVED_DNO};
+        uint32_t ino = RESERVED_INO;
+
+        if (asprintf(&inode.path, "%s/%s", c->inodes[dir].path,
+                     name) == -1) {
+            ret = -ENOMEM;
+            log(LOG_ERR, "asprintf() failed");
+            goto free;
+        }
+        if (fstatat(c->dfd, inode.path, &inode.st, AT_SYMLINK_NOFOLLOW)) {
+            ret = -errno;
+            log(LOG_ERR, "stat() %s failed with error %s", inode.path,
+                strerror(errno));
+            free(inode.path);
+            goto free;
+        }
+        if (!S_ISREG(inode.st.st_mode) && !S_ISDIR(inode.st.st_mode) &&
+            !S_ISLNK(inode.st.st_mode)) {
+            log(LOG_INFO, "skip %s, yaf has no special files", inode.path);
+            free(inode.path);
+            continue;
+        }
+        if (strlen(name) > YAF_DENTRY_NAME_LEN) {
+            ret = -ENAMETOOLONG;
+            log(LOG_ERR, "%s is longer than %ld bytes", inode.path,
+                (long)YAF_DENTRY_NAME_LEN);
+            free(inode.path);
+            goto free;
+        }
+
+        /* a further link of an inode added before */
+        if (!S_ISDIR(inode.st.st_mode) && inode.st.st_nlink > 1) {
+            ino = populate_link(&c->links, &inode.st, RESERVED_INO);
+        }
+        if (ino != RESERVED_INO) {
+            free(inode.path);
+        } else {
+            if (S_ISLNK(inode.st.st_mode)) {
+                char target[YAF_BLOCK_SIZE];
+                ssize_t len = readlinkat(c->dfd, inode.path, target,
+                                         sizeof(target));
+
+                if (len < 0 || len == sizeof(target)) {
+                    ret = len < 0 ? -errno : -ENAMETOOLONG;
+                    log(LOG_ERR, "readlink() %s failed with error %s",
+                        inode.path, strerror(-ret));
+                    free(inode.path);
+                    goto free;
+                }
+                inode.target = strndup(target, len);
+                inode.size = len;
+            } else if (S_ISREG(inode.st.st_mode)) {
+                inode.size = inode.st.st_size;
+            }
+
+            ret = compact_grow((void **)&c->inodes, &c->max_inodes,
+                               c->nr_inodes, sizeof(Compact_Inode));
+            if (ret || (S_ISLNK(inode.st.st_mode) && !inode.target)) {
+                ret = -ENOMEM;
+                free(inode.path);
+                free(inode.target);
+                goto free;
+            }
+            ino = c->nr_inodes++;
+            c->inodes[ino] = inode;
+            if (!S_ISDIR(inode.st.st_mode) && inode.st.st_nlink > 1) {
+                populate_link(&c->links, &inode.st, ino);
+            }
+        }
+
+        ret = compact_grow((void **)&c->dentrys, &c->max_dentrys,
+                           c->nr_dentrys, sizeof(Compact_Dentry));
+        if (ret) {
+            goto free;
+        }
+        c->dentrys[c->nr_dentrys].name = strdup(name);
+        if (!c->dentrys[c->nr_dentrys].name) {
+            ret = -ENOMEM;
+            log(LOG_ERR, "strdup() failed");
+            goto free;
+        }
+        c->dentrys[c->nr_dentrys++].ino = ino;
+        ++c->inodes[ino].nlink;
+        ++c->inodes[dir].nlink;
+        ++c->inodes[dir].nr_dentrys;
+    }
+    c->inodes[dir].size = (uint64_t)c->inodes[dir].nr_dentrys *
+                          YAF_DENTRY_SIZE;
+
+free:
+    for (int i = 0; i < nr; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/* give the inode @ino the next data blocks for its data, if any */
+static void compact_place(Compact *c, uint32_t ino) {
+    Compact_Inode *inode = &c->inodes[ino];
+
+    if (inode->dno != RESERVED_DNO || !inode->size ||
+        (S_ISLNK(inode->st.st_mode) &&
+         inode->size <= YAF_FAST_SYMLINK_LEN)) {
+        return;
+    }
+    inode->dno = c->nr_d;
+    c->nr_d += (inode->size + YAF_BLOCK_SIZE - 1) / YAF_BLOCK_SIZE;
+    c->order[c->nr_order++] = ino;
+}
+
+/*
+ * Lay the data out directory by directory in inode order: the dentry
+ * blocks of a directory, then the data of its files and symlinks in
+ * name order, each one in consecutive data blocks.
+ */
+static long compact_layout(Compact *c) {
+    c->order = calloc(c->nr_inodes, sizeof(uint32_t));
+    if (!c->order) {
+        log(LOG_ERR, "calloc() failed");
+        return -ENOMEM;
+    }
+
+    for (uint32_t ino = ROOT_INO; ino < c->nr_inodes; ++ino) {
+        Compact_Inode *dir = &c->inodes[ino];
+
+        if (!S_ISDIR(dir->st.st_mode)) {
+            continue;
+        }
+        compact_place(c, ino);
+        for (uint32_t i = 0; i < dir->nr_dentrys; ++i) {
+            uint32_t child = c->dentrys[dir->dentry + i].ino;
+
+            if (!S_ISDIR(c->inodes[child].st.st_mode)) {
+                compact_place(c, child);
+            }
+        }
+    }
+
+    if (c->nr_d > UINT32_MAX) {
+        log(LOG_ERR, "%lu data blocks are too many",
+            (unsigned long)c->nr_d);
+        return -EFBIG;
+    }
+    return 0;
+}
+
+/* write all @len bytes of @buf at @off of the device @bfd */
+static long compact_pwrite(int bfd, const void *buf, size_t len,
+                           uint64_t off) {
+    while (len) {
+        ssize_t nr = pwrite(bfd, buf, len, off);
+
+        if (nr <= 0) {
+            log(LOG_ERR, "pwrite() failed with error %s", strerror(errno));
+            return -EIO;
+        }
+        buf = (const char *)buf + nr;
+        len -= nr;
+        off += nr;
+    }
+    return 0;
+}
+
+/* fill the on-disk inode @yi with the inode @ino */
+static void compact_inode(Compact *c, uint32_t ino, Yaf_Inode *yi) {
+    Compact_Inode *inode = &c->inodes[ino];
+    Yaf_Inode_Ext *ext = (Yaf_Inode_Ext *)(yi + 1);
+
+    yi->i_mode = htole32(inode->st.st_mode);
+    yi->i_uid = htole32(inode->st.st_uid);
+    yi->i_gid = htole32(inode->st.st_gid);
+    yi->i_nlink = htole32(inode->nlink);
+    yi->i_size = htole32(inode->size);
+    ext->i_size_hi = htole32(inode->size >> 32);
+
+    /* the change time is the modification time, so the same tree
+       always yields the same image */
+    yi->i_atime = htole32(inode->st.st_atim.tv_sec);
+    ext->i_atime_hi = htole32((uint64_t)inode->st.st_atim.tv_sec >> 32);
+    ext->i_atime_nsec = htole32(inode->st.st_atim.tv_nsec);
+    yi->i_mtime = yi->i_ctime = htole32(inode->st.st_mtim.tv_sec);
+    ext->i_mtime_hi = ext->i_ctime_hi =
+        htole32((uint64_t)inode->st.st_mtim.tv_sec >> 32);
+    ext->i_mtime_nsec = ext->i_ctime_nsec =
+        htole32(inode->st.st_mtim.tv_nsec);
+
+    if (S_ISLNK(inode->st.st_mode) && inode->size <= YAF_FAST_SYMLINK_LEN) {
+        memcpy(yi->i_block, inode->target, inode->size);
+        return;
+    }
+    for (int i = 0; i < YAF_IBLOCKS; ++i) {
+        yi->i_block[i] = htole32(RESERVED_DNO);
+    }
+    yi->i_block[0] = htole32(inode->dno);
+}
+
+/* write the superblock and the inode blocks of a compact image */
+static long compact_write_inodes(Compact *c, int bfd, Yaf_Superblock *ysb) {
+    uint32_t nr_i = le32toh(ysb->yaf_sb_info.nr_i);
+    uint8_t *blocks;
+    long ret;
+
+    ret = compact_pwrite(bfd, ysb, sizeof(*ysb),
+                         BID_SB_MIN(ysb) * YAF_BLOCK_SIZE);
+    if (ret) {
+        return ret;
+    }
+
+    blocks = calloc(nr_i, YAF_BLOCK_SIZE);
+    if (!blocks) {
+        log(LOG_ERR, "calloc() failed");
+        return -ENOMEM;
+    }
+    for (uint32_t ino = ROOT_INO; ino < c->nr_inodes; ++ino) {
+        compact_inode(c, ino, (Yaf_Inode *)(blocks +
+                      (uint64_t)ino * YAF_INODE_SIZE(ysb)));
+    }
+    ret = compact_pwrite(bfd, blocks, (size_t)nr_i * YAF_BLOCK_SIZE,
+                         BID_I_MIN(ysb) * YAF_BLOCK_SIZE);
+    free(blocks);
+    return ret;
+}
+
+/*
+ * Write the data of the inode @ino from its first data block on: the
+ * dentry blocks of a directory, the target of a symlink or the content
+ * of a file, zero padded to a whole block.
+ */
+static long compact_write_data(Compact *c, int bfd, Yaf_Superblock *ysb,
+                               uint32_t ino, char *buf) {
+    Compact_Inode *inode = &c->inodes[ino];
+    uint64_t off = DNO2BID(ysb, (uint64_t)inode->dno) * YAF_BLOCK_SIZE;
+    uint64_t done = 0;
+    long ret = 0;
+    int fd;
+
+    if (S_ISDIR(inode->st.st_mode)) {
+        for (uint32_t i = 0; i < inode->nr_dentrys; ++i) {
+            Compact_Dentry *cd = &c->dentrys[inode->dentry + i];
+            Yaf_Dentry *yd = (Yaf_Dentry *)buf + i % DENTRYS_PER_BLOCK;
+
+            if (!(i % DENTRYS_PER_BLOCK)) {
+                memset(buf, 0, YAF_BLOCK_SIZE);
+            }
+            yd->d_ino = htole32(cd->ino);
+            yd->d_name_len = htole32(strlen(cd->name));
+            memcpy(yd->d_name, cd->name, strlen(cd->name));
+            if (i % DENTRYS_PER_BLOCK != DENTRYS_PER_BLOCK - 1 &&
+                i != inode->nr_dentrys - 1) {
+                continue;
+            }
+
+            ret = compact_pwrite(bfd, buf, YAF_BLOCK_SIZE, off);
+            if (ret) {
+                return ret;
+            }
+            off += YAF_BLOCK_SIZE;
+        }
+        return 0;
+    }
+    if (S_ISLNK(inode->st.st_mode)) {
+        memset(buf, 0, YAF_BLOCK_SIZE);
+        memcpy(buf, inode->target, inode->size);
+        return compact_pwrite(bfd, buf, YAF_BLOCK_SIZE, off);
+    }
+
+    fd = openat(c->dfd, inode->path, O_RDONLY);
+    if (fd == -1) {
+        log(LOG_ERR, "open() %s failed with error %s", inode->path,
+            strerror(errno));
+        return -errno;
+    }
+    while (done < inode->size) {
+        size_t len = inode->size - done < COMPACT_COPY_SIZE
+                     ? inode->size - done : COMPACT_COPY_SIZE;
+        ssize_t nr = pread(fd, buf, len, done);
+        size_t pad = 0;
+
+        if (nr < 0) {
+            ret = -errno;
+            log(LOG_ERR, "read() %s failed with error %s", inode->path,
+                strerror(errno));
+            break;
+        }
+        /* the blocks were laid out for the size stat() saw */
+        if (!nr) {
+            ret = -EIO;
+            log(LOG_ERR, "%s shrank while being copied", inode->path);
+            break;
+        }
+        if (done + nr == inode->size) {
+            pad = (YAF_BLOCK_SIZE - inode->size % YAF_BLOCK_SIZE) %
+                  YAF_BLOCK_SIZE;
+            memset(buf + nr, 0, pad);
+        }
+        ret = compact_pwrite(bfd, buf, nr + pad, off + done);
+        if (ret) {
+            break;
+        }
+        done += nr;
+    }
+    close(fd);
+    return ret;
+}
+
+/*
+ * Copy the tree below @arguments->root_directory into a compact
+ * read-only image on the device @bfd, see compact.h.
+ *
+ * The tree is scanned breadth-first, numbering the inodes as they are
+ * found, then laid out by compact_layout(), so the image is exactly as
+ * large as the tree needs, and an image file is truncated to that.
+ */
+static long compact(Arguments *arguments, int bfd) {
+    Compact c = {};
+    Yaf_Superblock ysb = {};
+    uint64_t bnr, dev_bnr;
+    struct stat bstat;
+    char *buf = NULL;
+    uint32_t nr_i;
+    long ret;
+
+    c.dfd = open(arguments->root_directory, O_RDONLY | O_DIRECTORY);
+    if (c.dfd == -1) {
+        log(LOG_ERR, "open() %s failed with error %s",
+            arguments->root_directory, strerror(errno));
+        return -errno;
+    }
+
+    /* the reserved inode and the root directory */
+    c.max_inodes = 64;
+    c.inodes = calloc(c.max_inodes, sizeof(Compact_Inode));
+    if (!c.inodes) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "calloc() failed");
+        goto free;
+    }
+    c.nr_inodes = ROOT_INO + 1;
+    c.inodes[ROOT_INO] = (Compact_Inode){.dno = RESERVED_DNO, .nlink = 1};
+    c.inodes[ROOT_INO].path = strdup(".");
+    if (!c.inodes[ROOT_INO].path || fstat(c.dfd, &c.inodes[ROOT_INO].st)) {
+        ret = -errno;
+        log(LOG_ERR, "stat() %s failed with error %s",
+            arguments->root_directory, strerror(errno));
+        goto free;
+    }
+
+    /* the inodes found are appended, so this is breadth-first */
+    for (uint32_t ino = ROOT_INO; ino < c.nr_inodes; ++ino) {
+        if (S_ISDIR(c.inodes[ino].st.st_mode)) {
+            ret = compact_scan(&c, ino);
+            if (ret) {
+                goto free;
+            }
+        }
+    }
+    ret = compact_layout(&c);
+    if (ret) {
+        goto free;
+    }
+
+    /* only the inode and data blocks sections, none of them free */
+    ysb.yaf_sb_info.version = htole32(YAF_VERSION_COMPACT);
+    nr_i = ((uint64_t)c.nr_inodes + INODES_PER_BLOCK(&ysb) - 1) /
+           INODES_PER_BLOCK(&ysb);
+    ysb.yaf_sb_info.nr_i = htole32(nr_i);
+    ysb.yaf_sb_info.nr_d = htole32(c.nr_d);
+    ysb.state = htole32(YAF_STATE_CLEAN);
+    ysb.nr_i_init = htole32(nr_i);
+    for (int idx = 0; idx < sizeof(ysb.magic); idx += sizeof(MAGIC)) {
+        memcpy(&ysb.magic[idx], MAGIC, sizeof(MAGIC));
+    }
+    bnr = BID_D_MAX(&ysb) + 1;
+
+    if (fstat(bfd, &bstat)) {
+        ret = -errno;
+        log(LOG_ERR, "fstat() failed with error %s", strerror(errno));
+        goto free;
+    }
+    if (S_ISREG(bstat.st_mode)) {
+        if (ftruncate(bfd, bnr * YAF_BLOCK_SIZE)) {
+            ret = -errno;
+            log(LOG_ERR, "ftruncate() failed with error %s",
+                strerror(errno));
+            goto free;
+        }
+    } else {
+        ret = yaf_device_blocks(bfd, &dev_bnr);
+        if (ret) {
+            goto free;
+        }
+        if (dev_bnr < bnr) {
+            ret = -ENOSPC;
+            log(LOG_ERR, "%lu blocks are needed, the device has %lu",
+                (unsigned long)bnr, (unsigned long)dev_bnr);
+            goto free;
+        }
+    }
+
+    /* with room for the zero padding of the last block */
+    buf = malloc(COMPACT_COPY_SIZE + YAF_BLOCK_SIZE);
+    if (!buf) {
+        ret = -ENOMEM;
+        log(LOG_ERR, "malloc() failed");
+        goto free;
+    }
+    ret = compact_write_inodes(&c, bfd, &ysb);
+    for (uint32_t i = 0; !ret && i < c.nr_order; ++i) {
+        ret = compact_write_data(&c, bfd, &ysb, c.order[i], buf);
+    }
+    if (!ret && fsync(bfd)) {
+        ret = -errno;
+        log(LOG_ERR, "fsync() failed with error %s", strerror(errno));
+    }
+    if (!ret) {
+        log(LOG_INFO, "compact image of %u inodes in %u block(s) and %lu "
+            "data block(s), %lu blocks in total", c.nr_inodes - ROOT_INO,
+            nr_i, (unsigned long)c.nr_d, (unsigned long)bnr);
+    }
+
+free:
+    free(buf);
+    for (uint32_t ino = ROOT_INO; ino < c.nr_inodes; ++ino) {
+        free(c.inodes[ino].path);
+        free(c.inodes[ino].target);
+    }
+    for (uint32_t i = 0; i < c.nr_dentrys; ++i) {
+        free(c.dentrys[i].name);
+    }
+    free(c.inodes);
+    free(c.dentrys);
+    free(c.order);
+    tdestroy(c.links, free);
+    close(c.dfd);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     Arguments arguments = {};
     Yaf_Superblock ysb = {};
     int bfd = -1;
-    long ret = 0, bnr;
-    struct stat bstat;
+    long ret = 0;
+    uint64_t bnr;
 
     log(LOG_INFO, "format the yaf filesystem");
 
@@ -272,31 +1247,40 @@ int main(int argc, char *argv[])
     }
 
     /* get device block number */
-    ret = fstat(bfd, &bstat);
-    if (ret == -1) {
-        ret = errno;
-        log(LOG_ERR, "fstat() failed with error %s", strerror(errno));
+    ret = yaf_device_blocks(bfd, &bnr);
+    if (ret) {
+        ret = -ret;
         goto close_bfd;
     }
-    if ((bstat.st_mode & S_IFMT) == S_IFBLK) {
-        /* for block device */
-        long size;
-        ret = ioctl(bfd, BLKGETSIZE64, &size);
+    log(LOG_INFO, "%s has %ld blocks", arguments.device, (long)bnr);
+
+    /* a compact image is sized by the tree copied into it */
+    if (arguments.compact) {
+        ret = compact(&arguments, bfd);
         if (ret) {
-            ret = errno;
-            log(LOG_ERR, "ioctl() failed with error %s", strerror(errno));
-            goto close_bfd;
+            ret = -ret;
+            log(LOG_ERR, "compact() failed with error %s", strerror(ret));
         }
-        bnr = size / YAF_BLOCK_SIZE;
-    } else {
-        /* for other cases */
-        bnr = bstat.st_size / YAF_BLOCK_SIZE;
+        goto close_bfd;
     }
-    log(LOG_INFO, "%s has %ld blocks", arguments.device, bnr);
 
+    /* small devices cannot spare the journal blocks by default */
+    if (arguments.journal_blocks < 0) {
+        arguments.journal_blocks =
+            arguments.inode_size != sizeof(Yaf_Inode) &&
+            bnr >= JOURNAL_DEFAULT_MIN_BNR ? YAF_JOURNAL_MIN_BLOCKS : 0;
+    }
+    if (arguments.journal_blocks >= bnr / 2) {
+        ret = -EINVAL;
+        log(LOG_ERR, "journal of %ld blocks is too large for %ld blocks",
+            arguments.journal_blocks, (long)bnr);
+        goto close_bfd;
+    }
 
     /* write down the superblock data */
-    ret = write_superblock(bfd, &ysb, bnr);
+    ret = write_superblock(bfd, &ysb, bnr,
+                           arguments.inode_size == sizeof(Yaf_Inode)
+                           ? YAF_VERSION_COUNTERS : YAF_VERSION, &arguments);
     if (ret) {
         ret = errno;
         log(LOG_ERR,
@@ -304,6 +1288,15 @@ int main(int argc, char *argv[])
         goto close_bfd;
     }
 
+    /* write down the journal data */
+    ret = write_journal(bfd, &ysb);
+    if (ret) {
+        ret = errno;
+        log(LOG_ERR,
+            "write_journal() failed with error %s", strerror(errno));
+        goto close_bfd;
+    }
+
     /* write down the inode bitmap data */
     ret = write_inode_bitmap(bfd, &ysb);
     if (ret) {
@@ -340,9 +1333,28 @@ int main(int argc, char *argv[])
         goto close_bfd;
     }
 
+    /* write down the checksums of the blocks written above */
+    ret = write_checksums(bfd, &ysb);
+    if (ret) {
+        ret = errno;
+        log(LOG_ERR,
+            "write_checksums() failed with error %s", strerror(errno));
+        goto close_bfd;
+    }
+
     log(LOG_INFO, "yaf filesystem has been successfully "
         "formatted on the device");
 
+    /* copy the root directory into the formatted device */
+    if (arguments.root_directory) {
+        ret = populate(&arguments);
+        if (ret) {
+            ret = -ret;
+            log(LOG_ERR, "populate() failed with error %s", strerror(ret));
+            goto close_bfd;
+        }
+    }
+
 close_bfd:
     close(bfd);
 out:
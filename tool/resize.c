@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/bitmap.h"
+#include "../include/csum.h"
+#include "../include/fs.h"
+#include "../include/inode.h"
+#include "../include/ioctl.h"
+#include "../include/resize.h"
+#include "../include/super.h"
+#include "../include/yaf.h"
+#include "arguments.h"
+#include "libyaf.h"
+
+/*
+ * yaf-resize grows an image to a larger device, see resize.h.
+ *
+ * A mounted image, given by its mountpoint, is grown by the driver
+ * through YAF_IOC_RESIZE within its data bitmap and checksum blocks.
+ * An unmounted one is grown here through the memory-mapped device,
+ * moving the sections behind the journal when those blocks have to
+ * grow as well.
+ */
+
+static inline uint64_t div_ceil(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+/* the sections of the grown image */
+typedef struct RESIZE {
+    uint32_t nr_c;          /* number of checksum blocks */
+    uint32_t nr_dbp;        /* number of data bitmap blocks */
+    uint32_t nr_d;          /* number of data blocks */
+    uint32_t shift;         /* blocks the sections behind the checksum
+                               section move up */
+    unsigned long bid_ibp;  /* first inode bitmap block */
+    unsigned long bid_dbp;  /* first data bitmap block */
+    unsigned long bid_i;    /* first inode block */
+    unsigned long bid_d;    /* first data block */
+    uint32_t nr_i_used;     /* number of inode blocks up to the last
+                               one holding an inode in use */
+    uint32_t *moved;        /* per data block below *shift* its new data
+                               block, if in use */
+    uint8_t *dbitmap;       /* the new data bitmap */
+    uint32_t *csums;        /* the new checksum section */
+} Resize;
+
+/* grow the mounted image at the mountpoint @path to @bnr blocks */
+static long resize_online(const char *path, uint64_t bnr) {
+    long ret = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        log(LOG_ERR, "open() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    if (ioctl(fd, YAF_IOC_RESIZE, &bnr)) {
+        ret = -errno;
+        log(LOG_ERR, "ioctl() failed with error %s", strerror(errno));
+    }
+    close(fd);
+    return ret;
+}
+
+/*
+ * Pick the sections of @img grown to @bnr blocks, with the data bitmap
+ * and checksum sections covering @max_bnr blocks.
+ */
+static long plan(Yaf_Image *img, Resize *r, uint64_t bnr, uint64_t max_bnr) {
+    Yaf_Superblock *ysb = img->ysb;
+    uint32_t nr_c = NR_C(ysb), nr_j = NR_J(ysb);
+    uint32_t nr_ibp = le32toh(ysb->yaf_sb_info.nr_ibp);
+    uint32_t nr_dbp = le32toh(ysb->yaf_sb_info.nr_dbp);
+    uint32_t nr_i = le32toh(ysb->yaf_sb_info.nr_i);
+    uint64_t nr_d;
+
+    /* the sections only grow, like yaf_layout() sizes them */
+    r->nr_c = nr_c;
+    if (nr_c && div_ceil(max_bnr - 1 - nr_j, YAF_CSUMS_PER_BLOCK) > nr_c) {
+        r->nr_c = div_ceil(max_bnr - 1 - nr_j, YAF_CSUMS_PER_BLOCK);
+    }
+    r->nr_dbp = nr_dbp;
+    if (max_bnr > 1 + nr_j + r->nr_c + nr_ibp + nr_i &&
+        div_ceil(max_bnr - 1 - nr_j - r->nr_c - nr_ibp - nr_i,
+                 BITS_PER_BLOCK) > nr_dbp) {
+        r->nr_dbp = div_ceil(max_bnr - 1 - nr_j - r->nr_c - nr_ibp - nr_i,
+                             BITS_PER_BLOCK);
+    }
+    r->shift = r->nr_c - nr_c + r->nr_dbp - nr_dbp;
+
+    r->bid_ibp = BID_C_MIN(ysb) + r->nr_c;
+    r->bid_dbp = r->bid_ibp + nr_ibp;
+    r->bid_i = r->bid_dbp + r->nr_dbp;
+    r->bid_d = r->bid_i + nr_i;
+    nr_d = bnr > r->bid_d ? bnr - r->bid_d : 0;
+    if (nr_d < img->nr_d) {
+        log(LOG_ERR, "the sections grown for %lu blocks leave fewer than "
+            "the %u data blocks", (unsigned long)max_bnr, img->nr_d);
+        return -EINVAL;
+    }
+    if (nr_d > yaf_resize_capacity(nr_ibp, r->nr_dbp, nr_i, r->nr_c)) {
+        log(LOG_ERR, "%lu data blocks are too many", (unsigned long)nr_d);
+        return -EFBIG;
+    }
+    r->nr_d = nr_d;
+    return 0;
+}
+
+/* return the new data block of the data block @dno in use */
+static inline uint32_t new_dno(Resize *r, uint32_t dno) {
+    return dno < r->shift ? r->moved[dno] : dno - r->shift;
+}
+
+/*
+ * Build the new data bitmap and checksum section, and copy the data
+ * blocks in use below *shift*, which end up within the inode blocks,
+ * to the new end of the device, keeping their order.
+ */
+static long relocate(Yaf_Image *img, Resize *r) {
+    unsigned long bid_ibp = BID_IBP_MIN(img->ysb);
+    unsigned long bid_dbp = BID_DBP_MIN(img->ysb);
+    uint32_t *csums = yaf_block(img, BID_C_MIN(img->ysb));
+    uint64_t next = img->bid_d + img->nr_d;
+    uint32_t nr_moved = 0;
+    int64_t dno = 0;
+
+    r->moved = calloc(r->shift + 1, sizeof(*r->moved));
+    r->dbitmap = calloc(r->nr_dbp, YAF_BLOCK_SIZE);
+    r->csums = calloc(r->nr_c + 1, YAF_BLOCK_SIZE);
+    if (!r->moved || !r->dbitmap || !r->csums) {
+        log(LOG_ERR, "calloc() failed");
+        return -ENOMEM;
+    }
+    if (next < r->bid_d) {
+        next = r->bid_d;
+    }
+
+    while ((dno = yaf_find_bit(img, bid_dbp, dno, img->nr_d, true)) >= 0) {
+        uint32_t ndno;
+
+        if (dno < r->shift) {
+            r->moved[dno] = next++ - r->bid_d;
+            memcpy(yaf_block(img, r->bid_d + r->moved[dno]),
+                   yaf_block(img, img->bid_d + dno), YAF_BLOCK_SIZE);
+            ++nr_moved;
+        }
+        ndno = new_dno(r, dno);
+        r->dbitmap[ndno / BITS_PER_BYTE] |= BEOFF2MASK(IDX2BEOFF(ndno));
+        /* only the dentry blocks use theirs, which move along */
+        if (r->nr_c) {
+            r->csums[r->bid_d + ndno - r->bid_ibp] =
+                csums[img->bid_d + dno - bid_ibp];
+        }
+        ++dno;
+    }
+
+    /* the copies are on the device before the metadata refers to them */
+    if (nr_moved && msync(img->map, img->bnr * YAF_BLOCK_SIZE, MS_SYNC)) {
+        log(LOG_ERR, "msync() failed with error %s", strerror(errno));
+        return -errno;
+    }
+    log(LOG_INFO, "moved %u data blocks to the end", nr_moved);
+    return 0;
+}
+
+/*
+ * Renumber the data blocks in the *i_block* of every inode in use and
+ * find the last inode block holding one.
+ */
+static void renumber(Yaf_Image *img, Resize *r) {
+    unsigned long bid_ibp = BID_IBP_MIN(img->ysb);
+    uint32_t ipb = YAF_BLOCK_SIZE / img->inode_size;
+    int64_t ino = ROOT_INO;
+
+    while ((ino = yaf_find_bit(img, bid_ibp, ino, img->nr_inodes,
+                               true)) >= 0) {
+        Yaf_Inode *yi = yaf_inode(img, ino);
+        uint32_t nr = yaf_inode_blocks(img, yi);
+
+        for (uint32_t i = 0; i < nr; ++i) {
+            yi->i_block[i] = htole32(new_dno(r, le32toh(yi->i_block[i])));
+        }
+        r->nr_i_used = ino / ipb + 1;
+        ++ino;
+    }
+}
+
+/*
+ * Move the sections behind the journal to their new places, from the
+ * last one down as they only move up, and store the new layout.
+ */
+static void move_sections(Yaf_Image *img, Resize *r) {
+    Yaf_Superblock *ysb = img->ysb;
+    uint32_t nr_ibp = le32toh(ysb->yaf_sb_info.nr_ibp);
+    uint32_t nr_i = img->nr_i_init > r->nr_i_used ? img->nr_i_init
+                                                  : r->nr_i_used;
+    uint64_t nr_d = img->nr_d;
+
+    /*
+     * The inode blocks beyond *nr_i_init* may hold anything, unless
+     * one of their inodes is in use, see yaf_alloc_inode().
+     */
+    memmove(yaf_block(img, r->bid_i), yaf_block(img, img->bid_i),
+            (size_t)nr_i * YAF_BLOCK_SIZE);
+    memcpy(yaf_block(img, r->bid_dbp), r->dbitmap,
+           (size_t)r->nr_dbp * YAF_BLOCK_SIZE);
+    memmove(yaf_block(img, r->bid_ibp), yaf_block(img, BID_IBP_MIN(ysb)),
+            (size_t)nr_ibp * YAF_BLOCK_SIZE);
+    if (r->nr_c) {
+        memcpy(yaf_block(img, BID_C_MIN(ysb)), r->csums,
+               (size_t)r->nr_c * YAF_BLOCK_SIZE);
+    }
+
+    ysb->yaf_sb_info.nr_dbp = htole32(r->nr_dbp);
+    ysb->yaf_sb_info.nr_d = htole32(r->nr_d);
+    if (img->version != YAF_VERSION_LEGACY) {
+        ysb->nr_r = htole32(le32toh(ysb->nr_r) * (uint64_t)r->nr_d / nr_d);
+    }
+    if (NR_C(ysb)) {
+        ysb->nr_c = htole32(r->nr_c);
+    }
+    img->nr_d = r->nr_d;
+    img->nr_free_d += r->nr_d - nr_d;
+    img->bid_i = r->bid_i;
+    img->bid_d = r->bid_d;
+
+    /* yaf_image_sync() checksums the moved metadata blocks */
+    for (unsigned long bid = r->bid_ibp; bid < r->bid_i + nr_i; ++bid) {
+        yaf_dirty(img, yaf_block(img, bid));
+    }
+}
+
+/* grow the unmounted image @path to @bnr blocks, 0 for its device */
+static long resize_offline(const char *path, uint64_t bnr,
+                           uint64_t max_bnr) {
+    Resize r = {};
+    Yaf_Image img;
+    long ret;
+
+    ret = yaf_image_open(&img, path, YAF_IMAGE_RDWR);
+    if (ret) {
+        return ret;
+    }
+    if (img.version != YAF_VERSION_LEGACY &&
+        le32toh(img.ysb->state) != YAF_STATE_CLEAN) {
+        ret = -EINVAL;
+        log(LOG_ERR, "%s was not unmounted cleanly, run fsck.yaf first",
+            path);
+        goto close;
+    }
+    bnr = bnr ? bnr : img.bnr;
+    max_bnr = max_bnr > bnr ? max_bnr : bnr;
+    if (bnr > img.bnr) {
+        ret = -EINVAL;
+        log(LOG_ERR, "%lu blocks exceed the %lu blocks of %s",
+            (unsigned long)bnr, (unsigned long)img.bnr, path);
+        goto close;
+    }
+
+    if (bnr < BID_D_MAX(img.ysb) + 1) {
+        ret = -EINVAL;
+        log(LOG_ERR, "shrinking to %lu blocks is not supported",
+            (unsigned long)bnr);
+        goto close;
+    }
+
+    ret = plan(&img, &r, bnr, max_bnr);
+    if (ret) {
+        goto close;
+    }
+    if (r.nr_d == img.nr_d && !r.shift) {
+        log(LOG_INFO, "%s already has %u data blocks", path, img.nr_d);
+        goto close;
+    }
+    log(LOG_INFO, "growing to %u data blocks, the sections behind the "
+        "journal move up by %u blocks", r.nr_d, r.shift);
+
+    ret = relocate(&img, &r);
+    if (ret) {
+        goto close;
+    }
+    renumber(&img, &r);
+    move_sections(&img, &r);
+
+close:
+    if (yaf_image_close(&img) && !ret) {
+        ret = -EIO;
+    }
+    free(r.moved);
+    free(r.dbitmap);
+    free(r.csums);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    Resize_Arguments arguments = {};
+    uint64_t bnr, max_bnr;
+    struct stat st;
+    long ret;
+
+    resize_parse_arguments(&arguments, argc, argv);
+    bnr = arguments.size / YAF_BLOCK_SIZE;
+    max_bnr = arguments.max_size / YAF_BLOCK_SIZE;
+
+    if (stat(arguments.device, &st)) {
+        log(LOG_ERR, "stat() failed with error %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* a mountpoint, grown by the driver */
+    if (S_ISDIR(st.st_mode)) {
+        if (max_bnr) {
+            log(LOG_ERR, "--max-size needs an unmounted device");
+            return EXIT_FAILURE;
+        }
+        ret = resize_online(arguments.device, bnr);
+        goto out;
+    }
+
+    /* an image file is extended to the size first */
+    if (S_ISREG(st.st_mode) && arguments.size > st.st_size &&
+        truncate(arguments.device, arguments.size)) {
+        log(LOG_ERR, "truncate() failed with error %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    ret = resize_offline(arguments.device, bnr, max_bnr);
+
+out:
+    if (ret) {
+        log(LOG_ERR, "failed to grow %s with error %s", arguments.device,
+            strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    log(LOG_INFO, "%s has been successfully grown", arguments.device);
+    return EXIT_SUCCESS;
+}